@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+
+#define ARENA_MAGIC "CHATARNB"
+// Crescimento mínimo do arquivo
+#define ARENA_GROW (1u << 20)
+// Granularidade das páginas do sistema
+#define PAGE 4096
+
+// Função que retorna a classe de tamanho de um bloco (2^(classe + 4) bytes)
+static int size_class(size_t size) {
+    int c = 0;
+    while (((size_t)16 << c) < size)
+        c++;
+    return c;
+}
+
+// Função que abre (ou cria, apagando o conteúdo anterior) a arena do arquivo.
+// Retorna 0 em caso de sucesso ou -1 se o arquivo não existe ou não é uma arena.
+int arena_open(Arena* arena, const char* path, int create) {
+    memset(arena, 0, sizeof(*arena));
+
+    arena->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0644);
+    if (arena->fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(arena->fd, &st) < 0)
+        goto fail;
+    arena->size = st.st_size;
+    if (create) {
+        arena->size = ARENA_GROW;
+        if (ftruncate(arena->fd, arena->size) < 0)
+            goto fail;
+    } else if (arena->size < ARENA_HEADER_SIZE) {
+        goto fail;
+    }
+
+    // Reservando todo o espaço de endereços; só a parte dentro do arquivo é acessada
+    arena->base = mmap(NULL, ARENA_RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, arena->fd, 0);
+    if (arena->base == MAP_FAILED) {
+        arena->base = NULL;
+        goto fail;
+    }
+    arena->header = (ArenaHeader*)arena->base;
+
+    if (create) {
+        memcpy(arena->header->magic, ARENA_MAGIC, 8);
+        arena->header->top = ARENA_HEADER_SIZE;
+    } else if (memcmp(arena->header->magic, ARENA_MAGIC, 8) != 0 || arena->header->top > arena->size) {
+        arena_close(arena);
+        return -1;
+    }
+
+    return 0;
+
+fail:
+    perror(path);
+    close(arena->fd);
+    arena->fd = -1;
+    return -1;
+}
+
+// Função que grava tudo no disco e desfaz o mapeamento
+void arena_close(Arena* arena) {
+    if (arena->base != NULL) {
+        msync(arena->base, arena->size, MS_SYNC);
+        munmap(arena->base, ARENA_RESERVE);
+    }
+    if (arena->fd >= 0)
+        close(arena->fd);
+    arena->base = NULL;
+    arena->header = NULL;
+    arena->fd = -1;
+}
+
+// Função que grava no disco todas as páginas alteradas da arena
+void arena_sync(Arena* arena) {
+    if (msync(arena->base, arena->size, MS_SYNC) < 0)
+        perror("msync");
+}
+
+// Função que grava no disco somente o cabeçalho
+void arena_sync_header(Arena* arena) {
+    if (msync(arena->base, ARENA_HEADER_SIZE, MS_SYNC) < 0)
+        perror("msync");
+}
+
+// Função que aloca um bloco de pelo menos `size` bytes (conteúdo indefinido).
+// Retorna o deslocamento do bloco ou 0 se o arquivo não pode crescer.
+ArenaOff arena_alloc(Arena* arena, size_t size) {
+    int c = size_class(size);
+    if (c >= ARENA_CLASSES)
+        return 0;
+
+    ArenaHeader* header = arena->header;
+    ArenaOff off = header->free_lists[c];
+    if (off != 0) {
+        header->free_lists[c] = *(ArenaOff*)(arena->base + off);
+        return off;
+    }
+
+    // Bloco novo no fim da área usada; blocos grandes começam numa página do sistema
+    uint64_t block = (uint64_t)16 << c;
+    uint64_t align = block < PAGE ? block : PAGE;
+    off = (header->top + align - 1) & ~(align - 1);
+    if (off + block > ARENA_RESERVE)
+        return 0;
+
+    if (off + block > arena->size) {
+        uint64_t size = arena->size * 2;
+        if (size < off + block)
+            size = (off + block + ARENA_GROW - 1) & ~(uint64_t)(ARENA_GROW - 1);
+        if (size > ARENA_RESERVE)
+            size = ARENA_RESERVE;
+        if (ftruncate(arena->fd, size) < 0) {
+            perror("ftruncate");
+            return 0;
+        }
+        arena->size = size;
+    }
+
+    header->top = off + block;
+    return off;
+}
+
+// Função que devolve um bloco à lista livre da sua classe. As páginas de blocos
+// grandes voltam ao sistema (memória e disco); só a primeira fica com o encadeamento.
+void arena_free(Arena* arena, ArenaOff off, size_t size) {
+    if (off == 0)
+        return;
+
+    int c = size_class(size);
+    uint64_t block = (uint64_t)16 << c;
+    if (block > PAGE)
+        madvise(arena->base + off + PAGE, block - PAGE, MADV_REMOVE);
+
+    *(ArenaOff*)(arena->base + off) = arena->header->free_lists[c];
+    arena->header->free_lists[c] = off;
+}
@@ -0,0 +1,54 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Arena mapeada em arquivo (mmap compartilhado). Tudo o que é guardado nela usa
+// deslocamentos a partir do início do arquivo em vez de ponteiros, então o arquivo
+// pode ser mapeado de novo em outro endereço num reinício sem nenhuma conversão.
+// O espaço de endereços é reservado uma única vez: o arquivo cresce por baixo do
+// mapeamento e os ponteiros obtidos com arena_ptr continuam válidos enquanto o
+// bloco estiver alocado.
+
+// Espaço de endereços reservado por arena
+#define ARENA_RESERVE (32ull << 30)
+// Tamanho do cabeçalho (o deslocamento 0 nunca é um bloco válido)
+#define ARENA_HEADER_SIZE 4096
+// Classes de tamanho (potências de 2 a partir de 16 bytes)
+#define ARENA_CLASSES 40
+
+typedef uint64_t ArenaOff;      // Deslocamento de um bloco na arena (0 = nenhum)
+
+typedef struct {
+    char magic[8];              // Identificador do arquivo
+    uint32_t clean;             // Arquivo fechado corretamente (sem alterações pendentes)
+    uint32_t reserved;
+    uint64_t epoch;             // Época do conjunto de arquivos do servidor
+    uint64_t generation;        // Geração do log que continua este estado
+    uint64_t wal_size;          // Tamanho do log quando a arena foi fechada
+    uint64_t top;               // Fim da área já usada do arquivo
+    ArenaOff root;              // Estrutura raiz do dono da arena
+    ArenaOff free_lists[ARENA_CLASSES]; // Blocos livres de cada classe
+} ArenaHeader;
+
+typedef struct {
+    int fd;                     // Arquivo da arena
+    char* base;                 // Início do mapeamento
+    uint64_t size;              // Tamanho atual do arquivo
+    ArenaHeader* header;
+} Arena;
+
+int arena_open(Arena* arena, const char* path, int create);
+void arena_close(Arena* arena);
+void arena_sync(Arena* arena);
+void arena_sync_header(Arena* arena);
+ArenaOff arena_alloc(Arena* arena, size_t size);
+void arena_free(Arena* arena, ArenaOff off, size_t size);
+
+// Função que converte um deslocamento em ponteiro
+static inline void* arena_ptr(const Arena* arena, ArenaOff off) {
+    return off ? arena->base + off : NULL;
+}
+
+#endif
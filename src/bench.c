@@ -0,0 +1,615 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "chat_client.h"
+#include "protocol.h"
+#include "histogram.h"
+
+// Gerador de carga sem interface: simula milhares de usuários falando o protocolo do
+// servidor (REGISTER, LOGIN, SEND_MSG e LIST) e mede vazão e latência de entrega.
+//
+// Cada thread cuida de uma faixa de usuários: registra todos por uma conexão de
+// controle e abre uma conexão com LOGIN para cada usuário online. Durante a medição
+// as mensagens saem num ritmo fixo (carga em malha aberta, que não espera as
+// respostas) para destinatários sorteados entre todos os usuários, online ou não.
+// O texto de cada mensagem começa com o instante (em microssegundos) em que ela
+// deveria ter sido enviada, então a latência de entrega medida no destinatário inclui
+// também o atraso do próprio gerador e não esconde as pausas do servidor.
+//
+// As conexões usam a biblioteca de cliente (chat_client.h); cada thread espera os
+// descritores delas no seu próprio epoll.
+
+#define MAX_NICK_LEN 50
+#define PORT 8080
+// Tamanho máximo do texto de uma mensagem no protocolo de texto
+#define MAX_TEXT_LINE_LEN 255
+// Segundos esperando as entregas em trânsito depois do fim dos envios
+#define DRAIN_SECONDS 2
+// Segundos de espera pelas respostas do registro e do login
+#define SETUP_TIMEOUT 60
+// Bytes pendentes de envio numa conexão a partir dos quais novas mensagens são descartadas
+#define MAX_BACKLOG (8u << 20)
+#define MAX_EVENTS 256
+
+// Comandos aguardando resposta
+enum {
+    REQ_REGISTER,
+    REQ_LOGIN,
+    REQ_SEND,
+    REQ_LIST
+};
+
+typedef struct {
+    int type;                   // REQ_*
+    uint64_t start;             // Instante do envio (µs)
+} Pending;
+
+typedef struct Worker Worker;
+
+// Conexão simulada. As respostas chegam na ordem dos comandos, então uma fila de
+// comandos pendentes basta para associar cada resposta ao seu comando.
+typedef struct {
+    ChatClient* client;
+    Worker* worker;             // Thread dona da conexão
+    int user;                   // Usuário logado (-1 na conexão de controle)
+    Pending* pending;           // Fila circular de comandos sem resposta
+    uint32_t pending_head, pending_count, pending_cap;
+} BenchConn;
+
+struct Worker {
+    int id;
+    pthread_t thread;
+    int first_user;             // Faixa de usuários da thread
+    int user_count;
+    BenchConn control;          // Conexão usada no registro
+    BenchConn* conns;           // Uma conexão por usuário online
+    int conn_count;
+    int epoll_fd;
+    uint64_t rng;
+
+    uint64_t sent;              // SEND_MSG enviados
+    uint64_t dropped;           // Mensagens não enviadas (servidor não lia a conexão)
+    uint64_t acked;             // OK: entregue ou guardada para um usuário offline
+    uint64_t queued;            // OK{QUEUED}: destinatário online com a fila de saída cheia
+    uint64_t to_online;         // Mensagens para usuários online (entregas esperadas)
+    uint64_t errors;            // ERROR em SEND_MSG
+    uint64_t delivered;         // DELIVER_MSG recebidos desta execução
+    uint64_t stale;             // DELIVER_MSG de execuções anteriores
+    uint64_t lists;             // Respostas de LIST
+    uint64_t setup_errors;
+    uint64_t wire_bytes;        // Bytes recebidos do servidor
+    uint64_t plain_bytes;       // Bytes recebidos depois de descomprimidos
+    long max_ts_lag;            // Maior diferença entre a chegada e o ts do servidor (s)
+    Histogram delivery;         // Latência de entrega (µs)
+    Histogram send_rtt;         // Tempo até a resposta do SEND_MSG (µs)
+    Histogram list_rtt;         // Tempo até a resposta do LIST (µs)
+};
+
+static int user_count = 1000;           // Usuários simulados
+static double online_ratio = 0.8;      // Fração dos usuários conectados
+static double send_rate = 1.0;          // Mensagens por segundo por usuário online
+static int msg_size = 64;               // Bytes do texto de cada mensagem
+static int duration = 10;               // Segundos de medição
+static int thread_count = 4;
+static double list_rate = 1.0;          // LIST por segundo (total)
+static int binary_mode = 0;             // Usa o protocolo binário (opção -b)
+static int deflate_mode = 0;            // Pede a saída do servidor comprimida (opção -z)
+static const char* host = "127.0.0.1";
+static int port = PORT;
+static const char* prefix = "bench";    // Prefixo dos apelidos simulados
+static uint32_t run_id;                 // Identifica as mensagens desta execução
+static pthread_barrier_t setup_barrier;
+
+// Função que retorna o relógio monotônico em microssegundos
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Função que sorteia um número (xorshift64*)
+static uint64_t rng_next(Worker* w) {
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 0x2545F4914F6CDD1Dull;
+}
+
+// Função que sorteia um número em [0, 1)
+static double rng_unit(Worker* w) {
+    return (double)(rng_next(w) >> 11) / (double)(1ull << 53);
+}
+
+// Função que informa se um usuário fica online durante a medição. A escolha é fixa
+// por índice para que todas as threads concordem sem trocar informação.
+static int user_online(int user) {
+    uint64_t h = ((uint64_t)user + 1) * 0x9E3779B97F4A7C15ull;
+    return (double)(h >> 11) / (double)(1ull << 53) < online_ratio;
+}
+
+// Função que monta o apelido de um usuário simulado
+static int user_nick(char* out, int user) {
+    return snprintf(out, MAX_NICK_LEN, "%s%d", prefix, user);
+}
+
+// Função que encerra o gerador com uma mensagem de erro
+static void fatal(const char* message, const char* detail) {
+    fprintf(stderr, "bench: %s%s%s\n", message, detail ? ": " : "", detail ? detail : "");
+    exit(1);
+}
+
+// Função que guarda um comando aguardando resposta
+static void pending_push(BenchConn* c, int type, uint64_t start) {
+    if (c->pending_count == c->pending_cap) {
+        uint32_t new_cap = c->pending_cap ? c->pending_cap * 2 : 64;
+        Pending* ring = malloc(new_cap * sizeof(Pending));
+        if (ring == NULL)
+            fatal("sem memória", NULL);
+        for (uint32_t i = 0; i < c->pending_count; i++)
+            ring[i] = c->pending[(c->pending_head + i) % c->pending_cap];
+        free(c->pending);
+        c->pending = ring;
+        c->pending_head = 0;
+        c->pending_cap = new_cap;
+    }
+    c->pending[(c->pending_head + c->pending_count) % c->pending_cap] = (Pending){ type, start };
+    c->pending_count++;
+}
+
+// Função que retira o comando mais antigo aguardando resposta
+static int pending_pop(BenchConn* c, Pending* out) {
+    if (c->pending_count == 0)
+        return -1;
+
+    *out = c->pending[c->pending_head];
+    c->pending_head = (c->pending_head + 1) % c->pending_cap;
+    c->pending_count--;
+    return 0;
+}
+
+// Função que confere o envio de um comando e o guarda aguardando resposta
+static void conn_sent(BenchConn* c, int result, int type, uint64_t start) {
+    if (result < 0)
+        fatal("erro ao enviar", strerror(errno));
+    pending_push(c, type, start);
+}
+
+// Função que envia uma mensagem de um usuário online para um destinatário sorteado.
+// `start` é o instante em que ela deveria sair, gravado no começo do texto.
+static void send_one(Worker* w, uint64_t start) {
+    BenchConn* c = &w->conns[rng_next(w) % w->conn_count];
+    if (chat_backlog(c->client) > MAX_BACKLOG) {
+        w->dropped++;
+        return;
+    }
+
+    int to = (int)(rng_next(w) % user_count);
+    if (to == c->user)
+        to = (to + 1) % user_count;
+
+    char nick[MAX_NICK_LEN];
+    char text[MAX_TEXT_LEN];
+    user_nick(nick, to);
+    int len = snprintf(text, sizeof(text), "%08x:%llu|", run_id, (unsigned long long)start);
+    if (len < msg_size) {
+        memset(text + len, 'x', msg_size - len);
+        len = msg_size;
+    }
+
+    conn_sent(c, chat_send(c->client, nick, text, len), REQ_SEND, start);
+    w->sent++;
+    if (user_online(to))
+        w->to_online++;
+}
+
+// Função que pede uma página da lista de usuários simulados
+static void list_one(Worker* w, uint64_t start) {
+    BenchConn* c = w->conn_count > 0 ? &w->conns[rng_next(w) % w->conn_count] : &w->control;
+    conn_sent(c, chat_list(c->client, prefix, 0, 100), REQ_LIST, start);
+}
+
+// Função que registra a chegada de uma entrega: `text` começa com o identificador da
+// execução e o instante previsto do envio; `ts` é o timestamp (s) posto pelo servidor
+static void on_delivery(Worker* w, const char* text, size_t len, long ts) {
+    char head[32];
+    if (len >= sizeof(head))
+        len = sizeof(head) - 1;
+    memcpy(head, text, len);
+    head[len] = '\0';
+
+    unsigned id;
+    unsigned long long start;
+    if (sscanf(head, "%8x:%llu|", &id, &start) != 2 || id != run_id) {
+        w->stale++;
+        return;
+    }
+
+    uint64_t now = now_us();
+    hist_record(&w->delivery, now > start ? now - start : 0);
+    w->delivered++;
+
+    long lag = (long)time(NULL) - ts;
+    if (lag > w->max_ts_lag)
+        w->max_ts_lag = lag;
+}
+
+// Função que trata a resposta de um comando
+static void on_reply(Worker* w, BenchConn* c, int ok, const char* detail, size_t detail_len) {
+    Pending req;
+    if (pending_pop(c, &req) < 0)
+        fatal("resposta sem comando pendente", NULL);
+
+    uint64_t elapsed = now_us() - req.start;
+    switch (req.type) {
+    case REQ_REGISTER:
+        // Apelidos de uma execução anterior continuam registrados
+        if (!ok && !(detail_len == 10 && memcmp(detail, "NICK_TAKEN", 10) == 0)) {
+            fprintf(stderr, "bench: REGISTER recusado: %.*s\n", (int)detail_len, detail);
+            w->setup_errors++;
+        }
+        break;
+    case REQ_LOGIN:
+        if (!ok) {
+            fprintf(stderr, "bench: LOGIN recusado: %.*s\n", (int)detail_len, detail);
+            w->setup_errors++;
+        }
+        break;
+    case REQ_SEND:
+        hist_record(&w->send_rtt, elapsed);
+        if (!ok)
+            w->errors++;
+        else if (detail_len == 6 && memcmp(detail, "QUEUED", 6) == 0)
+            w->queued++;
+        else
+            w->acked++;
+        break;
+    case REQ_LIST:
+        hist_record(&w->list_rtt, elapsed);
+        w->lists++;
+        break;
+    }
+}
+
+// Função que trata um evento de uma conexão
+static void on_event(ChatClient* client, const ChatEvent* event, void* ctx) {
+    (void)client;
+    BenchConn* c = ctx;
+    switch (event->type) {
+    case CHAT_EVENT_MESSAGE:
+        on_delivery(c->worker, event->text, event->text_len, (long)event->arg);
+        break;
+    case CHAT_EVENT_PRESENCE:
+        break;
+    case CHAT_EVENT_OK:
+    case CHAT_EVENT_USERS:
+        on_reply(c->worker, c, 1, event->text, event->type == CHAT_EVENT_OK ? event->text_len : 0);
+        break;
+    case CHAT_EVENT_ERROR:
+        on_reply(c->worker, c, 0, event->text, event->text_len);
+        break;
+    default:
+        fprintf(stderr, "bench: resposta inesperada: %d\n", event->type);
+    }
+}
+
+// Função que abre uma conexão com o servidor, já no protocolo pedido, e a acrescenta
+// ao epoll da thread
+static void conn_open(Worker* w, BenchConn* c, int user) {
+    memset(c, 0, sizeof(*c));
+    c->worker = w;
+    c->user = user;
+
+    int options = (binary_mode ? CHAT_BINARY : 0) | (deflate_mode ? CHAT_DEFLATE : 0);
+    c->client = chat_connect(host, port, options, on_event, c);
+    if (c->client == NULL)
+        fatal("falha ao conectar", strerror(errno));
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, chat_fd(c->client), &ev) < 0)
+        fatal("epoll_ctl", strerror(errno));
+}
+
+// Função que espera eventos por até `timeout_ms` e trata as conexões prontas
+static void worker_poll(Worker* w, int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR)
+        fatal("epoll_wait", strerror(errno));
+
+    for (int i = 0; i < n; i++) {
+        BenchConn* c = events[i].data.ptr;
+        if ((events[i].events & EPOLLOUT) && chat_flush(c->client) < 0)
+            fatal("erro ao enviar", strerror(errno));
+        if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && chat_read(c->client) < 0) {
+            if (errno == ECONNRESET)
+                fatal("o servidor fechou a conexão", NULL);
+            fatal("erro ao receber", strerror(errno));
+        }
+    }
+}
+
+// Função que conta os comandos da thread ainda sem resposta
+static uint64_t worker_pending(Worker* w) {
+    uint64_t count = w->control.pending_count;
+    for (int i = 0; i < w->conn_count; i++)
+        count += w->conns[i].pending_count;
+    return count;
+}
+
+// Função que espera as respostas de todos os comandos enviados
+static void worker_wait(Worker* w, const char* phase) {
+    uint64_t deadline = now_us() + (uint64_t)SETUP_TIMEOUT * 1000000;
+    while (worker_pending(w) > 0) {
+        if (now_us() > deadline)
+            fatal("tempo esgotado esperando as respostas", phase);
+        worker_poll(w, 100);
+    }
+}
+
+// Função que soma aos totais da thread os bytes recebidos por uma conexão
+static void worker_bytes(Worker* w, BenchConn* c) {
+    uint64_t wire, plain;
+    chat_bytes(c->client, &wire, &plain);
+    w->wire_bytes += wire;
+    w->plain_bytes += plain;
+}
+
+// Função que executa uma thread do gerador: registro, login e medição
+static void* worker_run(void* arg) {
+    Worker* w = arg;
+    char nick[MAX_NICK_LEN];
+    char name[MAX_NICK_LEN + 8];
+
+    w->epoll_fd = epoll_create1(0);
+    if (w->epoll_fd < 0)
+        fatal("epoll_create1", strerror(errno));
+
+    // Registrando todos os usuários da thread pela conexão de controle
+    conn_open(w, &w->control, -1);
+    for (int i = 0; i < w->user_count; i++) {
+        int user = w->first_user + i;
+        user_nick(nick, user);
+        snprintf(name, sizeof(name), "Bench %d", user);
+        conn_sent(&w->control, chat_register(w->control.client, nick, name), REQ_REGISTER, now_us());
+    }
+    worker_wait(w, "REGISTER");
+
+    // Conectando os usuários online
+    w->conns = calloc(w->user_count > 0 ? w->user_count : 1, sizeof(BenchConn));
+    if (w->conns == NULL)
+        fatal("sem memória", NULL);
+    for (int i = 0; i < w->user_count; i++) {
+        int user = w->first_user + i;
+        if (!user_online(user))
+            continue;
+        BenchConn* c = &w->conns[w->conn_count++];
+        conn_open(w, c, user);
+        user_nick(nick, user);
+        conn_sent(c, chat_login(c->client, nick), REQ_LOGIN, now_us());
+    }
+    worker_wait(w, "LOGIN");
+
+    // Todas as threads começam a medir juntas, com todos os usuários registrados
+    pthread_barrier_wait(&setup_barrier);
+
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t)duration * 1000000;
+    uint64_t stop = end + (uint64_t)DRAIN_SECONDS * 1000000;
+    double send_gap = w->conn_count > 0 && send_rate > 0 && user_count > 1
+                      ? 1e6 / (send_rate * w->conn_count) : 0;
+    double list_gap = list_rate > 0 ? 1e6 * thread_count / list_rate : 0;
+    double next_send = start + rng_unit(w) * send_gap;
+    double next_list = start + rng_unit(w) * list_gap;
+
+    for (;;) {
+        uint64_t now = now_us();
+        if (now >= stop)
+            break;
+
+        uint64_t wake = stop;
+        if (now < end) {
+            // Em malha aberta: os envios atrasados saem todos de uma vez, com o
+            // instante previsto, para que o atraso apareça na latência
+            while (send_gap > 0 && next_send <= now) {
+                send_one(w, (uint64_t)next_send);
+                next_send += send_gap * (0.5 + rng_unit(w));
+            }
+            while (list_gap > 0 && next_list <= now) {
+                list_one(w, (uint64_t)next_list);
+                next_list += list_gap;
+            }
+            wake = end;
+            if (send_gap > 0 && next_send < wake)
+                wake = (uint64_t)next_send;
+            if (list_gap > 0 && next_list < wake)
+                wake = (uint64_t)next_list;
+        }
+
+        worker_poll(w, wake > now ? (int)((wake - now + 999) / 1000) : 0);
+    }
+
+    // Bytes recebidos por todas as conexões da thread
+    worker_bytes(w, &w->control);
+    for (int i = 0; i < w->conn_count; i++)
+        worker_bytes(w, &w->conns[i]);
+    return NULL;
+}
+
+// Função que imprime os percentis de um histograma em milissegundos
+static void print_latency(const char* label, const Histogram* hist) {
+    if (hist->total == 0) {
+        printf("%-22s sem amostras\n", label);
+        return;
+    }
+    printf("%-22s p50 %.3f  p99 %.3f  p999 %.3f  max %.3f ms (%llu amostras)\n", label,
+           hist_percentile(hist, 50.0) / 1000.0, hist_percentile(hist, 99.0) / 1000.0,
+           hist_percentile(hist, 99.9) / 1000.0, hist->max / 1000.0,
+           (unsigned long long)hist->total);
+}
+
+// Função que aumenta o limite de descritores abertos até o máximo permitido
+static void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// Função que exibe as opções do gerador
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Uso: %s [-u usuários] [-o fração online] [-r msg/s por usuário] [-s bytes]\n"
+            "          [-d segundos] [-t threads] [-l LIST/s] [-p prefixo] [-a endereço]\n"
+            "          [-P porta] [-b] [-z]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "u:o:r:s:d:t:l:p:a:P:bz")) != -1) {
+        switch (opt) {
+        case 'u':
+            user_count = atoi(optarg);
+            break;
+        case 'o':
+            online_ratio = atof(optarg);
+            break;
+        case 'r':
+            send_rate = atof(optarg);
+            break;
+        case 's':
+            msg_size = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            break;
+        case 'l':
+            list_rate = atof(optarg);
+            break;
+        case 'p':
+            prefix = optarg;
+            break;
+        case 'a':
+            host = optarg;
+            break;
+        case 'P':
+            port = atoi(optarg);
+            break;
+        case 'b':
+            binary_mode = 1;
+            break;
+        case 'z':
+            deflate_mode = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // O texto precisa caber o identificador da execução e o instante do envio
+    int max_size = binary_mode ? MAX_TEXT_LEN : MAX_TEXT_LINE_LEN;
+    if (user_count < 1 || thread_count < 1 || duration < 1 || online_ratio < 0 || online_ratio > 1)
+        usage(argv[0]);
+    if (msg_size < 32 || msg_size > max_size) {
+        fprintf(stderr, "bench: o tamanho da mensagem deve estar entre 32 e %d bytes\n", max_size);
+        exit(1);
+    }
+    if (strlen(prefix) + 11 > MAX_NICK_LEN - 1 || strchr(prefix, '#') || strchr(prefix, ','))
+        fatal("prefixo inválido", prefix);
+    if (thread_count > user_count)
+        thread_count = user_count;
+
+    raise_fd_limit();
+    run_id = (uint32_t)(time(NULL) ^ ((uint32_t)getpid() << 16));
+
+    Worker* workers = calloc(thread_count, sizeof(Worker));
+    if (workers == NULL)
+        fatal("sem memória", NULL);
+    pthread_barrier_init(&setup_barrier, NULL, thread_count + 1);
+
+    uint64_t setup_start = now_us();
+    for (int i = 0; i < thread_count; i++) {
+        Worker* w = &workers[i];
+        w->id = i;
+        w->first_user = (int)((long)user_count * i / thread_count);
+        w->user_count = (int)((long)user_count * (i + 1) / thread_count) - w->first_user;
+        w->rng = ((uint64_t)run_id << 32 | (uint64_t)(i + 1)) * 0x9E3779B97F4A7C15ull;
+        if (pthread_create(&w->thread, NULL, worker_run, w) != 0)
+            fatal("pthread_create", NULL);
+    }
+
+    pthread_barrier_wait(&setup_barrier);
+    int online = 0;
+    for (int i = 0; i < thread_count; i++)
+        online += workers[i].conn_count;
+    printf("%d usuários registrados (%d online) em %.1f s; medindo por %d s...\n",
+           user_count, online, (now_us() - setup_start) / 1e6, duration);
+    fflush(stdout);
+
+    Worker total = { 0 };
+    for (int i = 0; i < thread_count; i++) {
+        Worker* w = &workers[i];
+        pthread_join(w->thread, NULL);
+        total.sent += w->sent;
+        total.dropped += w->dropped;
+        total.acked += w->acked;
+        total.queued += w->queued;
+        total.errors += w->errors;
+        total.delivered += w->delivered;
+        total.to_online += w->to_online;
+        total.stale += w->stale;
+        total.lists += w->lists;
+        total.setup_errors += w->setup_errors;
+        total.wire_bytes += w->wire_bytes;
+        total.plain_bytes += w->plain_bytes;
+        if (w->max_ts_lag > total.max_ts_lag)
+            total.max_ts_lag = w->max_ts_lag;
+        hist_merge(&total.delivery, &w->delivery);
+        hist_merge(&total.send_rtt, &w->send_rtt);
+        hist_merge(&total.list_rtt, &w->list_rtt);
+    }
+
+    printf("\nProtocolo %s%s, %d threads, mensagens de %d bytes, %.2f msg/s por usuário online\n",
+           binary_mode ? "binário" : "texto", deflate_mode ? " com deflate" : "", thread_count, msg_size, send_rate);
+    printf("Enviadas:    %llu (%.0f msg/s)", (unsigned long long)total.sent, total.sent / (double)duration);
+    if (total.dropped > 0)
+        printf(", %llu descartadas (o servidor parou de ler)", (unsigned long long)total.dropped);
+    printf("\n");
+    printf("Respostas:   %llu OK, %llu guardadas (OK{QUEUED}), %llu erros, %llu sem resposta\n",
+           (unsigned long long)total.acked, (unsigned long long)total.queued,
+           (unsigned long long)total.errors,
+           (unsigned long long)(total.sent - total.acked - total.queued - total.errors));
+    printf("Entregues:   %llu de %llu para usuários online (%.0f msg/s)",
+           (unsigned long long)total.delivered, (unsigned long long)total.to_online,
+           total.delivered / (double)duration);
+    if (total.stale > 0)
+        printf(", %llu de execuções anteriores", (unsigned long long)total.stale);
+    printf("\n");
+    printf("LIST:        %llu respostas\n", (unsigned long long)total.lists);
+    printf("Recebidos:   %.1f MiB", total.wire_bytes / 1048576.0);
+    if (deflate_mode && total.wire_bytes > 0)
+        printf(" comprimidos (%.1f MiB descomprimidos, %.1fx)", total.plain_bytes / 1048576.0,
+               total.plain_bytes / (double)total.wire_bytes);
+    printf("\n");
+    print_latency("Latência de entrega:", &total.delivery);
+    print_latency("Resposta do SEND_MSG:", &total.send_rtt);
+    print_latency("Resposta do LIST:", &total.list_rtt);
+    printf("Maior atraso pelo ts do servidor: %ld s\n", total.max_ts_lag);
+    if (total.setup_errors > 0)
+        printf("Erros no registro/login: %llu\n", (unsigned long long)total.setup_errors);
+
+    return 0;
+}
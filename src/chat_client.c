@@ -0,0 +1,643 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "chat_client.h"
+#include "protocol.h"
+
+// Maior frame aceito do servidor (a lista completa de usuários pode ser grande)
+#define MAX_RECV_FRAME (1u << 30)
+// Maior comando enviado: cabeçalho, apelido, texto e a sintaxe do protocolo de texto
+#define MAX_COMMAND_LEN (PROTO_HEADER_LEN + 255 + MAX_TEXT_LEN + 64)
+// Separador do grupo e do remetente no campo A das entregas de grupo
+#define GROUP_SEP '/'
+// Campos de um objeto JSON de uma linha (DELIVER_MSG e PRESENCE)
+#define MAX_JSON_FIELDS 8
+
+struct ChatClient {
+    int fd;
+    ChatCallback callback;
+    void* ctx;
+    int binary;                 // Conversa no protocolo binário
+    z_stream* zin;              // Descompressor da entrada (CHAT_DEFLATE)
+    char* in;                   // Bytes recebidos ainda não processados
+    size_t in_len, in_cap;
+    char* out;                  // Bytes ainda não aceitos pelo socket
+    size_t out_off, out_len, out_cap;
+    uint32_t pending;           // Comandos sem resposta
+    uint64_t wire_bytes;        // Bytes recebidos do servidor
+    uint64_t plain_bytes;       // Bytes recebidos depois de descomprimidos
+};
+
+// Campo de um objeto JSON plano; o valor aponta para a linha recebida
+typedef struct {
+    const char* key;
+    size_t key_len;
+    char* value;
+    size_t len;
+    int string;                 // O valor era uma string (e já está sem os escapes)
+} JsonField;
+
+// Função que lê um inteiro big-endian de 64 bits
+static uint64_t get_u64(const char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value = (value << 8) | (uint8_t)in[i];
+    return value;
+}
+
+// Função que garante espaço para `extra` bytes num buffer crescente. Retorna -1 sem memória.
+static int buffer_reserve(char** buf, size_t len, size_t* cap, size_t extra) {
+    if (len + extra <= *cap)
+        return 0;
+
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < len + extra)
+        new_cap *= 2;
+    char* grown = realloc(*buf, new_cap);
+    if (grown == NULL)
+        return -1;
+    *buf = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+// Função que grava todo o buffer no socket ainda bloqueante. Retorna -1 se falhar.
+static int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Função que negocia o protocolo da conexão, antes dela virar não bloqueante: a
+// resposta ainda vem em texto e o servidor só troca de protocolo depois dela.
+// Retorna -1 se o servidor recusar.
+static int negotiate(ChatClient* client, int options) {
+    char proto[32];
+    int len = snprintf(proto, sizeof(proto), "PROTO {%s%s}\n", options & CHAT_BINARY ? "BINARY" : "TEXT",
+                       options & CHAT_DEFLATE ? ", DEFLATE" : "");
+    if (write_all(client->fd, proto, len) < 0)
+        return -1;
+
+    // Byte a byte: nada além da resposta pode ser consumido aqui
+    char reply[64];
+    size_t n = 0;
+    while (n < sizeof(reply)) {
+        ssize_t got = recv(client->fd, reply + n, 1, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        if (reply[n++] == '\n')
+            break;
+    }
+    if (n != 3 || memcmp(reply, "OK\n", 3) != 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    client->binary = (options & CHAT_BINARY) != 0;
+    if (options & CHAT_DEFLATE) {
+        client->zin = calloc(1, sizeof(z_stream));
+        if (client->zin == NULL || inflateInit2(client->zin, -15) != Z_OK) {
+            free(client->zin);
+            client->zin = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Função que conecta ao servidor e negocia o protocolo pedido em `options`
+// (CHAT_BINARY, CHAT_DEFLATE). `callback` recebe os eventos lidos por chat_read.
+// Retorna NULL (com errno) se não conseguir.
+ChatClient* chat_connect(const char* host, int port, int options, ChatCallback callback, void* ctx) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ChatClient* client = calloc(1, sizeof(ChatClient));
+    if (client == NULL)
+        return NULL;
+    client->callback = callback;
+    client->ctx = ctx;
+    client->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->fd < 0 || connect(client->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        (options != 0 && negotiate(client, options) < 0)) {
+        int saved = errno;
+        chat_close(client);
+        errno = saved;
+        return NULL;
+    }
+
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+    return client;
+}
+
+// Função que fecha a conexão e libera o cliente
+void chat_close(ChatClient* client) {
+    if (client->fd >= 0)
+        close(client->fd);
+    if (client->zin != NULL) {
+        inflateEnd(client->zin);
+        free(client->zin);
+    }
+    free(client->in);
+    free(client->out);
+    free(client);
+}
+
+// Função que retorna o descritor da conexão, para o poll ou epoll de quem usa
+int chat_fd(const ChatClient* client) {
+    return client->fd;
+}
+
+// Função que retorna os bytes de comandos ainda não aceitos pelo socket
+size_t chat_backlog(const ChatClient* client) {
+    return client->out_len - client->out_off;
+}
+
+// Função que retorna os comandos enviados que ainda não tiveram resposta
+uint32_t chat_pending(const ChatClient* client) {
+    return client->pending;
+}
+
+// Função que informa os bytes recebidos do servidor, antes (`wire`) e depois
+// (`plain`) da descompressão
+void chat_bytes(const ChatClient* client, uint64_t* wire, uint64_t* plain) {
+    *wire = client->wire_bytes;
+    *plain = client->plain_bytes;
+}
+
+// Função que envia o que o socket aceitar dos comandos acumulados. Retorna -1 se a
+// conexão falhou.
+int chat_flush(ChatClient* client) {
+    while (client->out_off < client->out_len) {
+        ssize_t n = send(client->fd, client->out + client->out_off, client->out_len - client->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        client->out_off += n;
+    }
+    client->out_off = 0;
+    client->out_len = 0;
+    return 0;
+}
+
+// Função que acrescenta um comando à saída e tenta enviá-lo
+static int send_command(ChatClient* client, const char* data, size_t len) {
+    if (buffer_reserve(&client->out, client->out_len, &client->out_cap, len) < 0)
+        return -1;
+    memcpy(client->out + client->out_len, data, len);
+    client->out_len += len;
+    client->pending++;
+    return chat_flush(client);
+}
+
+// Função que monta um comando com até dois campos nos dois protocolos: no texto
+// "NOME {a, b}", "NOME {a}" ou "NOME"; no binário, A e B do frame
+static int command(ChatClient* client, uint8_t op, const char* name, const char* a,
+                   const char* b, size_t b_len, uint64_t arg) {
+    char out[MAX_COMMAND_LEN];
+    size_t len;
+    if (b_len > MAX_TEXT_LEN)
+        b_len = MAX_TEXT_LEN;
+
+    if (client->binary)
+        len = proto_encode(out, op, a, a ? strlen(a) : 0, b, b_len, arg);
+    else if (a != NULL && b != NULL)
+        len = snprintf(out, sizeof(out), "%s {%s, %.*s}\n", name, a, (int)b_len, b);
+    else if (a != NULL || b != NULL)
+        len = snprintf(out, sizeof(out), "%s {%.*s}\n", name, a ? (int)strlen(a) : (int)b_len, a ? a : b);
+    else
+        len = snprintf(out, sizeof(out), "%s\n", name);
+    return send_command(client, out, len);
+}
+
+int chat_register(ChatClient* client, const char* nick, const char* name) {
+    return command(client, OP_REGISTER, "REGISTER", nick, name, strlen(name), 0);
+}
+
+int chat_delete(ChatClient* client, const char* nick) {
+    return command(client, OP_DELETE, "DELETE", nick, NULL, 0, 0);
+}
+
+int chat_login(ChatClient* client, const char* nick) {
+    return command(client, OP_LOGIN, "LOGIN", nick, NULL, 0, 0);
+}
+
+int chat_logout(ChatClient* client, const char* nick) {
+    return command(client, OP_LOGOUT, "LOGOUT", nick, NULL, 0, 0);
+}
+
+int chat_send(ChatClient* client, const char* to, const char* text, size_t len) {
+    return command(client, OP_SEND_MSG, "SEND_MSG", to, text, len, 0);
+}
+
+int chat_subscribe(ChatClient* client, const char* nick) {
+    return command(client, OP_SUBSCRIBE, "SUBSCRIBE", nick, NULL, 0, 0);
+}
+
+int chat_join(ChatClient* client, const char* group) {
+    return command(client, OP_JOIN, "JOIN", group, NULL, 0, 0);
+}
+
+int chat_history(ChatClient* client, const char* nick) {
+    return command(client, OP_HISTORY, "HISTORY", nick, NULL, 0, 0);
+}
+
+int chat_search(ChatClient* client, const char* terms) {
+    return command(client, OP_SEARCH, "SEARCH", NULL, terms, strlen(terms), 0);
+}
+
+// Função que pede a lista de usuários: todos, os com o prefixo ou uma página deles
+// (`count` 0 = todos a partir de `offset`)
+int chat_list(ChatClient* client, const char* prefix, uint32_t offset, uint32_t count) {
+    char out[MAX_COMMAND_LEN];
+    size_t len;
+    const char* p = prefix ? prefix : "";
+    if (client->binary)
+        len = proto_encode(out, OP_LIST, p, strlen(p), NULL, 0, (uint64_t)offset << 32 | count);
+    else if (offset > 0 || count > 0)
+        len = snprintf(out, sizeof(out), "LIST {%s, %u, %u}\n", p, offset, count);
+    else if (p[0] != '\0')
+        len = snprintf(out, sizeof(out), "LIST {%s}\n", p);
+    else
+        len = snprintf(out, sizeof(out), "LIST\n");
+    return send_command(client, out, len);
+}
+
+// Função que passa o evento ao callback, contando as respostas
+static void emit(ChatClient* client, ChatEvent* event) {
+    if (event->type != CHAT_EVENT_MESSAGE && event->type != CHAT_EVENT_PRESENCE && client->pending > 0)
+        client->pending--;
+    client->callback(client, event, client->ctx);
+}
+
+// Função que tira os escapes de uma string JSON no próprio lugar. Retorna o novo tamanho.
+static size_t json_unescape(char* s, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\\' && i + 1 < len) {
+            i++;
+            s[n++] = s[i] == 'n' ? '\n' : s[i];
+        } else {
+            s[n++] = s[i];
+        }
+    }
+    return n;
+}
+
+// Função que separa os campos de um objeto JSON plano ({"chave":valor,...}), com
+// strings e números. Retorna quantos campos leu.
+static int json_fields(char* p, char* end, JsonField* fields, int max) {
+    int count = 0;
+    if (p < end && *p == '{')
+        p++;
+    while (p < end && *p == '"' && count < max) {
+        JsonField* field = &fields[count];
+        field->key = ++p;
+        while (p < end && *p != '"')
+            p++;
+        field->key_len = p - field->key;
+        if (end - p < 2 || p[1] != ':')
+            break;
+        p += 2;
+
+        if (p < end && *p == '"') {
+            field->value = ++p;
+            while (p < end && *p != '"')
+                p += *p == '\\' ? 2 : 1;
+            if (p >= end)
+                break;
+            field->len = json_unescape(field->value, p - field->value);
+            field->string = 1;
+            p++;
+        } else {
+            field->value = p;
+            while (p < end && *p != ',' && *p != '}')
+                p++;
+            field->len = p - field->value;
+            field->string = 0;
+        }
+        count++;
+        if (p < end && *p == ',')
+            p++;
+    }
+    return count;
+}
+
+// Função que procura um campo pela chave. Retorna NULL se não existe.
+static const JsonField* json_get(const JsonField* fields, int count, const char* key) {
+    size_t len = strlen(key);
+    for (int i = 0; i < count; i++)
+        if (fields[i].key_len == len && memcmp(fields[i].key, key, len) == 0)
+            return &fields[i];
+    return NULL;
+}
+
+// Função que interpreta o número de um campo (0 se não existe)
+static uint64_t json_number(const JsonField* fields, int count, const char* key) {
+    const JsonField* field = json_get(fields, count, key);
+    return field != NULL && !field->string ? strtoull(field->value, NULL, 10) : 0;
+}
+
+// Função que interpreta o array JSON de uma resposta ("NOME{chave:[...]...}"): `text`
+// recebe o array e o resto da linha fica em `*rest`
+static void line_array(ChatEvent* event, char* line, char* end, char** rest) {
+    char* open = memchr(line, '[', end - line);
+    char* close = end;
+    while (close > line && close[-1] != ']')
+        close--;
+    if (open == NULL || close <= open) {
+        *rest = end;
+        return;
+    }
+    event->text = open;
+    event->text_len = close - open;
+    *rest = close;
+}
+
+// Função que trata uma linha do protocolo de texto (terminada em '\0')
+static void on_line(ChatClient* client, char* line, size_t len) {
+    ChatEvent event = { 0 };
+    char* end = line + len;
+    char* rest;
+    JsonField fields[MAX_JSON_FIELDS];
+
+    if (strncmp(line, "DELIVER_MSG{", 12) == 0) {
+        // DELIVER_MSG{"from":"...",["group":"...",]"text":"...","ts":...[,"seq":...]}
+        int count = json_fields(line + 11, end, fields, MAX_JSON_FIELDS);
+        const JsonField* from = json_get(fields, count, "from");
+        const JsonField* group = json_get(fields, count, "group");
+        const JsonField* text = json_get(fields, count, "text");
+        if (from == NULL || text == NULL)
+            return;
+        event.type = CHAT_EVENT_MESSAGE;
+        event.from = from->value;
+        event.from_len = from->len;
+        if (group != NULL) {
+            event.group = group->value;
+            event.group_len = group->len;
+        }
+        event.text = text->value;
+        event.text_len = text->len;
+        event.arg = json_number(fields, count, "ts");
+        event.seq = json_number(fields, count, "seq");
+    } else if (strncmp(line, "PRESENCE{", 9) == 0) {
+        // PRESENCE{"nick":"...","online":0|1[,"name":"..."]} ou PRESENCE{"nick":"...","deleted":1}
+        int count = json_fields(line + 8, end, fields, MAX_JSON_FIELDS);
+        const JsonField* nick = json_get(fields, count, "nick");
+        const JsonField* name = json_get(fields, count, "name");
+        if (nick == NULL)
+            return;
+        event.type = CHAT_EVENT_PRESENCE;
+        event.from = nick->value;
+        event.from_len = nick->len;
+        if (json_get(fields, count, "deleted") != NULL)
+            event.arg = PRESENCE_DELETED;
+        else if (name != NULL)
+            event.arg = PRESENCE_REGISTERED;
+        else
+            event.arg = json_number(fields, count, "online") ? PRESENCE_ONLINE : PRESENCE_OFFLINE;
+        if (name != NULL) {
+            event.text = name->value;
+            event.text_len = name->len;
+        }
+    } else if (strncmp(line, "OK", 2) == 0) {
+        // OK ou OK{detalhe}
+        event.type = CHAT_EVENT_OK;
+        if (line[2] == '{' && len > 3) {
+            event.text = line + 3;
+            event.text_len = len - 4;
+        }
+    } else if (strncmp(line, "ERROR{", 6) == 0) {
+        event.type = CHAT_EVENT_ERROR;
+        event.text = line + 6;
+        event.text_len = len > 7 ? len - 7 : 0;
+    } else if (strncmp(line, "USERS{", 6) == 0) {
+        // USERS{users:[...]} ou USERS{users:[...],total:N}
+        event.type = CHAT_EVENT_USERS;
+        line_array(&event, line, end, &rest);
+        event.arg = strncmp(rest, ",total:", 7) == 0 ? strtoull(rest + 7, NULL, 10) : 0;
+    } else if (strncmp(line, "HISTORY{", 8) == 0) {
+        // HISTORY{messages:[...],next:N}
+        event.type = CHAT_EVENT_HISTORY;
+        line_array(&event, line, end, &rest);
+        event.arg = strncmp(rest, ",next:", 6) == 0 ? strtoull(rest + 6, NULL, 10) : 0;
+    } else if (strncmp(line, "SEARCH{", 7) == 0) {
+        // SEARCH{messages:[...]}: a quantidade vem contada das entradas
+        event.type = CHAT_EVENT_SEARCH;
+        line_array(&event, line, end, &rest);
+        for (const char* p = event.text; p != NULL && (p = memmem(p, event.text + event.text_len - p, "{\"with\":", 8)); p++)
+            event.arg++;
+    } else if (strncmp(line, "STATS{", 6) == 0) {
+        event.type = CHAT_EVENT_STATS;
+        event.text = line + 6;
+        event.text_len = len > 7 ? len - 7 : 0;
+    } else {
+        return;
+    }
+    emit(client, &event);
+}
+
+// Função que trata um frame do protocolo binário
+static void on_frame(ChatClient* client, const ProtoFrame* frame) {
+    ChatEvent event = { 0 };
+    event.arg = frame->arg;
+    event.text = frame->b;
+    event.text_len = frame->b_len;
+
+    switch (frame->op) {
+    case OP_DELIVER: {
+        // A = remetente ou "#grupo/remetente"; com PROTO_FLAG_SEQ, B começa com a sequência
+        event.type = CHAT_EVENT_MESSAGE;
+        event.from = frame->a;
+        event.from_len = frame->a_len;
+        const char* sep = frame->a_len > 0 && frame->a[0] == '#' ? memchr(frame->a, GROUP_SEP, frame->a_len) : NULL;
+        if (sep != NULL) {
+            event.group = frame->a;
+            event.group_len = sep - frame->a;
+            event.from = sep + 1;
+            event.from_len = frame->a_len - event.group_len - 1;
+        }
+        if ((frame->flags & PROTO_FLAG_SEQ) && frame->b_len >= 8) {
+            event.seq = get_u64(frame->b);
+            event.text += 8;
+            event.text_len -= 8;
+        }
+        break;
+    }
+    case OP_PRESENCE:
+        event.type = CHAT_EVENT_PRESENCE;
+        event.from = frame->a;
+        event.from_len = frame->a_len;
+        break;
+    case OP_OK:
+        // Só o STATS responde com B (os contadores)
+        event.type = frame->b_len > 0 ? CHAT_EVENT_STATS : CHAT_EVENT_OK;
+        if (frame->b_len == 0) {
+            event.text = frame->a;
+            event.text_len = frame->a_len;
+        }
+        break;
+    case OP_ERROR:
+        event.type = CHAT_EVENT_ERROR;
+        event.text = frame->a;
+        event.text_len = frame->a_len;
+        break;
+    case OP_USERS:        event.type = CHAT_EVENT_USERS;   break;
+    case OP_HISTORY_PAGE: event.type = CHAT_EVENT_HISTORY; break;
+    case OP_SEARCH_RESULT: event.type = CHAT_EVENT_SEARCH; break;
+    default:
+        return;
+    }
+    emit(client, &event);
+}
+
+// Função que descomprime bytes recebidos para o fim do buffer de entrada
+static int inflate_input(ChatClient* client, const char* data, size_t len) {
+    z_stream* z = client->zin;
+    z->next_in = (Bytef*)data;
+    z->avail_in = len;
+    do {
+        if (buffer_reserve(&client->in, client->in_len, &client->in_cap, 65536) < 0)
+            return -1;
+        z->next_out = (Bytef*)client->in + client->in_len;
+        z->avail_out = client->in_cap - client->in_len;
+        int ret = inflate(z, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            errno = EPROTO;
+            return -1;
+        }
+        size_t produced = client->in_cap - client->in_len - z->avail_out;
+        client->in_len += produced;
+        client->plain_bytes += produced;
+    } while (z->avail_in > 0 || z->avail_out == 0);
+    return 0;
+}
+
+// Função que lê tudo o que chegou na conexão e passa ao callback os eventos completos.
+// Retorna -1 se o servidor fechou a conexão, ela falhou ou chegou um frame inválido.
+int chat_read(ChatClient* client) {
+    char raw[65536];
+    for (;;) {
+        char* dest = raw;
+        size_t room = sizeof(raw);
+        if (client->zin == NULL) {
+            if (buffer_reserve(&client->in, client->in_len, &client->in_cap, 65536) < 0)
+                return -1;
+            dest = client->in + client->in_len;
+            room = client->in_cap - client->in_len;
+        }
+        ssize_t n = recv(client->fd, dest, room, 0);
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        client->wire_bytes += n;
+        if (client->zin != NULL) {
+            if (inflate_input(client, raw, n) < 0)
+                return -1;
+        } else {
+            client->in_len += n;
+            client->plain_bytes += n;
+        }
+    }
+
+    size_t off = 0;
+    while (off < client->in_len) {
+        if (!client->binary) {
+            char* line = client->in + off;
+            char* nl = memchr(line, '\n', client->in_len - off);
+            if (nl == NULL)
+                break;
+            *nl = '\0';
+            off = nl - client->in + 1;
+            on_line(client, line, nl - line);
+        } else {
+            ProtoFrame frame;
+            long n = proto_parse(client->in + off, client->in_len - off, MAX_RECV_FRAME, &frame);
+            if (n < 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (n == 0)
+                break;
+            off += n;
+            on_frame(client, &frame);
+        }
+    }
+
+    memmove(client->in, client->in + off, client->in_len - off);
+    client->in_len -= off;
+    return 0;
+}
+
+// Função que espera até `timeout_ms` (-1 = sem limite) pelas respostas de todos os
+// comandos enviados, para uso sequencial (testes, scripts). Retorna -1 se a conexão
+// falhou ou o tempo acabou com respostas faltando.
+int chat_wait(ChatClient* client, int timeout_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t deadline = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + timeout_ms;
+
+    while (client->pending > 0) {
+        struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+        if (chat_backlog(client) > 0)
+            pfd.events |= POLLOUT;
+        int wait = -1;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t left = deadline - ((int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+            wait = left > 0 ? (int)left : 0;
+        }
+        int ready = poll(&pfd, 1, wait);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0) {
+            if (ready == 0)
+                errno = ETIMEDOUT;
+            return -1;
+        }
+        if ((pfd.revents & POLLOUT) && chat_flush(client) < 0)
+            return -1;
+        if ((pfd.revents & (POLLIN | POLLERR | POLLHUP)) && chat_read(client) < 0)
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Biblioteca de cliente do servidor de chat, usada pelo cliente interativo e pelo
+// gerador de carga. A conexão é não bloqueante e não tem laço próprio: quem usa espera
+// o descritor (chat_fd) com poll ou epoll, chama chat_read quando há dados e
+// chat_flush quando o socket aceita escrita (chat_backlog > 0). Os bytes recebidos
+// são remontados em linhas (protocolo de texto) ou frames (binário), por mais que
+// cheguem divididos ou juntos num recv, e cada resposta ou entrega vira um ChatEvent
+// passado ao callback.
+//
+// As respostas chegam na ordem dos comandos, uma por comando: chat_pending conta os
+// comandos que ainda não tiveram resposta.
+
+// Opções da conexão
+#define CHAT_BINARY 0x01        // Protocolo binário (PROTO {BINARY})
+#define CHAT_DEFLATE 0x02       // Saída do servidor comprimida (PROTO {..., DEFLATE})
+
+// Eventos recebidos do servidor
+enum {
+    CHAT_EVENT_MESSAGE,         // Entrega: from, group (mensagem de grupo), text, arg = ts, seq
+    CHAT_EVENT_PRESENCE,        // Mudança de estado: from = apelido, arg = PRESENCE_*, text = nome
+    CHAT_EVENT_OK,              // Resposta OK: text = detalhe (apelido no LOGIN, QUEUED, ...)
+    CHAT_EVENT_ERROR,           // Resposta ERROR: text = código
+    CHAT_EVENT_USERS,           // Resposta do LIST: text = lista em JSON, arg = total
+    CHAT_EVENT_HISTORY,         // Resposta do HISTORY: text = mensagens em JSON, arg = próxima sequência
+    CHAT_EVENT_SEARCH,          // Resposta do SEARCH: text = mensagens em JSON, arg = quantidade
+    CHAT_EVENT_STATS            // Resposta do STATS: text = contadores em JSON
+};
+
+// Evento recebido; os campos apontam para o buffer de entrada e só valem durante o
+// callback. Os textos do protocolo de texto já vêm sem os escapes do JSON.
+typedef struct {
+    int type;                   // CHAT_EVENT_*
+    const char* from;
+    size_t from_len;
+    const char* group;          // NULL fora das mensagens de grupo
+    size_t group_len;
+    const char* text;
+    size_t text_len;
+    uint64_t arg;
+    uint64_t seq;               // Sequência da entrega (sessões com ACK), 0 se não tem
+} ChatEvent;
+
+typedef struct ChatClient ChatClient;
+
+// Função chamada para cada evento recebido. Pode enviar comandos, mas não fechar o cliente.
+typedef void (*ChatCallback)(ChatClient* client, const ChatEvent* event, void* ctx);
+
+ChatClient* chat_connect(const char* host, int port, int options, ChatCallback callback, void* ctx);
+void chat_close(ChatClient* client);
+int chat_fd(const ChatClient* client);
+int chat_read(ChatClient* client);
+int chat_flush(ChatClient* client);
+size_t chat_backlog(const ChatClient* client);
+uint32_t chat_pending(const ChatClient* client);
+int chat_wait(ChatClient* client, int timeout_ms);
+void chat_bytes(const ChatClient* client, uint64_t* wire, uint64_t* plain);
+
+int chat_register(ChatClient* client, const char* nick, const char* name);
+int chat_delete(ChatClient* client, const char* nick);
+int chat_login(ChatClient* client, const char* nick);
+int chat_logout(ChatClient* client, const char* nick);
+int chat_list(ChatClient* client, const char* prefix, uint32_t offset, uint32_t count);
+int chat_send(ChatClient* client, const char* to, const char* text, size_t len);
+int chat_subscribe(ChatClient* client, const char* nick);
+int chat_join(ChatClient* client, const char* group);
+int chat_history(ChatClient* client, const char* nick);
+int chat_search(ChatClient* client, const char* terms);
+
+#endif
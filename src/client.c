@@ -2,252 +2,386 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+
+#include "chat_client.h"
+#include "protocol.h"
+
+// Cliente interativo. Um laço com poll atende ao mesmo tempo o teclado e o socket:
+// mensagens e respostas aparecem assim que chegam, mesmo no meio de uma pergunta do
+// menu, e cada pergunta é respondida numa linha sem bloquear a recepção.
 
-#define MAX_MSG_LEN 1024
 #define MAX_NICK_LEN 50
-#define MAX_NAME_LEN 100
 #define PORT 8080
-
-int socket_fd;                          // Socket de conexão com o servidor
+// Perguntas de uma opção do menu e tamanho de cada resposta
+#define MAX_FIELDS 2
+#define MAX_FIELD_LEN 256
+// Bytes digitados guardados até o fim da linha
+#define INPUT_BUFFER_LEN 4096
+// Milissegundos esperando as respostas pendentes ao sair
+#define EXIT_TIMEOUT 2000
+// Comandos enviados lembrados até a resposta
+#define SENT_RING 256
+
+ChatClient* client;                     // Conexão com o servidor
 char current_user[MAX_NICK_LEN] = "";   // Usuário logado atualmente
-
-// Função que estabele conexão com o servidor
-void connect_to_server() {
-    struct sockaddr_in server_addr;
-
-    // Criando socket TCP
-    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd < 0) {
-        perror("socket");
-        exit(1);
+int binary_mode = 0;                    // Usa o protocolo binário (opção -b)
+
+// Opção do menu: as perguntas feitas antes de enviar o comando
+typedef struct {
+    const char* title;
+    int needs_login;            // Só com um usuário logado
+    int field_count;
+    const char* prompts[MAX_FIELDS];
+    void (*run)(char fields[][MAX_FIELD_LEN]);
+} MenuOption;
+
+int option = -1;                        // Opção sendo preenchida (-1 = escolhendo)
+int field = 0;                          // Próxima pergunta da opção
+char fields[MAX_FIELDS][MAX_FIELD_LEN]; // Respostas da opção
+char input[INPUT_BUFFER_LEN];           // Linha sendo digitada
+size_t input_len = 0;
+
+// Comandos ainda sem resposta, na ordem de envio (o servidor responde na mesma ordem)
+int sent_ops[SENT_RING];
+int sent_head = 0, sent_count = 0;
+
+void show_prompt();
+
+// Função que lembra o comando enviado para interpretar a resposta dele
+void remember_sent(int op) {
+    if (sent_count == SENT_RING) {
+        sent_head = (sent_head + 1) % SENT_RING;
+        sent_count--;
     }
+    sent_ops[(sent_head + sent_count) % SENT_RING] = op;
+    sent_count++;
+}
 
-    // Configurando endereço do servidor
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");   // localhost
+// Função que retira o comando mais antigo sem resposta (-1 se não há nenhum)
+int take_sent() {
+    if (sent_count == 0)
+        return -1;
+    int op = sent_ops[sent_head];
+    sent_head = (sent_head + 1) % SENT_RING;
+    sent_count--;
+    return op;
+}
 
-    // Estabelecendo conexao
-    if (connect(socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect");
-        exit(1);
+// Função que exibe um evento recebido do servidor
+void show_event(ChatClient* c, const ChatEvent* event, void* ctx) {
+    (void)c;
+    (void)ctx;
+    int from_len = (int)event->from_len, text_len = (int)event->text_len;
+
+    printf("\n");
+    switch (event->type) {
+    case CHAT_EVENT_MESSAGE:
+        if (event->group != NULL)
+            printf(">>> Nova mensagem de %.*s em %.*s: %.*s\n", from_len, event->from,
+                   (int)event->group_len, event->group, text_len, event->text);
+        else
+            printf(">>> Nova mensagem de %.*s: %.*s\n", from_len, event->from, text_len, event->text);
+        break;
+    case CHAT_EVENT_PRESENCE:
+        if (event->arg == PRESENCE_REGISTERED)
+            printf(">>> Novo usuário: %.*s (%.*s)\n", from_len, event->from, text_len, event->text);
+        else if (event->arg == PRESENCE_DELETED)
+            printf(">>> Usuário removido: %.*s\n", from_len, event->from);
+        else
+            printf(">>> %.*s está %s\n", from_len, event->from, event->arg == PRESENCE_ONLINE ? "online" : "offline");
+        break;
+    case CHAT_EVENT_OK:
+        take_sent();
+        if (text_len > 0)
+            printf("Servidor: OK{%.*s}\n", text_len, event->text);
+        else
+            printf("Servidor: OK\n");
+        break;
+    case CHAT_EVENT_ERROR:
+        // Um LOGIN recusado não deixa o usuário logado
+        if (take_sent() == OP_LOGIN)
+            current_user[0] = '\0';
+        printf("Servidor: ERROR{%.*s}\n", text_len, event->text);
+        break;
+    case CHAT_EVENT_USERS:
+        take_sent();
+        printf("Servidor: USERS{users:%.*s}\n", text_len, event->text);
+        break;
+    case CHAT_EVENT_HISTORY:
+        take_sent();
+        printf("Servidor: HISTORY{messages:%.*s,next:%llu}\n", text_len, event->text,
+               (unsigned long long)event->arg);
+        break;
+    case CHAT_EVENT_SEARCH:
+        take_sent();
+        printf("Servidor: SEARCH{messages:%.*s}\n", text_len, event->text);
+        break;
+    case CHAT_EVENT_STATS:
+        take_sent();
+        printf("Servidor: STATS{%.*s}\n", text_len, event->text);
+        break;
     }
 
-    printf("Conectado ao servidor\n");
+    // A pergunta que estava na tela volta depois do evento
+    show_prompt();
 }
 
-// Função para limpar o buffer de entrada
-void clear_input_buffer() {
-    int c;
-    while ((c = getchar()) != '\n' && c != EOF);
-}
-
-// Função que verifica as mensagens recebidas do servidor
-void check_messages() {
-    char buffer[MAX_MSG_LEN];
-    
-    // Verificação não-bloqueante simples
-    int bytes_received = recv(socket_fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
-        
-        if (strncmp(buffer, "DELIVER_MSG", 11) == 0) {
-            char from[MAX_NICK_LEN], text[256];
-            long ts;
-            
-            if (sscanf(buffer, "DELIVER_MSG{\"from\":\"%[^\"]\",\"text\":\"%[^\"]\",\"ts\":%ld}", 
-                       from, text, &ts) == 3)
-                printf("\n>>> Nova mensagem de %s: %s\n", from, text);
-        } else {
-            printf("Servidor: %s\n", buffer);
-        }
-    } else if (bytes_received == 0) {
+// Função que confere o envio de um comando e o lembra até a resposta
+void check_sent(int result, int op) {
+    if (result < 0) {
         printf("Servidor desconectou\n");
         exit(1);
     }
-}
-
-// Função que exibe o menu principal
-void show_menu() {
-    printf("\n======== CLIENT ========\n");
-    if (strlen(current_user) > 0)
-        printf("Logado como: %s\n", current_user);
-    printf("1. Registro\n");
-    printf("2. Login\n");
-    printf("3. Listar Usuários\n");
-    printf("4. Enviar Mensagem\n");
-    printf("5. Logout\n");
-    printf("6. Deletar\n");
-    printf("7. Fecha Programa\n");
-
-    printf("Escolha: ");
-    
-}
-
-// Função que envia o comando para o servidor e recebe a resposta
-void send_command(const char* command){
-    // Enviando comando para o servidor
-    send(socket_fd, command, strlen(command), 0);
+    remember_sent(op);
 }
 
 // Interface para registro de um novo usuário
-void register_user() {
-    char nick[MAX_NICK_LEN], name[MAX_NAME_LEN];
-    printf("Apelido: ");
-    scanf("%s", nick);
-    clear_input_buffer();
-    
-    printf("Nome Completo: ");
-    scanf(" %[^\n]", name);
-    clear_input_buffer();
-
-    // Formatando e enviando o comando REGISTER
-    char command[MAX_MSG_LEN];
-    snprintf(command, sizeof(command), "REGISTER {%s, %s}", nick, name);
-    send_command(command);
+void register_user(char f[][MAX_FIELD_LEN]) {
+    char nick[MAX_NICK_LEN];
+    sscanf(f[0], "%49s", nick);
+    check_sent(chat_register(client, nick, f[1]), OP_REGISTER);
 }
 
 // Interface para o login do usuário
-void login_user() {
+void login_user(char f[][MAX_FIELD_LEN]) {
     char nick[MAX_NICK_LEN];
-    printf("Apelido: ");
-    scanf("%s", nick);
-    clear_input_buffer();
-
-    // Formatando e enviando comando LOGIN
-    char command[MAX_MSG_LEN];
-    snprintf(command, sizeof(command), "LOGIN {%s}", nick);
-    send_command(command);
+    sscanf(f[0], "%49s", nick);
+    check_sent(chat_login(client, nick), OP_LOGIN);
 
-    // Atualizando usuário atual
+    // Atualizando usuário atual (desfeito se o servidor recusar)
     strcpy(current_user, nick);
 }
 
 // Interface para solicitação de lista de usuários do servidor
-void list_users() {
-    send_command("LIST");
-    // Pequena pausa para garantir que a resposta chegue
-    usleep(100000); // 100ms
-    check_messages();
+void list_users(char f[][MAX_FIELD_LEN]) {
+    (void)f;
+    check_sent(chat_list(client, NULL, 0, 0), OP_LIST);
 }
 
 // Interface para envio de mensagens
-void send_message() {
-    if (strlen(current_user) == 0) {
-        printf("Faça o LOGIN primeiro.\n");
-        return;
-    }
-
-    char to[MAX_NICK_LEN], text[256];
-    printf("Para: ");
-    scanf("%s", to);
-    clear_input_buffer();
-    
-    printf("Mensagem: ");
-    scanf(" %[^\n]", text);
-    clear_input_buffer();
-    
-    // Formatando e enviando comando SEND_MSG
-    char command[MAX_MSG_LEN];
-    snprintf(command, sizeof(command), "SEND_MSG {%s, %s}", to, text);
-    send_command(command);
+void send_message(char f[][MAX_FIELD_LEN]) {
+    char to[MAX_NICK_LEN];
+    sscanf(f[0], "%49s", to);
+    check_sent(chat_send(client, to, f[1], strlen(f[1])), OP_SEND_MSG);
 }
 
 // Interface para logout de usuário
-void logout_user() {
-    if (strlen(current_user) == 0) {
-        printf("Não está logado.\n");
-        return;
-    }
-
-    // Formatando e enviando comando LOGOUT
-    char command[MAX_MSG_LEN];
-    snprintf(command, sizeof(command), "LOGOUT {%s}", current_user);
-    send_command(command);
+void logout_user(char f[][MAX_FIELD_LEN]) {
+    (void)f;
+    check_sent(chat_logout(client, current_user), OP_LOGOUT);
 
     // Limpando usuário atual
     strcpy(current_user, "");
 }
 
 // Interace para exclusão de usuário
-void delete_user() {
+void delete_user(char f[][MAX_FIELD_LEN]) {
     char nick[MAX_NICK_LEN];
-    printf("Apelido: ");
-    scanf("%s", nick);
-    clear_input_buffer();
+    sscanf(f[0], "%49s", nick);
+    check_sent(chat_delete(client, nick), OP_DELETE);
+}
 
-    // Formatando e enviando comando DELETE
-    char command[MAX_MSG_LEN];
-    snprintf(command, sizeof(command), "DELETE {%s}", nick);
-    send_command(command);
+// Interface para acompanhar o estado (online/offline) de um contato; as mudanças
+// chegam como PRESENCE
+void follow_contact(char f[][MAX_FIELD_LEN]) {
+    char nick[MAX_NICK_LEN];
+    sscanf(f[0], "%49s", nick);
+    check_sent(chat_subscribe(client, nick), OP_SUBSCRIBE);
 }
 
-int main() {
-    connect_to_server();
+// Interface para entrar num grupo; as mensagens do grupo são enviadas pela opção 4
+// com o nome do grupo (#grupo) como destinatário
+void join_group(char f[][MAX_FIELD_LEN]) {
+    char group[MAX_NICK_LEN];
+    sscanf(f[0], "%49s", group);
+    check_sent(chat_join(client, group), OP_JOIN);
+}
 
-    int option;
-    char input[10];
+// Interface para ver as últimas mensagens trocadas com um contato
+void show_history(char f[][MAX_FIELD_LEN]) {
+    char nick[MAX_NICK_LEN];
+    sscanf(f[0], "%49s", nick);
+    check_sent(chat_history(client, nick), OP_HISTORY);
+}
 
-    while (1) {
+// Interface para buscar, nas conversas do usuário, as mensagens com todas as palavras
+void search_messages(char f[][MAX_FIELD_LEN]) {
+    check_sent(chat_search(client, f[0]), OP_SEARCH);
+}
 
-        check_messages();
+// Função que fecha o programa: faz logout se estiver logado e espera as respostas
+// dos comandos ainda pendentes
+void quit(char f[][MAX_FIELD_LEN]) {
+    (void)f;
+    if (strlen(current_user) > 0)
+        logout_user(NULL);  // Faz logout caso esteja conectado
+    chat_wait(client, EXIT_TIMEOUT);
 
-        show_menu();
+    // Fechando conexão
+    chat_close(client);
+    printf("\nAté logo!\n");
+    exit(0);
+}
 
-        // Lendo entrada do usuário
-        if (fgets(input, sizeof(input), stdin) == NULL){
-            usleep(100000); // Pequena pausa para não sobrecarregar CPU
-            continue;
-        }
+// Opções do menu, na ordem em que aparecem
+MenuOption menu[] = {
+    { "Registro",           0, 2, { "Apelido: ", "Nome Completo: " }, register_user },
+    { "Login",              0, 1, { "Apelido: " },                    login_user },
+    { "Listar Usuários",    0, 0, { NULL },                           list_users },
+    { "Enviar Mensagem",    1, 2, { "Para: ", "Mensagem: " },         send_message },
+    { "Logout",             1, 0, { NULL },                           logout_user },
+    { "Deletar",            0, 1, { "Apelido: " },                    delete_user },
+    { "Acompanhar Contato", 0, 1, { "Apelido: " },                    follow_contact },
+    { "Entrar em Grupo",    0, 1, { "Grupo (#nome): " },              join_group },
+    { "Histórico",          1, 1, { "Contato: " },                    show_history },
+    { "Buscar Mensagens",   1, 1, { "Palavras: " },                   search_messages },
+    { "Fecha Programa",     0, 0, { NULL },                           quit },
+};
+#define MENU_OPTIONS (int)(sizeof(menu) / sizeof(menu[0]))
+
+// Função que exibe a pergunta atual: a escolha do menu ou o próximo campo da opção
+void show_prompt() {
+    printf("%s", option < 0 ? "Escolha: " : menu[option].prompts[field]);
+    fflush(stdout);
+}
 
-        // Verificar se a entrada está vazia
-        if (strlen(input) == 0) {
-            continue;
+// Função que exibe o menu principal
+void show_menu() {
+    printf("\n======== CLIENT ========\n");
+    if (strlen(current_user) > 0)
+        printf("Logado como: %s\n", current_user);
+    for (int i = 0; i < MENU_OPTIONS; i++)
+        printf("%d. %s\n", i + 1, menu[i].title);
+
+    option = -1;
+    show_prompt();
+}
+
+// Função que trata uma linha digitada: a escolha de uma opção ou a resposta da
+// pergunta atual
+void handle_line(char* line) {
+    // Tirando os espaços das pontas
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' || line[len - 1] == '\r'))
+        line[--len] = '\0';
+    while (*line == ' ' || *line == '\t')
+        line++;
+
+    // Linha vazia: a mesma pergunta de novo
+    if (*line == '\0') {
+        show_prompt();
+        return;
+    }
+
+    if (option < 0) {
+        int choice = atoi(line);
+        if (choice < 1 || choice > MENU_OPTIONS) {
+            printf("Opção inválida.\n");
+            show_menu();
+            return;
+        }
+        if (menu[choice - 1].needs_login && strlen(current_user) == 0) {
+            printf(menu[choice - 1].run == logout_user ? "Não está logado.\n" : "Faça o LOGIN primeiro.\n");
+            show_menu();
+            return;
         }
+        option = choice - 1;
+        field = 0;
+    } else {
+        snprintf(fields[field++], MAX_FIELD_LEN, "%s", line);
+    }
 
-        option = atoi(input);
+    if (field < menu[option].field_count) {
+        show_prompt();
+        return;
+    }
+    menu[option].run(fields);
+    show_menu();
+}
 
-        // Processamento da escolha
-        switch (option) {
-        case 1:
-            register_user();
-            break;
-        case 2:
-            login_user();
-            break;
-        case 3:
-            list_users();
-            break;
-        case 4:
-            send_message();
-            break;
-        case 5:
-            logout_user();
+// Função que lê o que foi digitado e trata as linhas completas
+void read_input() {
+    ssize_t bytes_read = read(STDIN_FILENO, input + input_len, sizeof(input) - 1 - input_len);
+    if (bytes_read < 0 && errno == EINTR)
+        return;
+    // Fim da entrada: sai como na opção de fechar
+    if (bytes_read <= 0)
+        quit(NULL);
+    input_len += bytes_read;
+
+    size_t start = 0;
+    char* newline;
+    while ((newline = memchr(input + start, '\n', input_len - start)) != NULL) {
+        *newline = '\0';
+        handle_line(input + start);
+        start = newline - input + 1;
+    }
+
+    // Uma linha maior que o buffer é tratada como se tivesse terminado
+    if (start == 0 && input_len == sizeof(input) - 1) {
+        input[input_len] = '\0';
+        handle_line(input);
+        start = input_len;
+    }
+    memmove(input, input + start, input_len - start);
+    input_len -= start;
+}
+
+int main(int argc, char* argv[]) {
+    int port = PORT;
+    int opt;
+    while ((opt = getopt(argc, argv, "bp:")) != -1) {
+        switch (opt) {
+        case 'b':
+            binary_mode = 1;
             break;
-        case 6:
-            delete_user();
+        case 'p':
+            port = atoi(optarg);
             break;
-        case 7:
-            if (strlen(current_user) > 0)
-                logout_user();  // Faz logout caso esteja conectado
-            
-            // Fechando conexão
-            close(socket_fd);
-            printf("Até logo!\n");
-            exit(0);
         default:
-            printf("Opção inválida.\n");
+            fprintf(stderr, "Uso: %s [-b] [-p porta]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    // Estabelecendo conexao (localhost)
+    client = chat_connect("127.0.0.1", port, binary_mode ? CHAT_BINARY : 0, show_event, NULL);
+    if (client == NULL) {
+        perror("connect");
+        exit(1);
+    }
+    printf("Conectado ao servidor\n");
+    if (binary_mode)
+        printf("Usando protocolo binário\n");
+
+    show_menu();
+
+    // Teclado e socket no mesmo laço
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = chat_fd(client), .events = POLLIN },
+    };
+    while (1) {
+        fds[1].events = POLLIN | (chat_backlog(client) > 0 ? POLLOUT : 0);
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(1);
+        }
+
+        if ((fds[1].revents & POLLOUT) && chat_flush(client) < 0) {
+            printf("\nServidor desconectou\n");
+            exit(1);
+        }
+        if ((fds[1].revents & (POLLIN | POLLERR | POLLHUP)) && chat_read(client) < 0) {
+            printf("\nServidor desconectou\n");
+            exit(1);
         }
-        
-        // Verificando as recebeu mensagens
-        check_messages();
-        usleep(100000);
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+            read_input();
     }
-    
-    close(socket_fd);
-    return 0;
 }
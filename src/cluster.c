@@ -0,0 +1,669 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "server.h"
+
+// Identificação do link, enviada por quem conecta: magic, índice do nó e tamanho da lista
+#define LINK_MAGIC "CHATNOD1"
+#define LINK_HELLO_LEN 16
+// Cabeçalho de cada frame: u64 tamanho (mantém as mensagens alinhadas a 8 bytes)
+#define FRAME_HEADER_LEN 8
+// Tempo máximo de uma conexão a outro nó
+#define CONNECT_TIMEOUT_MS 2000
+// Espaço livre mínimo no buffer de leitura de um link
+#define LINK_READ_CHUNK 65536
+
+// Estado do link de saída para um nó
+enum {
+    LINK_DOWN,                  // Desligado, nova tentativa em retry_at
+    LINK_CONNECTING,            // connect em andamento, até retry_at
+    LINK_UP                     // Aceita lotes
+};
+
+// Nó da lista e o link de saída para ele
+typedef struct {
+    char addr[64];              // "host:porta" como veio na lista (identifica o nó no anel)
+    struct sockaddr_in sa;      // Endereço da porta dos links
+    int fd;                     // Link de saída (-1 se desligado)
+    int state;                  // LINK_*
+    uint64_t retry_at;          // Próxima tentativa ou fim do prazo do connect (ns)
+    char* wbuf;                 // Frames a enviar
+    size_t wlen;
+    size_t wcap;
+    size_t woff;                // Bytes já enviados
+    size_t head;                // Início do primeiro frame ainda não enviado por inteiro
+} ClusterNode;
+
+// Link de entrada, aberto por outro nó
+typedef struct {
+    int fd;
+    int node;                   // Nó de origem (-1 até o hello chegar)
+    char* rbuf;                 // Bytes recebidos e ainda não processados
+    size_t rlen;
+    size_t rcap;
+} ClusterLink;
+
+// Ponto do anel do hash consistente
+typedef struct {
+    uint32_t hash;
+    int node;
+} RingPoint;
+
+int cluster_count;              // Nós do cluster (0 = servidor sozinho)
+int cluster_self;               // Índice deste nó na lista
+
+static ClusterNode nodes[CLUSTER_MAX_NODES];
+static RingPoint* ring;         // CLUSTER_VNODES pontos por nó, em ordem de hash
+static int ring_len;
+static Mailbox mailbox;         // Lotes dos shards para outros nós
+static int event_fd = -1;       // Acorda a thread quando chegam lotes
+static int epoll_fd = -1;
+static int listen_fd = -1;      // Porta dos links de entrada
+static ClusterLink** links;     // Links de entrada indexados pelo socket
+static int links_cap;
+static ShardBatch** inbox;      // Lote em montagem para cada shard deste nó
+static pthread_t thread;
+static int started;
+
+// Função que espalha os bits do hash (finalizador do MurmurHash3): o anel não usa os
+// mesmos bits que escolhem o shard dentro do nó
+static uint32_t ring_mix(uint32_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Função que compara dois pontos do anel (qsort)
+static int compare_points(const void* a, const void* b) {
+    const RingPoint* x = a;
+    const RingPoint* y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->node - y->node;
+}
+
+// Função que monta o anel: os pontos de cada nó saem do endereço dele, então não
+// dependem da posição do nó na lista
+static void ring_build() {
+    ring_len = cluster_count * CLUSTER_VNODES;
+    ring = malloc(ring_len * sizeof(RingPoint));
+    for (int i = 0; i < cluster_count; i++) {
+        for (int v = 0; v < CLUSTER_VNODES; v++) {
+            char key[sizeof(nodes[0].addr) + 12];
+            snprintf(key, sizeof(key), "%.*s#%d", (int)sizeof(nodes[0].addr) - 1, nodes[i].addr, v);
+            ring[i * CLUSTER_VNODES + v].hash = ring_mix(hash_nick(key));
+            ring[i * CLUSTER_VNODES + v].node = i;
+        }
+    }
+    qsort(ring, ring_len, sizeof(RingPoint), compare_points);
+}
+
+// Função que interpreta a lista de nós "host:porta,host:porta,..." (opção -c), na
+// mesma ordem em todos os nós. Retorna -1 se ela não é válida.
+int cluster_parse(const char* list) {
+    char copy[4096];
+    snprintf(copy, sizeof(copy), "%s", list);
+
+    cluster_count = 0;
+    char* save;
+    for (char* item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char* colon = strrchr(item, ':');
+        if (colon == NULL || cluster_count == CLUSTER_MAX_NODES || strlen(item) >= sizeof(nodes[0].addr)) {
+            fprintf(stderr, "Nó inválido na lista do cluster: %s (host:porta, até %d nós)\n", item,
+                    CLUSTER_MAX_NODES);
+            return -1;
+        }
+
+        ClusterNode* node = &nodes[cluster_count];
+        strcpy(node->addr, item);
+        *colon = '\0';
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        int err = getaddrinfo(item, colon + 1, &hints, &res);
+        if (err != 0) {
+            fprintf(stderr, "Nó inválido na lista do cluster: %s (%s)\n", node->addr, gai_strerror(err));
+            return -1;
+        }
+        memcpy(&node->sa, res->ai_addr, sizeof(node->sa));
+        freeaddrinfo(res);
+
+        node->fd = -1;
+        node->state = LINK_DOWN;
+        cluster_count++;
+    }
+    if (cluster_count == 0) {
+        fprintf(stderr, "Lista do cluster vazia\n");
+        return -1;
+    }
+
+    ring_build();
+    mailbox_init(&mailbox);
+    return 0;
+}
+
+// Função que retorna o nó dono da chave com hash `hash`: o primeiro ponto do anel a
+// partir dela, voltando ao início depois do último
+int cluster_node(uint32_t hash) {
+    if (cluster_count == 0)
+        return cluster_self;
+
+    uint32_t key = ring_mix(hash);
+    int lo = 0, hi = ring_len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return ring[lo == ring_len ? 0 : lo].node;
+}
+
+// Função que retorna o nó dono do usuário
+int cluster_node_of(const char* nick) {
+    return cluster_count == 0 ? cluster_self : cluster_node(hash_nick(nick));
+}
+
+// Função que entrega à thread do cluster um lote para o nó batch->peer (chamada pelos
+// shards no fim da iteração)
+void cluster_submit(ShardBatch* batch) {
+    mailbox_push(&mailbox, &batch->node);
+
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        LOG(LOG_ERROR, "eventfd: %s", strerror(errno));
+}
+
+// Função que responde ERROR{UNAVAILABLE} aos comandos das mensagens em `data` (uma
+// sequência de ShardMsg) que não chegaram ao outro nó
+static void bounce_messages(const char* data, size_t len) {
+    size_t offset = 0;
+    while (offset < len) {
+        const ShardMsg* msg = (const ShardMsg*)(data + offset);
+        remote_msg_unavailable(msg, inbox);
+        offset += shard_msg_size(msg->len);
+    }
+}
+
+// Função que desliga o link de saída para o nó: os frames que não saíram por inteiro
+// não foram processados do outro lado, então os comandos deles recebem ERROR{UNAVAILABLE}
+static void node_failed(int i, const char* reason) {
+    ClusterNode* node = &nodes[i];
+    if (node->state == LINK_UP)
+        LOG(LOG_WARN, "Link com o nó %d (%s) caiu: %s", i, node->addr, reason);
+    else
+        LOG(LOG_DEBUG, "Sem link com o nó %d (%s): %s", i, node->addr, reason);
+
+    size_t offset = node->head;
+    while (offset + FRAME_HEADER_LEN <= node->wlen) {
+        uint64_t len;
+        memcpy(&len, node->wbuf + offset, sizeof(len));
+        bounce_messages(node->wbuf + offset + FRAME_HEADER_LEN, len);
+        offset += FRAME_HEADER_LEN + len;
+    }
+    node->wlen = node->woff = node->head = 0;
+
+    if (node->fd >= 0)
+        close(node->fd);
+    node->fd = -1;
+    node->state = LINK_DOWN;
+    node->retry_at = stats_now() + (uint64_t)CLUSTER_RETRY_MS * 1000000;
+}
+
+// Função que inicia a conexão (não bloqueante) do link de saída para o nó
+static void node_connect(int i) {
+    ClusterNode* node = &nodes[i];
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        node_failed(i, strerror(errno));
+        return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    node->fd = fd;
+    node->state = LINK_CONNECTING;
+    node->retry_at = stats_now() + (uint64_t)CONNECT_TIMEOUT_MS * 1000000;
+
+    if (connect(fd, (struct sockaddr*)&node->sa, sizeof(node->sa)) < 0 && errno != EINPROGRESS) {
+        node_failed(i, strerror(errno));
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        node_failed(i, strerror(errno));
+}
+
+// Função que envia o que couber dos frames pendentes para o nó
+static void node_write(int i) {
+    ClusterNode* node = &nodes[i];
+    while (node->woff < node->wlen) {
+        ssize_t sent = send(node->fd, node->wbuf + node->woff, node->wlen - node->woff, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                node_failed(i, strerror(errno));
+            break;
+        }
+        node->woff += sent;
+    }
+    if (node->state != LINK_UP)
+        return;
+
+    // Avançando o início do primeiro frame que ainda não saiu por inteiro
+    while (node->head + FRAME_HEADER_LEN <= node->woff) {
+        uint64_t len;
+        memcpy(&len, node->wbuf + node->head, sizeof(len));
+        if (node->head + FRAME_HEADER_LEN + len > node->woff)
+            break;
+        node->head += FRAME_HEADER_LEN + len;
+    }
+    if (node->woff == node->wlen)
+        node->wlen = node->woff = node->head = 0;
+}
+
+// Função que trata os eventos do link de saída: fim do connect (envia o hello), fila
+// do socket liberada ou link fechado pelo outro lado (que nunca escreve nele)
+static void node_event(int i, uint32_t events) {
+    ClusterNode* node = &nodes[i];
+
+    if (node->state == LINK_CONNECTING) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        getsockopt(node->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (err != 0) {
+            node_failed(i, strerror(err));
+            return;
+        }
+
+        // O hello cabe no buffer ainda vazio do socket
+        char hello[LINK_HELLO_LEN];
+        uint32_t self = cluster_self, count = cluster_count;
+        memcpy(hello, LINK_MAGIC, 8);
+        memcpy(hello + 8, &self, sizeof(self));
+        memcpy(hello + 12, &count, sizeof(count));
+        if (send(node->fd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+            node_failed(i, "hello não enviado");
+            return;
+        }
+        node->state = LINK_UP;
+        LOG(LOG_INFO, "Link com o nó %d (%s) aberto", i, node->addr);
+    }
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        node_failed(i, "conexão encerrada");
+        return;
+    }
+    if (events & EPOLLIN) {
+        char discard[64];
+        ssize_t n = recv(node->fd, discard, sizeof(discard), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            node_failed(i, n == 0 ? "conexão encerrada" : strerror(errno));
+            return;
+        }
+    }
+    node_write(i);
+}
+
+// Função que põe o lote no fim da fila do link para o nó, como um frame. Com o link
+// fora do ar ou a fila cheia os comandos do lote recebem ERROR{UNAVAILABLE}.
+static void node_append(int i, ShardBatch* batch) {
+    ClusterNode* node = &nodes[i];
+    if (i == cluster_self || node->state != LINK_UP ||
+        node->wlen - node->head + FRAME_HEADER_LEN + batch->len > CLUSTER_BACKLOG_MAX) {
+        bounce_messages(batch->data, batch->len);
+        return;
+    }
+
+    // Os frames já enviados saem do buffer antes de ele crescer
+    if (node->head > 0 && node->wlen + FRAME_HEADER_LEN + batch->len > node->wcap) {
+        memmove(node->wbuf, node->wbuf + node->head, node->wlen - node->head);
+        node->wlen -= node->head;
+        node->woff -= node->head;
+        node->head = 0;
+    }
+    if (node->wlen + FRAME_HEADER_LEN + batch->len > node->wcap) {
+        size_t cap = node->wcap ? node->wcap : LINK_READ_CHUNK;
+        while (node->wlen + FRAME_HEADER_LEN + batch->len > cap)
+            cap *= 2;
+        node->wbuf = realloc(node->wbuf, cap);
+        node->wcap = cap;
+    }
+
+    uint64_t len = batch->len;
+    memcpy(node->wbuf + node->wlen, &len, sizeof(len));
+    memcpy(node->wbuf + node->wlen + FRAME_HEADER_LEN, batch->data, batch->len);
+    node->wlen += FRAME_HEADER_LEN + batch->len;
+}
+
+// Função que leva aos links os lotes entregues pelos shards
+static void drain_submitted() {
+    uint64_t count;
+    if (read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG(LOG_ERROR, "eventfd: %s", strerror(errno));
+
+    MailboxNode* mn;
+    while ((mn = mailbox_pop(&mailbox)) != NULL) {
+        ShardBatch* batch = (ShardBatch*)mn;
+        node_append(batch->peer, batch);
+        free(batch);
+    }
+
+    for (int i = 0; i < cluster_count; i++)
+        if (nodes[i].state == LINK_UP && nodes[i].woff < nodes[i].wlen)
+            node_write(i);
+}
+
+// Função que fecha o link de entrada; se ele era o do nó, as sessões abertas por esse
+// nó caem em todos os shards
+static void link_close(ClusterLink* link) {
+    if (link->node >= 0) {
+        LOG(LOG_WARN, "Nó %d (%s) desconectado", link->node, nodes[link->node].addr);
+        for (int s = 0; s < shard_count; s++) {
+            ShardMsg* msg = batch_post(&inbox[s], MSG_NODE_DOWN, 0);
+            msg->seq = link->node;
+        }
+    }
+
+    links[link->fd] = NULL;
+    close(link->fd);
+    free(link->rbuf);
+    free(link);
+}
+
+// Função que reparte as mensagens de um frame entre os lotes dos shards deste nó.
+// Retorna -1 se o frame está corrompido.
+static int frame_dispatch(char* data, size_t len) {
+    size_t offset = 0;
+    while (offset < len) {
+        if (len - offset < sizeof(ShardMsg))
+            return -1;
+        ShardMsg* msg = (ShardMsg*)(data + offset);
+        size_t size = shard_msg_size(msg->len);
+        if (msg->len > len || size > len - offset)
+            return -1;
+
+        int target = remote_msg_shard(msg);
+        if (target >= 0) {
+            ShardMsg* copy = batch_post(&inbox[target], msg->type, msg->len);
+            memcpy(copy, msg, size);
+        } else {
+            LOG_SAMPLED(LOG_WARN, 1000, "Mensagem de outro nó sem destino (tipo %d)", msg->type);
+        }
+        offset += size;
+    }
+    return 0;
+}
+
+// Função que processa o hello e os frames completos do buffer do link. Retorna -1 se
+// o link deve ser fechado.
+static int link_parse(ClusterLink* link) {
+    size_t offset = 0;
+
+    if (link->node < 0) {
+        if (link->rlen < LINK_HELLO_LEN)
+            return 0;
+        uint32_t node, count;
+        memcpy(&node, link->rbuf + 8, sizeof(node));
+        memcpy(&count, link->rbuf + 12, sizeof(count));
+        if (memcmp(link->rbuf, LINK_MAGIC, 8) != 0 || count != (uint32_t)cluster_count ||
+            node >= (uint32_t)cluster_count || node == (uint32_t)cluster_self) {
+            LOG(LOG_WARN, "Link de entrada recusado: hello inválido (socket %d)", link->fd);
+            return -1;
+        }
+
+        // Um link antigo do mesmo nó (reiniciado) fecha antes: as sessões dele caem
+        // antes dos comandos do novo
+        for (int fd = 0; fd < links_cap; fd++)
+            if (links[fd] != NULL && links[fd] != link && links[fd]->node == (int)node)
+                link_close(links[fd]);
+
+        link->node = node;
+        offset = LINK_HELLO_LEN;
+        LOG(LOG_INFO, "Nó %d (%s) conectado", link->node, nodes[link->node].addr);
+    }
+
+    while (link->rlen - offset >= FRAME_HEADER_LEN) {
+        uint64_t len;
+        memcpy(&len, link->rbuf + offset, sizeof(len));
+        if (len > CLUSTER_FRAME_MAX || len % 8 != 0) {
+            LOG(LOG_WARN, "Frame inválido do nó %d (%llu bytes)", link->node, (unsigned long long)len);
+            return -1;
+        }
+        if (link->rlen - offset - FRAME_HEADER_LEN < len)
+            break;
+        if (frame_dispatch(link->rbuf + offset + FRAME_HEADER_LEN, len) < 0) {
+            LOG(LOG_WARN, "Frame corrompido do nó %d", link->node);
+            return -1;
+        }
+        offset += FRAME_HEADER_LEN + len;
+    }
+
+    memmove(link->rbuf, link->rbuf + offset, link->rlen - offset);
+    link->rlen -= offset;
+    return 0;
+}
+
+// Função que lê tudo o que chegou no link de entrada
+static void link_read(ClusterLink* link) {
+    while (1) {
+        if (link->rcap - link->rlen < LINK_READ_CHUNK) {
+            link->rcap = link->rcap ? link->rcap * 2 : 2 * LINK_READ_CHUNK;
+            link->rbuf = realloc(link->rbuf, link->rcap);
+        }
+
+        ssize_t n = recv(link->fd, link->rbuf + link->rlen, link->rcap - link->rlen, 0);
+        if (n > 0) {
+            link->rlen += n;
+            if (link_parse(link) < 0) {
+                link_close(link);
+                return;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        link_close(link);
+        return;
+    }
+}
+
+// Função que aceita os links de entrada pendentes
+static void accept_links() {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_SAMPLED(LOG_ERROR, 1000, "accept: %s", strerror(errno));
+            return;
+        }
+
+        if (fd >= links_cap) {
+            int cap = links_cap ? links_cap : 64;
+            while (fd >= cap)
+                cap *= 2;
+            links = realloc(links, cap * sizeof(ClusterLink*));
+            memset(links + links_cap, 0, (cap - links_cap) * sizeof(ClusterLink*));
+            links_cap = cap;
+        }
+
+        ClusterLink* link = calloc(1, sizeof(ClusterLink));
+        link->fd = fd;
+        link->node = -1;
+        links[fd] = link;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            link_close(link);
+    }
+}
+
+// Função que retorna quanto esperar pelo próximo evento: até a próxima tentativa de
+// conexão ou o fim do prazo de um connect (-1 se nenhum)
+static int next_timeout() {
+    uint64_t now = stats_now();
+    int timeout = -1;
+    for (int i = 0; i < cluster_count; i++) {
+        if (i == cluster_self || nodes[i].state == LINK_UP)
+            continue;
+        int wait = nodes[i].retry_at > now ? (int)((nodes[i].retry_at - now) / 1000000) + 1 : 0;
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+    return timeout;
+}
+
+// Laço da thread do cluster: links de saída, links de entrada e lotes dos shards
+static void* cluster_run(void* arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+    log_thread_name("cluster");
+
+    while (!server_stopping) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, next_timeout());
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(LOG_ERROR, "epoll_wait: %s", strerror(errno));
+            break;
+        }
+        if (server_stopping)
+            break;
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                accept_links();
+                continue;
+            }
+            if (fd == event_fd)
+                continue;
+
+            int node = 0;
+            while (node < cluster_count && nodes[node].fd != fd)
+                node++;
+            if (node < cluster_count)
+                node_event(node, events[i].events);
+            else if (fd < links_cap && links[fd] != NULL)
+                link_read(links[fd]);
+        }
+        drain_submitted();
+
+        // Reconexões e connects que passaram do prazo
+        uint64_t now = stats_now();
+        for (int i = 0; i < cluster_count; i++) {
+            if (i == cluster_self || nodes[i].state == LINK_UP || nodes[i].retry_at > now)
+                continue;
+            if (nodes[i].state == LINK_CONNECTING)
+                node_failed(i, "tempo esgotado");
+            else
+                node_connect(i);
+        }
+
+        // Mensagens recebidas (e respostas dos comandos recusados) para os shards
+        for (int s = 0; s < shard_count; s++) {
+            if (inbox[s] != NULL) {
+                batch_deliver(shards[s], inbox[s]);
+                inbox[s] = NULL;
+            }
+        }
+    }
+
+    for (int i = 0; i < cluster_count; i++)
+        if (nodes[i].fd >= 0)
+            close(nodes[i].fd);
+    for (int fd = 0; fd < links_cap; fd++)
+        if (links[fd] != NULL)
+            close(fd);
+    close(listen_fd);
+    return NULL;
+}
+
+// Função que abre a porta dos links deste nó, inicia as conexões com os outros e cria
+// a thread do cluster. Retorna -1 em caso de erro.
+int cluster_start(void) {
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = nodes[cluster_self].sa.sin_port;
+    if (listen_fd < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, BACKLOG) < 0) {
+        LOG(LOG_ERROR, "Porta do cluster %s: %s", nodes[cluster_self].addr, strerror(errno));
+        return -1;
+    }
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_fd < 0 || epoll_fd < 0) {
+        LOG(LOG_ERROR, "epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.fd = event_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+
+    inbox = calloc(shard_count, sizeof(ShardBatch*));
+    for (int i = 0; i < cluster_count; i++)
+        if (i != cluster_self)
+            node_connect(i);
+
+    if (pthread_create(&thread, NULL, cluster_run, NULL) != 0) {
+        LOG(LOG_ERROR, "pthread_create: %s", strerror(errno));
+        return -1;
+    }
+    started = 1;
+
+    LOG(LOG_INFO, "Nó %d de %d do cluster, links na porta %d", cluster_self, cluster_count,
+        ntohs(nodes[cluster_self].sa.sin_port));
+    return 0;
+}
+
+// Função que acorda a thread do cluster para o encerramento (segura num tratador de sinal)
+void cluster_wake(void) {
+    if (event_fd < 0)
+        return;
+    uint64_t one = 1;
+    ssize_t written = write(event_fd, &one, sizeof(one));
+    (void)written;
+}
+
+// Função que espera a thread do cluster terminar
+void cluster_join(void) {
+    if (started)
+        pthread_join(thread, NULL);
+}
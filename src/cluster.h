@@ -0,0 +1,45 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdint.h>
+
+// Cluster de servidores com lista estática de nós (opções -c e -n). Cada usuário
+// pertence a um único nó, escolhido por hash consistente do apelido: um anel com
+// CLUSTER_VNODES pontos por nó, então mudar a lista só troca o dono dos usuários
+// que caem nos trechos do nó que entrou ou saiu. Dentro do nó dono o usuário fica no
+// shard de sempre (shard_of).
+//
+// Os shards mandam mensagens a outro nó como a outro shard: o destino shard_count + nó
+// de shard_post junta as mensagens da iteração num lote, entregue no fim dela à thread
+// do cluster. Ela mantém um link TCP persistente de saída para cada nó e envia cada
+// lote como um frame ([u32 tamanho][ShardMsg...], no formato de memória: os nós rodam
+// o mesmo binário). Do outro lado, os frames recebidos são repartidos entre os shards
+// do nó (remote_msg_shard) e entram nas mailboxes deles.
+//
+// Um comando para um nó fora do ar é respondido com ERROR{UNAVAILABLE}; as demais
+// mensagens para ele são descartadas. Quando o link de entrada de um nó cai, as
+// sessões abertas por ele ficam offline (MSG_NODE_DOWN).
+
+// Pontos de cada nó no anel do hash consistente
+#define CLUSTER_VNODES 128
+// Máximo de nós na lista
+#define CLUSTER_MAX_NODES 64
+// Bytes esperando o envio para um nó a partir dos quais novos lotes são recusados
+#define CLUSTER_BACKLOG_MAX (64u << 20)
+// Maior frame aceito num link de entrada
+#define CLUSTER_FRAME_MAX (64u << 20)
+// Intervalo entre as tentativas de conectar a um nó fora do ar
+#define CLUSTER_RETRY_MS 1000
+
+extern int cluster_count;       // Nós do cluster (0 = servidor sozinho)
+extern int cluster_self;        // Índice deste nó na lista (0 sem cluster)
+
+int cluster_parse(const char* list);
+int cluster_node(uint32_t hash);
+int cluster_node_of(const char* nick);
+int cluster_start(void);
+void cluster_submit(ShardBatch* batch);
+void cluster_wake(void);
+void cluster_join(void);
+
+#endif
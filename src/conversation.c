@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+
+// Tamanho inicial da tabela (em bits)
+#define INITIAL_CONV_BITS 3
+
+// Função que retorna a posição do remetente (id + 1) na tabela, ou a posição vazia
+// onde ele entraria
+static ConvEntry* slot_of(ConvEntry* entries, uint32_t bits, uint32_t from) {
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t i = (from * 2654435769u) >> (32 - bits);
+    while (entries[i].from != 0 && entries[i].from != from)
+        i = (i + 1) & mask;
+    return &entries[i];
+}
+
+// Função que retorna a maior sequência aceita do remetente (0 se nenhuma)
+uint64_t conv_last(Arena* arena, const ConvTable* table, uint32_t from) {
+    if (table->count == 0)
+        return 0;
+    ConvEntry* entry = slot_of(arena_ptr(arena, table->entries), table->bits, from + 1);
+    return entry->from != 0 ? entry->seq : 0;
+}
+
+// Função que dobra a tabela, reinserindo os remetentes. Retorna -1 sem espaço.
+static int conv_grow(Arena* arena, ConvTable* table) {
+    uint32_t bits = table->bits ? table->bits + 1 : INITIAL_CONV_BITS;
+    size_t size = (size_t)1 << bits;
+    ArenaOff off = arena_alloc(arena, size * sizeof(ConvEntry));
+    if (off == 0)
+        return -1;
+
+    ConvEntry* entries = arena_ptr(arena, off);
+    memset(entries, 0, size * sizeof(ConvEntry));
+    if (table->entries != 0) {
+        ConvEntry* old = arena_ptr(arena, table->entries);
+        for (uint32_t i = 0; i < conv_size(table); i++)
+            if (old[i].from != 0)
+                *slot_of(entries, bits, old[i].from) = old[i];
+        arena_free(arena, table->entries, conv_size(table) * sizeof(ConvEntry));
+    }
+
+    table->entries = off;
+    table->bits = bits;
+    return 0;
+}
+
+// Função que registra `seq` como a maior sequência aceita do remetente. Retorna -1 sem espaço.
+int conv_accept(Arena* arena, ConvTable* table, uint32_t from, uint64_t seq) {
+    // Ocupação máxima de 1/2
+    if ((table->count + 1) * 2 > conv_size(table) && conv_grow(arena, table) < 0)
+        return -1;
+
+    ConvEntry* entry = slot_of(arena_ptr(arena, table->entries), table->bits, from + 1);
+    if (entry->from == 0) {
+        entry->from = from + 1;
+        table->count++;
+    }
+    if (seq > entry->seq)
+        entry->seq = seq;
+    return 0;
+}
+
+// Função que retorna o tamanho do array da tabela
+uint32_t conv_size(const ConvTable* table) {
+    return table->entries ? 1u << table->bits : 0;
+}
+
+// Função que retorna a i-ésima posição da tabela (NULL se vazia), para percorrê-la
+ConvEntry* conv_at(Arena* arena, const ConvTable* table, uint32_t i) {
+    ConvEntry* entry = (ConvEntry*)arena_ptr(arena, table->entries) + i;
+    return entry->from != 0 ? entry : NULL;
+}
+
+// Função que libera a tabela
+void conv_clear(Arena* arena, ConvTable* table) {
+    arena_free(arena, table->entries, conv_size(table) * sizeof(ConvEntry));
+    memset(table, 0, sizeof(*table));
+}
+
+// Função que troca os ids dos remetentes (o novo id de `from` é remap[from]),
+// reposicionando as entradas no mesmo array
+void conv_remap(Arena* arena, ConvTable* table, const int32_t* remap) {
+    if (table->count == 0)
+        return;
+
+    size_t size = conv_size(table) * sizeof(ConvEntry);
+    ConvEntry* entries = arena_ptr(arena, table->entries);
+    ConvEntry* old = malloc(size);
+    memcpy(old, entries, size);
+    memset(entries, 0, size);
+    for (uint32_t i = 0; i < conv_size(table); i++) {
+        if (old[i].from == 0)
+            continue;
+        uint32_t from = remap[old[i].from - 1] + 1;
+        ConvEntry* entry = slot_of(entries, table->bits, from);
+        entry->from = from;
+        entry->seq = old[i].seq;
+    }
+    free(old);
+}
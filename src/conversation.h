@@ -0,0 +1,36 @@
+#ifndef CONVERSATION_H
+#define CONVERSATION_H
+
+#include <stdint.h>
+
+#include "arena.h"
+
+// Sequências das conversas de um usuário. Um remetente pode numerar os SEND_MSG
+// para um destinatário (sequência crescente por conversa, escolhida pelo cliente);
+// o shard do destinatário guarda a maior sequência aceita de cada remetente e trata
+// um reenvio com sequência igual ou menor como repetição, sem entregar de novo.
+// A tabela fica na arena, dentro do usuário destinatário; os remetentes são ids da
+// tabela de nomes do shard.
+
+// Última sequência aceita de um remetente
+typedef struct {
+    uint32_t from;              // Id do remetente + 1 (0 = posição vazia)
+    uint64_t seq;               // Maior sequência aceita
+} ConvEntry;
+
+// Conjunto hash (endereçamento aberto, sondagem linear) de remetentes; só cresce,
+// e é liberado inteiro quando o usuário é removido
+typedef struct {
+    ArenaOff entries;           // Array de ConvEntry (0 enquanto vazio)
+    uint32_t count;             // Remetentes
+    uint32_t bits;              // log2 do tamanho do array
+} ConvTable;
+
+uint64_t conv_last(Arena* arena, const ConvTable* table, uint32_t from);
+int conv_accept(Arena* arena, ConvTable* table, uint32_t from, uint64_t seq);
+ConvEntry* conv_at(Arena* arena, const ConvTable* table, uint32_t i);
+uint32_t conv_size(const ConvTable* table);
+void conv_clear(Arena* arena, ConvTable* table);
+void conv_remap(Arena* arena, ConvTable* table, const int32_t* remap);
+
+#endif
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "server.h"
+
+// Capacidade inicial do array de membros de um grupo
+#define INITIAL_MEMBER_CAPACITY 16
+
+// Função que retorna os apelidos dos membros do grupo
+static char (*members_of(Shard* shard, const Group* group))[MAX_NICK_LEN] {
+    return arena_ptr(&shard->arena, group->members);
+}
+
+// Função que retorna a posição do membro no grupo ou -1 se não for membro
+static int find_member(Shard* shard, const Group* group, const char* member) {
+    char (*members)[MAX_NICK_LEN] = members_of(shard, group);
+    for (uint32_t i = 0; i < group->member_count; i++)
+        if (strcmp(members[i], member) == 0)
+            return i;
+    return -1;
+}
+
+// Função que prepara as áreas de trabalho do shard para `count` membros
+static GroupScratch* scratch_of(Shard* shard, uint32_t count) {
+    GroupScratch* scratch = &shard->group_scratch;
+    if (scratch->counts == NULL) {
+        scratch->counts = malloc(shard_count * sizeof(uint32_t));
+        scratch->used = malloc(shard_count * sizeof(size_t));
+        scratch->lists = malloc(shard_count * sizeof(char*));
+    }
+    if (scratch->conns_cap < count) {
+        scratch->conns_cap = count;
+        scratch->conns = realloc(scratch->conns, count * sizeof(ConnRef));
+    }
+    memset(scratch->counts, 0, shard_count * sizeof(uint32_t));
+    memset(scratch->used, 0, shard_count * sizeof(size_t));
+    return scratch;
+}
+
+// Função que verifica o nome de um grupo: começa com '#' e não contém o separador
+// usado no remetente das entregas de grupo
+int group_name_valid(const char* name) {
+    return name[0] == '#' && name[1] != '\0' && strlen(name) < MAX_NICK_LEN && strchr(name, GROUP_SEP) == NULL;
+}
+
+// Função que adiciona um membro ao grupo, criando o grupo se ainda não existe.
+// Retorna 0 (também se já era membro) ou -1 sem espaço.
+int group_join(Shard* shard, const char* name, const char* member) {
+    Group* group = user_table_find(&shard->groups, name);
+    if (group == NULL && (group = user_table_add(&shard->groups, name)) == NULL)
+        return -1;
+    if (find_member(shard, group, member) >= 0)
+        return 0;
+
+    if (group->member_count == group->member_capacity) {
+        uint32_t capacity = group->member_capacity ? group->member_capacity * 2 : INITIAL_MEMBER_CAPACITY;
+        ArenaOff off = capacity <= MAX_GROUP_MEMBERS ? arena_alloc(&shard->arena, (size_t)capacity * MAX_NICK_LEN) : 0;
+        if (off == 0) {
+            // Grupo recém-criado sem nenhum membro não fica na tabela
+            if (group->member_count == 0)
+                user_table_remove(&shard->groups, group);
+            return -1;
+        }
+        if (group->member_count > 0)
+            memcpy(arena_ptr(&shard->arena, off), members_of(shard, group), (size_t)group->member_count * MAX_NICK_LEN);
+        arena_free(&shard->arena, group->members, (size_t)group->member_capacity * MAX_NICK_LEN);
+        group->members = off;
+        group->member_capacity = capacity;
+    }
+
+    strcpy(members_of(shard, group)[group->member_count++], member);
+    wal_append(&shard->wal, WAL_GROUP_JOIN, name, member, strlen(member));
+    LOG(LOG_INFO, "%s entrou no grupo %s", member, name);
+    return 0;
+}
+
+// Função que retira um membro do grupo; o grupo deixa de existir sem membros.
+// Retorna 0 ou -1 se o grupo não existe ou o usuário não é membro.
+int group_leave(Shard* shard, const char* name, const char* member) {
+    Group* group = user_table_find(&shard->groups, name);
+    if (group == NULL)
+        return -1;
+    int i = find_member(shard, group, member);
+    if (i < 0)
+        return -1;
+
+    // O último membro ocupa o lugar do que saiu
+    char (*members)[MAX_NICK_LEN] = members_of(shard, group);
+    if ((uint32_t)i != group->member_count - 1)
+        memcpy(members[i], members[group->member_count - 1], MAX_NICK_LEN);
+    group->member_count--;
+
+    wal_append(&shard->wal, WAL_GROUP_LEAVE, name, member, strlen(member));
+    LOG(LOG_INFO, "%s saiu do grupo %s", member, name);
+
+    if (group->member_count == 0) {
+        arena_free(&shard->arena, group->members, (size_t)group->member_capacity * MAX_NICK_LEN);
+        user_table_remove(&shard->groups, group);
+    }
+    return 0;
+}
+
+// Função que envia uma mensagem a todos os membros do grupo (menos o remetente). A
+// entrega é montada uma única vez; cada shard dono de membros recebe uma mensagem com
+// o ponteiro para ela e a lista dos seus membros.
+// Retorna 0, -1 se o grupo não existe ou -2 se o remetente não é membro.
+int group_send(Shard* shard, const char* from, const char* name, const char* text, size_t text_len) {
+    Group* group = user_table_find(&shard->groups, name);
+    if (group == NULL)
+        return -1;
+    if (from[0] == '\0' || find_member(shard, group, from) < 0)
+        return -2;
+
+    // Remetente no registro: "#grupo/remetente"
+    char sender[2 * MAX_NICK_LEN];
+    snprintf(sender, sizeof(sender), "%s%c%s", name, GROUP_SEP, from);
+    char record[MAX_RECORD_LEN];
+    size_t len = delivery_encode(record, sender, text, text_len, time(NULL));
+    SharedMsg* msg = shared_msg_new(record, len);
+
+    // Contando os membros e os bytes dos apelidos de cada shard dono
+    GroupScratch* scratch = scratch_of(shard, 0);
+    char (*members)[MAX_NICK_LEN] = members_of(shard, group);
+    for (uint32_t i = 0; i < group->member_count; i++) {
+        if (strcmp(members[i], from) == 0)
+            continue;
+        int s = shard_of(members[i]);
+        scratch->counts[s]++;
+        scratch->used[s] += strlen(members[i]) + 1;
+    }
+
+    // Uma mensagem por shard (o próprio shard entrega direto, sem passar pela mailbox)
+    for (int s = 0; s < shard_count; s++) {
+        scratch->lists[s] = NULL;
+        if (scratch->counts[s] == 0)
+            continue;
+        if (s == shard->id) {
+            scratch->lists[s] = malloc(scratch->used[s]);
+        } else {
+            ShardMsg* post = shard_post(shard, s, MSG_GROUP_DELIVER, scratch->used[s]);
+            post->seq = scratch->counts[s];
+            post->cookie = msg;
+            atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+            scratch->lists[s] = post->data;
+        }
+        scratch->used[s] = 0;
+    }
+
+    for (uint32_t i = 0; i < group->member_count; i++) {
+        if (strcmp(members[i], from) == 0)
+            continue;
+        int s = shard_of(members[i]);
+        size_t n = strlen(members[i]) + 1;
+        memcpy(scratch->lists[s] + scratch->used[s], members[i], n);
+        scratch->used[s] += n;
+    }
+
+    char* local = scratch->lists[shard->id];
+    if (local != NULL) {
+        atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+        group_deliver(shard, msg, local, scratch->counts[shard->id]);
+        free(local);
+    }
+
+    shared_msg_release(msg);
+    return 0;
+}
+
+// Função que entrega uma mensagem de grupo aos membros deste shard: os online recebem
+// a entrega compartilhada nas suas conexões (uma mensagem por shard de conexão) e os
+// offline guardam uma referência à mesma cópia no slab. Consome uma referência de `msg`.
+void group_deliver(Shard* shard, SharedMsg* msg, const char* members, uint32_t count) {
+    GroupScratch* scratch = scratch_of(shard, count);
+    uint32_t remote = 0;
+    uint32_t chain = NO_CHUNK;
+    size_t packed_len = 0;
+
+    // Registro do log: [u32 tamanho][registro de entrega][membros offline]
+    size_t need = 4 + msg->record_len + (size_t)count * MAX_NICK_LEN;
+    if (scratch->log_cap < need) {
+        scratch->log_cap = need;
+        scratch->log = realloc(scratch->log, need);
+    }
+    uint32_t record_len = msg->record_len;
+    scratch->log[0] = record_len >> 24;
+    scratch->log[1] = record_len >> 16;
+    scratch->log[2] = record_len >> 8;
+    scratch->log[3] = record_len;
+    memcpy(scratch->log + 4, msg->data, record_len);
+    size_t log_len = 4 + record_len;
+    size_t header_len = log_len;
+
+    const char* nick = members;
+    for (uint32_t i = 0; i < count; i++, nick += strlen(nick) + 1) {
+        User* user = find_user(shard, nick);
+        if (user == NULL)
+            continue;           // Membro removido depois de entrar no grupo
+
+        // Sessões com confirmação recebem pela fila, com sequência
+        int held = user->online && delivery_held(user);
+        if (user->online && !held && !user->acks) {
+            if (user->session.shard == shard->id) {
+                Connection* conn = conn_lookup(shard, user->session);
+                if (conn != NULL)
+                    conn_send_shared(conn, msg);
+            } else {
+                scratch->conns[remote++] = user->session;
+                scratch->counts[user->session.shard]++;
+            }
+            continue;
+        }
+
+        // Fila na cota: o membro fica sem a mensagem
+        if (queue_quota > 0 && user->queue.count >= queue_quota) {
+            atomic_fetch_add_explicit(&shard->flow.over_quota, 1, memory_order_relaxed);
+            continue;
+        }
+
+        // Offline, congestionado ou com confirmação: uma única cópia no slab para todos os membros do shard
+        if (chain == NO_CHUNK && (chain = record_share(shard, msg->data, record_len, &packed_len)) == NO_CHUNK) {
+            LOG(LOG_ERROR, "Sem memória para guardar a mensagem do grupo para %s", nick);
+            continue;
+        }
+        if (queue_push_shared(&shard->slab, &user->queue, chain, packed_len) < 0) {
+            LOG(LOG_ERROR, "Sem memória para guardar a mensagem do grupo para %s", nick);
+            continue;
+        }
+        size_t n = strlen(nick) + 1;
+        memcpy(scratch->log + log_len, nick, n);
+        log_len += n;
+        if (user->online && !held)
+            queue_stream(shard, user);
+        else if (user->online)
+            atomic_fetch_add_explicit(&shard->flow.spilled, 1, memory_order_relaxed);
+    }
+
+    if (chain != NO_CHUNK)
+        slab_release(&shard->slab, chain);
+
+    // Nome do grupo: parte do remetente antes do separador
+    if (log_len > header_len) {
+        char name[MAX_NICK_LEN];
+        size_t from_len = (uint8_t)msg->data[0];
+        const char* sep = memchr(msg->data + 1, GROUP_SEP, from_len);
+        size_t name_len = sep ? (size_t)(sep - msg->data - 1) : 0;
+        if (name_len > 0 && name_len < MAX_NICK_LEN) {
+            memcpy(name, msg->data + 1, name_len);
+            name[name_len] = '\0';
+            wal_append(&shard->wal, WAL_GROUP_ENQUEUE, name, scratch->log, log_len);
+        }
+    }
+
+    // Conexões em outros shards: uma mensagem por shard com as referências
+    for (int s = 0; s < shard_count; s++) {
+        scratch->lists[s] = NULL;
+        if (scratch->counts[s] == 0)
+            continue;
+        ShardMsg* post = shard_post(shard, s, MSG_GROUP_WRITE, scratch->counts[s] * sizeof(ConnRef));
+        post->seq = scratch->counts[s];
+        post->cookie = msg;
+        atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+        scratch->lists[s] = post->data;
+        scratch->counts[s] = 0;
+    }
+    for (uint32_t i = 0; i < remote; i++) {
+        int s = scratch->conns[i].shard;
+        memcpy(scratch->lists[s] + scratch->counts[s]++ * sizeof(ConnRef), &scratch->conns[i], sizeof(ConnRef));
+    }
+
+    shared_msg_release(msg);
+}
+
+// Função que coloca a entrega de grupo nas filas de saída das conexões deste shard.
+// Consome uma referência de `msg`.
+void group_write(Shard* shard, SharedMsg* msg, const ConnRef* conns, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        Connection* conn = conn_lookup(shard, conns[i]);
+        if (conn != NULL)
+            conn_send_shared(conn, msg);
+    }
+    shared_msg_release(msg);
+}
+
+// Função que acrescenta ao snapshot em construção os membros dos grupos do shard
+void group_checkpoint(Shard* shard) {
+    for (int i = 0; i < user_table_count(&shard->groups); i++) {
+        Group* group = user_table_at(&shard->groups, i);
+        char (*members)[MAX_NICK_LEN] = members_of(shard, group);
+        for (uint32_t j = 0; j < group->member_count; j++)
+            wal_checkpoint_add(&shard->wal, WAL_GROUP_JOIN, user_table_nick(&shard->groups, i), members[j], strlen(members[j]));
+    }
+}
+
+// Função que aplica um registro WAL_GROUP_ENQUEUE recuperado do disco: cada membro
+// offline volta a referenciar a mensagem, guardada uma vez no shard dono dele
+void group_replay_enqueue(const char* data, size_t len) {
+    if (len < 4)
+        return;
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t record_len = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    if (record_len == 0 || record_len > MAX_RECORD_LEN || record_len > len - 4)
+        return;
+    const char* record = data + 4;
+    if (record_len < 1 + (uint8_t)record[0] + sizeof(int64_t))
+        return;
+
+    // Cada shard compacta o registro com a sua tabela de nomes
+    uint32_t* chains = malloc(shard_count * sizeof(uint32_t));
+    size_t* packed_lens = malloc(shard_count * sizeof(size_t));
+    for (int s = 0; s < shard_count; s++)
+        chains[s] = NO_CHUNK;
+
+    const char* end = data + len;
+    const char* nick = record + record_len;
+    while (nick < end) {
+        const char* nul = memchr(nick, '\0', end - nick);
+        if (nul == NULL)
+            break;
+
+        Shard* shard = nul - nick < MAX_NICK_LEN ? shards[shard_of(nick)] : NULL;
+        User* user = shard ? find_user(shard, nick) : NULL;
+        if (user != NULL) {
+            uint32_t* chain = &chains[shard->id];
+            if (*chain == NO_CHUNK)
+                *chain = record_share(shard, record, record_len, &packed_lens[shard->id]);
+            if (*chain != NO_CHUNK)
+                queue_push_shared(&shard->slab, &user->queue, *chain, packed_lens[shard->id]);
+        }
+        nick = nul + 1;
+    }
+
+    for (int s = 0; s < shard_count; s++)
+        if (chains[s] != NO_CHUNK)
+            slab_release(&shards[s]->slab, chains[s]);
+    free(chains);
+    free(packed_lens);
+}
@@ -0,0 +1,48 @@
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Grupos (canais). Cada grupo pertence ao shard dono do nome (que começa com '#') e
+// guarda os apelidos dos membros na arena. Um SEND_MSG para o grupo monta a entrega
+// uma única vez (SharedMsg, com contador de referências) e envia uma mensagem por
+// shard dono de membros. Lá a mesma entrega entra nas filas de saída das conexões
+// online e, guardada uma única vez no slab, nas filas dos membros offline.
+
+// Membros por grupo
+#define MAX_GROUP_MEMBERS 65536
+// Separador entre o grupo e o remetente no registro de uma entrega de grupo
+#define GROUP_SEP '/'
+
+typedef struct Shard Shard;
+typedef struct SharedMsg SharedMsg;
+
+// Grupo; o nome (começa com '#') fica no array de apelidos da tabela de grupos
+typedef struct {
+    ArenaOff members;           // Apelidos dos membros (array de char[MAX_NICK_LEN])
+    uint32_t member_count;
+    uint32_t member_capacity;
+} Group;
+
+// Áreas de trabalho do envio de entregas de grupo, alocadas no primeiro uso
+typedef struct {
+    uint32_t* counts;           // Membros (ou conexões) por shard destino
+    size_t* used;               // Bytes já escritos nos dados de cada shard destino
+    char** lists;               // Dados da mensagem de cada shard destino
+    ConnRef* conns;             // Conexões online em outros shards
+    uint32_t conns_cap;
+    char* log;                  // Registro WAL_GROUP_ENQUEUE em montagem
+    size_t log_cap;
+} GroupScratch;
+
+int group_name_valid(const char* name);
+int group_join(Shard* shard, const char* name, const char* member);
+int group_leave(Shard* shard, const char* name, const char* member);
+int group_send(Shard* shard, const char* from, const char* name, const char* text, size_t text_len);
+void group_deliver(Shard* shard, SharedMsg* msg, const char* members, uint32_t count);
+void group_write(Shard* shard, SharedMsg* msg, const ConnRef* conns, uint32_t count);
+void group_checkpoint(Shard* shard);
+void group_replay_enqueue(const char* data, size_t len);
+
+#endif
@@ -0,0 +1,68 @@
+#include "histogram.h"
+
+#define LOAD(field) atomic_load_explicit(&(field), memory_order_relaxed)
+#define STORE(field, value) atomic_store_explicit(&(field), (value), memory_order_relaxed)
+
+// Função que calcula o balde de um valor
+static int hist_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS)
+        return (int)value;
+
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (int)(value >> shift) - HIST_SUB_BUCKETS;
+}
+
+// Função que retorna o maior valor que cai no balde `index`
+static uint64_t hist_upper(int index) {
+    if (index < HIST_SUB_BUCKETS)
+        return (uint64_t)index;
+
+    int shift = index / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t)(index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS);
+    return ((sub + 1) << shift) - 1;
+}
+
+// Função que registra um valor (só pela thread dona do histograma: leitura e escrita
+// separadas bastam, sem instrução atômica de soma)
+void hist_record(Histogram* hist, uint64_t value) {
+    int i = hist_index(value);
+    STORE(hist->counts[i], LOAD(hist->counts[i]) + 1);
+    STORE(hist->total, LOAD(hist->total) + 1);
+    STORE(hist->sum, LOAD(hist->sum) + value);
+    if (value > LOAD(hist->max))
+        STORE(hist->max, value);
+}
+
+// Função que soma os valores de `from` em `into` (`into` é da thread que chama)
+void hist_merge(Histogram* into, const Histogram* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        STORE(into->counts[i], LOAD(into->counts[i]) + LOAD(from->counts[i]));
+    STORE(into->total, LOAD(into->total) + LOAD(from->total));
+    STORE(into->sum, LOAD(into->sum) + LOAD(from->sum));
+    if (LOAD(from->max) > LOAD(into->max))
+        STORE(into->max, LOAD(from->max));
+}
+
+// Função que retorna o valor abaixo do qual estão `percentile`% dos registros
+// (limite superior do balde, nunca acima do maior valor registrado)
+uint64_t hist_percentile(const Histogram* hist, double percentile) {
+    uint64_t total = LOAD(hist->total);
+    uint64_t max = LOAD(hist->max);
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    // Com escritas concorrentes os baldes podem somar um pouco menos que `total`
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += LOAD(hist->counts[i]);
+        if (seen >= rank) {
+            uint64_t value = hist_upper(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
@@ -0,0 +1,29 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Histograma log-linear (no estilo HDR): cada potência de 2 é dividida em
+// HIST_SUB_BUCKETS baldes iguais, o que dá erro relativo de no máximo 1/64 em
+// qualquer faixa de valores com tamanho fixo e registro O(1), sem alocação.
+// Cada histograma tem um único escritor; outras threads podem lê-lo ao mesmo tempo
+// (os campos são atômicos e acessados sem barreiras, então o registro não custa mais
+// que uma soma comum).
+
+#define HIST_SUB_BITS 6
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    atomic_ullong counts[HIST_BUCKETS];
+    atomic_ullong total;        // Valores registrados
+    atomic_ullong sum;          // Soma dos valores registrados
+    atomic_ullong max;          // Maior valor registrado
+} Histogram;
+
+void hist_record(Histogram* hist, uint64_t value);
+void hist_merge(Histogram* into, const Histogram* from);
+uint64_t hist_percentile(const Histogram* hist, double percentile);
+
+#endif
@@ -0,0 +1,979 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "server.h"
+
+// Magic dos segmentos e do snapshot das conversas
+#define HISTORY_MAGIC "CHATHST1"
+#define SNAPSHOT_MAGIC "CHATCNV2"
+#define MAGIC_LEN 8
+// Cabeçalho de um registro (tamanho e crc32) e campos fixos do corpo
+#define HIST_RECORD_HEADER 8
+#define HIST_RECORD_FIXED 33
+// Flags do registro
+#define HIST_FLAG_FROM_B 0x01   // O remetente é o segundo apelido do par
+#define HIST_FLAG_PAIR 0x02     // O registro traz o par (primeira mensagem da conversa)
+// Segmento anterior da primeira mensagem de uma conversa
+#define HIST_NO_SEGMENT UINT32_MAX
+// Segmentos mapeados ao mesmo tempo numa consulta
+#define QUERY_MAPS 8
+
+// Entrada do índice no arquivo
+typedef struct {
+    uint64_t key;
+    uint64_t seq;
+    int64_t ts;
+    uint32_t segment;
+    uint32_t offset;
+} HistIndexDisk;
+
+// Registro lido de um segmento (os ponteiros apontam para o mapeamento)
+typedef struct {
+    uint64_t key;
+    uint64_t seq;
+    int64_t ts;
+    HistPos prev;               // Registro anterior da conversa
+    int flags;                  // HIST_FLAG_*
+    const char* a;              // Par, só com HIST_FLAG_PAIR
+    size_t a_len;
+    const char* b;
+    size_t b_len;
+    const char* text;
+    size_t text_len;
+} HistRecord;
+
+// Segmentos mapeados durante uma consulta
+typedef struct {
+    struct {
+        uint32_t segment;
+        char* map;
+        size_t size;
+    } slots[QUERY_MAPS];
+    int used;
+    int next;                   // Próximo a ser trocado quando todos estão em uso
+} SegMaps;
+
+// Função que calcula o hash (FNV-1a de 64 bits) do par de apelidos, já em ordem
+static uint64_t pair_hash(const char* a, const char* b) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char* p = (const unsigned char*)a; ; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ull;
+        if (*p == '\0')
+            break;
+    }
+    for (const unsigned char* p = (const unsigned char*)b; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Função que coloca o par em ordem. Retorna 1 se `from` é o segundo (sentido da mensagem).
+static int pair_order(const char* from, const char* to, const char** a, const char** b) {
+    int swap = strcmp(from, to) > 0;
+    *a = swap ? to : from;
+    *b = swap ? from : to;
+    return swap;
+}
+
+// Função que retorna o shard dono da conversa entre `a` e `b` (em qualquer ordem)
+int history_shard(const char* a, const char* b) {
+    const char* first;
+    const char* second;
+    pair_order(a, b, &first, &second);
+    return pair_hash(first, second) % HISTORY_PARTITIONS % shard_count;
+}
+
+// Função que retorna o destino de shard_post das mensagens para a conversa: o shard
+// dono dela, se ela pertence a este nó, ou o nó dono no cluster (pelo mesmo hash)
+int history_target(const char* a, const char* b) {
+    const char* first;
+    const char* second;
+    pair_order(a, b, &first, &second);
+    uint64_t hash = pair_hash(first, second);
+    int node = cluster_node((uint32_t)(hash ^ hash >> 32));
+    return node == cluster_self ? history_shard(a, b) : shard_count + node;
+}
+
+// Função que monta o caminho do segmento `segment` da partição
+static void segment_path(char* out, size_t size, int part, uint32_t segment) {
+    snprintf(out, size, "%s/history/%02d.%u.seg", wal_dir, part, segment);
+}
+
+// Função que monta o caminho de um arquivo da partição ("idx", "conv" ou "conv.tmp")
+static void part_path(char* out, size_t size, int part, const char* name) {
+    snprintf(out, size, "%s/history/%02d.%s", wal_dir, part, name);
+}
+
+// Função que grava todo o buffer no arquivo. Retorna -1 se falhar.
+static int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Função que cria (ou recria, vazio) o segmento `segment` da partição. Retorna o
+// descritor aberto para acréscimos ou -1.
+static int segment_create(int part, uint32_t segment) {
+    char path[512];
+    segment_path(path, sizeof(path), part, segment);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    if (write_all(fd, HISTORY_MAGIC, MAGIC_LEN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Função que lê o registro em `offset` do segmento mapeado. Retorna o tamanho total
+// do registro ou 0 se está incompleto ou corrompido.
+static size_t record_at(const char* map, size_t size, size_t offset, HistRecord* rec, int check) {
+    if (offset + HIST_RECORD_HEADER > size)
+        return 0;
+    uint32_t body, crc;
+    memcpy(&body, map + offset, sizeof(body));
+    memcpy(&crc, map + offset + 4, sizeof(crc));
+    if (body < HIST_RECORD_FIXED || body > size - offset - HIST_RECORD_HEADER)
+        return 0;
+
+    const char* p = map + offset + HIST_RECORD_HEADER;
+    if (check && crc32(0, (const Bytef*)p, body) != crc)
+        return 0;
+    memcpy(&rec->key, p, 8);
+    memcpy(&rec->seq, p + 8, 8);
+    memcpy(&rec->ts, p + 16, 8);
+    memcpy(&rec->prev.segment, p + 24, 4);
+    memcpy(&rec->prev.offset, p + 28, 4);
+    rec->flags = (uint8_t)p[32];
+
+    const char* end = p + body;
+    p += HIST_RECORD_FIXED;
+    if (rec->flags & HIST_FLAG_PAIR) {
+        if (end - p < 2 || (rec->a_len = (uint8_t)p[0]) >= MAX_NICK_LEN || end - p < (ptrdiff_t)(2 + rec->a_len))
+            return 0;
+        rec->a = p + 1;
+        p += 1 + rec->a_len;
+        if ((rec->b_len = (uint8_t)p[0]) >= MAX_NICK_LEN || end - p < (ptrdiff_t)(1 + rec->b_len))
+            return 0;
+        rec->b = p + 1;
+        p += 1 + rec->b_len;
+    }
+    rec->text = p;
+    rec->text_len = end - p;
+    return HIST_RECORD_HEADER + body;
+}
+
+// Função que procura a conversa pela chave
+static HistConv* conv_find(const HistPartition* part, uint64_t key) {
+    if (part->table_cap == 0)
+        return NULL;
+    uint32_t mask = part->table_cap - 1;
+    for (uint32_t i = key & mask; part->table[i] != NULL; i = (i + 1) & mask) {
+        if (part->table[i]->key == key)
+            return part->table[i];
+    }
+    return NULL;
+}
+
+// Função que insere a conversa na tabela, sem verificar se ela já existe
+static void table_insert(HistConv** table, uint32_t cap, HistConv* conv) {
+    uint32_t i = conv->key & (cap - 1);
+    while (table[i] != NULL)
+        i = (i + 1) & (cap - 1);
+    table[i] = conv;
+}
+
+// Função que cria a conversa entre `a` e `b` (já em ordem) na partição
+static HistConv* conv_add(HistPartition* part, uint64_t key, const char* a, size_t a_len,
+                          const char* b, size_t b_len) {
+    // Tabela no máximo meio cheia
+    if ((part->count + 1) * 2 > part->table_cap) {
+        uint32_t cap = part->table_cap ? part->table_cap * 2 : 64;
+        HistConv** table = calloc(cap, sizeof(HistConv*));
+        for (uint32_t i = 0; i < part->table_cap; i++)
+            if (part->table[i] != NULL)
+                table_insert(table, cap, part->table[i]);
+        free(part->table);
+        part->table = table;
+        part->table_cap = cap;
+    }
+
+    HistConv* conv = calloc(1, sizeof(HistConv));
+    conv->key = key;
+    memcpy(conv->a, a, a_len);
+    memcpy(conv->b, b, b_len);
+    conv->next_seq = 1;
+    conv->tail.segment = HIST_NO_SEGMENT;
+    table_insert(part->table, part->table_cap, conv);
+    part->count++;
+    return conv;
+}
+
+// Função que libera todas as conversas da partição
+static void table_clear(HistPartition* part) {
+    for (uint32_t i = 0; i < part->table_cap; i++) {
+        if (part->table[i] != NULL) {
+            free(part->table[i]->index);
+            free(part->table[i]);
+        }
+    }
+    free(part->table);
+    part->table = NULL;
+    part->table_cap = part->count = 0;
+}
+
+// Função que acrescenta uma entrada ao índice da conversa; com `persist` ela também
+// vai para o arquivo do índice junto com os registros da iteração
+static void index_push(HistPartition* part, HistConv* conv, uint64_t seq, int64_t ts, HistPos pos, int persist) {
+    if (conv->index_len == conv->index_cap) {
+        conv->index_cap = conv->index_cap ? conv->index_cap * 2 : 4;
+        conv->index = realloc(conv->index, conv->index_cap * sizeof(HistIndexEntry));
+    }
+    conv->index[conv->index_len++] = (HistIndexEntry){ seq, ts, pos };
+    if (!persist)
+        return;
+
+    if (part->index_len + sizeof(HistIndexDisk) > part->index_cap) {
+        part->index_cap = part->index_cap ? part->index_cap * 2 : 64 * sizeof(HistIndexDisk);
+        part->index_buf = realloc(part->index_buf, part->index_cap);
+    }
+    HistIndexDisk entry = { conv->key, seq, ts, pos.segment, pos.offset };
+    memcpy(part->index_buf + part->index_len, &entry, sizeof(entry));
+    part->index_len += sizeof(entry);
+}
+
+// Função que avança a conversa para a mensagem `seq`, gravada em `pos`
+static void conv_advance(HistPartition* part, HistConv* conv, uint64_t seq, int64_t ts, HistPos pos) {
+    if ((seq - 1) % HISTORY_INDEX_STRIDE == 0)
+        index_push(part, conv, seq, ts, pos, 1);
+    conv->next_seq = seq + 1;
+    conv->last_ts = ts;
+    conv->tail = pos;
+}
+
+// Função que acrescenta a mensagem gravada em `pos` ao índice invertido da partição:
+// cada termo do texto entra nas listas dos dois participantes da conversa
+static void search_index(HistPartition* part, const HistConv* conv, const HistRecord* rec, HistPos pos) {
+    if (part->msg_count == part->msg_cap) {
+        part->msg_cap = part->msg_cap ? part->msg_cap * 2 : 1024;
+        part->msg_pos = realloc(part->msg_pos, part->msg_cap * sizeof(HistPos));
+    }
+    uint32_t id = part->msg_count++;
+    part->msg_pos[id] = pos;
+
+    uint64_t terms[SEARCH_TEXT_TERMS];
+    int count = search_terms(rec->text, rec->text_len, terms, SEARCH_TEXT_TERMS);
+    for (int i = 0; i < count; i++) {
+        search_add(&part->search, search_key(conv->a, terms[i]), id);
+        search_add(&part->search, search_key(conv->b, terms[i]), id);
+    }
+}
+
+// Função que grava o snapshot das conversas da partição, válido até o fim do log
+// gravado (chamada sem registros acumulados)
+static void snapshot_write(HistPartition* part) {
+    size_t cap = MAGIC_LEN + 20 + (size_t)part->count * (34 + 2 * MAX_NICK_LEN) +
+                 (size_t)part->msg_count * sizeof(HistPos) + search_dump_size(&part->search);
+    char* data = malloc(cap);
+    memcpy(data, SNAPSHOT_MAGIC, MAGIC_LEN);
+    size_t n = MAGIC_LEN;
+    memcpy(data + n, &part->segment, 4);
+    memcpy(data + n + 4, &part->seg_size, 4);
+    memcpy(data + n + 8, &part->count, 4);
+    n += 12;
+
+    // Por conversa: [u64 chave][u64 próxima][i64 ts][u32 seg][u32 pos][u8][a][u8][b]
+    for (uint32_t i = 0; i < part->table_cap; i++) {
+        const HistConv* conv = part->table[i];
+        if (conv == NULL)
+            continue;
+        memcpy(data + n, &conv->key, 8);
+        memcpy(data + n + 8, &conv->next_seq, 8);
+        memcpy(data + n + 16, &conv->last_ts, 8);
+        memcpy(data + n + 24, &conv->tail.segment, 4);
+        memcpy(data + n + 28, &conv->tail.offset, 4);
+        n += 32;
+        size_t a_len = strlen(conv->a), b_len = strlen(conv->b);
+        data[n++] = (char)a_len;
+        memcpy(data + n, conv->a, a_len);
+        n += a_len;
+        data[n++] = (char)b_len;
+        memcpy(data + n, conv->b, b_len);
+        n += b_len;
+    }
+
+    // Índice invertido: [u32 mensagens][posição de cada uma][listas (search_dump)]
+    memcpy(data + n, &part->msg_count, 4);
+    n += 4;
+    memcpy(data + n, part->msg_pos, (size_t)part->msg_count * sizeof(HistPos));
+    n += (size_t)part->msg_count * sizeof(HistPos);
+    n += search_dump(&part->search, data + n);
+    uint32_t crc = crc32(0, (const Bytef*)data, n);
+    memcpy(data + n, &crc, 4);
+    n += 4;
+
+    // Arquivo novo e rename: uma queda no meio deixa o snapshot anterior
+    char tmp[512], path[512];
+    part_path(tmp, sizeof(tmp), part->id, "conv.tmp");
+    part_path(path, sizeof(path), part->id, "conv");
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || write_all(fd, data, n) < 0 || rename(tmp, path) < 0)
+        LOG(LOG_ERROR, "Snapshot do histórico %s: %s", path, strerror(errno));
+    else {
+        part->snapshot_size = n;
+        part->since_snapshot = 0;
+    }
+    if (fd >= 0)
+        close(fd);
+    free(data);
+}
+
+// Função que carrega o snapshot das conversas da partição. `pos` recebe a posição do
+// log até onde ele vale. Retorna -1 se não existe ou não é válido.
+static int snapshot_load(HistPartition* part, HistPos* pos) {
+    char path[512];
+    part_path(path, sizeof(path), part->id, "conv");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    char* data = malloc(size + 1);
+    ssize_t got = size > 0 ? pread(fd, data, size, 0) : 0;
+    close(fd);
+
+    uint32_t crc, count = 0;
+    int ok = got == (ssize_t)size && size >= MAGIC_LEN + 16 && memcmp(data, SNAPSHOT_MAGIC, MAGIC_LEN) == 0;
+    if (ok) {
+        memcpy(&crc, data + size - 4, 4);
+        ok = crc32(0, (const Bytef*)data, size - 4) == crc;
+    }
+    if (ok) {
+        memcpy(&pos->segment, data + MAGIC_LEN, 4);
+        memcpy(&pos->offset, data + MAGIC_LEN + 4, 4);
+        memcpy(&count, data + MAGIC_LEN + 8, 4);
+    }
+
+    const char* p = data + MAGIC_LEN + 12;
+    const char* end = data + size - 4;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        if (end - p < 34) {
+            ok = 0;
+            break;
+        }
+        size_t a_len = (uint8_t)p[32];
+        if (a_len >= MAX_NICK_LEN || end - p < (ptrdiff_t)(34 + a_len)) {
+            ok = 0;
+            break;
+        }
+        size_t b_len = (uint8_t)p[33 + a_len];
+        if (b_len >= MAX_NICK_LEN || end - p < (ptrdiff_t)(34 + a_len + b_len)) {
+            ok = 0;
+            break;
+        }
+        uint64_t key;
+        memcpy(&key, p, 8);
+        HistConv* conv = conv_add(part, key, p + 33, a_len, p + 34 + a_len, b_len);
+        memcpy(&conv->next_seq, p + 8, 8);
+        memcpy(&conv->last_ts, p + 16, 8);
+        memcpy(&conv->tail.segment, p + 24, 4);
+        memcpy(&conv->tail.offset, p + 28, 4);
+        p += 34 + a_len + b_len;
+    }
+
+    uint32_t msgs = 0;
+    if (ok && end - p >= 4) {
+        memcpy(&msgs, p, 4);
+        p += 4;
+    } else {
+        ok = 0;
+    }
+    if (ok && (size_t)(end - p) / sizeof(HistPos) >= msgs) {
+        part->msg_cap = msgs > 0 ? msgs : 1024;
+        part->msg_pos = malloc(part->msg_cap * sizeof(HistPos));
+        memcpy(part->msg_pos, p, (size_t)msgs * sizeof(HistPos));
+        part->msg_count = msgs;
+        p += (size_t)msgs * sizeof(HistPos);
+        ok = search_load(&part->search, p, end - p) == 0;
+    } else {
+        ok = 0;
+    }
+    free(data);
+
+    if (!ok) {
+        LOG(LOG_WARN, "Snapshot do histórico %s inválido: a partição será relida do início", path);
+        table_clear(part);
+        search_free(&part->search);
+        free(part->msg_pos);
+        part->msg_pos = NULL;
+        part->msg_count = part->msg_cap = 0;
+        return -1;
+    }
+    part->snapshot_size = size;
+    return 0;
+}
+
+// Função que diz se a posição `a` vem antes de `b` no log
+static int pos_before(HistPos a, HistPos b) {
+    return a.segment < b.segment || (a.segment == b.segment && a.offset < b.offset);
+}
+
+// Função que carrega as entradas do índice anteriores a `pos`; as seguintes são
+// descartadas (a releitura do log as refaz). Retorna -1 se o arquivo não abre.
+static int index_load(HistPartition* part, HistPos pos) {
+    char path[512];
+    part_path(path, sizeof(path), part->id, "idx");
+    part->idx_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (part->idx_fd < 0)
+        return -1;
+
+    struct stat st;
+    size_t count = fstat(part->idx_fd, &st) == 0 ? st.st_size / sizeof(HistIndexDisk) : 0;
+    HistIndexDisk* entries = count > 0 ? mmap(NULL, count * sizeof(HistIndexDisk), PROT_READ, MAP_SHARED,
+                                              part->idx_fd, 0) : MAP_FAILED;
+    size_t kept = 0;
+    if (entries != MAP_FAILED) {
+        for (; kept < count; kept++) {
+            HistPos at = { entries[kept].segment, entries[kept].offset };
+            if (!pos_before(at, pos))
+                break;
+            HistConv* conv = conv_find(part, entries[kept].key);
+            if (conv != NULL)
+                index_push(part, conv, entries[kept].seq, entries[kept].ts, at, 0);
+        }
+        munmap(entries, count * sizeof(HistIndexDisk));
+    }
+    if ((size_t)st.st_size != kept * sizeof(HistIndexDisk) && ftruncate(part->idx_fd, kept * sizeof(HistIndexDisk)) < 0)
+        LOG(LOG_ERROR, "Histórico %s: %s", path, strerror(errno));
+    return 0;
+}
+
+// Função que relê o log a partir de `pos` (o que o snapshot ainda não tem) até o fim
+// do último segmento, que fica aberto para acréscimos. Um registro incompleto no fim
+// (queda no meio da gravação) é descartado. Retorna -1 se o segmento atual não abre.
+static int log_load(HistPartition* part, HistPos pos) {
+    char path[512];
+    uint32_t segment = pos.segment, offset = pos.offset;
+    for (;;) {
+        segment_path(path, sizeof(path), part->id, segment);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            break;
+
+        struct stat st;
+        size_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+        char* map = size > MAGIC_LEN ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (map != MAP_FAILED) {
+            HistRecord rec;
+            size_t used;
+            while ((used = record_at(map, size, offset, &rec, 1)) > 0) {
+                HistConv* conv = conv_find(part, rec.key);
+                if (conv == NULL && (rec.flags & HIST_FLAG_PAIR))
+                    conv = conv_add(part, rec.key, rec.a, rec.a_len, rec.b, rec.b_len);
+                if (conv != NULL && rec.seq == conv->next_seq) {
+                    conv_advance(part, conv, rec.seq, rec.ts, (HistPos){ segment, offset });
+                    search_index(part, conv, &rec, (HistPos){ segment, offset });
+                }
+                offset += used;
+                part->since_snapshot += used;
+            }
+            munmap(map, size);
+        }
+
+        // Só o último segmento pode terminar num registro incompleto
+        char next[512];
+        segment_path(next, sizeof(next), part->id, segment + 1);
+        if (access(next, F_OK) == 0) {
+            close(fd);
+            segment++;
+            offset = MAGIC_LEN;
+            continue;
+        }
+        if (size < MAGIC_LEN) {
+            close(fd);
+            break;
+        }
+        if (offset < size && ftruncate(fd, offset) < 0)
+            LOG(LOG_ERROR, "Histórico %s: %s", path, strerror(errno));
+        close(fd);
+        part->segment = segment;
+        part->seg_size = offset;
+        part->seg_fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        return part->seg_fd < 0 ? -1 : 0;
+    }
+
+    // Partição nova (ou segmento sem o magic): o segmento começa vazio
+    part->segment = segment;
+    part->seg_size = MAGIC_LEN;
+    part->seg_fd = segment_create(part->id, segment);
+    return part->seg_fd < 0 ? -1 : 0;
+}
+
+// Função que fecha a partição e libera as conversas
+static void partition_free(HistPartition* part) {
+    if (part->seg_fd >= 0)
+        close(part->seg_fd);
+    if (part->idx_fd >= 0)
+        close(part->idx_fd);
+    table_clear(part);
+    search_free(&part->search);
+    free(part->msg_pos);
+    free(part->buf);
+    free(part->index_buf);
+    free(part);
+}
+
+// Função que abre a partição: snapshot, índice e o log gravado depois do snapshot
+static HistPartition* partition_open(int id) {
+    HistPartition* part = calloc(1, sizeof(HistPartition));
+    part->id = id;
+    part->seg_fd = part->idx_fd = -1;
+
+    HistPos pos = { 0, MAGIC_LEN };
+    if (snapshot_load(part, &pos) < 0)
+        pos = (HistPos){ 0, MAGIC_LEN };
+    if (index_load(part, pos) < 0 || log_load(part, pos) < 0) {
+        LOG_SAMPLED(LOG_ERROR, 1000, "Partição %d do histórico não abre: %s", id, strerror(errno));
+        partition_free(part);
+        return NULL;
+    }
+    return part;
+}
+
+// Função que marca a partição para ser gravada no fim da iteração
+static void partition_mark_dirty(HistoryStore* store, HistPartition* part) {
+    if (part->dirty)
+        return;
+    part->dirty = 1;
+    store->dirty[store->dirty_count++] = part;
+}
+
+// Função que retorna a partição, abrindo-a no primeiro uso
+static HistPartition* partition_get(HistoryStore* store, int id) {
+    if (store->parts[id] != NULL)
+        return store->parts[id];
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/history", wal_dir);
+    mkdir(path, 0755);
+    HistPartition* part = partition_open(id);
+    if (part == NULL)
+        return NULL;
+    store->parts[id] = part;
+
+    // Entradas do índice refeitas na releitura do log
+    if (part->index_len > 0)
+        partition_mark_dirty(store, part);
+    return part;
+}
+
+// Função que grava os registros e as entradas do índice acumulados na partição. Os
+// registros entram no índice invertido aqui, depois das respostas da iteração.
+static void partition_write(HistPartition* part) {
+    if (part->len > 0) {
+        // Os registros acumulados são os últimos do segmento atual
+        uint32_t base = part->seg_size - part->len;
+        HistRecord rec;
+        size_t used;
+        for (size_t offset = 0; (used = record_at(part->buf, part->len, offset, &rec, 0)) > 0; offset += used) {
+            HistConv* conv = conv_find(part, rec.key);
+            if (conv != NULL)
+                search_index(part, conv, &rec, (HistPos){ part->segment, base + offset });
+        }
+
+        if (write_all(part->seg_fd, part->buf, part->len) < 0)
+            LOG_SAMPLED(LOG_ERROR, 1000, "Histórico da partição %d: %s", part->id, strerror(errno));
+        part->len = 0;
+    }
+
+    // O índice vai depois dos registros: uma entrada nunca aponta para além deles
+    if (part->index_len > 0) {
+        if (write_all(part->idx_fd, part->index_buf, part->index_len) < 0)
+            LOG_SAMPLED(LOG_ERROR, 1000, "Índice do histórico da partição %d: %s", part->id, strerror(errno));
+        part->index_len = 0;
+    }
+}
+
+// Função que começa o próximo segmento da partição. O snapshot das conversas é
+// regravado quando o log depois do último já passa do tamanho dele: a releitura ao
+// abrir fica limitada e o custo dos snapshots, proporcional ao log gravado.
+static void partition_rotate(HistPartition* part) {
+    partition_write(part);
+    int fd = segment_create(part->id, part->segment + 1);
+    if (fd < 0) {
+        LOG_SAMPLED(LOG_ERROR, 1000, "Segmento do histórico da partição %d: %s", part->id, strerror(errno));
+        return;
+    }
+    close(part->seg_fd);
+    part->seg_fd = fd;
+    part->segment++;
+    part->seg_size = MAGIC_LEN;
+    if (part->since_snapshot >= part->snapshot_size)
+        snapshot_write(part);
+}
+
+// Função que grava as partições com registros da iteração
+void history_flush(HistoryStore* store) {
+    for (int i = 0; i < store->dirty_count; i++) {
+        partition_write(store->dirty[i]);
+        store->dirty[i]->dirty = 0;
+    }
+    store->dirty_count = 0;
+}
+
+// Função que fecha o histórico do shard (encerramento), com um snapshot de cada
+// partição para que a próxima abertura não precise reler o log
+void history_close(HistoryStore* store) {
+    history_flush(store);
+    for (int i = 0; i < HISTORY_PARTITIONS; i++) {
+        if (store->parts[i] == NULL)
+            continue;
+        snapshot_write(store->parts[i]);
+        partition_free(store->parts[i]);
+        store->parts[i] = NULL;
+    }
+}
+
+// Função que acrescenta ao histórico da conversa a mensagem entregue a `to`. O
+// registro de entrega traz o remetente, o timestamp e o texto.
+void history_append(Shard* shard, const char* to, const char* record, size_t len) {
+    char from[MAX_NICK_LEN];
+    size_t from_len = (uint8_t)record[0];
+    if (from_len >= MAX_NICK_LEN)
+        return;
+    memcpy(from, record + 1, from_len);
+    from[from_len] = '\0';
+    int64_t ts;
+    memcpy(&ts, record + 1 + from_len, sizeof(ts));
+    const char* text = record + 1 + from_len + sizeof(ts);
+    size_t text_len = len - 1 - from_len - sizeof(ts);
+
+    const char* a;
+    const char* b;
+    int from_b = pair_order(from, to, &a, &b);
+    size_t a_len = strlen(a), b_len = strlen(b);
+    uint64_t key = pair_hash(a, b);
+    HistoryStore* store = &shard->history;
+    HistPartition* part = partition_get(store, key % HISTORY_PARTITIONS);
+    if (part == NULL)
+        return;
+
+    HistConv* conv = conv_find(part, key);
+    if (conv == NULL) {
+        conv = conv_add(part, key, a, a_len, b, b_len);
+    } else if (strcmp(conv->a, a) != 0 || strcmp(conv->b, b) != 0) {
+        // Colisão do hash de 64 bits: a conversa mais nova fica sem histórico
+        LOG_SAMPLED(LOG_WARN, 1000, "Histórico de %s e %s colide com o de %s e %s", a, b, conv->a, conv->b);
+        return;
+    }
+
+    if (ts < conv->last_ts)
+        ts = conv->last_ts;
+    uint64_t seq = conv->next_seq;
+
+    // A primeira mensagem leva o par: a releitura do log recria a conversa por ela
+    int flags = from_b ? HIST_FLAG_FROM_B : 0;
+    size_t pair_len = 0;
+    if (seq == 1) {
+        flags |= HIST_FLAG_PAIR;
+        pair_len = 2 + a_len + b_len;
+    }
+    size_t size = HIST_RECORD_HEADER + HIST_RECORD_FIXED + pair_len + text_len;
+    if (part->seg_size + size > HISTORY_SEGMENT_SIZE && part->seg_size > MAGIC_LEN)
+        partition_rotate(part);
+
+    if (part->len + size > part->cap) {
+        part->cap = part->cap ? part->cap * 2 : 16384;
+        while (part->len + size > part->cap)
+            part->cap *= 2;
+        part->buf = realloc(part->buf, part->cap);
+    }
+    char* p = part->buf + part->len;
+    char* body = p + HIST_RECORD_HEADER;
+    memcpy(body, &key, 8);
+    memcpy(body + 8, &seq, 8);
+    memcpy(body + 16, &ts, 8);
+    memcpy(body + 24, &conv->tail.segment, 4);
+    memcpy(body + 28, &conv->tail.offset, 4);
+    body[32] = (char)flags;
+    size_t n = HIST_RECORD_FIXED;
+    if (pair_len > 0) {
+        body[n++] = (char)a_len;
+        memcpy(body + n, a, a_len);
+        n += a_len;
+        body[n++] = (char)b_len;
+        memcpy(body + n, b, b_len);
+        n += b_len;
+    }
+    memcpy(body + n, text, text_len);
+    uint32_t body_len = size - HIST_RECORD_HEADER;
+    uint32_t crc = crc32(0, (const Bytef*)body, body_len);
+    memcpy(p, &body_len, 4);
+    memcpy(p + 4, &crc, 4);
+
+    HistPos pos = { part->segment, part->seg_size };
+    part->len += size;
+    part->seg_size += size;
+    part->since_snapshot += size;
+    conv_advance(part, conv, seq, ts, pos);
+    partition_mark_dirty(store, part);
+}
+
+// Função que leva a mensagem entregue a `to` ao histórico da conversa, no shard dono dela
+void history_record(Shard* shard, const char* to, const char* record, size_t len) {
+    char from[MAX_NICK_LEN];
+    size_t from_len = (uint8_t)record[0];
+    if (from_len >= MAX_NICK_LEN)
+        return;
+    memcpy(from, record + 1, from_len);
+    from[from_len] = '\0';
+
+    int target = history_target(from, to);
+    if (target == shard->id) {
+        history_append(shard, to, record, len);
+        return;
+    }
+
+    // Dados: destinatário ('\0' no fim) e o registro de entrega
+    size_t to_len = strlen(to) + 1;
+    ShardMsg* msg = shard_post(shard, target, MSG_HISTORY, to_len + len);
+    memcpy(msg->data, to, to_len);
+    memcpy(msg->data + to_len, record, len);
+}
+
+// Função que lê o registro em `pos`, mapeando o segmento se ainda não está mapeado
+// nesta consulta. Retorna 0 se ele não pode ser lido.
+static int record_read(const HistPartition* part, SegMaps* maps, HistPos pos, HistRecord* rec) {
+    int slot = -1;
+    for (int i = 0; i < maps->used; i++)
+        if (maps->slots[i].segment == pos.segment)
+            slot = i;
+
+    if (slot < 0) {
+        char path[512];
+        segment_path(path, sizeof(path), part->id, pos.segment);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return 0;
+        struct stat st;
+        size_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+        char* map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (map == MAP_FAILED)
+            return 0;
+
+        if (maps->used < QUERY_MAPS) {
+            slot = maps->used++;
+        } else {
+            slot = maps->next;
+            maps->next = (maps->next + 1) % QUERY_MAPS;
+            munmap(maps->slots[slot].map, maps->slots[slot].size);
+        }
+        maps->slots[slot].segment = pos.segment;
+        maps->slots[slot].map = map;
+        maps->slots[slot].size = size;
+    }
+    return record_at(maps->slots[slot].map, maps->slots[slot].size, pos.offset, rec, 0) > 0;
+}
+
+// Função que procura a primeira mensagem da conversa com timestamp a partir de
+// `start`. Retorna a sequência dela ou 0 se não há nenhuma.
+static uint64_t ts_seek(const HistPartition* part, const HistConv* conv, int64_t start, SegMaps* maps) {
+    // Primeira entrada do índice com ts >= início (o ts guardado nunca volta)
+    uint32_t lo = 0, hi = conv->index_len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (conv->index[mid].ts < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return 1;
+
+    // A mensagem está entre a entrada anterior e essa (ou o fim da conversa): volta
+    // pelos ponteiros enquanto o ts não fica menor que o início
+    uint64_t floor = conv->index[lo - 1].seq;
+    HistPos at = lo < conv->index_len ? conv->index[lo].pos : conv->tail;
+    uint64_t seq = lo < conv->index_len ? conv->index[lo].seq : conv->next_seq - 1;
+    uint64_t found = 0;
+    HistRecord rec;
+    for (; seq > floor; seq--) {
+        if (!record_read(part, maps, at, &rec) || rec.seq != seq || rec.ts < start)
+            break;
+        found = seq;
+        at = rec.prev;
+    }
+    return found;
+}
+
+// Função que lê uma página do histórico da conversa entre `a` e `b`: até `count`
+// mensagens (HISTORY_PAGE_MAX se 0) com sequência ou timestamp de `start` a `end`, das
+// mais antigas para as mais novas, chamando `emit` para cada uma. Retorna a sequência
+// de onde a próxima página continua (0 se a faixa acabou).
+uint64_t history_query(Shard* shard, const char* a, const char* b, int range, uint64_t start,
+                       uint64_t end, uint32_t count, HistoryEmit emit, void* ctx) {
+    const char* first;
+    const char* second;
+    pair_order(a, b, &first, &second);
+    uint64_t key = pair_hash(first, second);
+    HistPartition* part = partition_get(&shard->history, key % HISTORY_PARTITIONS);
+    HistConv* conv = part ? conv_find(part, key) : NULL;
+    if (conv == NULL || strcmp(conv->a, first) != 0 || strcmp(conv->b, second) != 0)
+        return 0;
+
+    // O que a iteração acumulou também entra na página
+    partition_write(part);
+
+    if (count == 0 || count > HISTORY_PAGE_MAX)
+        count = HISTORY_PAGE_MAX;
+    uint64_t last = conv->next_seq - 1;
+    SegMaps maps = { 0 };
+
+    // Primeira mensagem da página
+    uint64_t lo;
+    if (range == HISTORY_LAST) {
+        lo = last > count ? last - count + 1 : 1;
+        range = HISTORY_SEQ;
+        end = UINT64_MAX;
+    } else if (range == HISTORY_SEQ) {
+        lo = start > 0 ? start : 1;
+    } else {
+        lo = start > INT64_MAX ? 0 : ts_seek(part, conv, (int64_t)start, &maps);
+    }
+
+    uint64_t next = 0;
+    if (lo > 0 && lo <= last) {
+        // Posições de lo até uma além da página (para saber se há próxima), voltando
+        // pelos ponteiros a partir da primeira entrada do índice depois delas
+        uint64_t hi = last - lo > count ? lo + count : last;
+        uint32_t i = 0, n = conv->index_len;
+        while (i < n) {
+            uint32_t mid = i + (n - i) / 2;
+            if (conv->index[mid].seq < hi)
+                i = mid + 1;
+            else
+                n = mid;
+        }
+        HistPos at = i < conv->index_len ? conv->index[i].pos : conv->tail;
+        uint64_t seq = i < conv->index_len ? conv->index[i].seq : last;
+
+        HistPos pos[HISTORY_PAGE_MAX + 1];
+        HistRecord rec;
+        int ok = 1;
+        for (;; seq--) {
+            if (!record_read(part, &maps, at, &rec) || rec.key != key || rec.seq != seq) {
+                ok = 0;
+                break;
+            }
+            if (seq <= hi)
+                pos[seq - lo] = at;
+            if (seq == lo)
+                break;
+            at = rec.prev;
+        }
+        if (!ok)
+            LOG_SAMPLED(LOG_ERROR, 1000, "Histórico de %s e %s corrompido na sequência %llu",
+                        first, second, (unsigned long long)seq);
+
+        uint32_t emitted = 0;
+        for (seq = lo; ok && seq <= hi; seq++) {
+            if (!record_read(part, &maps, pos[seq - lo], &rec))
+                break;
+            uint64_t k = range == HISTORY_TS ? (uint64_t)rec.ts : seq;
+            if (k > end)
+                break;
+            if (emitted == count) {
+                next = seq;
+                break;
+            }
+            emit(ctx, seq, rec.ts, rec.flags & HIST_FLAG_FROM_B ? conv->b : conv->a, rec.text, rec.text_len);
+            emitted++;
+        }
+    }
+
+    for (int i = 0; i < maps.used; i++)
+        munmap(maps.slots[i].map, maps.slots[i].size);
+    return next;
+}
+
+// Função que diz se o texto contém todos os termos (hashes em ordem crescente)
+static int text_has_terms(const char* text, size_t len, const uint64_t* terms, int count) {
+    uint64_t found[SEARCH_TEXT_TERMS];
+    int n = search_terms(text, len, found, SEARCH_TEXT_TERMS);
+    int j = 0;
+    for (int i = 0; i < count; i++) {
+        while (j < n && found[j] < terms[i])
+            j++;
+        if (j == n || found[j] != terms[i])
+            return 0;
+    }
+    return 1;
+}
+
+// Função que procura, nas partições do shard, as mensagens das conversas de `user` com
+// todos os termos (hashes de search_terms, em ordem crescente), chamando `emit` para
+// cada uma. Cada partição contribui com as SEARCH_PAGE_MAX mais novas dela. Retorna
+// quantas mensagens foram encontradas.
+int history_search(Shard* shard, const char* user, const uint64_t* terms, int count,
+                   SearchEmit emit, void* ctx) {
+    uint64_t keys[SEARCH_TERMS_MAX];
+    for (int i = 0; i < count; i++)
+        keys[i] = search_key(user, terms[i]);
+
+    int found = 0;
+    for (int id = shard->id; id < HISTORY_PARTITIONS; id += shard_count) {
+        HistPartition* part = shard->history.parts[id];
+        if (part == NULL) {
+            // A busca não cria partições que nunca foram gravadas
+            char path[512];
+            segment_path(path, sizeof(path), id, 0);
+            if (access(path, F_OK) != 0 || (part = partition_get(&shard->history, id)) == NULL)
+                continue;
+        }
+
+        // O que a iteração acumulou também entra na busca
+        partition_write(part);
+
+        uint32_t* ids;
+        uint32_t n = search_query(&part->search, keys, count, &ids);
+        SegMaps maps = { 0 };
+        int taken = 0;
+        for (uint32_t i = n; i > 0 && taken < SEARCH_PAGE_MAX; i--) {
+            HistRecord rec;
+            if (!record_read(part, &maps, part->msg_pos[ids[i - 1]], &rec))
+                continue;
+
+            // As listas são por hash: a conversa e os termos são conferidos no registro
+            const HistConv* conv = conv_find(part, rec.key);
+            if (conv == NULL || (strcmp(conv->a, user) != 0 && strcmp(conv->b, user) != 0) ||
+                !text_has_terms(rec.text, rec.text_len, terms, count))
+                continue;
+            const char* with = strcmp(conv->a, user) == 0 ? conv->b : conv->a;
+            emit(ctx, with, rec.seq, rec.ts, rec.flags & HIST_FLAG_FROM_B ? conv->b : conv->a,
+                 rec.text, rec.text_len);
+            taken++;
+        }
+        for (int i = 0; i < maps.used; i++)
+            munmap(maps.slots[i].map, maps.slots[i].size);
+        free(ids);
+        found += taken;
+    }
+    return found;
+}
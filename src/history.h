@@ -0,0 +1,134 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "search.h"
+
+// Histórico das conversas entre dois usuários, fora da arena. As conversas são
+// espalhadas pelo hash do par de apelidos em HISTORY_PARTITIONS partições fixas, cada
+// uma pertencente a um shard (partição % número de shards), então os arquivos não
+// mudam de dono quando o número de shards muda. Cada partição tem, no subdiretório
+// history/ do diretório de dados:
+//
+//   <p>.<n>.seg   segmento n: magic e registros de todas as conversas da partição
+//   <p>.idx       índice esparso: uma entrada a cada HISTORY_INDEX_STRIDE mensagens
+//                 de cada conversa
+//   <p>.conv      snapshot das conversas (apelidos, próxima sequência e último
+//                 registro) até uma posição do log
+//
+// Registro:          [u32 tamanho][u32 crc32][u64 conversa][u64 sequência][i64 ts]
+//                    [u32 segmento anterior][u32 posição anterior][u8 flags]
+//                    ([u8 tamanho][a][u8 tamanho][b] na primeira mensagem)[texto]
+// Entrada do índice: [u64 conversa][u64 sequência][i64 ts][u32 segmento][u32 posição]
+//
+// Cada registro aponta para o anterior da mesma conversa. Uma página começa pela
+// entrada do índice logo depois do fim dela e volta pelos ponteiros até o início, lendo
+// os segmentos com mmap: custa o mesmo no começo ou no fim do histórico. O ts guardado
+// nunca volta (mensagens dos dois sentidos chegam por shards diferentes), o que permite
+// buscar no índice também por timestamp. O índice de cada conversa fica em memória; ao
+// abrir a partição ele vem do snapshot e do arquivo de índice, e os registros gravados
+// depois do snapshot são relidos (um registro incompleto no fim é descartado).
+//
+// Cada partição tem também o índice invertido do SEARCH (search.h): a mensagem número
+// n da partição está na posição msg_pos[n]. Os registros entram nele quando são
+// gravados, no fim da iteração, e o índice vai junto no snapshot.
+
+// Partições do histórico (fixas: definem os nomes dos arquivos)
+#define HISTORY_PARTITIONS 64
+// Tamanho a partir do qual o próximo registro começa um segmento novo
+#define HISTORY_SEGMENT_SIZE (4u << 20)
+// Mensagens de uma conversa entre duas entradas do índice
+#define HISTORY_INDEX_STRIDE 32
+// Mensagens por página do HISTORY
+#define HISTORY_PAGE_MAX 100
+
+// Faixa pedida no HISTORY
+enum {
+    HISTORY_LAST,               // As últimas mensagens da conversa
+    HISTORY_SEQ,                // Sequências de início a fim
+    HISTORY_TS                  // Timestamps de início a fim
+};
+
+// Posição de um registro no log da partição
+typedef struct {
+    uint32_t segment;
+    uint32_t offset;
+} HistPos;
+
+// Entrada do índice esparso de uma conversa
+typedef struct {
+    uint64_t seq;               // Sequência da mensagem
+    int64_t ts;                 // Timestamp guardado
+    HistPos pos;                // Registro da mensagem
+} HistIndexEntry;
+
+// Conversa entre dois usuários
+typedef struct {
+    uint64_t key;               // Hash do par (identifica a conversa nos arquivos)
+    char a[MAX_NICK_LEN];       // Par de apelidos, em ordem
+    char b[MAX_NICK_LEN];
+    uint64_t next_seq;          // Sequência da próxima mensagem
+    int64_t last_ts;            // Maior timestamp guardado
+    HistPos tail;               // Último registro
+    HistIndexEntry* index;      // Índice esparso, em ordem de sequência
+    uint32_t index_len;
+    uint32_t index_cap;
+} HistConv;
+
+// Partição aberta: conversas e o segmento atual do log
+typedef struct {
+    int id;                     // Número da partição
+    HistConv** table;           // Conversas pela chave (endereçamento aberto)
+    uint32_t table_cap;
+    uint32_t count;
+    uint32_t segment;           // Segmento atual
+    uint32_t seg_size;          // Bytes do segmento atual, contando os acumulados
+    int seg_fd;                 // Segmento atual (só acréscimos)
+    int idx_fd;                 // Arquivo do índice (só acréscimos)
+    char* buf;                  // Registros da iteração ainda não gravados
+    size_t len;
+    size_t cap;
+    char* index_buf;            // Entradas do índice ainda não gravadas
+    size_t index_len;
+    size_t index_cap;
+    uint64_t since_snapshot;    // Bytes do log gravados depois do último snapshot
+    uint64_t snapshot_size;     // Tamanho do último snapshot
+    int dirty;                  // Está na lista de partições a gravar
+    SearchIndex search;         // Índice invertido das mensagens da partição
+    HistPos* msg_pos;           // Registro de cada mensagem, pelo número dela no índice
+    uint32_t msg_count;
+    uint32_t msg_cap;
+} HistPartition;
+
+// Partições do shard, abertas no primeiro uso
+typedef struct {
+    HistPartition* parts[HISTORY_PARTITIONS];
+    HistPartition* dirty[HISTORY_PARTITIONS];
+    int dirty_count;
+} HistoryStore;
+
+// Função chamada para cada mensagem de uma página do histórico
+typedef void (*HistoryEmit)(void* ctx, uint64_t seq, int64_t ts, const char* from,
+                            const char* text, size_t len);
+
+// Função chamada para cada mensagem encontrada pelo SEARCH; `with` é o outro
+// participante da conversa
+typedef void (*SearchEmit)(void* ctx, const char* with, uint64_t seq, int64_t ts, const char* from,
+                           const char* text, size_t len);
+
+typedef struct Shard Shard;
+
+int history_shard(const char* a, const char* b);
+int history_target(const char* a, const char* b);
+void history_record(Shard* shard, const char* to, const char* record, size_t len);
+void history_append(Shard* shard, const char* to, const char* record, size_t len);
+uint64_t history_query(Shard* shard, const char* a, const char* b, int range, uint64_t start,
+                       uint64_t end, uint32_t count, HistoryEmit emit, void* ctx);
+int history_search(Shard* shard, const char* user, const uint64_t* terms, int count,
+                   SearchEmit emit, void* ctx);
+void history_flush(HistoryStore* store);
+void history_close(HistoryStore* store);
+
+#endif
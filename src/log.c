@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+
+// Pausa da thread de gravação quando não há eventos
+#define LOG_IDLE_NS 5000000
+// Bytes acumulados antes de cada write
+#define LOG_WRITE_BUF (64u << 10)
+
+// Evento no anel (256 bytes)
+typedef struct {
+    uint64_t time_ns;           // Relógio do sistema no momento do evento
+    uint16_t len;               // Bytes de texto
+    uint8_t level;              // LOG_*
+    char thread[13];            // Thread que registrou
+    char text[LOG_TEXT_LEN];
+} LogRecord;
+
+// Anel de uma thread: só ela avança `head` e só a thread de gravação avança `tail`
+typedef struct LogRing {
+    struct LogRing* next;       // Próximo anel registrado
+    _Alignas(64) atomic_ullong head;    // Próximo evento a escrever
+    _Alignas(64) atomic_ullong tail;    // Próximo evento a gravar
+    atomic_ullong dropped;      // Eventos descartados com o anel cheio
+    unsigned long long reported;        // Descartes já avisados (thread de gravação)
+    LogRecord slots[LOG_RING_SLOTS];
+} LogRing;
+
+int log_level = LOG_INFO;
+
+static _Atomic(LogRing*) rings;         // Anéis de todas as threads que já registraram
+static _Thread_local LogRing* my_ring;  // Anel da thread atual
+static _Thread_local char my_name[13] = "main";
+
+static const char* path;                // Arquivo do log (NULL = saída padrão)
+static int out_fd = STDOUT_FILENO;
+static uint64_t out_size;               // Bytes no arquivo atual
+static char* out_buf;                   // Linhas formatadas ainda não gravadas
+static size_t out_len;
+static pthread_t writer;
+static atomic_int stopping;
+static int running;
+
+static const char* level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// Função que converte o nome de um nível (debug, info, warn, error). Retorna -1 se inválido.
+int log_level_parse(const char* name) {
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++)
+        if (strcasecmp(name, level_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+// Função que dá nome à thread atual nos eventos seguintes
+void log_thread_name(const char* name) {
+    snprintf(my_name, sizeof(my_name), "%s", name);
+}
+
+// Função que cria o anel da thread atual e o publica para a thread de gravação
+static LogRing* ring_create() {
+    LogRing* ring = aligned_alloc(64, sizeof(LogRing));
+    if (ring == NULL)
+        return NULL;
+    memset(ring, 0, sizeof(LogRing));
+
+    LogRing* first = atomic_load_explicit(&rings, memory_order_relaxed);
+    do {
+        ring->next = first;
+    } while (!atomic_compare_exchange_weak_explicit(&rings, &first, ring,
+                                                    memory_order_release, memory_order_relaxed));
+    return ring;
+}
+
+// Função que registra um evento: formata o texto direto na posição livre do anel da
+// thread e a publica. Nunca bloqueia; com o anel cheio o evento é descartado.
+void log_write(int level, const char* fmt, ...) {
+    LogRing* ring = my_ring;
+    if (ring == NULL && (ring = my_ring = ring_create()) == NULL)
+        return;
+
+    unsigned long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogRecord* rec = &ring->slots[head & (LOG_RING_SLOTS - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time_ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+    rec->level = (uint8_t)level;
+    memcpy(rec->thread, my_name, sizeof(rec->thread));
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(rec->text, sizeof(rec->text), fmt, args);
+    va_end(args);
+    if (len < 0)
+        len = 0;
+    rec->len = len < (int)sizeof(rec->text) ? (uint16_t)len : sizeof(rec->text) - 1;
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Função que abre (ou cria) o arquivo do log para acrescentar
+static int open_output() {
+    out_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (out_fd < 0) {
+        perror(path);
+        return -1;
+    }
+    off_t size = lseek(out_fd, 0, SEEK_END);
+    out_size = size > 0 ? (uint64_t)size : 0;
+    return 0;
+}
+
+// Função que renomeia arquivo -> arquivo.1 -> ... -> arquivo.N (o mais antigo sai)
+// e começa um arquivo novo
+static void rotate() {
+    char from[4096], to[4096];
+    close(out_fd);
+    for (int i = LOG_ROTATE_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", path, i);
+        snprintf(to, sizeof(to), "%s.%d", path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", path);
+    rename(path, to);
+    if (open_output() < 0)
+        out_fd = STDERR_FILENO;
+}
+
+// Função que grava as linhas acumuladas, girando o arquivo quando passa do limite
+static void flush_output() {
+    size_t off = 0;
+    while (off < out_len) {
+        ssize_t n = write(out_fd, out_buf + off, out_len - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;              // Sem onde gravar: as linhas são perdidas, o servidor segue
+        }
+        off += n;
+    }
+    out_size += out_len;
+    out_len = 0;
+
+    if (path != NULL && out_fd != STDERR_FILENO && out_size >= LOG_ROTATE_SIZE)
+        rotate();
+}
+
+// Função que acrescenta uma linha formatada ao buffer de gravação
+static void append_line(uint64_t time_ns, int level, const char* thread, const char* text, size_t len) {
+    static time_t cached_sec = -1;
+    static char cached_prefix[32];
+
+    if (out_len + len + 96 > LOG_WRITE_BUF)
+        flush_output();
+
+    // A data só é refeita quando muda o segundo
+    time_t sec = (time_t)(time_ns / 1000000000);
+    if (sec != cached_sec) {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(cached_prefix, sizeof(cached_prefix), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_sec = sec;
+    }
+
+    out_len += sprintf(out_buf + out_len, "%s.%06u %-5s [%s] ", cached_prefix,
+                       (unsigned)(time_ns % 1000000000 / 1000), level_names[level], thread);
+    memcpy(out_buf + out_len, text, len);
+    out_len += len;
+    out_buf[out_len++] = '\n';
+}
+
+// Função que recolhe os eventos de todos os anéis. Retorna quantos foram gravados.
+static size_t drain_rings() {
+    size_t total = 0;
+
+    for (LogRing* ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+        unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        total += head - tail;
+        for (; tail < head; tail++) {
+            LogRecord* rec = &ring->slots[tail & (LOG_RING_SLOTS - 1)];
+            append_line(rec->time_ns, rec->level, rec->thread, rec->text, rec->len);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        // Descartes avisados pela própria thread de gravação, uma linha por rodada
+        unsigned long long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->reported) {
+            char text[96];
+            int len = snprintf(text, sizeof(text), "%llu eventos de log descartados (anel cheio)",
+                               dropped - ring->reported);
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            append_line((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, LOG_WARN, "log", text, len);
+            ring->reported = dropped;
+        }
+    }
+
+    if (out_len > 0)
+        flush_output();
+    return total;
+}
+
+// Função executada pela thread de gravação
+static void* log_run(void* arg) {
+    (void)arg;
+    struct timespec idle = { 0, LOG_IDLE_NS };
+
+    while (!atomic_load_explicit(&stopping, memory_order_acquire))
+        if (drain_rings() == 0)
+            nanosleep(&idle, NULL);
+
+    drain_rings();
+    return NULL;
+}
+
+// Função que inicia a thread de gravação. `file` NULL grava na saída padrão.
+int log_init(const char* file) {
+    path = file;
+    if (path != NULL && open_output() < 0)
+        return -1;
+
+    out_buf = malloc(LOG_WRITE_BUF);
+    if (out_buf == NULL || pthread_create(&writer, NULL, log_run, NULL) != 0)
+        return -1;
+    running = 1;
+    return 0;
+}
+
+// Função que grava os eventos restantes e encerra a thread de gravação
+void log_shutdown() {
+    if (!running)
+        return;
+
+    atomic_store_explicit(&stopping, 1, memory_order_release);
+    pthread_join(writer, NULL);
+    running = 0;
+    if (path != NULL)
+        close(out_fd);
+}
@@ -0,0 +1,52 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// Log assíncrono do servidor. Cada thread escreve os eventos já formatados num anel
+// próprio (um produtor e um consumidor, sem travas); uma thread de fundo recolhe os
+// anéis em lote e grava no arquivo (opção -L, com rotação por tamanho) ou na saída
+// padrão. Quem registra nunca espera: com o anel cheio o evento é descartado e contado.
+
+// Níveis
+enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+};
+
+// Eventos guardados por anel (potência de 2)
+#define LOG_RING_SLOTS 4096
+// Bytes de texto de um evento (o restante é cortado)
+#define LOG_TEXT_LEN 232
+// Tamanho do arquivo que dispara a rotação
+#define LOG_ROTATE_SIZE (64u << 20)
+// Arquivos antigos mantidos na rotação (arquivo.1 ... arquivo.N)
+#define LOG_ROTATE_KEEP 4
+
+extern int log_level;           // Eventos abaixo deste nível são ignorados
+
+// Registra um evento se o nível estiver ativo (só uma comparação quando não está)
+#define LOG(level, ...) \
+    do { \
+        if ((level) >= log_level) \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+
+// Registra 1 de cada `n` eventos deste ponto do código (contagem por thread), para
+// eventos frequentes demais para aparecer todos
+#define LOG_SAMPLED(level, n, ...) \
+    do { \
+        static _Thread_local uint32_t log_seen_; \
+        if ((level) >= log_level && log_seen_++ % (n) == 0) \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+
+int log_level_parse(const char* name);
+int log_init(const char* path);
+void log_shutdown();
+void log_thread_name(const char* name);
+void log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Fila intrusiva MPSC (vários produtores, um consumidor) sem travas, baseada no
+// algoritmo de Dmitry Vyukov. Cada shard consome a própria mailbox; qualquer outro
+// shard pode inserir nela.
+
+typedef struct MailboxNode {
+    _Atomic(struct MailboxNode*) next;
+} MailboxNode;
+
+typedef struct {
+    _Atomic(MailboxNode*) head;     // Último nó inserido (lado dos produtores)
+    MailboxNode* tail;              // Próximo nó a retirar (lado do consumidor)
+    MailboxNode stub;               // Nó sentinela
+} Mailbox;
+
+// Função que inicializa a mailbox vazia
+static inline void mailbox_init(Mailbox* mb) {
+    atomic_store_explicit(&mb->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&mb->head, &mb->stub, memory_order_relaxed);
+    mb->tail = &mb->stub;
+}
+
+// Função que insere um nó na mailbox (pode ser chamada por qualquer thread)
+static inline void mailbox_push(Mailbox* mb, MailboxNode* node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    MailboxNode* prev = atomic_exchange_explicit(&mb->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// Função que retira o nó mais antigo da mailbox (somente a thread consumidora).
+// Retorna NULL se estiver vazia ou se um produtor ainda estiver no meio da inserção;
+// nesse caso o produtor acorda o consumidor logo em seguida.
+static inline MailboxNode* mailbox_pop(Mailbox* mb) {
+    MailboxNode* tail = mb->tail;
+    MailboxNode* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    // Pulando o sentinela
+    if (tail == &mb->stub) {
+        if (next == NULL)
+            return NULL;
+        mb->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        mb->tail = next;
+        return tail;
+    }
+
+    // Produtor em andamento
+    if (tail != atomic_load_explicit(&mb->head, memory_order_acquire))
+        return NULL;
+
+    // Último nó: reinsere o sentinela para poder liberar o nó
+    mailbox_push(mb, &mb->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        mb->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "msg_queue.h"
+
+// Capacidade inicial do buffer circular de uma fila
+#define INITIAL_QUEUE_CAPACITY 16
+// Capacidade inicial dos arrays de páginas
+#define INITIAL_PAGE_CAPACITY 16
+
+// Função que retorna os dados de controle da página
+static SlabPage* page_at(Slab* slab, uint32_t id) {
+    return (SlabPage*)arena_ptr(slab->arena, slab->data->pages) + id;
+}
+
+// Função que retorna o chunk identificado pelo índice
+static Chunk* chunk_at(Slab* slab, uint32_t index) {
+    Chunk* chunks = arena_ptr(slab->arena, page_at(slab, index / CHUNKS_PER_PAGE)->chunks);
+    return &chunks[index % CHUNKS_PER_PAGE];
+}
+
+// Função que retorna o buffer circular da fila
+static MsgDesc* ring_of(Slab* slab, const MessageQueue* queue) {
+    return arena_ptr(slab->arena, queue->ring);
+}
+
+// Função que retira a página da lista de páginas com chunks livres
+static void partial_unlink(Slab* slab, uint32_t id) {
+    SlabPage* page = page_at(slab, id);
+    if (page->prev != NO_PAGE)
+        page_at(slab, page->prev)->next = page->next;
+    else
+        slab->data->partial = page->next;
+    if (page->next != NO_PAGE)
+        page_at(slab, page->next)->prev = page->prev;
+    page->prev = page->next = NO_PAGE;
+}
+
+// Função que coloca a página na lista de páginas com chunks livres
+static void partial_link(Slab* slab, uint32_t id) {
+    SlabPage* page = page_at(slab, id);
+    page->prev = NO_PAGE;
+    page->next = slab->data->partial;
+    if (slab->data->partial != NO_PAGE)
+        page_at(slab, slab->data->partial)->prev = id;
+    slab->data->partial = id;
+}
+
+// Função que dobra os arrays de páginas e de ids livres. Retorna -1 sem espaço.
+static int pages_grow(Slab* slab) {
+    SlabData* data = slab->data;
+    uint32_t capacity = data->page_capacity ? data->page_capacity * 2 : INITIAL_PAGE_CAPACITY;
+
+    ArenaOff pages = arena_alloc(slab->arena, capacity * sizeof(SlabPage));
+    ArenaOff free_ids = arena_alloc(slab->arena, capacity * sizeof(uint32_t));
+    if (pages == 0 || free_ids == 0) {
+        arena_free(slab->arena, pages, capacity * sizeof(SlabPage));
+        arena_free(slab->arena, free_ids, capacity * sizeof(uint32_t));
+        return -1;
+    }
+
+    if (data->page_count > 0) {
+        memcpy(arena_ptr(slab->arena, pages), arena_ptr(slab->arena, data->pages), data->page_count * sizeof(SlabPage));
+        memcpy(arena_ptr(slab->arena, free_ids), arena_ptr(slab->arena, data->free_ids), data->free_id_count * sizeof(uint32_t));
+    }
+    arena_free(slab->arena, data->pages, data->page_capacity * sizeof(SlabPage));
+    arena_free(slab->arena, data->free_ids, data->page_capacity * sizeof(uint32_t));
+
+    data->pages = pages;
+    data->free_ids = free_ids;
+    data->page_capacity = capacity;
+    return 0;
+}
+
+// Função que cria uma nova página com todos os chunks livres. Retorna o id da página
+// ou NO_PAGE sem espaço.
+static uint32_t page_new(Slab* slab) {
+    SlabData* data = slab->data;
+    ArenaOff block = arena_alloc(slab->arena, CHUNKS_PER_PAGE * sizeof(Chunk));
+    if (block == 0)
+        return NO_PAGE;
+
+    // Reaproveitando o id de uma página devolvida
+    uint32_t id;
+    if (data->free_id_count > 0) {
+        id = ((uint32_t*)arena_ptr(slab->arena, data->free_ids))[--data->free_id_count];
+    } else {
+        if (data->page_count == data->page_capacity && pages_grow(slab) < 0) {
+            arena_free(slab->arena, block, CHUNKS_PER_PAGE * sizeof(Chunk));
+            return NO_PAGE;
+        }
+        id = data->page_count++;
+    }
+
+    SlabPage* page = page_at(slab, id);
+    page->chunks = block;
+
+    // Encadeando os chunks livres da página
+    Chunk* chunks = arena_ptr(slab->arena, block);
+    for (uint32_t i = 0; i < CHUNKS_PER_PAGE; i++)
+        chunks[i].next = i + 1;
+    page->free_head = 0;
+    page->live = 0;
+
+    partial_link(slab, id);
+    return id;
+}
+
+// Função que aloca um chunk e retorna seu índice (NO_CHUNK sem memória)
+static uint32_t chunk_alloc(Slab* slab) {
+    uint32_t id = slab->data->partial;
+    if (id == NO_PAGE && (id = page_new(slab)) == NO_PAGE)
+        return NO_CHUNK;
+
+    SlabPage* page = page_at(slab, id);
+    Chunk* chunks = arena_ptr(slab->arena, page->chunks);
+    uint32_t pos = page->free_head;
+    page->free_head = chunks[pos].next;
+    page->live++;
+    slab->data->chunks_in_use++;
+
+    // Página cheia sai da lista de páginas com chunks livres
+    if (page->free_head == CHUNKS_PER_PAGE)
+        partial_unlink(slab, id);
+
+    return id * CHUNKS_PER_PAGE + pos;
+}
+
+// Função que libera um chunk; a página volta ao sistema quando fica vazia,
+// exceto se for a única com espaço livre (evita alocar e liberar em sequência)
+static void chunk_free(Slab* slab, uint32_t index) {
+    uint32_t id = index / CHUNKS_PER_PAGE;
+    uint32_t pos = index % CHUNKS_PER_PAGE;
+    SlabPage* page = page_at(slab, id);
+
+    if (page->free_head == CHUNKS_PER_PAGE)
+        partial_link(slab, id);
+
+    chunk_at(slab, index)->next = page->free_head;
+    page->free_head = pos;
+    page->live--;
+    slab->data->chunks_in_use--;
+
+    if (page->live == 0 && (page->prev != NO_PAGE || page->next != NO_PAGE)) {
+        partial_unlink(slab, id);
+        arena_free(slab->arena, page->chunks, CHUNKS_PER_PAGE * sizeof(Chunk));
+        page->chunks = 0;
+        ((uint32_t*)arena_ptr(slab->arena, slab->data->free_ids))[slab->data->free_id_count++] = id;
+    }
+}
+
+// Função que libera a cadeia de chunks de uma mensagem
+static void chain_free(Slab* slab, uint32_t index) {
+    while (index != NO_CHUNK) {
+        uint32_t next = chunk_at(slab, index)->next;
+        chunk_free(slab, index);
+        index = next;
+    }
+}
+
+// Função que prepara o acesso ao slab guardado na arena (vazio se ainda não usado)
+void slab_init(Slab* slab, Arena* arena, SlabData* data) {
+    slab->arena = arena;
+    slab->data = data;
+    if (data->pages == 0) {
+        memset(data, 0, sizeof(*data));
+        data->partial = NO_PAGE;
+    }
+}
+
+// Função que retorna o contador de referências de uma mensagem compartilhada
+// (primeiros bytes do primeiro chunk)
+static uint32_t* refs_of(Slab* slab, uint32_t chain) {
+    return (uint32_t*)chunk_at(slab, chain)->data;
+}
+
+// Função que copia a mensagem para uma nova cadeia de chunks, deixando `reserve` bytes
+// livres no início do primeiro. Retorna o primeiro chunk ou NO_CHUNK sem memória.
+static uint32_t chain_store(Slab* slab, const char* message, size_t len, size_t reserve) {
+    uint32_t first = NO_CHUNK;
+    uint32_t* link = &first;
+    size_t offset = 0;
+    do {
+        uint32_t index = chunk_alloc(slab);
+        if (index == NO_CHUNK) {
+            chain_free(slab, first);
+            return NO_CHUNK;
+        }
+        *link = index;
+
+        Chunk* chunk = chunk_at(slab, index);
+        size_t room = CHUNK_DATA - reserve;
+        size_t part = len - offset < room ? len - offset : room;
+        memcpy(chunk->data + reserve, message + offset, part);
+        chunk->next = NO_CHUNK;
+        link = &chunk->next;
+        offset += part;
+        reserve = 0;
+    } while (offset < len);
+
+    return first;
+}
+
+// Função que copia a mensagem de um descritor para `out` (com '\0' no final; sem cópia
+// se `out` for NULL). Retorna o tamanho da mensagem.
+static size_t chain_read(Slab* slab, MsgDesc desc, char* out) {
+    size_t len = desc.len & ~MSG_SHARED;
+    if (out == NULL)
+        return len;
+    size_t skip = desc.len & MSG_SHARED ? sizeof(uint32_t) : 0;
+    size_t offset = 0;
+    for (uint32_t index = desc.chunk; index != NO_CHUNK; index = chunk_at(slab, index)->next) {
+        size_t room = CHUNK_DATA - skip;
+        size_t part = len - offset < room ? len - offset : room;
+        memcpy(out + offset, chunk_at(slab, index)->data + skip, part);
+        offset += part;
+        skip = 0;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// Função que solta a mensagem de um descritor: a cadeia volta ao slab, ou, se for
+// compartilhada, só quando a última fila que a referencia a soltar
+static void desc_release(Slab* slab, MsgDesc desc) {
+    if (desc.len & MSG_SHARED)
+        slab_release(slab, desc.chunk);
+    else
+        chain_free(slab, desc.chunk);
+}
+
+// Função que reserva a posição da próxima mensagem no fim da fila, dobrando o buffer
+// circular se necessário. Retorna o descritor a preencher ou NULL sem memória.
+static MsgDesc* ring_reserve(Slab* slab, MessageQueue* queue) {
+    if (queue->count == queue->capacity) {
+        uint32_t capacity = queue->capacity ? queue->capacity * 2 : INITIAL_QUEUE_CAPACITY;
+        ArenaOff off = arena_alloc(slab->arena, capacity * sizeof(MsgDesc));
+        if (off == 0)
+            return NULL;
+
+        // Copiando as mensagens em ordem para o início do novo buffer
+        MsgDesc* ring = arena_ptr(slab->arena, off);
+        MsgDesc* old = ring_of(slab, queue);
+        for (uint32_t i = 0; i < queue->count; i++)
+            ring[i] = old[(queue->head + i) & (queue->capacity - 1)];
+
+        arena_free(slab->arena, queue->ring, queue->capacity * sizeof(MsgDesc));
+        queue->ring = off;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+
+    return &ring_of(slab, queue)[(queue->head + queue->count) & (queue->capacity - 1)];
+}
+
+// Função que adiciona uma mensagem ao fim da fila do usuário, copiando-a para o slab.
+// Retorna 0 em caso de sucesso ou -1 sem memória.
+int queue_push(Slab* slab, MessageQueue* queue, const char* message, size_t len) {
+    MsgDesc* desc = ring_reserve(slab, queue);
+    if (desc == NULL)
+        return -1;
+
+    uint32_t first = chain_store(slab, message, len, 0);
+    if (first == NO_CHUNK)
+        return -1;
+
+    desc->chunk = first;
+    desc->len = len;
+    queue->count++;
+    slab->data->messages_queued++;
+
+    return 0;
+}
+
+// Função que guarda no slab uma mensagem que será referenciada por várias filas
+// (mensagens de grupo), com uma referência para quem a criou. Retorna o primeiro
+// chunk ou NO_CHUNK sem memória.
+uint32_t slab_share(Slab* slab, const char* message, size_t len) {
+    uint32_t chain = chain_store(slab, message, len, sizeof(uint32_t));
+    if (chain != NO_CHUNK)
+        *refs_of(slab, chain) = 1;
+    return chain;
+}
+
+// Função que solta uma referência a uma mensagem compartilhada; a última libera os chunks
+void slab_release(Slab* slab, uint32_t chain) {
+    if (--*refs_of(slab, chain) == 0)
+        chain_free(slab, chain);
+}
+
+// Função que adiciona à fila uma referência a uma mensagem compartilhada, sem copiá-la.
+// Retorna 0 em caso de sucesso ou -1 sem memória.
+int queue_push_shared(Slab* slab, MessageQueue* queue, uint32_t chain, size_t len) {
+    MsgDesc* desc = ring_reserve(slab, queue);
+    if (desc == NULL)
+        return -1;
+
+    (*refs_of(slab, chain))++;
+    desc->chunk = chain;
+    desc->len = len | MSG_SHARED;
+    queue->count++;
+    slab->data->messages_queued++;
+
+    return 0;
+}
+
+// Função que copia a i-ésima mensagem da fila (0 = mais antiga) sem retirá-la.
+// Retorna o tamanho da mensagem.
+size_t queue_peek(Slab* slab, const MessageQueue* queue, uint32_t i, char* out) {
+    return chain_read(slab, ring_of(slab, queue)[(queue->head + i) & (queue->capacity - 1)], out);
+}
+
+// Função que retorna a cadeia da i-ésima mensagem da fila se ela é compartilhada com
+// outras filas (NO_CHUNK se é só desta)
+uint32_t queue_shared_chain(Slab* slab, const MessageQueue* queue, uint32_t i) {
+    MsgDesc desc = ring_of(slab, queue)[(queue->head + i) & (queue->capacity - 1)];
+    return desc.len & MSG_SHARED ? desc.chunk : NO_CHUNK;
+}
+
+// Função que sobrescreve os primeiros `len` bytes da i-ésima mensagem da fila, sem
+// mudar o tamanho dela (no máximo o que cabe no primeiro chunk)
+void queue_patch(Slab* slab, const MessageQueue* queue, uint32_t i, const char* data, size_t len) {
+    MsgDesc desc = ring_of(slab, queue)[(queue->head + i) & (queue->capacity - 1)];
+    size_t skip = desc.len & MSG_SHARED ? sizeof(uint32_t) : 0;
+    if (len <= CHUNK_DATA - skip && len <= (desc.len & ~MSG_SHARED))
+        memcpy(chunk_at(slab, desc.chunk)->data + skip, data, len);
+}
+
+// Função que retira a mensagem mais antiga da fila em O(1), copiando-a para `out`
+// (com '\0' no final; NULL apenas descarta). Retorna o tamanho da mensagem ou 0 se a fila estiver vazia.
+size_t queue_pop(Slab* slab, MessageQueue* queue, char* out) {
+    if (queue->count == 0)
+        return 0;
+
+    MsgDesc desc = ring_of(slab, queue)[queue->head];
+    queue->head = (queue->head + 1) & (queue->capacity - 1);
+    queue->count--;
+    slab->data->messages_queued--;
+
+    // Copiando a mensagem e devolvendo os chunks ao slab
+    size_t len = chain_read(slab, desc, out);
+    desc_release(slab, desc);
+
+    // Fila vazia devolve o buffer circular
+    if (queue->count == 0)
+        queue_clear(slab, queue);
+
+    return len;
+}
+
+// Função que descarta todas as mensagens da fila e libera sua memória
+void queue_clear(Slab* slab, MessageQueue* queue) {
+    MsgDesc* ring = ring_of(slab, queue);
+    for (uint32_t i = 0; i < queue->count; i++)
+        desc_release(slab, ring[(queue->head + i) & (queue->capacity - 1)]);
+    slab->data->messages_queued -= queue->count;
+
+    arena_free(slab->arena, queue->ring, queue->capacity * sizeof(MsgDesc));
+    memset(queue, 0, sizeof(*queue));
+}
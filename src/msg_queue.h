@@ -0,0 +1,85 @@
+#ifndef MSG_QUEUE_H
+#define MSG_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+// Tamanho de cada chunk do slab (cabeçalho + dados)
+#define CHUNK_SIZE 64
+// Bytes de mensagem por chunk
+#define CHUNK_DATA (CHUNK_SIZE - sizeof(uint32_t))
+// Chunks por página do slab (páginas de 64 KiB)
+#define CHUNKS_PER_PAGE 1024
+// Índice que indica "nenhum chunk"
+#define NO_CHUNK UINT32_MAX
+
+// Chunk de mensagem; mensagens maiores que CHUNK_DATA ocupam uma cadeia de chunks
+typedef struct {
+    uint32_t next;              // Próximo chunk da mensagem (ou da lista livre)
+    char data[CHUNK_DATA];      // Bytes da mensagem
+} Chunk;
+
+// Índice que indica "nenhuma página"
+#define NO_PAGE UINT32_MAX
+
+// Página do slab: os chunks ficam num bloco de 64 KiB da arena e os dados de
+// controle num array separado, indexado pelo id da página
+typedef struct {
+    ArenaOff chunks;            // Bloco com os CHUNKS_PER_PAGE chunks (0 se devolvida)
+    uint32_t live;              // Chunks em uso
+    uint32_t free_head;         // Primeiro chunk livre da página (CHUNKS_PER_PAGE se nenhum)
+    uint32_t prev;              // Lista de páginas com chunks livres (ids)
+    uint32_t next;
+} SlabPage;
+
+// Estado do slab de um shard, guardado na arena. Os chunks são identificados por
+// índices de 32 bits (página << 10 | posição) e páginas vazias são devolvidas ao sistema.
+typedef struct {
+    ArenaOff pages;             // Array de SlabPage indexado pelo id
+    uint32_t page_count;        // Páginas criadas
+    uint32_t page_capacity;     // Capacidade dos arrays de páginas e de ids livres
+    ArenaOff free_ids;          // Ids de páginas devolvidas, para reuso
+    uint32_t free_id_count;
+    uint32_t partial;           // Páginas com chunks livres (NO_PAGE se nenhuma)
+    uint64_t chunks_in_use;     // Chunks alocados (estatística)
+    uint64_t messages_queued;   // Mensagens em todas as filas (estatística)
+} SlabData;
+
+// Acesso ao slab de um shard
+typedef struct {
+    Arena* arena;               // Arena onde ficam os chunks
+    SlabData* data;             // Estado do slab (dentro da arena)
+} Slab;
+
+// Bit de MsgDesc.len que marca uma mensagem compartilhada entre filas (mensagens de
+// grupo): o primeiro chunk começa com o contador de referências (u32)
+#define MSG_SHARED 0x80000000u
+
+// Descritor de uma mensagem na fila
+typedef struct {
+    uint32_t chunk;             // Primeiro chunk da mensagem
+    uint32_t len;               // Tamanho da mensagem em bytes (| MSG_SHARED)
+} MsgDesc;
+
+// Fila circular de descritores de mensagens pendentes de um usuário
+typedef struct {
+    ArenaOff ring;              // Buffer circular na arena (0 quando a fila está vazia)
+    uint32_t head;              // Posição da mensagem mais antiga
+    uint32_t count;             // Número de mensagens na fila
+    uint32_t capacity;          // Capacidade do buffer (potência de 2)
+} MessageQueue;
+
+void slab_init(Slab* slab, Arena* arena, SlabData* data);
+int queue_push(Slab* slab, MessageQueue* queue, const char* message, size_t len);
+size_t queue_pop(Slab* slab, MessageQueue* queue, char* out);
+size_t queue_peek(Slab* slab, const MessageQueue* queue, uint32_t i, char* out);
+void queue_clear(Slab* slab, MessageQueue* queue);
+uint32_t queue_shared_chain(Slab* slab, const MessageQueue* queue, uint32_t i);
+void queue_patch(Slab* slab, const MessageQueue* queue, uint32_t i, const char* data, size_t len);
+uint32_t slab_share(Slab* slab, const char* message, size_t len);
+void slab_release(Slab* slab, uint32_t chain);
+int queue_push_shared(Slab* slab, MessageQueue* queue, uint32_t chain, size_t len);
+
+#endif
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+
+// Tamanho inicial da tabela de tópicos e do conjunto de inscritos de um tópico
+#define INITIAL_BUCKETS 64
+#define INITIAL_SLOTS 16
+
+// Marcadores de posição do conjunto de inscritos
+#define SLOT_EMPTY -1
+#define SLOT_REMOVED -2
+
+// Função que calcula a posição inicial de um inscrito no conjunto
+static uint32_t ref_hash(ConnRef ref) {
+    uint32_t hash = (uint32_t)ref.fd * 2654435761u;
+    hash ^= ref.id * 2246822519u;
+    hash ^= (uint32_t)ref.shard * 3266489917u;
+    hash ^= (uint32_t)ref.node * 668265263u;
+    return hash ^ (hash >> 16);
+}
+
+// Função que busca o tópico de um usuário (NULL se ninguém está inscrito nele)
+static PresenceTopic** topic_link(PresenceTable* table, const char* nick) {
+    if (table->bucket_count == 0)
+        return NULL;
+
+    PresenceTopic** link = &table->buckets[hash_nick(nick) & (table->bucket_count - 1)];
+    while (*link != NULL && strcmp((*link)->nick, nick) != 0)
+        link = &(*link)->next;
+    return link;
+}
+
+static PresenceTopic* topic_find(PresenceTable* table, const char* nick) {
+    PresenceTopic** link = topic_link(table, nick);
+    return link ? *link : NULL;
+}
+
+// Função que dobra a tabela de tópicos quando há mais tópicos que baldes
+static void buckets_grow(PresenceTable* table) {
+    uint32_t count = table->bucket_count ? table->bucket_count * 2 : INITIAL_BUCKETS;
+    PresenceTopic** buckets = calloc(count, sizeof(PresenceTopic*));
+
+    for (uint32_t i = 0; i < table->bucket_count; i++) {
+        PresenceTopic* topic = table->buckets[i];
+        while (topic != NULL) {
+            PresenceTopic* next = topic->next;
+            PresenceTopic** head = &buckets[hash_nick(topic->nick) & (count - 1)];
+            topic->next = *head;
+            *head = topic;
+            topic = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = count;
+}
+
+// Função que refaz o conjunto de inscritos com `cap` posições, sem os removidos.
+// Um envio em andamento recomeça (quem já foi avisado recebe o estado de novo).
+static void slots_rebuild(PresenceTopic* topic, uint32_t cap) {
+    ConnRef* slots = malloc(cap * sizeof(ConnRef));
+    for (uint32_t i = 0; i < cap; i++)
+        slots[i].fd = SLOT_EMPTY;
+
+    for (uint32_t i = 0; i < topic->cap; i++) {
+        if (topic->slots[i].fd < 0)
+            continue;
+        uint32_t pos = ref_hash(topic->slots[i]) & (cap - 1);
+        while (slots[pos].fd != SLOT_EMPTY)
+            pos = (pos + 1) & (cap - 1);
+        slots[pos] = topic->slots[i];
+    }
+
+    free(topic->slots);
+    topic->slots = slots;
+    topic->cap = cap;
+    topic->used = topic->live;
+    topic->cursor = 0;
+}
+
+// Função que libera o tópico quando não há inscritos nem envio em andamento
+static void topic_release(PresenceTable* table, PresenceTopic* topic) {
+    if (topic->live > 0 || topic->active)
+        return;
+
+    PresenceTopic** link = topic_link(table, topic->nick);
+    *link = topic->next;
+    table->topic_count--;
+    free(topic->slots);
+    free(topic);
+}
+
+// Função que inscreve a conexão nas mudanças de estado do usuário (sem efeito se ela
+// já está inscrita)
+void presence_subscribe(Shard* shard, const char* nick, ConnRef sub) {
+    PresenceTable* table = &shard->presence;
+    PresenceTopic* topic = topic_find(table, nick);
+    if (topic == NULL) {
+        if (table->topic_count >= table->bucket_count)
+            buckets_grow(table);
+
+        topic = calloc(1, sizeof(PresenceTopic));
+        strcpy(topic->nick, nick);
+        PresenceTopic** head = &table->buckets[hash_nick(nick) & (table->bucket_count - 1)];
+        topic->next = *head;
+        *head = topic;
+        table->topic_count++;
+    }
+
+    // Ocupação máxima de 3/4, contando os removidos
+    if ((topic->used + 1) * 4 > topic->cap * 3) {
+        uint32_t cap = INITIAL_SLOTS;
+        while ((topic->live + 1) * 2 > cap)
+            cap *= 2;
+        slots_rebuild(topic, cap);
+    }
+
+    uint32_t mask = topic->cap - 1;
+    uint32_t pos = ref_hash(sub) & mask;
+    int32_t reuse = -1;
+    while (topic->slots[pos].fd != SLOT_EMPTY) {
+        ConnRef* slot = &topic->slots[pos];
+        if (slot->fd == sub.fd && slot->id == sub.id && slot->shard == sub.shard && slot->node == sub.node)
+            return;
+        if (slot->fd == SLOT_REMOVED && reuse < 0)
+            reuse = pos;
+        pos = (pos + 1) & mask;
+    }
+
+    if (reuse >= 0)
+        pos = reuse;
+    else
+        topic->used++;
+    topic->slots[pos] = sub;
+    topic->live++;
+}
+
+// Função que cancela a inscrição da conexão no usuário
+void presence_unsubscribe(Shard* shard, const char* nick, ConnRef sub) {
+    PresenceTopic* topic = topic_find(&shard->presence, nick);
+    if (topic == NULL)
+        return;
+
+    uint32_t mask = topic->cap - 1;
+    for (uint32_t pos = ref_hash(sub) & mask; topic->slots[pos].fd != SLOT_EMPTY; pos = (pos + 1) & mask) {
+        ConnRef* slot = &topic->slots[pos];
+        if (slot->fd == sub.fd && slot->id == sub.id && slot->shard == sub.shard && slot->node == sub.node) {
+            // A posição continua ocupada para não quebrar a sondagem
+            slot->fd = SLOT_REMOVED;
+            topic->live--;
+            break;
+        }
+    }
+
+    topic_release(&shard->presence, topic);
+}
+
+// Função que cancela as inscrições das conexões do nó `node`, que saiu do cluster
+void presence_drop_node(Shard* shard, int node) {
+    PresenceTable* table = &shard->presence;
+    for (uint32_t b = 0; b < table->bucket_count; b++) {
+        PresenceTopic* topic = table->buckets[b];
+        while (topic != NULL) {
+            PresenceTopic* next = topic->next;
+            for (uint32_t pos = 0; pos < topic->cap; pos++) {
+                if (topic->slots[pos].fd >= 0 && topic->slots[pos].node == node) {
+                    topic->slots[pos].fd = SLOT_REMOVED;
+                    topic->live--;
+                }
+            }
+            topic_release(table, topic);
+            topic = next;
+        }
+    }
+}
+
+// Função que registra uma mudança de estado do usuário. Nada é enviado aqui: o tópico
+// entra na fila de envio e, se já estava nela, o envio recomeça com o estado novo.
+void presence_publish(Shard* shard, const char* nick, int event) {
+    PresenceTable* table = &shard->presence;
+    PresenceTopic* topic = topic_find(table, nick);
+    if (topic == NULL)
+        return;
+
+    topic->event = event;
+    topic->cursor = 0;
+    if (topic->active)
+        return;
+
+    if (table->active_count == table->active_cap) {
+        table->active_cap = table->active_cap ? table->active_cap * 2 : 16;
+        table->active = realloc(table->active, table->active_cap * sizeof(PresenceTopic*));
+    }
+    table->active[table->active_count++] = topic;
+    topic->active = 1;
+}
+
+// Função que avisa os inscritos das posições [from, to) do tópico: os do próprio shard
+// diretamente, os de cada outro shard numa única mensagem e os de outros nós numa
+// mensagem cada (que vai no lote do link para o nó)
+static void fanout_range(Shard* shard, PresenceTopic* topic, uint32_t from, uint32_t to) {
+    PresenceTable* table = &shard->presence;
+    if (table->counts == NULL) {
+        table->counts = malloc(shard_count * sizeof(int));
+        table->posts = malloc(shard_count * sizeof(ShardMsg*));
+    }
+
+    memset(table->counts, 0, shard_count * sizeof(int));
+    for (uint32_t i = from; i < to; i++)
+        if (topic->slots[i].fd >= 0 && topic->slots[i].node == cluster_self)
+            table->counts[topic->slots[i].shard]++;
+
+    // Dados da mensagem: os inscritos (ConnRef) seguidos do apelido
+    size_t nick_len = strlen(topic->nick);
+    for (int s = 0; s < shard_count; s++) {
+        table->posts[s] = NULL;
+        if (s == shard->id || table->counts[s] == 0)
+            continue;
+
+        ShardMsg* msg = shard_post(shard, s, MSG_PRESENCE_FANOUT, table->counts[s] * sizeof(ConnRef) + nick_len);
+        msg->seq = table->counts[s];
+        msg->session_op = topic->event;
+        memcpy(msg->data + table->counts[s] * sizeof(ConnRef), topic->nick, nick_len);
+        table->posts[s] = msg;
+    }
+
+    for (uint32_t i = from; i < to; i++) {
+        ConnRef sub = topic->slots[i];
+        if (sub.fd < 0)
+            continue;
+
+        if (sub.node != cluster_self) {
+            ShardMsg* msg = shard_post(shard, conn_target(sub), MSG_PRESENCE_FANOUT, sizeof(ConnRef) + nick_len);
+            msg->seq = 1;
+            msg->session_op = topic->event;
+            memcpy(msg->data, &sub, sizeof(ConnRef));
+            memcpy(msg->data + sizeof(ConnRef), topic->nick, nick_len);
+            continue;
+        }
+
+        if (sub.shard == shard->id) {
+            Connection* conn = conn_lookup(shard, sub);
+            if (conn != NULL)
+                presence_notify(conn, topic->nick, topic->event);
+            continue;
+        }
+
+        ShardMsg* msg = table->posts[sub.shard];
+        ((ConnRef*)msg->data)[--table->counts[sub.shard]] = sub;
+    }
+}
+
+// Função que avança os envios pendentes, no máximo PRESENCE_FANOUT_BUDGET posições por
+// chamada. Retorna 1 se ainda há envios pendentes.
+int presence_fanout(Shard* shard) {
+    PresenceTable* table = &shard->presence;
+    uint32_t budget = PRESENCE_FANOUT_BUDGET;
+
+    int i = 0;
+    while (i < table->active_count && budget > 0) {
+        PresenceTopic* topic = table->active[i];
+        uint32_t to = topic->cap - topic->cursor > budget ? topic->cursor + budget : topic->cap;
+        fanout_range(shard, topic, topic->cursor, to);
+        budget -= to - topic->cursor;
+        topic->cursor = to;
+
+        if (topic->cursor < topic->cap) {
+            i++;
+            continue;
+        }
+
+        // Envio concluído: sai da fila (a ordem dos demais não importa)
+        table->active[i] = table->active[--table->active_count];
+        topic->active = 0;
+        topic_release(table, topic);
+    }
+
+    return table->active_count > 0;
+}
+
+// Função que entrega a mudança de estado às conexões do shard listadas pelo dono do usuário
+void presence_received(Shard* shard, int event, const char* nick, const ConnRef* subs, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        Connection* conn = conn_lookup(shard, subs[i]);
+        if (conn != NULL)
+            presence_notify(conn, nick, event);
+    }
+}
+
+// Função que acrescenta o usuário aos contatos da conexão. Retorna 0 em caso de
+// sucesso (inclusive se já era contato) ou -1 se a conexão atingiu MAX_CONTACTS.
+int presence_add_contact(Connection* conn, const char* nick) {
+    for (int i = 0; i < conn->contact_count; i++)
+        if (strcmp(conn->contacts[i], nick) == 0)
+            return 0;
+
+    if (conn->contact_count == MAX_CONTACTS)
+        return -1;
+    if (conn->contact_count == conn->contact_cap) {
+        conn->contact_cap = conn->contact_cap ? conn->contact_cap * 2 : 16;
+        conn->contacts = realloc(conn->contacts, conn->contact_cap * sizeof(*conn->contacts));
+    }
+    strcpy(conn->contacts[conn->contact_count++], nick);
+    return 0;
+}
+
+// Função que retira o usuário dos contatos da conexão
+void presence_remove_contact(Connection* conn, const char* nick) {
+    for (int i = 0; i < conn->contact_count; i++) {
+        if (strcmp(conn->contacts[i], nick) == 0) {
+            strcpy(conn->contacts[i], conn->contacts[--conn->contact_count]);
+            return;
+        }
+    }
+}
+
+// Função que envia à conexão o estado de um contato. Com a fila de saída acima de
+// PRESENCE_HIGH_WATER o aviso fica retido, substituindo o anterior do mesmo contato.
+void presence_notify(Connection* conn, const char* nick, int event) {
+    if (conn->held_count > 0 && conn->out_bytes < PRESENCE_LOW_WATER)
+        presence_release(conn);
+
+    if (conn->held_count == 0 && conn->out_bytes < PRESENCE_HIGH_WATER) {
+        char out[PROTO_HEADER_LEN + 2 * MAX_NICK_LEN + 64];
+        conn_send(conn, out, presence_encode(conn->mode, out, event, nick, ""));
+        return;
+    }
+
+    for (int i = 0; i < conn->held_count; i++) {
+        if (strcmp(conn->held[i].nick, nick) == 0) {
+            conn->held[i].event = event;
+            return;
+        }
+    }
+
+    if (conn->held_count == conn->held_cap) {
+        conn->held_cap = conn->held_cap ? conn->held_cap * 2 : 16;
+        conn->held = realloc(conn->held, conn->held_cap * sizeof(PresenceNote));
+    }
+    strcpy(conn->held[conn->held_count].nick, nick);
+    conn->held[conn->held_count].event = event;
+    conn->held_count++;
+}
+
+// Função que envia os avisos retidos na conexão, na ordem em que chegaram
+void presence_release(Connection* conn) {
+    char out[PROTO_HEADER_LEN + 2 * MAX_NICK_LEN + 64];
+    for (int i = 0; i < conn->held_count; i++)
+        conn_send(conn, out, presence_encode(conn->mode, out, conn->held[i].event, conn->held[i].nick, ""));
+    conn->held_count = 0;
+}
+
+// Função chamada quando a conexão é encerrada: cancela as inscrições nos shards donos
+// dos contatos e libera os avisos retidos
+void presence_disconnect(Shard* shard, Connection* conn) {
+    ConnRef ref = conn_ref(shard, conn);
+
+    for (int i = 0; i < conn->contact_count; i++) {
+        const char* nick = conn->contacts[i];
+        int target = owner_target(nick);
+        if (target == shard->id) {
+            presence_unsubscribe(shard, nick, ref);
+            continue;
+        }
+
+        size_t len = strlen(nick);
+        ShardMsg* msg = shard_post(shard, target, MSG_PRESENCE_UNSUBSCRIBE, len);
+        msg->conn = ref;
+        memcpy(msg->data, nick, len);
+    }
+
+    free(conn->contacts);
+    free(conn->held);
+    conn->contacts = NULL;
+    conn->held = NULL;
+    conn->contact_count = conn->held_count = 0;
+}
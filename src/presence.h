@@ -0,0 +1,72 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Assinaturas de presença (contatos). O shard dono de um usuário guarda as conexões
+// inscritas nele, de qualquer shard. Uma mudança de estado só marca o tópico; o envio
+// acontece no fim da iteração, com no máximo PRESENCE_FANOUT_BUDGET inscritos por
+// iteração (o restante fica para as próximas) e uma mensagem por shard destino.
+// Mudanças seguidas antes do envio terminar se juntam: cada inscrito recebe o estado
+// mais recente. Do lado do inscrito, uma conexão com a fila de saída cheia guarda só
+// o último estado de cada contato até a fila esvaziar.
+
+// Contatos por conexão
+#define MAX_CONTACTS 1024
+// Inscritos avisados por iteração do reactor
+#define PRESENCE_FANOUT_BUDGET 4096
+// Fila de saída a partir da qual os avisos ficam retidos na conexão
+#define PRESENCE_HIGH_WATER (256u << 10)
+// Fila de saída abaixo da qual os avisos retidos são enviados
+#define PRESENCE_LOW_WATER (64u << 10)
+
+typedef struct Shard Shard;
+typedef struct Connection Connection;
+
+// Usuário com inscritos. Os inscritos ficam num conjunto hash com endereçamento
+// aberto, percorrido por posição durante o envio.
+typedef struct PresenceTopic {
+    struct PresenceTopic* next; // Próximo tópico no mesmo balde
+    char nick[MAX_NICK_LEN];    // Usuário observado
+    ConnRef* slots;             // Inscritos (fd -1: vazio, fd -2: removido)
+    uint32_t cap;               // Posições em slots (potência de 2)
+    uint32_t live;              // Inscritos
+    uint32_t used;              // Posições ocupadas (inscritos e removidos)
+    int event;                  // Estado a enviar (PRESENCE_*)
+    uint32_t cursor;            // Próxima posição a avisar
+    int active;                 // Está na fila de envio
+} PresenceTopic;
+
+// Tópicos do shard
+typedef struct {
+    PresenceTopic** buckets;    // Tabela hash por apelido (encadeada)
+    uint32_t bucket_count;      // Potência de 2
+    uint32_t topic_count;
+    PresenceTopic** active;     // Tópicos com envio em andamento
+    int active_count;
+    int active_cap;
+    int* counts;                // Inscritos por shard no trecho sendo enviado
+    struct ShardMsg** posts;    // Mensagem de cada shard no trecho sendo enviado
+} PresenceTable;
+
+// Aviso retido numa conexão com a fila de saída cheia
+typedef struct {
+    char nick[MAX_NICK_LEN];
+    int event;                  // PRESENCE_*
+} PresenceNote;
+
+void presence_subscribe(Shard* shard, const char* nick, ConnRef sub);
+void presence_unsubscribe(Shard* shard, const char* nick, ConnRef sub);
+void presence_drop_node(Shard* shard, int node);
+void presence_publish(Shard* shard, const char* nick, int event);
+int presence_fanout(Shard* shard);
+void presence_received(Shard* shard, int event, const char* nick, const ConnRef* subs, uint32_t count);
+
+int presence_add_contact(Connection* conn, const char* nick);
+void presence_remove_contact(Connection* conn, const char* nick);
+void presence_notify(Connection* conn, const char* nick, int event);
+void presence_release(Connection* conn);
+void presence_disconnect(Shard* shard, Connection* conn);
+
+#endif
@@ -0,0 +1,68 @@
+#include <string.h>
+
+#include "protocol.h"
+
+// Função que escreve um inteiro big-endian de `bytes` bytes
+static void put_be(char* out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+// Função que lê um inteiro big-endian de `bytes` bytes
+static uint64_t get_be(const char* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value = (value << 8) | (uint8_t)in[i];
+    return value;
+}
+
+// Função que monta um frame binário em `out` (que deve ter espaço para
+// PROTO_HEADER_LEN + a_len + b_len bytes). Com `b` NULL só o cabeçalho e o campo A
+// são escritos, para quem já colocou B no lugar. Retorna o tamanho do frame.
+size_t proto_encode(char* out, uint8_t op, const char* a, size_t a_len,
+                    const char* b, size_t b_len, uint64_t arg) {
+    if (a_len > 255)
+        a_len = 255;
+
+    size_t total = PROTO_HEADER_LEN + a_len + b_len;
+    put_be(out, total - 4, 4);
+    out[4] = (char)op;
+    out[5] = (char)a_len;
+    put_be(out + 6, 0, 2);
+    put_be(out + 8, arg, 8);
+    if (a_len > 0)
+        memcpy(out + PROTO_HEADER_LEN, a, a_len);
+    if (b != NULL && b_len > 0)
+        memcpy(out + PROTO_HEADER_LEN + a_len, b, b_len);
+
+    return total;
+}
+
+// Função que interpreta o próximo frame do buffer sem copiar os campos.
+// Retorna o número de bytes do frame, 0 se ainda estiver incompleto ou -1 se for
+// inválido (maior que `max_len` ou com campos que não cabem no frame).
+long proto_parse(const char* buf, size_t len, size_t max_len, ProtoFrame* frame) {
+    if (len < 4)
+        return 0;
+
+    size_t total = get_be(buf, 4) + 4;
+    if (total < PROTO_HEADER_LEN || total > max_len)
+        return -1;
+    if (len < total)
+        return 0;
+
+    frame->op = (uint8_t)buf[4];
+    frame->a_len = (uint8_t)buf[5];
+    frame->flags = get_be(buf + 6, 2);
+    frame->arg = get_be(buf + 8, 8);
+    if (PROTO_HEADER_LEN + frame->a_len > total)
+        return -1;
+
+    frame->a = buf + PROTO_HEADER_LEN;
+    frame->b = frame->a + frame->a_len;
+    frame->b_len = total - PROTO_HEADER_LEN - frame->a_len;
+
+    return total;
+}
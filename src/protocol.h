@@ -0,0 +1,89 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Protocolo binário negociado com "PROTO {BINARY}". Cada frame tem um cabeçalho de
+// 16 bytes seguido de dois campos de tamanho variável (inteiros em big-endian):
+//
+//   0: u32 len      bytes do frame após este campo (12 + a_len + tamanho de B)
+//   4: u8  op       operação (OP_*)
+//   5: u8  a_len    tamanho do campo A (apelido, destinatário, remetente ou erro)
+//   6: u16 flags    PROTO_FLAG_* (0 nos demais casos)
+//   8: u64 arg      argumento numérico (timestamp no DELIVER)
+//  16: A            a_len bytes
+//  16 + a_len: B    restante do frame (nome, texto ou lista de usuários)
+//
+// "PROTO {BINARY, DEFLATE}" (ou TEXT) também comprime a saída do servidor: depois do
+// OK os frames chegam dentro de um fluxo deflate cru, com flush síncrono a cada envio.
+
+#define PROTO_HEADER_LEN 16
+// Tamanho máximo do texto de uma mensagem no modo binário
+#define MAX_TEXT_LEN 4000
+// Tamanho máximo de um frame binário recebido pelo servidor
+#define MAX_FRAME_LEN (PROTO_HEADER_LEN + 255 + MAX_TEXT_LEN)
+
+// Operações do cliente para o servidor
+#define OP_REGISTER 0x01        // A = apelido, B = nome
+#define OP_DELETE   0x02        // A = apelido
+#define OP_LOGIN    0x03        // A = apelido, arg = 1 para confirmar as entregas (OP_ACK),
+                                // B (opcional) = última sequência já recebida (u64)
+#define OP_LOGOUT   0x04        // A = apelido
+#define OP_LIST     0x05
+#define OP_SEND_MSG 0x06        // A = destinatário, B = texto, arg = sequência na conversa (0 = sem)
+#define OP_LIST_SUBSCRIBE   0x07    // Lista completa seguida das mudanças (OP_PRESENCE)
+#define OP_LIST_UNSUBSCRIBE 0x08
+#define OP_SUBSCRIBE        0x09    // A = contato; mudanças de estado chegam em OP_PRESENCE
+#define OP_UNSUBSCRIBE      0x0A    // A = contato
+#define OP_JOIN             0x0B    // A = grupo
+#define OP_LEAVE            0x0C    // A = grupo
+#define OP_STATS            0x0D    // Resposta OP_OK com os contadores (JSON) em B
+#define OP_ACK              0x0E    // arg = sequência: confirma as entregas até ela
+#define OP_HISTORY          0x0F    // A = contato, arg = início; B = fim (u64) e quantidade (u32)
+                                    // ou vazio para as últimas `arg` mensagens
+#define OP_SEARCH           0x10    // B = termos da busca
+
+// Operações do servidor para o cliente
+#define OP_OK       0x80        // A = apelido (LOGIN), estado do contato (SUBSCRIBE) ou vazio
+#define OP_ERROR    0x81        // A = código do erro (NICK_TAKEN, NO_SUCH_USER, ...)
+#define OP_DELIVER  0x82        // A = remetente ("#grupo/remetente" no grupo), B = texto, arg = timestamp
+#define OP_USERS    0x83        // B = lista de usuários em JSON, arg = total que casa com o filtro
+#define OP_PRESENCE 0x84        // A = apelido, arg = PRESENCE_*, B = nome (PRESENCE_REGISTERED)
+#define OP_HISTORY_PAGE 0x85    // B = mensagens em JSON, arg = próxima sequência (0 = fim da faixa)
+#define OP_SEARCH_RESULT 0x86   // B = mensagens encontradas em JSON, arg = quantidade
+
+// OP_DELIVER com PROTO_FLAG_SEQ (sessões com confirmação): B começa com a sequência
+// da entrega (u64), seguida do texto
+#define PROTO_FLAG_SEQ 0x0001
+
+// No OP_HISTORY com PROTO_FLAG_TS o início e o fim são timestamps, não sequências
+#define PROTO_FLAG_TS 0x0002
+
+// No OP_LIST: A = prefixo do apelido (vazio = todos), arg = início << 32 | quantidade
+// (quantidade 0 = todos a partir do início)
+
+// Mudanças na lista de usuários enviadas aos inscritos
+enum {
+    PRESENCE_OFFLINE,
+    PRESENCE_ONLINE,
+    PRESENCE_REGISTERED,
+    PRESENCE_DELETED
+};
+
+// Frame binário interpretado; A e B apontam para dentro do buffer recebido
+typedef struct {
+    uint8_t op;
+    uint16_t flags;
+    uint64_t arg;
+    const char* a;
+    size_t a_len;
+    const char* b;
+    size_t b_len;
+} ProtoFrame;
+
+size_t proto_encode(char* out, uint8_t op, const char* a, size_t a_len,
+                    const char* b, size_t b_len, uint64_t arg);
+long proto_parse(const char* buf, size_t len, size_t max_len, ProtoFrame* frame);
+
+#endif
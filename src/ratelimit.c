@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ratelimit.h"
+
+// Função que interpreta um limite no formato "taxa[:rajada]" (rajada padrão: o dobro
+// da taxa, pelo menos 1). Retorna -1 se o texto não é válido.
+int rate_limit_parse(const char* text, RateLimit* limit) {
+    char* end;
+    double rate = strtod(text, &end);
+    double burst = rate * 2 < 1 ? 1 : rate * 2;
+    if (end == text || rate < 0)
+        return -1;
+    if (*end == ':') {
+        const char* start = end + 1;
+        burst = strtod(start, &end);
+        if (end == start || burst < 1)
+            return -1;
+    }
+    if (*end != '\0')
+        return -1;
+
+    limit->rate = rate;
+    limit->burst = burst;
+    return 0;
+}
+
+// Função que prepara o balde cheio
+void bucket_init(TokenBucket* bucket, const RateLimit* limit, uint64_t now) {
+    bucket->tokens = limit->burst;
+    bucket->last = now;
+}
+
+// Função que repõe as fichas acumuladas desde a última reposição
+static void bucket_refill(TokenBucket* bucket, const RateLimit* limit, uint64_t now) {
+    if (now > bucket->last) {
+        bucket->tokens += (double)(now - bucket->last) * limit->rate / 1e9;
+        if (bucket->tokens > limit->burst)
+            bucket->tokens = limit->burst;
+    }
+    bucket->last = now;
+}
+
+// Função que gasta uma ficha do balde. Retorna -1 se o balde está vazio (sempre 0
+// sem limite).
+int bucket_take(TokenBucket* bucket, const RateLimit* limit, uint64_t now) {
+    if (limit->rate <= 0)
+        return 0;
+    bucket_refill(bucket, limit, now);
+    if (bucket->tokens < 1)
+        return -1;
+    bucket->tokens -= 1;
+    return 0;
+}
+
+// Função que retorna em quantos milissegundos o balde terá uma ficha (0 se já tem)
+int bucket_wait(TokenBucket* bucket, const RateLimit* limit, uint64_t now) {
+    if (limit->rate <= 0)
+        return 0;
+    bucket_refill(bucket, limit, now);
+    if (bucket->tokens >= 1)
+        return 0;
+    return (int)((1 - bucket->tokens) * 1000 / limit->rate) + 1;
+}
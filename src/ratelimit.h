@@ -0,0 +1,27 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// Limites de taxa com balde de fichas: o balde ganha `rate` fichas por segundo, até
+// `burst`, e cada comando limitado gasta uma. Uma rajada de até `burst` comandos
+// passa de uma vez; depois disso, a média fica em `rate` por segundo.
+
+// Taxa e rajada de um limite (rate 0 = sem limite)
+typedef struct {
+    double rate;                // Fichas por segundo
+    double burst;               // Capacidade do balde
+} RateLimit;
+
+// Balde de um limitado (conexão ou sessão); começa cheio
+typedef struct {
+    double tokens;              // Fichas disponíveis
+    uint64_t last;              // Instante da última reposição (ns, relógio monotônico)
+} TokenBucket;
+
+int rate_limit_parse(const char* text, RateLimit* limit);
+void bucket_init(TokenBucket* bucket, const RateLimit* limit, uint64_t now);
+int bucket_take(TokenBucket* bucket, const RateLimit* limit, uint64_t now);
+int bucket_wait(TokenBucket* bucket, const RateLimit* limit, uint64_t now);
+
+#endif
@@ -0,0 +1,1400 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "server.h"
+
+// Tamanho mínimo de um bloco da fila de saída
+#define OUT_BLOCK_SIZE 16384
+// Número máximo de blocos enviados por chamada a sendmsg
+#define IOV_BATCH 64
+// Entregas de grupo a partir deste tamanho entram na fila de saída por referência
+#define SHARED_REF_MIN 512
+// Compressão da saída (PROTO com DEFLATE): janela de 4 KiB e estado pequeno, para
+// caber em muitas conexões (cerca de 32 KiB por conexão)
+#define WIRE_DEFLATE_LEVEL 1
+#define WIRE_DEFLATE_BITS 12
+#define WIRE_DEFLATE_MEM 5
+// Capacidade inicial do lote de mensagens para outro shard
+#define BATCH_SIZE 4096
+// Limite de sockets acompanhados pela tabela de congestionamento
+#define MAX_CONGESTED_FDS (1 << 22)
+// Entradas da fila de submissão do io_uring de cada shard
+#define URING_ENTRIES 4096
+// Envios encadeados (IOSQE_IO_LINK) por conexão, cada um com até IOV_BATCH blocos
+#define SEND_LINKS 4
+
+// Operação do io_uring, nos bits baixos do user_data (o resto é o ponteiro da conexão)
+enum {
+    RING_ACCEPT = 1,            // accept multishot no socket de escuta
+    RING_WAKE,                  // poll multishot no eventfd da mailbox
+    RING_IGNORE,                // Cancelamentos: a conclusão não tem o que fazer
+    RING_RECV,                  // recv multishot da conexão
+    RING_SEND                   // sendmsg da fila de saída da conexão
+};
+#define RING_TAG_MASK 7
+
+// Mensagens dos envios em andamento de uma conexão: o kernel lê os iovecs até a
+// conclusão, então eles não podem ficar na pilha
+struct IoSend {
+    struct msghdr msg[SEND_LINKS];
+    struct iovec iov[SEND_LINKS][IOV_BATCH];
+};
+
+// Backend de E/S pedido na linha de comando
+int io_engine = IO_EPOLL;
+// Porta dos clientes (opção -p)
+int server_port = PORT;
+// Limite de comandos por segundo de cada conexão (opção -r)
+RateLimit conn_rate_limit = { DEFAULT_CONN_RATE, 2 * DEFAULT_CONN_RATE };
+
+// Função que cria o socket de escuta do shard; com SO_REUSEPORT cada shard tem o seu
+// e o kernel distribui as novas conexões entre eles
+static int create_listener() {
+    // Socket do servidor (não-bloqueante, o accept é guiado pelo epoll)
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_socket < 0) {
+        perror("Socket não criado\n");
+        return -1;
+    }
+
+    // Configurando opções do socket
+    int opt = 1;
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        close(server_socket);
+        return -1;
+    }
+
+    // Configurando endereço de servidor
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;   // Aceita conexões de qualquer interface
+    server_addr.sin_port = htons(server_port);  // Porta do servidor
+
+    // Associando socket ao endereço
+    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("bind");
+        close(server_socket);
+        return -1;
+    }
+
+    // Socket no modo de ESCUTA
+    if (listen(server_socket, BACKLOG) < 0) {
+        perror("listen");
+        close(server_socket);
+        return -1;
+    }
+
+    return server_socket;
+}
+
+// Função que inicializa o shard: epoll, socket de escuta e mailbox
+int shard_init(Shard* shard, int id) {
+    shard->id = id;
+    shard->ring.fd = -1;
+    mailbox_init(&shard->mailbox);
+    shard->outbox = calloc(shard_count + cluster_count, sizeof(ShardBatch*));
+
+    // Os identificadores começam num valor diferente a cada execução: referências
+    // guardadas por outros nós antes de um reinício não casam com conexões novas
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    shard->next_conn_id = ((uint32_t)now.tv_nsec ^ (uint32_t)now.tv_sec << 12 ^ (uint32_t)id << 24) | 1;
+
+    // Tabela de congestionamento com uma posição por socket possível: não cresce, pois
+    // é lida pelos outros shards (as páginas só são usadas quando tocadas)
+    struct rlimit rl;
+    shard->congested_cap = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < MAX_CONGESTED_FDS
+                         ? (int)rl.rlim_cur : MAX_CONGESTED_FDS;
+    shard->congested = calloc(shard->congested_cap, sizeof(atomic_uint));
+
+    shard->listen_fd = create_listener();
+    if (shard->listen_fd < 0)
+        return -1;
+
+    shard->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (shard->event_fd < 0 || shard->epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = shard->listen_fd;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = shard->event_fd;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->event_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Função que diz se o shard usa o io_uring (o anel é criado na thread do shard)
+static int shard_uring(const Shard* shard) {
+    return shard->ring.fd >= 0;
+}
+
+// Função que monta o user_data de uma operação da conexão no io_uring
+static uint64_t ring_tag(Connection* conn, int op) {
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+// Função que cancela a operação do io_uring identificada por `tag`
+static void ring_cancel(Shard* shard, uint64_t tag) {
+    struct io_uring_sqe* sqe = uring_sqe(&shard->ring);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag;
+    sqe->user_data = RING_IGNORE;
+}
+
+// Função que cancela todas as operações do io_uring sobre o socket `fd`, incluindo as
+// preparadas na fila de submissão e ainda não entregues (saem antes do cancelamento)
+static void ring_cancel_fd(Shard* shard, int fd) {
+    struct io_uring_sqe* sqe = uring_sqe(&shard->ring);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = RING_IGNORE;
+    uring_submit(&shard->ring);
+}
+
+// Função que busca uma conexão do shard, garantindo que não é outra conexão no mesmo fd
+Connection* conn_lookup(Shard* shard, ConnRef ref) {
+    if (ref.node != cluster_self || ref.shard != shard->id || ref.fd < 0 || ref.fd >= shard->connections_cap)
+        return NULL;
+
+    Connection* conn = shard->connections[ref.fd];
+    if (conn == NULL || conn->id != ref.id)
+        return NULL;
+
+    return conn;
+}
+
+// Função que monta a referência para uma conexão do shard
+ConnRef conn_ref(Shard* shard, Connection* conn) {
+    ConnRef ref = { shard->id, conn->fd, conn->id, cluster_self };
+    return ref;
+}
+
+// Função que diz se a conexão (de qualquer shard) está congestionada; pode ser chamada
+// de outra thread, que vê o estado com algum atraso. O estado das conexões de outros
+// nós não é visto daqui: elas nunca contam como congestionadas.
+int conn_congested(ConnRef ref) {
+    if (ref.node != cluster_self)
+        return 0;
+    Shard* shard = shards[ref.shard];
+    return ref.fd >= 0 && ref.fd < shard->congested_cap &&
+           atomic_load_explicit(&shard->congested[ref.fd], memory_order_relaxed) == ref.id;
+}
+
+// Função que marca ou desmarca a conexão como congestionada
+static void conn_set_congested(Shard* shard, Connection* conn, int congested) {
+    if (conn->congested == congested)
+        return;
+
+    conn->congested = congested;
+    if (conn->fd < shard->congested_cap)
+        atomic_store_explicit(&shard->congested[conn->fd], congested ? conn->id : 0, memory_order_relaxed);
+
+    if (congested) {
+        // As entregas seguintes podem ficar retidas: a retomada é pedida ao esvaziar
+        conn->spill_pending = 1;
+        atomic_fetch_add_explicit(&shard->flow.congested, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&shard->flow.congestion_events, 1, memory_order_relaxed);
+        LOG(LOG_INFO, "Conexão %d (%s) congestionada: %zu bytes na fila de saída",
+               conn->fd, conn->nick[0] ? conn->nick : "-", conn->out_bytes);
+    } else {
+        atomic_fetch_sub_explicit(&shard->flow.congested, 1, memory_order_relaxed);
+        LOG(LOG_INFO, "Conexão %d (%s) descongestionada", conn->fd, conn->nick[0] ? conn->nick : "-");
+    }
+}
+
+// Função que marca a conexão para ser enviada/fechada no fim da iteração do shard
+static void conn_mark_dirty(Connection* conn) {
+    if (conn->dirty)
+        return;
+
+    Shard* shard = conn->shard;
+    if (shard->dirty_count == shard->dirty_cap) {
+        shard->dirty_cap = shard->dirty_cap ? shard->dirty_cap * 2 : 256;
+        shard->dirty = realloc(shard->dirty, shard->dirty_cap * sizeof(int));
+    }
+    shard->dirty[shard->dirty_count++] = conn->fd;
+    conn->dirty = 1;
+}
+
+// Função que retorna o último bloco da fila de saída se ainda tem espaço; senão
+// acrescenta um bloco novo com pelo menos `want` bytes
+static OutBlock* out_tail_space(Connection* conn, size_t want) {
+    OutBlock* tail = conn->out_tail;
+    if (tail != NULL && tail->cap > tail->len)
+        return tail;
+
+    size_t cap = want > OUT_BLOCK_SIZE ? want : OUT_BLOCK_SIZE;
+    OutBlock* block = malloc(sizeof(OutBlock) + cap);
+    block->next = NULL;
+    block->off = block->len = 0;
+    block->cap = cap;
+    block->shared = NULL;
+    if (tail)
+        tail->next = block;
+    else
+        conn->out_head = block;
+    conn->out_tail = block;
+    return block;
+}
+
+// Função que comprime bytes direto no fim da fila de saída. Com Z_SYNC_FLUSH tudo o
+// que o compressor guardava sai, terminando num ponto onde o cliente consegue
+// descomprimir até o fim.
+static void conn_deflate(Connection* conn, const char* data, size_t len, int flush) {
+    z_stream* z = conn->zout;
+    z->next_in = (Bytef*)data;
+    z->avail_in = len;
+    do {
+        OutBlock* tail = out_tail_space(conn, OUT_BLOCK_SIZE);
+        size_t space = tail->cap - tail->len;
+        z->next_out = (Bytef*)tail->data + tail->len;
+        z->avail_out = space;
+        deflate(z, flush);
+
+        size_t part = space - z->avail_out;
+        tail->len += part;
+        conn->out_bytes += part;
+        conn->shard->out_bytes += part;
+    } while (z->avail_in > 0 || z->avail_out == 0);
+    conn->zpending = flush == Z_NO_FLUSH;
+}
+
+// Função que liga a compressão da saída da conexão (PROTO com DEFLATE): os bytes
+// seguintes formam um fluxo deflate cru. Retorna -1 sem memória.
+int conn_compress(Connection* conn) {
+    if (conn->zout != NULL)
+        return 0;
+
+    z_stream* z = calloc(1, sizeof(z_stream));
+    if (z == NULL)
+        return -1;
+    if (deflateInit2(z, WIRE_DEFLATE_LEVEL, Z_DEFLATED, -WIRE_DEFLATE_BITS, WIRE_DEFLATE_MEM,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(z);
+        return -1;
+    }
+    conn->zout = z;
+    return 0;
+}
+
+// Função que coloca bytes na fila de saída da conexão. Nada é enviado aqui: todas as
+// respostas e entregas de uma iteração saem juntas, numa única chamada a sendmsg.
+void conn_send(Connection* conn, const char* data, size_t len) {
+    if (conn->closing)
+        return;
+
+    if (conn->zout != NULL) {
+        conn_deflate(conn, data, len, Z_NO_FLUSH);
+    } else {
+        while (len > 0) {
+            OutBlock* tail = out_tail_space(conn, len);
+            size_t space = tail->cap - tail->len;
+            size_t part = len < space ? len : space;
+            memcpy(tail->data + tail->len, data, part);
+            tail->len += part;
+            conn->out_bytes += part;
+            conn->shard->out_bytes += part;
+            data += part;
+            len -= part;
+        }
+    }
+
+    if (conn->out_bytes >= CONN_HIGH_WATER)
+        conn_set_congested(conn->shard, conn, 1);
+    conn_mark_dirty(conn);
+}
+
+// Função que coloca na fila de saída uma entrega de grupo, no protocolo da conexão.
+// Entregas grandes entram por referência, sem cópia; as pequenas são copiadas para o
+// bloco atual, o que custa menos que alocar um bloco só para a referência.
+void conn_send_shared(Connection* conn, SharedMsg* msg) {
+    if (conn->closing)
+        return;
+
+    const char* bytes = msg->data + msg->record_len;
+    size_t len = msg->text_len;
+    if (conn->mode == MODE_BINARY) {
+        bytes += msg->text_len;
+        len = msg->binary_len;
+    }
+    // Com compressão os bytes passam pelo compressor da conexão
+    if (len < SHARED_REF_MIN || conn->zout != NULL) {
+        conn_send(conn, bytes, len);
+        return;
+    }
+
+    OutBlock* block = malloc(sizeof(OutBlock));
+    block->next = NULL;
+    block->off = 0;
+    block->len = block->cap = len;
+    block->shared = msg;
+    block->ref = bytes;
+    atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+
+    if (conn->out_tail)
+        conn->out_tail->next = block;
+    else
+        conn->out_head = block;
+    conn->out_tail = block;
+    conn->out_bytes += len;
+    conn->shard->out_bytes += len;
+
+    if (conn->out_bytes >= CONN_HIGH_WATER)
+        conn_set_congested(conn->shard, conn, 1);
+    conn_mark_dirty(conn);
+}
+
+// Função chamada quando o shard dono do usuário ainda tem entregas retidas para a
+// conexão: a retomada é pedida de novo assim que a fila de saída estiver abaixo do limite
+void conn_spill_pending(Connection* conn) {
+    conn->spill_pending = 1;
+    conn_mark_dirty(conn);
+}
+
+// Função que libera um bloco da fila de saída (e a referência à entrega de grupo)
+static void block_free(OutBlock* block) {
+    if (block->shared != NULL)
+        shared_msg_release(block->shared);
+    free(block);
+}
+
+// Função que retira da fila de saída os `sent` bytes já enviados
+static void out_consume(Connection* conn, size_t sent) {
+    conn->out_bytes -= sent;
+    conn->shard->out_bytes -= sent;
+
+    // Liberando os blocos enviados; o último é mantido para reuso (se não for referência)
+    while (conn->out_head != NULL) {
+        OutBlock* block = conn->out_head;
+        size_t avail = block->len - block->off;
+        if (sent < avail) {
+            block->off += sent;
+            break;
+        }
+        sent -= avail;
+        if (block == conn->out_tail && block->shared == NULL) {
+            block->off = block->len = 0;
+            break;
+        }
+        conn->out_head = block->next;
+        if (block == conn->out_tail)
+            conn->out_tail = NULL;
+        block_free(block);
+    }
+}
+
+// Função que submete ao io_uring o envio da fila de saída: até SEND_LINKS sendmsg
+// encadeados, cada um com até IOV_BATCH blocos. Com MSG_WAITALL cada envio só termina
+// com todos os seus bytes no socket (ou com erro, que cancela os seguintes). Enquanto
+// há envio em andamento os bytes novos esperam; a conclusão marca a conexão de novo.
+static void uring_flush(Connection* conn) {
+    if (conn->send_inflight > 0 || conn->out_bytes == 0 || (conn->closing && conn->send_final))
+        return;
+
+    if (conn->io_send == NULL)
+        conn->io_send = malloc(sizeof(struct IoSend));
+    struct IoSend* op = conn->io_send;
+
+    int links = 0;
+    OutBlock* block = conn->out_head;
+    while (block != NULL && links < SEND_LINKS) {
+        int count = 0;
+        for (; block != NULL && count < IOV_BATCH; block = block->next) {
+            if (block->len == block->off)
+                continue;
+            op->iov[links][count].iov_base = (char*)(block->shared ? block->ref : block->data) + block->off;
+            op->iov[links][count].iov_len = block->len - block->off;
+            count++;
+        }
+        if (count == 0)
+            break;
+        memset(&op->msg[links], 0, sizeof(struct msghdr));
+        op->msg[links].msg_iov = op->iov[links];
+        op->msg[links].msg_iovlen = count;
+        links++;
+    }
+
+    // A cadeia precisa entrar inteira na fila de submissão
+    Uring* ring = &conn->shard->ring;
+    if (uring_reserve(ring, links) < 0) {
+        conn->closing = 1;
+        return;
+    }
+    for (int i = 0; i < links; i++) {
+        struct io_uring_sqe* sqe = uring_sqe(ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&op->msg[i];
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = i + 1 < links ? IOSQE_IO_LINK : 0;
+        sqe->user_data = ring_tag(conn, RING_SEND);
+    }
+    conn->send_inflight = links;
+    conn->io_refs += links;
+    conn->send_final = conn->closing;
+}
+
+// Função que envia a fila de saída da conexão com sendmsg (vários blocos por chamada)
+static void conn_flush(Connection* conn) {
+    if (conn->zpending)
+        conn_deflate(conn, NULL, 0, Z_SYNC_FLUSH);
+
+    if (shard_uring(conn->shard)) {
+        uring_flush(conn);
+        return;
+    }
+
+    while (conn->out_bytes > 0) {
+        struct iovec iov[IOV_BATCH];
+        int count = 0;
+        for (OutBlock* block = conn->out_head; block != NULL && count < IOV_BATCH; block = block->next) {
+            if (block->len == block->off)
+                continue;
+            iov[count].iov_base = (char*)(block->shared ? block->ref : block->data) + block->off;
+            iov[count].iov_len = block->len - block->off;
+            count++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                conn->closing = 1;
+            return;
+        }
+        out_consume(conn, sent);
+    }
+}
+
+// Função que reserva a posição da próxima resposta da conexão
+uint32_t conn_reserve_reply(Connection* conn) {
+    return conn->next_seq++;
+}
+
+// Função que entrega uma resposta; respostas que chegam antes das anteriores
+// (vindas de outros shards) esperam a vez para manter a ordem dos comandos
+void conn_complete_reply(Connection* conn, uint32_t seq, const char* data, size_t len) {
+    if (seq != conn->flush_seq) {
+        if (conn->pending == NULL)
+            conn->pending = calloc(MAX_PENDING, sizeof(PendingReply));
+
+        PendingReply* slot = &conn->pending[seq % MAX_PENDING];
+        slot->data = malloc(len);
+        memcpy(slot->data, data, len);
+        slot->len = len;
+        slot->done = 1;
+        return;
+    }
+
+    conn_send(conn, data, len);
+    conn->flush_seq++;
+
+    // Escrevendo as respostas seguintes que já estavam prontas
+    while (conn->pending != NULL && conn->flush_seq != conn->next_seq) {
+        PendingReply* slot = &conn->pending[conn->flush_seq % MAX_PENDING];
+        if (!slot->done)
+            break;
+
+        conn_send(conn, slot->data, slot->len);
+        free(slot->data);
+        slot->data = NULL;
+        slot->done = 0;
+        conn->flush_seq++;
+    }
+}
+
+// Função que retorna o tamanho do próximo comando completo no buffer.
+// Um comando termina em '\n' ou no '}' que fecha seus argumentos; `consumed` recebe
+// quantos bytes devem ser descartados do buffer, incluindo o terminador (0 se incompleto).
+static size_t next_frame(const char* buf, size_t len, size_t* consumed) {
+    *consumed = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\n') {
+            *consumed = i + 1;
+            // Ignora '\r' de clientes que enviam CRLF
+            return (i > 0 && buf[i - 1] == '\r') ? i - 1 : i;
+        }
+        if (buf[i] == '}') {
+            // Consome também a quebra de linha que vem logo depois, se já chegou
+            *consumed = i + 1;
+            if (*consumed < len && buf[*consumed] == '\r')
+                (*consumed)++;
+            if (*consumed < len && buf[*consumed] == '\n')
+                (*consumed)++;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Função que suspende a leitura da conexão até a fila de saída esvaziar
+static void conn_pause_read(Shard* shard, Connection* conn) {
+    if (conn->read_paused)
+        return;
+    conn->read_paused = 1;
+    atomic_fetch_add_explicit(&shard->flow.read_pauses, 1, memory_order_relaxed);
+
+    // No io_uring o recv multishot continuaria recebendo: ele é cancelado e rearmado na retomada
+    if (shard_uring(shard) && conn->recv_armed)
+        ring_cancel(shard, ring_tag(conn, RING_RECV));
+}
+
+// Função que coloca a conexão no fim da fila de conexões prontas: os comandos que
+// sobraram esperam a próxima vez dela
+static void conn_defer(Shard* shard, Connection* conn) {
+    if (conn->ready)
+        return;
+
+    if (shard->ready_count == shard->ready_cap) {
+        shard->ready_cap = shard->ready_cap ? shard->ready_cap * 2 : 256;
+        shard->ready = realloc(shard->ready, shard->ready_cap * sizeof(ConnRef));
+    }
+    shard->ready[shard->ready_count++] = conn_ref(shard, conn);
+    conn->ready = 1;
+}
+
+// Função que verifica se o comando de `cost` bytes cabe na vez da conexão e no limite
+// de comandos dela; senão a conexão volta para a fila de prontas
+static int conn_turn(Shard* shard, Connection* conn, size_t cost, uint64_t now) {
+    if (cost > conn->deficit) {
+        atomic_fetch_add_explicit(&shard->flow.deferred, 1, memory_order_relaxed);
+        conn_defer(shard, conn);
+        return 0;
+    }
+    if (bucket_take(&conn->bucket, &conn_rate_limit, now) < 0) {
+        atomic_fetch_add_explicit(&shard->flow.throttled, 1, memory_order_relaxed);
+        conn_defer(shard, conn);
+        return 0;
+    }
+    conn->deficit -= cost;
+    return 1;
+}
+
+// Função que despacha os comandos completos presentes no buffer de leitura, enquanto
+// couberem na vez da conexão. Para também quando a conexão espera uma resposta que
+// altera a sessão, quando há respostas demais pendentes em outros shards ou quando a
+// fila de saída passou do limite (o cliente não está lendo as respostas); retoma
+// quando isso se resolve.
+static void process_frames(Shard* shard, Connection* conn) {
+    size_t offset = 0;
+    uint64_t now = stats_now();
+
+    while (offset < conn->rlen && !conn->closing && !conn->blocked &&
+           conn->next_seq - conn->flush_seq < MAX_PENDING) {
+        if (conn->out_bytes >= CONN_HIGH_WATER) {
+            conn_pause_read(shard, conn);
+            break;
+        }
+        if (conn->mode == MODE_BINARY) {
+            // Quebra de linha que sobrou do PROTO {BINARY} (nenhum frame válido começa assim)
+            if (conn->rbuf[offset] == '\n' || conn->rbuf[offset] == '\r') {
+                offset++;
+                continue;
+            }
+
+            // Frame binário: os campos são lidos direto do buffer de leitura
+            ProtoFrame frame;
+            long frame_len = proto_parse(conn->rbuf + offset, conn->rlen - offset, MAX_FRAME_LEN, &frame);
+            if (frame_len == 0)
+                break;
+            if (frame_len < 0) {
+                char error[PROTO_HEADER_LEN + 16];
+                size_t n = proto_encode(error, OP_ERROR, "BAD_FORMAT", 10, NULL, 0, 0);
+                conn_send(conn, error, n);
+                conn->closing = 1;
+                break;
+            }
+
+            if (!conn_turn(shard, conn, frame_len, now))
+                break;
+            dispatch_binary(shard, conn, &frame);
+            offset += frame_len;
+            continue;
+        }
+
+        char buffer[MAX_MSG_LEN];
+        size_t consumed;
+        size_t frame_len = next_frame(conn->rbuf + offset, conn->rlen - offset, &consumed);
+
+        if (consumed == 0) {
+            size_t remaining = conn->rlen - offset;
+
+            // Clientes antigos enviam "LIST" sem terminador
+            if (remaining == 4 && memcmp(conn->rbuf + offset, "LIST", 4) == 0) {
+                frame_len = consumed = 4;
+            } else {
+                if (remaining >= MAX_MSG_LEN) {
+                    conn_send(conn, "ERROR{BAD_FORMAT}\n", 18);
+                    conn->closing = 1;
+                }
+                break;
+            }
+        }
+
+        if (!conn_turn(shard, conn, consumed, now))
+            break;
+        if (frame_len >= MAX_MSG_LEN) {
+            uint32_t seq = conn_reserve_reply(conn);
+            conn_complete_reply(conn, seq, "ERROR{BAD_FORMAT}\n", 18);
+        } else if (frame_len > 0) {
+            memcpy(buffer, conn->rbuf + offset, frame_len);
+            buffer[frame_len] = '\0';
+            dispatch_frame(shard, conn, buffer);
+        }
+        offset += consumed;
+    }
+
+    // Descartando os bytes já processados
+    if (offset > 0) {
+        memmove(conn->rbuf, conn->rbuf + offset, conn->rlen - offset);
+        conn->rlen -= offset;
+    }
+}
+
+// Função que despacha os comandos recebidos pela conexão. Uma conexão que já está na
+// fila de prontas espera a vez dela; as outras começam uma vez nova.
+void conn_process_frames(Shard* shard, Connection* conn) {
+    if (conn->ready)
+        return;
+    conn->deficit = DRR_QUANTUM;
+    process_frames(shard, conn);
+}
+
+// Função que dá a vez às conexões da fila de prontas (deficit round robin): cada uma
+// ganha DRR_QUANTUM bytes e processa os comandos que couberem, e a que ainda tiver
+// comandos volta para o fim da fila. Uma conexão que inunda o servidor de comandos
+// processa no máximo uma vez por iteração, e as outras não esperam por ela. As que
+// aguardam fichas do limite de comandos continuam na fila sem ganhar a vez.
+static void serve_ready(Shard* shard) {
+    int count = shard->ready_count;
+    if (count == 0)
+        return;
+
+    uint64_t now = stats_now();
+    for (int i = 0; i < count; i++) {
+        Connection* conn = conn_lookup(shard, shard->ready[i]);
+        if (conn == NULL || !conn->ready)
+            continue;
+
+        conn->ready = 0;
+        if (bucket_wait(&conn->bucket, &conn_rate_limit, now) > 0) {
+            conn_defer(shard, conn);
+            continue;
+        }
+        conn->deficit += DRR_QUANTUM;
+        process_frames(shard, conn);
+    }
+
+    // As conexões que voltaram para a fila ficam no lugar das atendidas
+    memmove(shard->ready, shard->ready + count, (shard->ready_count - count) * sizeof(ConnRef));
+    shard->ready_count -= count;
+}
+
+// Função que retorna quanto o laço pode esperar por eventos (ms, -1 = sem limite):
+// nada com avisos de presença pendentes ou conexões prontas para a vez; até a próxima
+// ficha se as prontas só aguardam o limite de comandos; senão até o próximo fsync do log
+static int shard_timeout(Shard* shard) {
+    if (shard->presence.active_count > 0)
+        return 0;
+
+    int timeout = wal_timeout(&shard->wal);
+    uint64_t now = shard->ready_count > 0 ? stats_now() : 0;
+    for (int i = 0; i < shard->ready_count && timeout != 0; i++) {
+        Connection* conn = conn_lookup(shard, shard->ready[i]);
+        if (conn == NULL || !conn->ready)
+            continue;
+        int wait = bucket_wait(&conn->bucket, &conn_rate_limit, now);
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+    return timeout;
+}
+
+// Função que registra uma nova conexão na tabela do shard e no epoll
+static Connection* conn_open(Shard* shard, int fd) {
+    // Expandindo a tabela de conexões indexada pelo socket
+    if (fd >= shard->connections_cap) {
+        int new_cap = shard->connections_cap ? shard->connections_cap : 1024;
+        while (new_cap <= fd)
+            new_cap *= 2;
+        shard->connections = realloc(shard->connections, new_cap * sizeof(Connection*));
+        memset(shard->connections + shard->connections_cap, 0,
+               (new_cap - shard->connections_cap) * sizeof(Connection*));
+        shard->connections_cap = new_cap;
+    }
+
+    Connection* conn = calloc(1, sizeof(Connection));
+    conn->fd = fd;
+    conn->id = shard->next_conn_id++;
+    conn->shard = shard;
+    conn->close_fd = -1;
+    uint64_t now = stats_now();
+    bucket_init(&conn->bucket, &conn_rate_limit, now);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (!shard_uring(shard) && epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        LOG(LOG_ERROR, "epoll_ctl: %s", strerror(errno));
+        free(conn);
+        close(fd);
+        return NULL;
+    }
+
+    shard->connections[fd] = conn;
+    shard->connection_count++;
+    return conn;
+}
+
+// Função que libera a memória da conexão (no io_uring, só depois da última conclusão,
+// quando o socket também é fechado)
+static void conn_free(Connection* conn) {
+    if (conn->close_fd >= 0)
+        close(conn->close_fd);
+    while (conn->out_head != NULL) {
+        OutBlock* next = conn->out_head->next;
+        block_free(conn->out_head);
+        conn->out_head = next;
+    }
+    if (conn->zout != NULL) {
+        deflateEnd(conn->zout);
+        free(conn->zout);
+    }
+    free(conn->io_send);
+    free(conn->rbuf);
+    free(conn);
+}
+
+// Função que encerra a conexão e avisa o shard dono do usuário logado nela
+static void conn_close(Shard* shard, Connection* conn) {
+    int client_socket = conn->fd;
+
+    handle_disconnect(shard, conn);
+
+    if (!shard_uring(shard))
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, client_socket, NULL);
+    shard->connections[client_socket] = NULL;
+    shard->connection_count--;
+    shard->out_bytes -= conn->out_bytes;
+    conn_set_congested(shard, conn, 0);
+    if (conn->pending != NULL) {
+        for (int i = 0; i < MAX_PENDING; i++)
+            free(conn->pending[i].data);
+        free(conn->pending);
+        conn->pending = NULL;
+    }
+
+    // Fechando o socket do cliente. No io_uring as operações em andamento usam o número
+    // do socket: elas são canceladas e o close espera a última conclusão (conn_free),
+    // para o número não ser reaproveitado por outra conexão antes disso. Até lá a
+    // conexão fica fora da tabela.
+    conn->fd = -1;
+    if (conn->io_refs > 0) {
+        conn->close_fd = client_socket;
+        ring_cancel_fd(shard, client_socket);
+        return;
+    }
+    close(client_socket);
+    conn_free(conn);
+}
+
+// Função que arma o recv multishot da conexão: o kernel escolhe um buffer do anel de
+// buffers fornecidos a cada pacote e gera uma conclusão por pacote
+static void uring_arm_recv(Shard* shard, Connection* conn) {
+    if (conn->recv_armed || conn->read_paused || conn->closing)
+        return;
+
+    struct io_uring_sqe* sqe = uring_sqe(&shard->ring);
+    if (sqe == NULL) {
+        conn->closing = 1;
+        conn_mark_dirty(conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = ring_tag(conn, RING_RECV);
+    conn->recv_armed = 1;
+    conn->io_refs++;
+}
+
+// Função que despacha os comandos recebidos pelo io_uring e mantém a leitura armada,
+// a menos que ela precise ser suspensa
+static void uring_client(Shard* shard, Connection* conn) {
+    conn_process_frames(shard, conn);
+    if (conn->rlen >= READ_LIMIT || conn->out_bytes >= CONN_HIGH_WATER)
+        conn_pause_read(shard, conn);
+    else
+        uring_arm_recv(shard, conn);
+}
+
+// Função que trata uma conclusão do recv multishot: copia os bytes para o buffer de
+// leitura da conexão e devolve o buffer fornecido ao kernel na hora
+static void uring_recv_done(Shard* shard, Connection* conn, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = 0;
+        conn->io_refs--;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && conn->fd >= 0) {
+            if (conn->rcap - conn->rlen < (size_t)res) {
+                size_t cap = conn->rcap ? conn->rcap : READ_CHUNK * 2;
+                while (cap - conn->rlen < (size_t)res)
+                    cap *= 2;
+                conn->rbuf = realloc(conn->rbuf, cap);
+                conn->rcap = cap;
+            }
+            memcpy(conn->rbuf + conn->rlen, uring_buf(&shard->ring, id), res);
+            conn->rlen += res;
+        }
+        uring_buf_recycle(&shard->ring, id);
+    }
+
+    // Conexão já fechada: só esperava esta conclusão
+    if (conn->fd < 0) {
+        if (conn->io_refs == 0)
+            conn_free(conn);
+        return;
+    }
+
+    // Cliente desconectou (ou erro no socket); sem buffers livres o recv é rearmado
+    if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+        conn_process_frames(shard, conn);
+        conn->closing = 1;
+        conn_mark_dirty(conn);
+        return;
+    }
+    uring_client(shard, conn);
+}
+
+// Função que trata a conclusão de um envio: retira os bytes enviados e marca a
+// conexão para o próximo envio (e para a reavaliação do controle de fluxo)
+static void uring_send_done(Connection* conn, int res) {
+    conn->send_inflight--;
+    conn->io_refs--;
+    if (conn->fd < 0) {
+        if (conn->io_refs == 0)
+            conn_free(conn);
+        return;
+    }
+
+    // -ECANCELED: um envio anterior da cadeia falhou; o restante é submetido de novo
+    if (res > 0)
+        out_consume(conn, res);
+    else if (res < 0 && res != -ECANCELED)
+        conn->closing = 1;
+    if (conn->send_inflight == 0)
+        conn_mark_dirty(conn);
+}
+
+// Função que gerencia a comunicação com o cliente: lê tudo o que estiver
+// disponível no socket e despacha cada comando completo
+static void handle_client(Shard* shard, Connection* conn) {
+    int eof = 0;
+
+    // No io_uring os bytes já chegaram pelas conclusões do recv
+    if (shard_uring(shard)) {
+        uring_client(shard, conn);
+        return;
+    }
+
+    // Com EPOLLET é preciso ler até o socket ficar vazio, a menos que a leitura seja
+    // suspensa: os bytes ficam no kernel e a janela TCP segura o cliente
+    while (1) {
+        if (conn->rlen >= READ_LIMIT || conn->out_bytes >= CONN_HIGH_WATER) {
+            conn_pause_read(shard, conn);
+            break;
+        }
+        if (conn->rcap - conn->rlen < READ_CHUNK) {
+            conn->rcap = conn->rcap ? conn->rcap * 2 : READ_CHUNK * 2;
+            conn->rbuf = realloc(conn->rbuf, conn->rcap);
+        }
+
+        ssize_t bytes_received = recv(conn->fd, conn->rbuf + conn->rlen, conn->rcap - conn->rlen, 0);
+        if (bytes_received > 0) {
+            conn->rlen += bytes_received;
+            continue;
+        }
+        if (bytes_received < 0 && errno == EINTR)
+            continue;
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        // Cliente desconectou (ou erro no socket)
+        eof = 1;
+        break;
+    }
+
+    conn_process_frames(shard, conn);
+
+    if (eof) {
+        conn->closing = 1;
+        conn_mark_dirty(conn);
+    }
+}
+
+// Função que aceita todas as conexões pendentes no socket de escuta do shard
+static void accept_clients(Shard* shard) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len;
+
+    while (1) {
+        client_len = sizeof(client_addr);
+
+        // Nova conexão aceita (já em modo não-bloqueante)
+        int client_socket = accept4(shard->listen_fd, (struct sockaddr*)&client_addr, &client_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR)
+                continue;
+            // Sem descritores (EMFILE) o accept falha a cada evento: só uma amostra vai ao log
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_SAMPLED(LOG_ERROR, 1000, "accept: %s", strerror(errno));
+            return;
+        }
+
+        if (conn_open(shard, client_socket) == NULL)
+            continue;
+
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, addr, sizeof(addr));
+        LOG(LOG_INFO, "Novo cliente conectado - %s:%d", addr, ntohs(client_addr.sin_port));
+    }
+}
+
+// Função que reserva uma mensagem de `len` bytes no fim do lote `*slot` (criado ou
+// aumentado se preciso) e a devolve para ser preenchida
+ShardMsg* batch_post(ShardBatch** slot, int type, size_t len) {
+    size_t size = shard_msg_size(len);
+    ShardBatch* batch = *slot;
+
+    if (batch == NULL || batch->len + size > batch->cap) {
+        size_t cap = batch ? batch->cap * 2 : BATCH_SIZE;
+        while ((batch ? batch->len : 0) + size > cap)
+            cap *= 2;
+        batch = realloc(batch, sizeof(ShardBatch) + cap);
+        if (*slot == NULL)
+            batch->len = 0;
+        batch->cap = cap;
+        *slot = batch;
+    }
+
+    ShardMsg* msg = (ShardMsg*)(batch->data + batch->len);
+    memset(msg, 0, size);
+    msg->type = type;
+    msg->len = len;
+    batch->len += size;
+
+    return msg;
+}
+
+// Função que reserva uma mensagem de `len` bytes para o destino e a devolve para ser
+// preenchida: um shard (0 a shard_count - 1) ou outro nó do cluster (shard_count + nó).
+// Ela vai no lote do destino, enviado no fim da iteração (uma inserção na mailbox e
+// um eventfd por destino); o ponteiro só é válido até a próxima reserva para o mesmo
+// destino.
+ShardMsg* shard_post(Shard* from, int target, int type, size_t len) {
+    return batch_post(&from->outbox[target], type, len);
+}
+
+// Função que insere o lote na mailbox do shard e o acorda (qualquer thread)
+void batch_deliver(Shard* target, ShardBatch* batch) {
+    mailbox_push(&target->mailbox, &batch->node);
+
+    uint64_t one = 1;
+    if (write(target->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        LOG(LOG_ERROR, "eventfd: %s", strerror(errno));
+}
+
+// Função que entrega um lote ao destino: a mailbox de um shard ou a thread do cluster
+static void outbox_send(int target, ShardBatch* batch) {
+    if (target < shard_count) {
+        batch_deliver(shards[target], batch);
+    } else {
+        batch->peer = target - shard_count;
+        cluster_submit(batch);
+    }
+}
+
+// Função que envia os lotes montados nesta iteração e acorda os shards destino; os
+// lotes para outros nós vão para a thread do cluster. Com SYNC_ALWAYS, se o log tem
+// gravações sem fsync, os lotes esperam por ele atrás dos já retidos (mesma ordem).
+static void flush_outbox(Shard* shard) {
+    uint64_t barrier = wal_barrier(&shard->wal);
+    if (barrier == 0 && shard->sync_batch_count > 0)
+        barrier = shard->sync_batches[shard->sync_batch_count - 1].ticket;
+
+    for (int i = 0; i < shard_count + cluster_count; i++) {
+        ShardBatch* batch = shard->outbox[i];
+        if (batch == NULL)
+            continue;
+
+        shard->outbox[i] = NULL;
+        if (barrier == 0) {
+            outbox_send(i, batch);
+            continue;
+        }
+
+        if (shard->sync_batch_count == shard->sync_batch_cap) {
+            shard->sync_batch_cap = shard->sync_batch_cap ? shard->sync_batch_cap * 2 : 64;
+            shard->sync_batches = realloc(shard->sync_batches, shard->sync_batch_cap * sizeof(HeldBatch));
+        }
+        shard->sync_batches[shard->sync_batch_count++] = (HeldBatch){ batch, i, barrier };
+    }
+}
+
+// Função que guarda a conexão até o fsync do log de que a saída dela depende
+static void conn_hold_sync(Shard* shard, Connection* conn) {
+    if (conn->sync_held)
+        return;
+
+    if (shard->sync_conn_count == shard->sync_conn_cap) {
+        shard->sync_conn_cap = shard->sync_conn_cap ? shard->sync_conn_cap * 2 : 256;
+        shard->sync_conns = realloc(shard->sync_conns, shard->sync_conn_cap * sizeof(ConnRef));
+    }
+    shard->sync_conns[shard->sync_conn_count++] = conn_ref(shard, conn);
+    conn->sync_held = 1;
+}
+
+// Função que libera a saída cujo fsync do log já terminou (a thread de fsync acorda o
+// shard pelo eventfd): as conexões voltam à lista de envio e os lotes retidos seguem
+// para os destinos, na ordem
+static void release_synced(Shard* shard) {
+    if (shard->sync_conn_count == 0 && shard->sync_batch_count == 0)
+        return;
+
+    uint64_t synced = wal_synced(&shard->wal);
+    int kept = 0;
+    for (int i = 0; i < shard->sync_conn_count; i++) {
+        Connection* conn = conn_lookup(shard, shard->sync_conns[i]);
+        if (conn == NULL)
+            continue;
+        if (conn->sync_wait > synced) {
+            shard->sync_conns[kept++] = shard->sync_conns[i];
+            continue;
+        }
+        conn->sync_held = 0;
+        conn_mark_dirty(conn);
+    }
+    shard->sync_conn_count = kept;
+
+    int released = 0;
+    while (released < shard->sync_batch_count && shard->sync_batches[released].ticket <= synced) {
+        outbox_send(shard->sync_batches[released].target, shard->sync_batches[released].batch);
+        released++;
+    }
+    shard->sync_batch_count -= released;
+    memmove(shard->sync_batches, shard->sync_batches + released, shard->sync_batch_count * sizeof(HeldBatch));
+}
+
+// Função que processa todas as mensagens vindas de outros shards
+static void drain_mailbox(Shard* shard) {
+    uint64_t count;
+    if (read(shard->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG(LOG_ERROR, "eventfd: %s", strerror(errno));
+
+    MailboxNode* node;
+    uint64_t received = 0;
+    while ((node = mailbox_pop(&shard->mailbox)) != NULL) {
+        ShardBatch* batch = (ShardBatch*)node;
+        size_t offset = 0;
+        while (offset < batch->len) {
+            ShardMsg* msg = (ShardMsg*)(batch->data + offset);
+            handle_shard_msg(shard, msg);
+            received++;
+            offset += shard_msg_size(msg->len);
+        }
+        free(batch);
+    }
+
+    if (received > 0)
+        atomic_fetch_add_explicit(&shard->stats.mailbox_messages, received, memory_order_relaxed);
+}
+
+// Função que envia o que as conexões acumularam nesta iteração e fecha as encerradas.
+// Com SYNC_ALWAYS, a saída produzida enquanto o log tem gravações sem fsync espera
+// por ele (release_synced); as demais conexões saem na hora.
+static void flush_connections(Shard* shard) {
+    uint64_t barrier = wal_barrier(&shard->wal);
+    uint64_t synced = wal_synced(&shard->wal);
+
+    for (int i = 0; i < shard->dirty_count; i++) {
+        int fd = shard->dirty[i];
+        Connection* conn = fd < shard->connections_cap ? shard->connections[fd] : NULL;
+        if (conn == NULL || !conn->dirty)
+            continue;
+
+        conn->dirty = 0;
+        if (barrier > conn->sync_wait)
+            conn->sync_wait = barrier;
+        if (conn->sync_wait > synced) {
+            conn_hold_sync(shard, conn);
+            continue;
+        }
+        conn_flush(conn);
+
+        // Fila esvaziada: os avisos de presença retidos saem ainda neste laço
+        if (conn->held_count > 0 && conn->out_bytes < PRESENCE_LOW_WATER && !conn->closing)
+            presence_release(conn);
+
+        // Abaixo do limite inferior: as entregas retidas são pedidas ao shard dono do
+        // usuário e a leitura dos comandos continua de onde parou
+        if (conn->out_bytes < CONN_LOW_WATER && !conn->closing) {
+            conn_set_congested(shard, conn, 0);
+            if (conn->spill_pending) {
+                conn->spill_pending = 0;
+                request_resume(shard, conn);
+            }
+            if (conn->read_paused) {
+                conn->read_paused = 0;
+                handle_client(shard, conn);
+            }
+        }
+        // Se a leitura retomada produziu respostas, o fechamento espera elas saírem
+        // (no io_uring, também o envio em andamento)
+        if (conn->closing && !conn->dirty && conn->send_inflight == 0)
+            conn_close(shard, conn);
+    }
+    shard->dirty_count = 0;
+}
+
+// Função que faz o trabalho do fim de cada iteração do shard, depois dos eventos dos sockets
+static void shard_iteration(Shard* shard, uint64_t work_start) {
+    // A vez das conexões com comandos acumulados
+    serve_ready(shard);
+
+    // Mensagens de outros shards (respostas, entregas, comandos)
+    drain_mailbox(shard);
+
+    // Mudanças de presença desta iteração (e o restante das anteriores)
+    presence_fanout(shard);
+
+    // Gravando o log da iteração (group commit); o fsync fica com a thread de fsync
+    uint64_t commit_start = shard->wal.len > 0 ? stats_now() : 0;
+    if (wal_commit(&shard->wal))
+        shard_checkpoint(shard);
+    if (commit_start)
+        hist_record(&shard->stats.wal_commit, stats_now() - commit_start);
+
+    // Saída de iterações anteriores cujo fsync já terminou
+    release_synced(shard);
+
+    // Enviando tudo o que foi produzido nesta iteração (com SYNC_ALWAYS, o que depende
+    // de gravações sem fsync fica retido)
+    flush_connections(shard);
+    flush_outbox(shard);
+
+    // Histórico e índice do SEARCH depois das respostas: não estão no caminho delas
+    history_flush(&shard->history);
+
+    stats_publish(shard);
+    hist_record(&shard->stats.loop, stats_now() - work_start);
+}
+
+// Função que executa o laço de eventos do shard com o epoll
+static void epoll_run(Shard* shard) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // Com fsync em lote, acorda a tempo de sincronizar o log; com avisos de presença
+        // pendentes ou conexões prontas, só verifica os eventos e continua
+        int n = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, shard_timeout(shard));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(LOG_ERROR, "epoll_wait: %s", strerror(errno));
+            break;
+        }
+        if (server_stopping)
+            break;
+        uint64_t work_start = stats_now();
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == shard->listen_fd) {
+                accept_clients(shard);
+                continue;
+            }
+            if (fd == shard->event_fd)
+                continue;
+
+            Connection* conn = shard->connections[fd];
+            if (conn == NULL)
+                continue;
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                handle_client(shard, conn);
+            if ((events[i].events & EPOLLOUT) && conn->out_bytes > 0)
+                conn_mark_dirty(conn);
+        }
+
+        shard_iteration(shard, work_start);
+    }
+}
+
+// Função que arma o accept multishot no socket de escuta do shard
+static void uring_arm_accept(Shard* shard) {
+    struct io_uring_sqe* sqe = uring_sqe(&shard->ring);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = RING_ACCEPT;
+}
+
+// Função que arma o poll multishot no eventfd da mailbox (e do encerramento)
+static void uring_arm_wake(Shard* shard) {
+    struct io_uring_sqe* sqe = uring_sqe(&shard->ring);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard->event_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = RING_WAKE;
+}
+
+// Função que trata a conclusão do accept multishot: registra a conexão e arma o recv
+static void uring_accept_done(Shard* shard, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE))
+        uring_arm_accept(shard);
+    if (res < 0) {
+        // Sem descritores (EMFILE) o accept falha a cada tentativa: só uma amostra vai ao log
+        if (res != -EAGAIN && res != -EINTR && res != -ECANCELED)
+            LOG_SAMPLED(LOG_ERROR, 1000, "accept: %s", strerror(-res));
+        return;
+    }
+
+    Connection* conn = conn_open(shard, res);
+    if (conn == NULL)
+        return;
+    uring_arm_recv(shard, conn);
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    if (getpeername(res, (struct sockaddr*)&client_addr, &client_len) == 0) {
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, addr, sizeof(addr));
+        LOG(LOG_INFO, "Novo cliente conectado - %s:%d", addr, ntohs(client_addr.sin_port));
+    }
+}
+
+// Função que executa o laço de eventos do shard com o io_uring: as submissões da
+// iteração (recv rearmados, envios de todas as conexões, cancelamentos) saem juntas
+// na mesma chamada que espera pelas próximas conclusões
+static void uring_run(Shard* shard) {
+    Uring* ring = &shard->ring;
+    uring_arm_accept(shard);
+    uring_arm_wake(shard);
+
+    while (1) {
+        if (uring_wait(ring, shard_timeout(shard)) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(LOG_ERROR, "io_uring_enter: %s", strerror(errno));
+            break;
+        }
+        if (server_stopping)
+            break;
+        uint64_t work_start = stats_now();
+
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_cqe(ring)) != NULL) {
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(ring);
+
+            Connection* conn = (Connection*)(uintptr_t)(tag & ~(uint64_t)RING_TAG_MASK);
+            switch (tag & RING_TAG_MASK) {
+            case RING_ACCEPT:
+                uring_accept_done(shard, res, flags);
+                break;
+            case RING_WAKE:
+                if (!(flags & IORING_CQE_F_MORE))
+                    uring_arm_wake(shard);
+                break;
+            case RING_RECV:
+                uring_recv_done(shard, conn, res, flags);
+                break;
+            case RING_SEND:
+                uring_send_done(conn, res);
+                break;
+            }
+        }
+
+        shard_iteration(shard, work_start);
+    }
+}
+
+// Função que executa o laço de eventos do shard (uma thread por shard)
+void* shard_run(void* arg) {
+    Shard* shard = arg;
+
+    char name[16];
+    snprintf(name, sizeof(name), "shard %d", shard->id);
+    log_thread_name(name);
+    wal_start(&shard->wal, shard->event_fd);
+
+    // O anel é criado na própria thread (um único submissor); sem suporte do kernel o
+    // shard continua com o epoll
+    if (io_engine == IO_URING && uring_init(&shard->ring, URING_ENTRIES) < 0)
+        LOG(LOG_WARN, "io_uring indisponível no shard %d (%s): usando epoll", shard->id, strerror(errno));
+
+    if (shard_uring(shard))
+        uring_run(shard);
+    else
+        epoll_run(shard);
+
+    shard_shutdown(shard);
+    if (shard_uring(shard))
+        uring_close(&shard->ring);
+    return NULL;
+}
@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+
+// Nível do deflate nos textos guardados (registros curtos: velocidade acima da taxa)
+#define RECORD_DEFLATE_LEVEL 1
+
+// Dicionário do deflate: trechos comuns em conversas, os mais frequentes no fim
+// (mais perto do texto, com distâncias menores)
+static const char dictionary[] =
+    "http://https://www..com.br.com/ .org/ .pdf.png.jpg "
+    "obrigado obrigada por favor desculpa parabéns feliz aniversário bom dia boa tarde "
+    "boa noite tudo bem? tudo bom? beleza valeu abraço beijo até amanhã até logo "
+    "thanks thank you please sorry good morning good night see you tomorrow "
+    "the and that have for not with you this but his from they say her she will "
+    "one all would there their what about which when make can like time just know "
+    "people into year your some could them see other than then now look only come "
+    "its over think also back after use two how our work first well way even new "
+    "want because any these give day most us is are was were been has had did do "
+    "que não para com uma por mais como mas foi ele ela das dos tem você quando "
+    "muito nos já eu também só pelo pela até isso entre depois sem mesmo aos seus "
+    "quem nas esse eles essa num nem suas meu minha numa pelos elas havia seja "
+    "qual será nós tenho lhe deles essas esses pelas este fosse dele tu te vocês "
+    "vos lhes meus minhas teu tua teus tuas nosso nossa nossos nossas agora aqui "
+    "hoje ontem amanhã reunião projeto mensagem arquivo grupo pessoal gente "
+    "de a o e do da em um os no na se ao é ";
+
+// Função que escreve um varint (7 bits por byte). Retorna os bytes escritos.
+static size_t put_varint(char* out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (char)value;
+    return n;
+}
+
+// Função que lê um varint. Retorna os bytes lidos (0 se inválido).
+static size_t get_varint(const char* in, size_t len, uint64_t* value) {
+    *value = 0;
+    for (size_t n = 0; n < len && n < 10; n++) {
+        *value |= (uint64_t)((uint8_t)in[n] & 0x7f) << (7 * n);
+        if (!((uint8_t)in[n] & 0x80))
+            return n + 1;
+    }
+    return 0;
+}
+
+// Função que escreve um varint ocupando exatamente `width` bytes (bytes de
+// continuação a mais se o valor couber em menos), para trocar um id no lugar
+static void put_varint_width(char* out, uint64_t value, size_t width) {
+    for (size_t n = 0; n + 1 < width; n++) {
+        out[n] = (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out[width - 1] = (char)value;
+}
+
+// Função que inicia os compressores do shard no primeiro uso. Retorna -1 sem memória.
+static int codec_ready(RecordCodec* codec) {
+    if (codec->ready)
+        return 0;
+    memset(codec, 0, sizeof(*codec));
+    if (deflateInit2(&codec->deflate, RECORD_DEFLATE_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    if (inflateInit2(&codec->inflate, -15) != Z_OK) {
+        deflateEnd(&codec->deflate);
+        return -1;
+    }
+    codec->ready = 1;
+    return 0;
+}
+
+// Função que libera os compressores do shard
+void record_codec_free(RecordCodec* codec) {
+    if (!codec->ready)
+        return;
+    deflateEnd(&codec->deflate);
+    inflateEnd(&codec->inflate);
+    codec->ready = 0;
+}
+
+// Função que retorna o id do nome na tabela de nomes do shard, internando-o se ainda
+// não existe. Retorna -1 se não coube.
+int32_t name_intern(Shard* shard, const char* name, size_t len) {
+    if (len == 0 || len >= MAX_NICK_LEN)
+        return -1;
+
+    char nick[MAX_NICK_LEN];
+    memcpy(nick, name, len);
+    nick[len] = '\0';
+    int32_t id = user_table_lookup(&shard->names, nick);
+    return id >= 0 ? id : user_table_insert(&shard->names, nick);
+}
+
+// Função que comprime o texto para `out`. Retorna o tamanho comprimido ou 0 se não
+// ficou menor.
+static size_t deflate_text(Shard* shard, const char* text, size_t len, char* out) {
+    RecordCodec* codec = &shard->codec;
+    if (codec_ready(codec) < 0)
+        return 0;
+
+    z_stream* z = &codec->deflate;
+    deflateReset(z);
+    deflateSetDictionary(z, (const Bytef*)dictionary, sizeof(dictionary) - 1);
+    z->next_in = (Bytef*)text;
+    z->avail_in = len;
+    z->next_out = (Bytef*)out;
+    z->avail_out = len - 1;
+    if (deflate(z, Z_FINISH) != Z_STREAM_END)
+        return 0;
+    return len - 1 - z->avail_out;
+}
+
+// Função que descomprime o texto para `out` (no máximo `cap` bytes). Retorna o
+// tamanho ou 0 se inválido.
+static size_t inflate_text(Shard* shard, const char* in, size_t len, char* out, size_t cap) {
+    RecordCodec* codec = &shard->codec;
+    if (codec_ready(codec) < 0)
+        return 0;
+
+    z_stream* z = &codec->inflate;
+    inflateReset(z);
+    inflateSetDictionary(z, (const Bytef*)dictionary, sizeof(dictionary) - 1);
+    z->next_in = (Bytef*)in;
+    z->avail_in = len;
+    z->next_out = (Bytef*)out;
+    z->avail_out = cap;
+    if (inflate(z, Z_FINISH) != Z_STREAM_END)
+        return 0;
+    return cap - z->avail_out;
+}
+
+// Função que compacta um registro de entrega para a fila. Retorna o tamanho escrito
+// em `out` (que tem espaço para MAX_PACKED_LEN bytes).
+size_t record_pack(Shard* shard, const char* record, size_t len, char* out) {
+    size_t from_len = (uint8_t)record[0];
+    const char* from = record + 1;
+    int64_t ts;
+    memcpy(&ts, from + from_len, sizeof(ts));
+    const char* text = from + from_len + sizeof(ts);
+    size_t text_len = len - 1 - from_len - sizeof(ts);
+
+    // "#grupo/remetente": os dois nomes são internados separadamente
+    int32_t group = -1;
+    const char* sep = from_len > 0 && from[0] == '#' ? memchr(from, GROUP_SEP, from_len) : NULL;
+    if (sep != NULL) {
+        group = name_intern(shard, from, sep - from);
+        from_len -= sep - from + 1;
+        from = sep + 1;
+    }
+    int32_t sender = name_intern(shard, from, from_len);
+    if (sender < 0 || (sep != NULL && group < 0)) {
+        out[0] = RECORD_INLINE;
+        memcpy(out + 1, record, len);
+        return 1 + len;
+    }
+
+    size_t n = 1;
+    out[0] = 0;
+    n += put_varint(out + n, sender);
+    if (sep != NULL) {
+        out[0] |= RECORD_GROUP;
+        n += put_varint(out + n, group);
+    }
+    n += put_varint(out + n, (uint64_t)ts);
+
+    size_t packed = text_len >= RECORD_DEFLATE_MIN ? deflate_text(shard, text, text_len, out + n) : 0;
+    if (packed > 0) {
+        out[0] |= RECORD_DEFLATE;
+        return n + packed;
+    }
+    memcpy(out + n, text, text_len);
+    return n + text_len;
+}
+
+// Função que devolve o registro completo de um registro compactado. Retorna o
+// tamanho escrito em `out` (MAX_RECORD_LEN + 1 bytes, com '\0' no final) ou 0 se inválido.
+size_t record_unpack(Shard* shard, const char* packed, size_t len, char* out) {
+    if (len == 0)
+        return 0;
+    uint8_t flags = packed[0];
+    if (flags & RECORD_INLINE) {
+        if (len - 1 > MAX_RECORD_LEN)
+            return 0;
+        memcpy(out, packed + 1, len - 1);
+        out[len - 1] = '\0';
+        return len - 1;
+    }
+
+    uint64_t sender, group = 0, ts;
+    size_t n = 1, used;
+    if ((used = get_varint(packed + n, len - n, &sender)) == 0)
+        return 0;
+    n += used;
+    if ((flags & RECORD_GROUP) && (used = get_varint(packed + n, len - n, &group)) == 0)
+        return 0;
+    n += flags & RECORD_GROUP ? used : 0;
+    if ((used = get_varint(packed + n, len - n, &ts)) == 0)
+        return 0;
+    n += used;
+
+    int count = user_table_count(&shard->names);
+    if (sender >= (uint64_t)count || group >= (uint64_t)count)
+        return 0;
+
+    // Remetente: "#grupo/remetente" nas mensagens de grupo
+    size_t from_len = 0;
+    if (flags & RECORD_GROUP) {
+        const char* name = user_table_nick(&shard->names, group);
+        from_len = strlen(name);
+        memcpy(out + 1, name, from_len);
+        out[1 + from_len++] = GROUP_SEP;
+    }
+    const char* name = user_table_nick(&shard->names, sender);
+    memcpy(out + 1 + from_len, name, strlen(name));
+    from_len += strlen(name);
+    out[0] = (char)from_len;
+
+    int64_t stamp = (int64_t)ts;
+    char* text = out + 1 + from_len + sizeof(stamp);
+    memcpy(out + 1 + from_len, &stamp, sizeof(stamp));
+    size_t cap = MAX_RECORD_LEN - (text - out);
+    size_t text_len = len - n;
+    if (flags & RECORD_DEFLATE) {
+        if ((text_len = inflate_text(shard, packed + n, len - n, text, cap)) == 0)
+            return 0;
+    } else {
+        if (text_len > cap)
+            return 0;
+        memcpy(text, packed + n, text_len);
+    }
+
+    size_t total = text - out + text_len;
+    out[total] = '\0';
+    return total;
+}
+
+// Função que guarda o registro compactado no fim da fila. Retorna -1 sem memória.
+int record_push(Shard* shard, MessageQueue* queue, const char* record, size_t len) {
+    char packed[MAX_PACKED_LEN];
+    return queue_push(&shard->slab, queue, packed, record_pack(shard, record, len, packed));
+}
+
+// Função que retira a mensagem mais antiga da fila e devolve o registro completo.
+// Retorna o tamanho ou 0 se a fila estiver vazia.
+size_t record_pop(Shard* shard, MessageQueue* queue, char* out) {
+    char packed[MAX_PACKED_LEN + 1];
+    size_t len = queue_pop(&shard->slab, queue, packed);
+    return len > 0 ? record_unpack(shard, packed, len, out) : 0;
+}
+
+// Função que devolve o registro completo da i-ésima mensagem da fila sem retirá-la
+size_t record_peek(Shard* shard, const MessageQueue* queue, uint32_t i, char* out) {
+    char packed[MAX_PACKED_LEN + 1];
+    size_t len = queue_peek(&shard->slab, queue, i, packed);
+    return record_unpack(shard, packed, len, out);
+}
+
+// Função que guarda o registro compactado uma única vez para várias filas (grupos).
+// Retorna a cadeia (NO_CHUNK sem memória) e o tamanho guardado em `packed_len`.
+uint32_t record_share(Shard* shard, const char* record, size_t len, size_t* packed_len) {
+    char packed[MAX_PACKED_LEN];
+    *packed_len = record_pack(shard, record, len, packed);
+    return slab_share(&shard->slab, packed, *packed_len);
+}
+
+// Id de nome dentro de um registro compactado
+typedef struct {
+    uint64_t id;
+    size_t pos;                 // Posição do varint no registro
+    size_t width;               // Bytes do varint
+} NameRef;
+
+// Função que localiza os ids de nomes de um registro compactado: o remetente e, nas
+// mensagens de grupo, o grupo. Retorna quantos achou (0 no registro sem compactação
+// ou inválido).
+static int packed_names(const char* packed, size_t len, NameRef refs[2]) {
+    if (len == 0 || (packed[0] & RECORD_INLINE))
+        return 0;
+
+    int count = (packed[0] & RECORD_GROUP) ? 2 : 1;
+    size_t n = 1;
+    for (int i = 0; i < count; i++) {
+        refs[i].pos = n;
+        if ((refs[i].width = get_varint(packed + n, len - n, &refs[i].id)) == 0)
+            return 0;
+        n += refs[i].width;
+    }
+    return count;
+}
+
+// Função que refaz a tabela de nomes do shard só com os nomes ainda usados pelas
+// filas e pelas conversas, quando os demais passam da metade. Chamada no checkpoint.
+// Os ids mudam: os novos seguem a ordem dos antigos, então nenhum cresce e os
+// registros guardados são reescritos no lugar, no mesmo número de bytes (as
+// mensagens compartilhadas de grupo uma única vez).
+void names_compact(Shard* shard) {
+    int count = user_table_count(&shard->names);
+    if (count < NAMES_COMPACT_MIN)
+        return;
+
+    // Marcando os nomes usados (remap: -1 = livre)
+    int32_t* remap = malloc((size_t)count * sizeof(int32_t));
+    memset(remap, 0xff, (size_t)count * sizeof(int32_t));
+    char packed[MAX_PACKED_LEN + 1];
+    NameRef refs[2];
+    int users = user_table_count(&shard->users);
+    for (int i = 0; i < users; i++) {
+        User* user = user_table_at(&shard->users, i);
+        for (uint32_t j = 0; j < user->queue.count; j++) {
+            size_t len = queue_peek(&shard->slab, &user->queue, j, packed);
+            int found = packed_names(packed, len, refs);
+            for (int k = 0; k < found; k++)
+                if (refs[k].id < (uint64_t)count)
+                    remap[refs[k].id] = 0;
+        }
+        for (uint32_t j = 0; j < conv_size(&user->conversations); j++) {
+            ConvEntry* conv = conv_at(&shard->arena, &user->conversations, j);
+            if (conv != NULL && conv->from - 1 < (uint32_t)count)
+                remap[conv->from - 1] = 0;
+        }
+    }
+    int live = 0;
+    for (int id = 0; id < count; id++)
+        live += remap[id] == 0;
+    if (count - live < count / 2) {
+        free(remap);
+        return;
+    }
+
+    // Nova tabela com os nomes usados; sem espaço na arena a antiga continua valendo
+    UserTableData old_data = *shard->names.data;
+    UserTable old = { shard->names.arena, &old_data };
+    memset(shard->names.data, 0, sizeof(UserTableData));
+    int failed = user_table_init(&shard->names, &shard->arena, shard->names.data, 0, 0) < 0;
+    for (int id = 0; id < count && !failed; id++)
+        if (remap[id] == 0 && (remap[id] = user_table_insert(&shard->names, user_table_nick(&old, id))) < 0)
+            failed = 1;
+    if (failed) {
+        if (shard->names.data->index != 0)
+            user_table_free(&shard->names);
+        *shard->names.data = old_data;
+        free(remap);
+        LOG(LOG_WARN, "Sem espaço para refazer a tabela de nomes");
+        return;
+    }
+    user_table_free(&old);
+
+    // Reescrevendo os ids guardados; as cadeias compartilhadas já reescritas ficam
+    // marcadas num bitmap indexado pelo chunk
+    size_t chunks = (size_t)shard->slab.data->page_count * CHUNKS_PER_PAGE;
+    uint8_t* done = calloc(chunks / 8 + 1, 1);
+    for (int i = 0; i < users; i++) {
+        User* user = user_table_at(&shard->users, i);
+        for (uint32_t j = 0; j < user->queue.count; j++) {
+            uint32_t chain = queue_shared_chain(&shard->slab, &user->queue, j);
+            if (chain != NO_CHUNK) {
+                if (done[chain / 8] & (1u << (chain % 8)))
+                    continue;
+                done[chain / 8] |= 1u << (chain % 8);
+            }
+            size_t len = queue_peek(&shard->slab, &user->queue, j, packed);
+            int found = packed_names(packed, len, refs);
+            size_t end = 0;
+            for (int k = 0; k < found; k++) {
+                if (refs[k].id >= (uint64_t)count)
+                    continue;
+                put_varint_width(packed + refs[k].pos, (uint64_t)remap[refs[k].id], refs[k].width);
+                end = refs[k].pos + refs[k].width;
+            }
+            if (end > 0)
+                queue_patch(&shard->slab, &user->queue, j, packed, end);
+        }
+        conv_remap(&shard->arena, &user->conversations, remap);
+    }
+    free(done);
+    free(remap);
+
+    LOG(LOG_INFO, "Tabela de nomes refeita: %d de %d nomes em uso", live, count);
+}
@@ -0,0 +1,54 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "msg_queue.h"
+
+// Registro de entrega compactado, a forma guardada nas filas dos usuários. Os
+// apelidos do remetente e do grupo viram ids da tabela de nomes do shard (na arena,
+// só com o array de apelidos; o checkpoint a refaz sem os nomes que nenhuma fila ou
+// conversa usa mais, reescrevendo os ids, ver names_compact),
+// o timestamp vira um varint e textos longos são comprimidos com deflate e um
+// dicionário fixo. O log, os snapshots e as mensagens entre shards continuam com o
+// registro completo; só as filas usam esta forma.
+//
+//   [u8 flags][varint remetente][varint grupo (RECORD_GROUP)][varint ts][texto]
+//
+// Com RECORD_INLINE o registro completo vem logo depois das flags (nome que não
+// coube na tabela).
+
+// Flags do registro compactado
+#define RECORD_GROUP   0x01     // Mensagem de grupo: tem o id do grupo
+#define RECORD_DEFLATE 0x02     // Texto comprimido (deflate cru com o dicionário)
+#define RECORD_INLINE  0x04     // Registro completo sem compactação
+
+// Texto a partir do qual vale tentar comprimir
+#define RECORD_DEFLATE_MIN 64
+// Tamanho máximo de um registro compactado
+#define MAX_PACKED_LEN (MAX_RECORD_LEN + 16)
+// Nomes na tabela a partir dos quais o checkpoint a refaz, se metade não é mais usada
+#define NAMES_COMPACT_MIN 1024
+
+// Compressores do shard, reiniciados a cada registro
+typedef struct {
+    z_stream deflate;
+    z_stream inflate;
+    int ready;                  // Iniciados no primeiro uso
+} RecordCodec;
+
+typedef struct Shard Shard;
+
+int32_t name_intern(Shard* shard, const char* name, size_t len);
+size_t record_pack(Shard* shard, const char* record, size_t len, char* out);
+size_t record_unpack(Shard* shard, const char* packed, size_t len, char* out);
+int record_push(Shard* shard, MessageQueue* queue, const char* record, size_t len);
+size_t record_pop(Shard* shard, MessageQueue* queue, char* out);
+size_t record_peek(Shard* shard, const MessageQueue* queue, uint32_t i, char* out);
+uint32_t record_share(Shard* shard, const char* record, size_t len, size_t* packed_len);
+void record_codec_free(RecordCodec* codec);
+void names_compact(Shard* shard);
+
+#endif
@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "search.h"
+
+// Razão de tamanhos a partir da qual a interseção avança na lista maior aos saltos
+#define GALLOP_RATIO 32
+
+// Função que diz se o byte faz parte de um termo
+static int term_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// Função que compara dois hashes (ordenação com qsort)
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Função que separa os termos do texto. `terms` recebe o hash (FNV-1a de 64 bits) de
+// cada termo diferente, em ordem crescente. Retorna quantos (no máximo `max`).
+int search_terms(const char* text, size_t len, uint64_t* terms, int max) {
+    int count = 0;
+    size_t i = 0;
+    while (i < len && count < max) {
+        while (i < len && !term_byte((unsigned char)text[i]))
+            i++;
+        if (i == len)
+            break;
+
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t n = 0; i < len && term_byte((unsigned char)text[i]); i++, n++) {
+            unsigned char c = text[i];
+            if (n >= SEARCH_TERM_LEN)
+                continue;
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        terms[count++] = hash;
+    }
+
+    qsort(terms, count, sizeof(uint64_t), compare_u64);
+    int unique = 0;
+    for (int j = 0; j < count; j++)
+        if (unique == 0 || terms[unique - 1] != terms[j])
+            terms[unique++] = terms[j];
+    return unique;
+}
+
+// Função que calcula a chave da lista de postings do termo para o participante
+uint64_t search_key(const char* nick, uint64_t term) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char* p = (const unsigned char*)nick; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ull;
+    }
+    hash = (hash ^ term) * 0x9E3779B97F4A7C15ull;
+    hash ^= hash >> 29;
+    return hash ? hash : 1;
+}
+
+// Função que procura a lista da chave. Retorna a posição dela ou a posição livre
+// onde ela entraria.
+static uint32_t slot_of(const SearchIndex* index, uint64_t key) {
+    uint32_t mask = index->cap - 1;
+    uint32_t i = key & mask;
+    while (index->table[i].key != 0 && index->table[i].key != key)
+        i = (i + 1) & mask;
+    return i;
+}
+
+// Função que dobra a tabela de listas
+static void table_grow(SearchIndex* index) {
+    uint32_t old_cap = index->cap;
+    Posting* old = index->table;
+    index->cap = old_cap ? old_cap * 2 : 1024;
+    index->table = calloc(index->cap, sizeof(Posting));
+    for (uint32_t i = 0; i < old_cap; i++)
+        if (old[i].key != 0)
+            index->table[slot_of(index, old[i].key)] = old[i];
+    free(old);
+}
+
+// Função que acrescenta a mensagem `id` à lista da chave (ids sempre crescentes)
+void search_add(SearchIndex* index, uint64_t key, uint32_t id) {
+    if ((index->used + 1) * 2 > index->cap)
+        table_grow(index);
+    Posting* posting = &index->table[slot_of(index, key)];
+    if (posting->key == 0) {
+        posting->key = key;
+        index->used++;
+    } else if (posting->count > 0 && id <= posting->last) {
+        return;
+    }
+
+    if (posting->len + 5 > posting->cap) {
+        posting->cap = posting->cap ? posting->cap * 2 : 8;
+        posting->data = realloc(posting->data, posting->cap);
+    }
+    // O primeiro delta é o próprio id
+    uint32_t delta = posting->count > 0 ? id - posting->last : id;
+    while (delta >= 0x80) {
+        posting->data[posting->len++] = (uint8_t)(delta | 0x80);
+        delta >>= 7;
+    }
+    posting->data[posting->len++] = (uint8_t)delta;
+    posting->last = id;
+    posting->count++;
+}
+
+// Função que decodifica a lista em `out` (posting->count posições)
+static void posting_decode(const Posting* posting, uint32_t* out) {
+    uint32_t id = 0, n = 0;
+    for (uint32_t i = 0; i < posting->len; ) {
+        uint32_t delta = 0;
+        for (int shift = 0; i < posting->len; shift += 7) {
+            uint8_t byte = posting->data[i++];
+            delta |= (uint32_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        id = n == 0 ? delta : id + delta;
+        out[n++] = id;
+    }
+}
+
+// Função que retorna a primeira posição a partir de `j` com b[posição] >= v, avançando
+// aos saltos (dobrando o passo) e terminando com uma busca binária
+static uint32_t gallop(const uint32_t* b, uint32_t nb, uint32_t j, uint32_t v) {
+    uint32_t step = 1, lo = j, hi = j;
+    while (hi < nb && b[hi] < v) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > nb)
+        hi = nb;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (b[mid] < v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Função que intersecta as listas crescentes `a` (a menor) e `b`, escrevendo o
+// resultado em `out` (que pode ser `a`). Com listas de tamanhos parecidos a maior é
+// percorrida em blocos de 8: blocos inteiros menores que o id são pulados com uma
+// comparação e o bloco que pode contê-lo é comparado de uma vez (SSE2). Com a maior
+// muito maior ela é percorrida aos saltos. Retorna o tamanho do resultado.
+static uint32_t intersect(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, uint32_t* out) {
+    uint32_t n = 0, j = 0;
+    if (na > 0 && nb / na >= GALLOP_RATIO) {
+        for (uint32_t i = 0; i < na && j < nb; i++) {
+            j = gallop(b, nb, j, a[i]);
+            if (j < nb && b[j] == a[i])
+                out[n++] = a[i];
+        }
+        return n;
+    }
+
+    for (uint32_t i = 0; i < na; i++) {
+        uint32_t v = a[i];
+#ifdef __SSE2__
+        while (j + 8 <= nb && b[j + 7] < v)
+            j += 8;
+        if (j + 8 <= nb) {
+            __m128i key = _mm_set1_epi32((int)v);
+            __m128i lo = _mm_loadu_si128((const __m128i*)(b + j));
+            __m128i hi = _mm_loadu_si128((const __m128i*)(b + j + 4));
+            __m128i eq = _mm_or_si128(_mm_cmpeq_epi32(lo, key), _mm_cmpeq_epi32(hi, key));
+            if (_mm_movemask_epi8(eq) != 0)
+                out[n++] = v;
+            continue;
+        }
+#endif
+        while (j < nb && b[j] < v)
+            j++;
+        if (j < nb && b[j] == v)
+            out[n++] = v;
+    }
+    return n;
+}
+
+// Função que compara duas listas pelo tamanho (ordenação com qsort)
+static int compare_count(const void* a, const void* b) {
+    const Posting* x = *(const Posting* const*)a;
+    const Posting* y = *(const Posting* const*)b;
+    return x->count < y->count ? -1 : x->count > y->count;
+}
+
+// Função que retorna as mensagens presentes nas listas de todas as chaves, em ordem
+// crescente, em `out` (alocado; NULL se nenhuma). Retorna quantas.
+uint32_t search_query(const SearchIndex* index, const uint64_t* keys, int count, uint32_t** out) {
+    *out = NULL;
+    if (count == 0 || index->cap == 0)
+        return 0;
+
+    // Da menor lista para a maior: o resultado só diminui
+    const Posting* postings[SEARCH_TERMS_MAX];
+    for (int i = 0; i < count; i++) {
+        const Posting* posting = &index->table[slot_of(index, keys[i])];
+        if (posting->key == 0)
+            return 0;
+        postings[i] = posting;
+    }
+    qsort(postings, count, sizeof(Posting*), compare_count);
+
+    uint32_t* result = malloc(postings[0]->count * sizeof(uint32_t));
+    uint32_t n = postings[0]->count;
+    posting_decode(postings[0], result);
+    uint32_t* other = count > 1 ? malloc(postings[count - 1]->count * sizeof(uint32_t)) : NULL;
+    for (int i = 1; i < count && n > 0; i++) {
+        posting_decode(postings[i], other);
+        n = intersect(result, n, other, postings[i]->count, result);
+    }
+    free(other);
+
+    if (n == 0) {
+        free(result);
+        return 0;
+    }
+    *out = result;
+    return n;
+}
+
+// Função que retorna o tamanho do índice serializado
+size_t search_dump_size(const SearchIndex* index) {
+    size_t size = 4;
+    for (uint32_t i = 0; i < index->cap; i++)
+        if (index->table[i].key != 0)
+            size += 20 + index->table[i].len;
+    return size;
+}
+
+// Função que serializa o índice em `out` (search_dump_size bytes):
+// [u32 listas] e, por lista, [u64 chave][u32 quantidade][u32 último][u32 bytes][deltas].
+// Retorna o tamanho escrito.
+size_t search_dump(const SearchIndex* index, char* out) {
+    memcpy(out, &index->used, 4);
+    size_t n = 4;
+    for (uint32_t i = 0; i < index->cap; i++) {
+        const Posting* posting = &index->table[i];
+        if (posting->key == 0)
+            continue;
+        memcpy(out + n, &posting->key, 8);
+        memcpy(out + n + 8, &posting->count, 4);
+        memcpy(out + n + 12, &posting->last, 4);
+        memcpy(out + n + 16, &posting->len, 4);
+        memcpy(out + n + 20, posting->data, posting->len);
+        n += 20 + posting->len;
+    }
+    return n;
+}
+
+// Função que carrega o índice serializado por search_dump. Retorna -1 se os dados
+// não são válidos (o índice fica vazio).
+int search_load(SearchIndex* index, const char* data, size_t len) {
+    uint32_t count;
+    if (len < 4)
+        return -1;
+    memcpy(&count, data, 4);
+    size_t n = 4;
+    for (uint32_t i = 0; i < count; i++) {
+        Posting posting = { 0 };
+        if (len - n < 20)
+            goto invalid;
+        memcpy(&posting.key, data + n, 8);
+        memcpy(&posting.count, data + n + 8, 4);
+        memcpy(&posting.last, data + n + 12, 4);
+        memcpy(&posting.len, data + n + 16, 4);
+        if (posting.key == 0 || len - n - 20 < posting.len)
+            goto invalid;
+        posting.cap = posting.len > 0 ? posting.len : 8;
+        posting.data = malloc(posting.cap);
+        memcpy(posting.data, data + n + 20, posting.len);
+        n += 20 + posting.len;
+
+        if ((index->used + 1) * 2 > index->cap)
+            table_grow(index);
+        index->table[slot_of(index, posting.key)] = posting;
+        index->used++;
+    }
+    return n == len ? 0 : -1;
+
+invalid:
+    search_free(index);
+    return -1;
+}
+
+// Função que libera o índice
+void search_free(SearchIndex* index) {
+    for (uint32_t i = 0; i < index->cap; i++)
+        free(index->table[i].data);
+    free(index->table);
+    memset(index, 0, sizeof(*index));
+}
@@ -0,0 +1,53 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Índice invertido das mensagens do histórico, um por partição. Cada mensagem recebe
+// um número na partição (em ordem de gravação) e entra, para cada termo do texto, na
+// lista de postings de (participante, termo) dos dois participantes da conversa:
+// a busca de um usuário só lê as listas dele. As listas guardam os números em ordem
+// crescente como deltas em varint, e só crescem no fim.
+//
+// Termos: sequências de letras e dígitos ASCII (em minúsculas) e bytes UTF-8 acima de
+// 0x7f, cortadas em SEARCH_TERM_LEN bytes.
+
+// Termos de uma busca
+#define SEARCH_TERMS_MAX 8
+// Bytes considerados de um termo
+#define SEARCH_TERM_LEN 32
+// Mensagens devolvidas por uma busca (as mais novas)
+#define SEARCH_PAGE_MAX 50
+// Termos de um texto de até MAX_TEXT_LEN bytes (no máximo um a cada dois bytes)
+#define SEARCH_TEXT_TERMS (MAX_TEXT_LEN / 2 + 1)
+
+// Lista de postings de (participante, termo)
+typedef struct {
+    uint64_t key;               // Hash do participante e do termo (0 = posição livre)
+    uint32_t count;             // Números na lista
+    uint32_t last;              // Último número (base do próximo delta)
+    uint8_t* data;              // Deltas em varint
+    uint32_t len;
+    uint32_t cap;
+} Posting;
+
+// Listas de uma partição, numa tabela hash pela chave
+typedef struct {
+    Posting* table;
+    uint32_t cap;
+    uint32_t used;
+} SearchIndex;
+
+int search_terms(const char* text, size_t len, uint64_t* terms, int max);
+uint64_t search_key(const char* nick, uint64_t term);
+void search_add(SearchIndex* index, uint64_t key, uint32_t id);
+uint32_t search_query(const SearchIndex* index, const uint64_t* keys, int count, uint32_t** out);
+size_t search_dump_size(const SearchIndex* index);
+size_t search_dump(const SearchIndex* index, char* out);
+int search_load(SearchIndex* index, const char* data, size_t len);
+void search_free(SearchIndex* index);
+
+#endif
@@ -1,458 +1,2419 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#include "server.h"
+#include "protocol.h"
+
+Shard** shards;                 // Todos os shards do servidor
+int shard_count;                // Número de shards (threads de reactor)
+volatile sig_atomic_t server_stopping; // Encerramento pedido (SIGINT/SIGTERM)
+RateLimit user_rate_limit = { DEFAULT_USER_RATE, 2 * DEFAULT_USER_RATE }; // Mensagens por segundo de cada usuário (opção -u)
+uint32_t queue_quota = DEFAULT_QUEUE_QUOTA;     // Mensagens guardadas por destinatário (opção -q)
+static atomic_int list_subscribers;     // Conexões inscritas nas mudanças da lista (todos os shards)
+
+// Comandos do protocolo
+enum {
+    CMD_REGISTER,
+    CMD_DELETE,
+    CMD_LOGIN,
+    CMD_LOGOUT,
+    CMD_LIST,
+    CMD_SEND_MSG,
+    CMD_LIST_SUBSCRIBE,
+    CMD_LIST_UNSUBSCRIBE,
+    CMD_SUBSCRIBE,
+    CMD_UNSUBSCRIBE,
+    CMD_JOIN,
+    CMD_LEAVE,
+    CMD_STATS,
+    CMD_ACK,
+    CMD_HISTORY,
+    CMD_SEARCH,
+    CMD_COUNT
+};
+
+_Static_assert(CMD_COUNT == STATS_COMMANDS, "STATS_COMMANDS deve acompanhar CMD_*");
+
+// Comando já interpretado, pronto para ser executado no shard dono do usuário.
+// O texto aponta para o buffer de onde o comando foi lido (sem cópia).
+typedef struct {
+    int op;                     // Comando (CMD_*)
+    char nick[MAX_NICK_LEN];    // Apelido (ou destinatário no SEND_MSG, grupo no JOIN/LEAVE)
+    const char* text;           // Nome (REGISTER), texto (SEND_MSG) ou termos (SEARCH)
+    size_t text_len;            // Tamanho do texto
+    uint32_t offset;            // LIST: primeira entrada da página
+    uint32_t count;             // LIST: entradas da página (0 = todas); HISTORY: mensagens da página
+    int acks;                   // LOGIN: a sessão confirma as entregas
+    uint64_t seq;               // ACK: última entrega confirmada; LOGIN: última recebida;
+                                // SEND_MSG: sequência do remetente na conversa (0 = sem);
+                                // HISTORY: início da faixa
+    int range;                  // HISTORY: faixa pedida (HISTORY_*)
+    uint64_t end;               // HISTORY: fim da faixa
+    int charged;                // SEND_MSG: limite do remetente já conferido no shard dono dele
+} Command;
+
+// Origem de um comando: para onde vai a resposta e quem está logado na conexão
+typedef struct {
+    ConnRef conn;               // Conexão que enviou o comando
+    uint32_t seq;               // Posição da resposta na ordem da conexão
+    int mode;                   // Protocolo da conexão (MODE_*) para codificar a resposta
+    char from[MAX_NICK_LEN];    // Usuário logado na conexão ("" se nenhum)
+    int op;                     // Comando (CMD_*), -1 se não foi reconhecido
+    uint64_t start;             // Instante do despacho (ns), para a latência do comando
+} Request;
+
+// Filtro e página de um LIST
+typedef struct {
+    char prefix[MAX_NICK_LEN];  // Prefixo do apelido ("" = todos)
+    uint32_t offset;            // Primeira entrada da página
+    uint32_t count;             // Entradas da página (0 = todas)
+} ListQuery;
 
-#define MAX_USERS 100
-#define MAX_MSG_LEN 1024
-#define MAX_NAME_LEN 100
-#define MAX_NICK_LEN 50
-#define PORT 8080
-// Tamanho da fila de conexões pendentes
-#define BACKLOG 10
+// Parte da lista de usuários enviada por um shard
+typedef struct {
+    char* data;                 // Entradas ",{...}" que casam com o filtro
+    size_t len;
+    uint32_t total;             // Usuários do shard que casam com o filtro
+} ListPart;
+
+// Coleta das partes da lista de usuários enviadas por cada shard
+typedef struct {
+    ConnRef conn;               // Conexão que pediu a lista
+    uint32_t seq;               // Posição da resposta na ordem da conexão
+    int mode;                   // Protocolo da conexão (MODE_*)
+    int subscribe;              // Pedido de LIST_SUBSCRIBE
+    ListQuery query;            // Filtro e página pedidos
+    int op;                     // CMD_LIST ou CMD_LIST_SUBSCRIBE
+    uint64_t start;             // Instante do despacho (ns)
+    int parts_left;             // Shards que ainda não responderam
+    ListPart* parts;            // Parte de cada shard
+} ListGather;
+
+// Busca pedida a um shard
+typedef struct {
+    char user[MAX_NICK_LEN];    // Usuário logado: só as conversas dele
+    int count;                  // Termos
+    uint64_t terms[SEARCH_TERMS_MAX];   // Hashes dos termos, em ordem crescente
+} SearchQuery;
 
+// Coleta das mensagens encontradas por cada shard
 typedef struct {
-    char nick[MAX_NICK_LEN];    // Apelido do usuário
-    char name[MAX_NAME_LEN];    // Nome do usuário
-    int online;                 // Flag que indica se está online <1> ou offline <2>
-    int socket;                 // Socket associado ao usuário
-    char** message_queue;       // FIla de mensagens pendentes
-    int queue_size;             // Número atual de mensagens na fila
-    int queue_capacity;         // Capacidade atual da fila
-} User;
+    ConnRef conn;               // Conexão que pediu a busca
+    uint32_t seq;               // Posição da resposta na ordem da conexão
+    int mode;                   // Protocolo da conexão (MODE_*)
+    uint64_t start;             // Instante do despacho (ns)
+    int parts_left;             // Shards que ainda não responderam
+    char* data;                 // Mensagens recebidas: [i64 ts][u32 tamanho][",{...}"]
+    size_t len;
+} SearchGather;
+
+// Função de hash FNV-1a do apelido, usada para escolher o shard dono do usuário
+uint32_t hash_nick(const char* nick) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)nick; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-int user_count = 0;             // Contador de usuários
-User users[MAX_USERS];          // Array dos usuários registrados
+// Função que retorna o shard dono do usuário
+int shard_of(const char* nick) {
+    return hash_nick(nick) % shard_count;
+}
 
+// Função que retorna o destino de shard_post das mensagens para o dono do usuário:
+// o shard dele, se o usuário pertence a este nó, ou o nó dono no cluster
+int owner_target(const char* nick) {
+    int node = cluster_node_of(nick);
+    return node == cluster_self ? shard_of(nick) : shard_count + node;
+}
 
-// Função que inicializa a fila de mensagens de um usuário
-void init_user_queue(User* user) {
-    user->queue_capacity = 10;  // Capacidade inicial da fila de mensagens
-    user->queue_size = 0;       // Fila começa vazia
+// Função que retorna o destino de shard_post das mensagens para a conexão
+int conn_target(ConnRef ref) {
+    return ref.node == cluster_self ? ref.shard : shard_count + ref.node;
+}
+
+// Função que compara duas referências de conexão
+static int same_conn(ConnRef a, ConnRef b) {
+    return a.shard == b.shard && a.fd == b.fd && a.id == b.id && a.node == b.node;
+}
 
-    // Aloca memória para a fila de mensagens
-    user->message_queue = malloc(user->queue_capacity * sizeof(char*));
+// Funções que escrevem e leem inteiros big-endian (sequências no binário e no log)
+static void put_u64(char* out, uint64_t value) {
+    for (int i = 7; i >= 0; i--, value >>= 8)
+        out[i] = (char)(value & 0xff);
 }
 
-// Função que busca um usuário no sistema pelo apelido
-User* find_user(const char* nick) {
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].nick, nick) == 0)
-            return &users[i];   // Usuário encontrado
+static uint64_t get_u64(const char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value = value << 8 | (uint8_t)in[i];
+    return value;
+}
+
+static uint32_t get_u32(const char* in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value = value << 8 | (uint8_t)in[i];
+    return value;
+}
+
+// Função que escreve `text` em `out` escapando-o como string JSON. Retorna o tamanho
+// escrito; `out` precisa de espaço para 2 * len + 1 bytes.
+static size_t json_escape(char* out, const char* text, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = text[i];
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = c;
+        } else if (c == '\n') {
+            out[n++] = '\\';
+            out[n++] = 'n';
+        } else if ((unsigned char)c < 0x20) {
+            out[n++] = ' ';
+        } else {
+            out[n++] = c;
+        }
     }
+    out[n] = '\0';
+    return n;
+}
 
-    // Caso o usuário não seja encontrado, retorna NULL.
-    return NULL;
+// Tamanho máximo de uma entrega já codificada para a conexão
+#define MAX_DELIVERY_LEN (64 + 4 * MAX_NICK_LEN + 2 * MAX_TEXT_LEN)
+// Bytes de entregas retidas enviados por retomada (o intervalo entre os dois limites)
+#define RESUME_BUDGET (CONN_HIGH_WATER - CONN_LOW_WATER)
+
+// Função que monta o registro de uma entrega, o formato usado nas filas e entre shards:
+// [u8 tamanho do remetente][remetente][i64 timestamp][texto]. Retorna o tamanho.
+size_t delivery_encode(char* out, const char* from, const char* text, size_t text_len, int64_t ts) {
+    size_t from_len = strlen(from);
+    out[0] = (char)from_len;
+    memcpy(out + 1, from, from_len);
+    memcpy(out + 1 + from_len, &ts, sizeof(ts));
+    memcpy(out + 1 + from_len + sizeof(ts), text, text_len);
+    return 1 + from_len + sizeof(ts) + text_len;
 }
 
-// Função que elimina a primeira mensagem da fila do usuário
-char* pop_from_queue(User* user) {
-    if (user->queue_size == 0)
-        return NULL;
-    
-    // Primeira mensagem
-    char* msg = user->message_queue[0];
+// Função que codifica uma entrega no protocolo `mode`. Nas mensagens de grupo o
+// remetente do registro é "#grupo/remetente": no texto ele vira os campos "from" e
+// "group"; no binário vai inteiro no campo A. `seq` diferente de 0 numera a entrega
+// para o ACK. Retorna o tamanho escrito em `out`.
+static size_t delivery_format(int mode, char* out, const char* record, size_t len, uint64_t seq) {
+    size_t from_len = (uint8_t)record[0];
+    const char* from = record + 1;
+    int64_t ts;
+    memcpy(&ts, from + from_len, sizeof(ts));
+    const char* text = from + from_len + sizeof(ts);
+    size_t text_len = len - 1 - from_len - sizeof(ts);
+
+    if (mode == MODE_BINARY && seq == 0)
+        return proto_encode(out, OP_DELIVER, from, from_len, text, text_len, (uint64_t)ts);
+    if (mode == MODE_BINARY) {
+        // B = sequência (u64) e texto
+        size_t n = proto_encode(out, OP_DELIVER, from, from_len, NULL, 8 + text_len, (uint64_t)ts);
+        char* b = out + n - 8 - text_len;
+        put_u64(b, seq);
+        memcpy(b + 8, text, text_len);
+        out[7] = PROTO_FLAG_SEQ;
+        return n;
+    }
 
-    // Desloca todas as mensagens uma posição para frente
-    for (int i = 1; i < user->queue_size; i++) {
-        user->message_queue[i-1] = user->message_queue[i];
+    const char* group = NULL;
+    size_t group_len = 0;
+    const char* sep = from_len > 0 && from[0] == '#' ? memchr(from, GROUP_SEP, from_len) : NULL;
+    if (sep != NULL) {
+        group = from;
+        group_len = sep - from;
+        from_len -= group_len + 1;
+        from = sep + 1;
     }
-    user->queue_size--;
-    
+
+    // DELIVER_MSG{"from":"...",["group":"...",]"text":"...","ts":...}
+    size_t n = sprintf(out, "DELIVER_MSG{\"from\":\"");
+    n += json_escape(out + n, from, from_len);
+    if (group != NULL) {
+        n += sprintf(out + n, "\",\"group\":\"");
+        n += json_escape(out + n, group, group_len);
+    }
+    n += sprintf(out + n, "\",\"text\":\"");
+    n += json_escape(out + n, text, text_len);
+    n += sprintf(out + n, "\",\"ts\":%ld", (long)ts);
+    if (seq != 0)
+        n += sprintf(out + n, ",\"seq\":%llu", (unsigned long long)seq);
+    return n + sprintf(out + n, "}\n");
+}
+
+// Função que escreve uma entrega na conexão no protocolo que ela usa
+static void write_delivery(Connection* conn, const char* record, size_t len, uint64_t seq) {
+    char out[MAX_DELIVERY_LEN];
+    conn_send(conn, out, delivery_format(conn->mode, out, record, len, seq));
+}
+
+// Função que monta uma entrega de grupo compartilhada: o registro e as duas codificações
+// numa única alocação, com uma referência para quem a criou
+SharedMsg* shared_msg_new(const char* record, size_t len) {
+    char text[MAX_DELIVERY_LEN];
+    char frame[MAX_DELIVERY_LEN];
+    size_t text_len = delivery_format(MODE_TEXT, text, record, len, 0);
+    size_t binary_len = delivery_format(MODE_BINARY, frame, record, len, 0);
+
+    SharedMsg* msg = malloc(sizeof(SharedMsg) + len + text_len + binary_len);
+    atomic_init(&msg->refs, 1);
+    msg->record_len = len;
+    msg->text_len = text_len;
+    msg->binary_len = binary_len;
+    memcpy(msg->data, record, len);
+    memcpy(msg->data + len, text, text_len);
+    memcpy(msg->data + len + text_len, frame, binary_len);
     return msg;
 }
 
-// Função que adiciona uma mensagem a fila do usuário
-void add_to_queue(User* user, const char* message) {
-    // Verificando se precisa expandir a fila
-    if (user->queue_size >= user->queue_capacity) {
-        // Dobrando a capacidade da fila
-        user->queue_capacity *= 2;
+// Função que solta uma referência à entrega de grupo; a última a libera
+void shared_msg_release(SharedMsg* msg) {
+    if (atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1)
+        free(msg);
+}
 
-        // Realocando a fila com nova capacidade
-        user->message_queue = realloc(user->message_queue, user->queue_capacity * sizeof(char*));
+// Função que entrega uma mensagem à conexão de um usuário, esteja ela neste ou em outro
+// shard. `seq` é a sequência da entrega nas sessões com confirmação (0 nas demais).
+static void deliver(Shard* shard, ConnRef session, const char* record, size_t len, uint64_t seq) {
+    if (conn_target(session) == shard->id) {
+        Connection* conn = conn_lookup(shard, session);
+        if (conn != NULL)
+            write_delivery(conn, record, len, seq);
+        return;
     }
 
-    // Alocando espaço para a nova mensagem e copiando
-    user->message_queue[user->queue_size] = malloc(strlen(message) + 1);
-    strcpy(user->message_queue[user->queue_size], message);
-    
-    user->queue_size++;
-    
+    ShardMsg* msg = shard_post(shard, conn_target(session), MSG_DELIVER, sizeof(seq) + len);
+    msg->conn = session;
+    memcpy(msg->data, &seq, sizeof(seq));
+    memcpy(msg->data + sizeof(seq), record, len);
+}
+
+// Função que busca um usuário do shard pelo apelido
+User* find_user(Shard* shard, const char* nick) {
+    return user_table_find(&shard->users, nick);
+}
+
+// Função que retorna o apelido do usuário (no array de apelidos da tabela)
+const char* user_nick(Shard* shard, const User* user) {
+    return user_table_nick(&shard->users, user_table_id(&shard->users, user));
+}
+
+// Função que retorna os dados frios do usuário
+static UserProfile* user_profile(Shard* shard, const User* user) {
+    return user_table_profile(&shard->users, user_table_id(&shard->users, user));
+}
+
+// Função que diz se as entregas ao usuário online devem esperar na fila dele: a
+// conexão está congestionada ou ainda há entregas retidas que precisam sair antes
+// (as já enviadas que aguardam ACK não contam)
+int delivery_held(const User* user) {
+    return user->queue.count > user->sent || conn_congested(user->session);
+}
+
+// Função que confirma no log as mensagens retiradas da fila (saem do próximo snapshot)
+static void wal_ack(Shard* shard, const char* nick, uint32_t delivered) {
+    if (delivered == 0)
+        return;
+    char count[4] = { delivered >> 24, delivered >> 16, delivered >> 8, delivered };
+    wal_append(&shard->wal, WAL_ACK, nick, count, sizeof(count));
+}
+
+// Função que serializa a entrada do usuário na lista, com a vírgula que a separa da
+// anterior. Retorna o tamanho escrito.
+static size_t list_entry(char* out, const char* nick, const User* user, const UserProfile* profile) {
+    size_t n = sprintf(out, ",{\"nick\":\"");
+    n += json_escape(out + n, nick, strlen(nick));
+    n += sprintf(out + n, "\",\"online\":%d,\"name\":\"", user->online);
+    n += json_escape(out + n, profile->name, strlen(profile->name));
+    n += sprintf(out + n, "\"}");
+    return n;
+}
+
+// Tamanho máximo de uma entrada serializada
+#define MAX_LIST_ENTRY (64 + 2 * (MAX_NICK_LEN + MAX_NAME_LEN))
+
+// Função que acrescenta a entrada do usuário no fim da lista serializada do shard
+static void list_cache_append(Shard* shard, User* user) {
+    ListCache* list = &shard->list;
+    if (list->len + MAX_LIST_ENTRY > list->cap) {
+        while (list->len + MAX_LIST_ENTRY > list->cap)
+            list->cap = list->cap ? list->cap * 2 : 4096;
+        list->data = realloc(list->data, list->cap);
+    }
+
+    // Guardando a posição do dígito de "online" para as atualizações
+    size_t len = list_entry(list->data + list->len, user_nick(shard, user), user, user_profile(shard, user));
+    char* online = memmem(list->data + list->len, len, "\",\"online\":", 11);
+    user->list_offset = online + 11 - list->data;
+    list->len += len;
+}
+
+// Função que refaz a lista serializada do shard (depois de remoções ou na primeira consulta)
+static void list_cache_rebuild(Shard* shard) {
+    shard->list.len = 0;
+    for (int i = 0; i < user_table_count(&shard->users); i++)
+        list_cache_append(shard, user_table_at(&shard->users, i));
+    shard->list.valid = 1;
+}
+
+// Função que atualiza na lista serializada o estado online do usuário, trocando só
+// o dígito dentro da entrada
+static void list_cache_update(Shard* shard, User* user) {
+    if (shard->list.valid)
+        shard->list.data[user->list_offset] = '0' + user->online;
+}
+
+// Função que codifica uma mudança da lista ou do estado de um contato no protocolo
+// da conexão. Retorna o tamanho.
+size_t presence_encode(int mode, char* out, int event, const char* nick, const char* name) {
+    if (mode == MODE_BINARY)
+        return proto_encode(out, OP_PRESENCE, nick, strlen(nick), name, strlen(name), event);
+
+    size_t n = sprintf(out, "PRESENCE{\"nick\":\"");
+    n += json_escape(out + n, nick, strlen(nick));
+    if (event == PRESENCE_DELETED)
+        return n + sprintf(out + n, "\",\"deleted\":1}\n");
+
+    n += sprintf(out + n, "\",\"online\":%d", event == PRESENCE_ONLINE);
+    if (event == PRESENCE_REGISTERED) {
+        n += sprintf(out + n, ",\"name\":\"");
+        n += json_escape(out + n, name, strlen(name));
+        n += sprintf(out + n, "\"");
+    }
+    return n + sprintf(out + n, "}\n");
+}
+
+// Função que entrega uma mudança da lista às conexões do shard inscritas nela
+static void list_change_received(Shard* shard, int event, const char* nick, const char* name) {
+    for (int i = 0; i < shard->list_sub_count; i++) {
+        Connection* conn = shard->connections[shard->list_subs[i]];
+        char out[PROTO_HEADER_LEN + MAX_LIST_ENTRY];
+        size_t len = presence_encode(conn->mode, out, event, nick, name);
+
+        if (conn->list_sub == LIST_SUB_ACTIVE) {
+            conn_send(conn, out, len);
+            continue;
+        }
+
+        // A lista inicial ainda não saiu: a mudança vai logo depois dela
+        if (conn->sub_hold_len + len > conn->sub_hold_cap) {
+            while (conn->sub_hold_len + len > conn->sub_hold_cap)
+                conn->sub_hold_cap = conn->sub_hold_cap ? conn->sub_hold_cap * 2 : 1024;
+            conn->sub_hold = realloc(conn->sub_hold, conn->sub_hold_cap);
+        }
+        memcpy(conn->sub_hold + conn->sub_hold_len, out, len);
+        conn->sub_hold_len += len;
+    }
+}
+
+// Função que avisa todos os shards de uma mudança na lista de usuários. Sem nenhum
+// inscrito no servidor não há custo além da leitura do contador.
+static void publish_list_change(Shard* shard, int event, const char* nick, const char* name) {
+    if (atomic_load_explicit(&list_subscribers, memory_order_acquire) == 0)
+        return;
+
+    size_t nick_len = strlen(nick), name_len = strlen(name);
+    for (int i = 0; i < shard_count; i++) {
+        if (i == shard->id) {
+            list_change_received(shard, event, nick, name);
+            continue;
+        }
+
+        // Dados: apelido e nome, cada um terminado em '\0'
+        ShardMsg* msg = shard_post(shard, i, MSG_PRESENCE, nick_len + 1 + name_len);
+        msg->session_op = event;
+        memcpy(msg->data, nick, nick_len);
+        memcpy(msg->data + nick_len + 1, name, name_len);
+    }
+}
+
+// Função que altera o estado online do usuário, mantendo a lista e os inscritos atualizados
+static void set_online(Shard* shard, User* user, int online, ConnRef session) {
+    user->online = online;
+    user->session = session;
+    // Entregas sem ACK voltam a ser pendentes: a próxima sessão as recebe de novo
+    user->sent = 0;
+    user->acks = 0;
+    list_cache_update(shard, user);
+    const char* nick = user_nick(shard, user);
+    publish_list_change(shard, online ? PRESENCE_ONLINE : PRESENCE_OFFLINE, nick, "");
+    presence_publish(shard, nick, online ? PRESENCE_ONLINE : PRESENCE_OFFLINE);
 }
 
 // Função que registra um novo usuário no sistema
-int register_user(const char* nick, const char* name) {
+int register_user(Shard* shard, const char* nick, const char* name, size_t name_len) {
     // Verificando se já existe o apelido
-    if (find_user(nick) != NULL)
+    if (find_user(shard, nick) != NULL)
         return -1;
 
-    // Verificando se já atingiu o limite máximo de usuários
-    if (user_count > MAX_USERS)
+    // Criando novo usuário (sem memória disponível não há como registrar)
+    User* new_user = user_table_add(&shard->users, nick);
+    if (new_user == NULL)
         return -2;
-
-    // Criando novo usuário
-    User* new_user = &users[user_count];
-    strcpy(new_user->nick, nick);
-    strcpy(new_user->name, name);
+    UserProfile* profile = user_profile(shard, new_user);
+    memcpy(profile->name, name, name_len);
+    profile->name[name_len] = '\0';
 
     new_user->online = 0;       // Inicia como offline
-    new_user->socket = -1;      // Nenhum socket associado ainda
+    new_user->session.fd = -1;  // Nenhum socket associado ainda
+    bucket_init(&new_user->bucket, &user_rate_limit, stats_now());
+
+    wal_append(&shard->wal, WAL_REGISTER, nick, name, name_len);
 
-    init_user_queue(new_user);  // Inicializa a fila de mensagens
+    if (shard->list.valid)
+        list_cache_append(shard, new_user);
+    publish_list_change(shard, PRESENCE_REGISTERED, nick, profile->name);
 
-    user_count++;
     return 0;
 }
 
 // Função que deleta um usuário do sistema
-int delete_user(const char* nick, int requester_socket) {
+int delete_user(Shard* shard, const char* nick, ConnRef requester) {
     
-    User* user = NULL;
-    int user_index = -1;
-
-    // Busca o usuário e índice de usuário
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].nick, nick) == 0) {
-            user = &users[i];
-            user_index = i;
-            break;
-        }
-    }
+    User* user = find_user(shard, nick);
 
     // Verificando se o usuário existe/foi encontrado
     if (user == NULL) 
         return -1;
     
     // Verificando autorização (se é o mesmo que requisitou)
-    if (user->online && user->socket != requester_socket)
+    if (user->online && !same_conn(user->session, requester))
         return -2;
 
     // Verificando se precisa fazer logout primeiro
     if (user->online)
         return -3;
 
-    // Liberar memória
-    init_user_queue(user);
+    // Liberar memória das mensagens pendentes e das conversas
+    queue_clear(&shard->slab, &user->queue);
+    conv_clear(&shard->arena, &user->conversations);
 
-    // Removendo usuário do array (usando shift left)
-    for (int i = user_index; i < user_count; i++) {
-        users[i] = user[i + 1];
-    }
-    user_count--;
+    // Removendo usuário da tabela (O(1), sem deslocar os demais)
+    user_table_remove(&shard->users, user);
+
+    wal_append(&shard->wal, WAL_DELETE, nick, NULL, 0);
+
+    // A remoção desloca as entradas seguintes: a lista é refeita na próxima consulta
+    shard->list.valid = 0;
+    publish_list_change(shard, PRESENCE_DELETED, nick, "");
+    presence_publish(shard, nick, PRESENCE_DELETED);
 
     return 0;
 }
 
-// Função que realiza login do usuário no sistema
-int login_user(const char* nick, int socket) {
-    User* user = find_user(nick);
+// Função que retira da fila as `count` primeiras mensagens, já recebidas pelo cliente
+static void drop_received(Shard* shard, User* user, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++)
+        queue_pop(&shard->slab, &user->queue, NULL);
+    user->acked_seq += count;
+    wal_ack(shard, user_nick(shard, user), count);
+}
+
+// Função que realiza login do usuário no sistema. As mensagens pendentes não saem
+// aqui: elas seguem a resposta do LOGIN aos poucos (ver queue_stream). Com
+// confirmação, `last_seen` é a última sequência que o cliente já tem: a retomada
+// começa depois dela.
+int login_user(Shard* shard, const char* nick, ConnRef session, int acks, uint64_t last_seen) {
+    User* user = find_user(shard, nick);
     if (user == NULL)
         return -1;
     
     if (user->online)
         return -2;
     
-    user->online = 1;
-    user->socket = socket;
-
-    // Entregando mensagens pendentes (store-and-forward)
-    while (user->queue_size > 0) {
-        char* msg = pop_from_queue(user);
-        
-        if (msg) {
-            // Verifica se o envio foi bem-sucedido antes de liberar a memória
-            int bytes_sent = send(socket, msg, strlen(msg), 0);
-            if (bytes_sent > 0) {
-                printf("Mensagem pendente entregue para %s: %s\n", nick, msg);
-            } else {
-                // Se falhou, recoloca a mensagem na fila
-                printf("Falha ao entregar mensagem pendente para %s\n", nick);
-                add_to_queue(user, msg);  // Recoloca na fila
-            }
-            free(msg);  // Libera a memória em ambos os casos
-        }
+    set_online(shard, user, 1, session);
+    user->acks = acks;
+    if (acks && last_seen > user->acked_seq) {
+        uint64_t seen = last_seen - user->acked_seq;
+        drop_received(shard, user, seen < user->queue.count ? (uint32_t)seen : user->queue.count);
     }
-    
+    if (user->queue.count > 0)
+        LOG(LOG_DEBUG, "%u mensagens pendentes para %s", user->queue.count, nick);
+
+    return 0;
+}
+
+// Função que confirma as entregas da sessão até a sequência `seq` (cumulativo): elas
+// saem da fila. Sequências ainda não enviadas são ignoradas.
+int ack_messages(Shard* shard, const char* nick, ConnRef session, uint64_t seq) {
+    User* user = find_user(shard, nick);
+    if (user == NULL || !user->online || !same_conn(user->session, session) || !user->acks)
+        return -1;
+    if (seq <= user->acked_seq)
+        return 0;
+
+    uint32_t count = seq - user->acked_seq < user->sent ? (uint32_t)(seq - user->acked_seq) : user->sent;
+    drop_received(shard, user, count);
+    user->sent -= count;
+
     return 0;
 }
 
 // Função que realiza logout do usuário do sistema
-int logout_user(const char* nick, int socket) {
+int logout_user(Shard* shard, const char* nick, ConnRef session) {
 
     // Verificando se o usuário existe
-    User* user = find_user(nick);
+    User* user = find_user(shard, nick);
     if (user == NULL)
         return -1;
 
     // Verificando se o usuário esta online e se o socket é o correto
-    if (!user->online || (user->socket != socket))
+    if (!user->online || !same_conn(user->session, session))
         return -2;
 
     // Atualizando estado do usuário
-    user->online = 0;
-    user->socket = -1;
+    ConnRef none = { 0, -1, 0, 0 };
+    set_online(shard, user, 0, none);
 
     return 0;
 }
 
-// Função que lista todos os usuários do sistema
-char* list_users() {
-    // Buffer estatico para retorno
-    static char list_buffer[4096];
-    char temp[256];
-    strcpy(list_buffer, "USERS{users:[");
+// Funções que retornam o início e o fim da entrada que contém `p` na lista serializada.
+// Valores escapados nunca têm aspas sem barra antes, então ,{" só aparece entre entradas.
+static const char* entry_start(const char* p, const char* begin) {
+    while (p > begin && !(p[0] == ',' && p[1] == '{' && p[2] == '"'))
+        p--;
+    return p;
+}
+
+static const char* entry_end(const char* p, const char* end) {
+    const char* next = memmem(p + 1, end - p - 1, ",{\"", 3);
+    return next ? next : end;
+}
+
+// Função que monta a parte do shard na lista de usuários: as entradas (",{...}") cujo
+// apelido começa com o prefixo, no máximo `limit` (0 = todas). As entradas são
+// copiadas da lista serializada, sem formatar nada de novo.
+static ListPart list_users(Shard* shard, const ListQuery* query, uint32_t limit) {
+    ListPart part = { NULL, 0, 0 };
+    ListCache* list = &shard->list;
+    if (!list->valid)
+        list_cache_rebuild(shard);
+
+    // Sem filtro nem página: a parte inteira de uma vez
+    size_t prefix_len = strlen(query->prefix);
+    int count = user_table_count(&shard->users);
+    if (prefix_len == 0 && limit == 0) {
+        part.data = malloc(list->len + 1);
+        memcpy(part.data, list->data, list->len);
+        part.len = list->len;
+        part.total = count;
+        return part;
+    }
+
+    // O filtro só percorre o array de apelidos
+    part.data = malloc(list->len + 1);
+    for (int i = 0; i < count; i++) {
+        if (strncmp(user_table_nick(&shard->users, i), query->prefix, prefix_len) != 0)
+            continue;
+        User* user = user_table_at(&shard->users, i);
+
+        if (limit == 0 || part.total < limit) {
+            const char* online = list->data + user->list_offset;
+            const char* start = entry_start(online, list->data);
+            const char* end = entry_end(online, list->data + list->len);
+            memcpy(part.data + part.len, start, end - start);
+            part.len += end - start;
+        }
+        part.total++;
+    }
+    return part;
+}
+
+// Função que envia à sessão do usuário as entregas da fila que ela ainda não recebeu
+// (pendentes do LOGIN ou retidas pelo congestionamento), no máximo RESUME_BUDGET bytes
+// por vez para não monopolizar o shard; se sobrar algo a conexão pede de novo ao
+// esvaziar. Sem confirmação as mensagens saem da fila; com ela ficam até o ACK.
+void queue_stream(Shard* shard, User* user) {
+    if (user == NULL || !user->online || user->sent >= user->queue.count)
+        return;
+
+    ConnRef session = user->session;
+    char record[MAX_RECORD_LEN + 1];
+    size_t len, bytes = 0;
+    uint32_t delivered = 0, popped = 0;
+    while (bytes < RESUME_BUDGET && user->sent < user->queue.count) {
+        if (user->acks) {
+            len = record_peek(shard, &user->queue, user->sent, record);
+            if (len == 0 && user->sent == 0) {
+                // Registro ilegível no início da fila: sai como se confirmado
+                LOG(LOG_WARN, "Registro inválido descartado da fila de %s", user_nick(shard, user));
+                drop_received(shard, user, 1);
+                continue;
+            }
+            // No meio da fila ele só consome a sequência; o próximo ACK o retira
+            user->sent++;
+            if (len == 0) {
+                LOG(LOG_WARN, "Registro inválido ignorado na fila de %s", user_nick(shard, user));
+                continue;
+            }
+            deliver(shard, session, record, len, user->acked_seq + user->sent);
+        } else {
+            len = record_pop(shard, &user->queue, record);
+            user->acked_seq++;
+            popped++;
+            if (len == 0) {
+                LOG(LOG_WARN, "Registro inválido descartado da fila de %s", user_nick(shard, user));
+                continue;
+            }
+            deliver(shard, session, record, len, 0);
+        }
+        bytes += len;
+        delivered++;
+    }
+    if (!user->acks)
+        wal_ack(shard, user_nick(shard, user), popped);
+    atomic_fetch_add_explicit(&shard->flow.resumed, delivered, memory_order_relaxed);
+
+    if (user->sent == user->queue.count)
+        return;
+    if (conn_target(session) == shard->id) {
+        Connection* conn = conn_lookup(shard, session);
+        if (conn != NULL)
+            conn_spill_pending(conn);
+        return;
+    }
+    ShardMsg* msg = shard_post(shard, conn_target(session), MSG_SPILL_PENDING, 0);
+    msg->conn = session;
+}
 
-    // Construindo a lista de usuários em formato JSON
-    int first = 1;
-    for (int i = 0; i < user_count; i++) {
-        if (!first)
-            strcat(list_buffer, ",");
-        snprintf(temp, sizeof(temp), "{\"nick\":\"%s\",\"online\":%d,\"name\":\"%s\"}", users[i].nick, users[i].online, users[i].name);
-        strcat(list_buffer, temp);
+// Função que retoma as entregas pedidas pela conexão `session` ao sair do congestionamento
+static void resume_deliveries(Shard* shard, const char* nick, ConnRef session) {
+    User* user = find_user(shard, nick);
+    if (user != NULL && user->online && same_conn(user->session, session))
+        queue_stream(shard, user);
+}
 
-        first = 0;
+// Função chamada quando a conexão sai do congestionamento: pede ao shard dono do usuário
+// logado as entregas retidas
+void request_resume(Shard* shard, Connection* conn) {
+    if (conn->nick[0] == '\0')
+        return;
+
+    ConnRef ref = conn_ref(shard, conn);
+    int target = owner_target(conn->nick);
+    if (target == shard->id) {
+        resume_deliveries(shard, conn->nick, ref);
+        return;
     }
 
-    strcat(list_buffer, "]}");
+    size_t len = strlen(conn->nick);
+    ShardMsg* msg = shard_post(shard, target, MSG_RESUME, len);
+    msg->conn = ref;
+    memcpy(msg->data, conn->nick, len);
+}
+
+// Função que guarda a sequência aceita do remetente na conversa, para reconhecer reenvios
+static void conversation_accept(Shard* shard, User* receiver, const char* from, uint64_t seq) {
+    if (seq == 0)
+        return;
+    size_t from_len = strlen(from);
+    int32_t id = name_intern(shard, from, from_len);
+    if (id < 0 || conv_accept(&shard->arena, &receiver->conversations, id, seq) < 0) {
+        LOG(LOG_ERROR, "Sem memória para a conversa de %s com %s", from, user_nick(shard, receiver));
+        return;
+    }
 
-    return list_buffer;
+    char data[8 + MAX_NICK_LEN];
+    put_u64(data, seq);
+    memcpy(data + 8, from, from_len);
+    wal_append(&shard->wal, WAL_CONV, user_nick(shard, receiver), data, 8 + from_len);
 }
 
 // Função que envia uma mensagem de um usuário para outro
-int send_message(const char* from, const char* to, const char* text) {
+// O remetente é o usuário logado na conexão de origem, validado pelo shard dela.
+// `seq` (0 = sem) numera a mensagem na conversa do remetente com o destinatário.
+// Retorna 1 se o destinatário está online mas congestionado (a mensagem esperou na
+// fila) e 2 se a sequência já foi aceita (reenvio, nada é entregue de novo); -4 se a
+// fila do destinatário chegou à cota.
+int send_message(Shard* shard, const char* from, const char* to, const char* text, size_t text_len, uint64_t seq) {
 
-    User* sender = find_user(from);
-    User* receiver = find_user(to);
+    User* receiver = find_user(shard, to);
 
     // Verificando se o destinatário existe
     if (receiver == NULL) 
         return -1;
     
-    // Verificando se o remetente existe e esta online
-    if (sender == NULL || !sender->online)
+    // Verificando se há remetente logado
+    if (from[0] == '\0')
         return -2;
 
-    // Criando timestamp e formatando mensagem de entrega
+    // Reenvio de uma mensagem já aceita
+    if (seq != 0) {
+        int32_t id = user_table_lookup(&shard->names, from);
+        if (id >= 0 && seq <= conv_last(&shard->arena, &receiver->conversations, id))
+            return 2;
+    }
+
+    // Criando timestamp e montando o registro de entrega
     time_t now = time(NULL);
-    char deliver_msg[512];
-    snprintf(deliver_msg, sizeof(deliver_msg), "DELIVER_MSG{\"from\":\"%s\",\"text\":\"%s\",\"ts\":%ld}", from, text, now);
+    char record[MAX_RECORD_LEN];
+    size_t len = delivery_encode(record, from, text, text_len, now);
     
     // Entregas
-    if (receiver->online)
+    int held = receiver->online && delivery_held(receiver);
+    if (receiver->online && !held && !receiver->acks) {
         // Entrega imediata se online
-        send(receiver->socket, deliver_msg, strlen(deliver_msg), 0);
-    else
-        // Entrega store-and-forward se offline
-        add_to_queue(receiver, deliver_msg);
-    
+        deliver(shard, receiver->session, record, len, 0);
+        conversation_accept(shard, receiver, from, seq);
+        history_record(shard, to, record, len);
+        return 0;
+    }
+
+    // Entrega store-and-forward se offline, com a conexão congestionada ou se a sessão
+    // confirma as entregas (a mensagem fica na fila até o ACK), dentro da cota da fila
+    if (queue_quota > 0 && receiver->queue.count >= queue_quota) {
+        atomic_fetch_add_explicit(&shard->flow.over_quota, 1, memory_order_relaxed);
+        return -4;
+    }
+    if (record_push(shard, &receiver->queue, record, len) < 0)
+        return -3;
+    wal_append(&shard->wal, WAL_ENQUEUE, to, record, len);
+    conversation_accept(shard, receiver, from, seq);
+    history_record(shard, to, record, len);
+    if (receiver->online && !held) {
+        queue_stream(shard, receiver);
+        return 0;
+    }
+    if (receiver->online) {
+        atomic_fetch_add_explicit(&shard->flow.spilled, 1, memory_order_relaxed);
+        return 1;
+    }
+
     return 0;
 }
 
-// Função que gerencia a comunicação com o cliente
-void handle_client(int client_socket) {
-    char buffer[MAX_MSG_LEN];
+// Função que interpreta o texto de um comando; `text` recebe o nome ou o texto da
+// mensagem. Retorna NULL em caso de sucesso ou a resposta de erro a ser enviada.
+static const char* parse_command(const char* buffer, Command* cmd, char* text) {
+    memset(cmd, 0, sizeof(*cmd));
+    text[0] = '\0';
+    cmd->text = text;
+
+    if (strncmp(buffer, "REGISTER", 8) == 0) {
+        // REGISTER {apelido, nome}; apelidos começando com '#' são nomes de grupo
+        cmd->op = CMD_REGISTER;
+        if (sscanf(buffer, "REGISTER {%49[^,], %99[^}]}", cmd->nick, text) != 2 || cmd->nick[0] == '#')
+            return "ERROR{BAD_FORMAT}";
+    }
+    else if (strncmp(buffer, "DELETE", 6) == 0) {
+        // DELETE {apelido}
+        cmd->op = CMD_DELETE;
+        if (sscanf(buffer, "DELETE {%49[^}]}", cmd->nick) != 1)
+            return "ERROR{BAD_FORMAT}";
+    }
+    else if (strncmp(buffer, "LOGIN", 5) == 0) {
+        // LOGIN {apelido} ou LOGIN {apelido, ACK} (entregas confirmadas com ACK)
+        cmd->op = CMD_LOGIN;
+        // LOGIN {apelido, ACK, última}: retoma depois da última sequência já recebida
+        char mode[8];
+        unsigned long long last = 0;
+        int n = sscanf(buffer, "LOGIN {%49[^,}], %7[^,}], %llu}", cmd->nick, mode, &last);
+        if (n < 1 || (n >= 2 && strcmp(mode, "ACK") != 0))
+            return "ERROR{BAD_FORMAT}";
+        cmd->acks = n >= 2;
+        cmd->seq = last;
+    }
+    else if (strncmp(buffer, "ACK", 3) == 0) {
+        // ACK {sequência}: confirma as entregas até ela
+        cmd->op = CMD_ACK;
+        unsigned long long seq;
+        if (sscanf(buffer, "ACK {%llu}", &seq) != 1)
+            return "ERROR{BAD_FORMAT}";
+        cmd->seq = seq;
+    }
+    else if (strncmp(buffer, "LOGOUT", 6) == 0) {
+        // LOGOUT {apelido}
+        cmd->op = CMD_LOGOUT;
+        if (sscanf(buffer, "LOGOUT {%49[^}]}", cmd->nick) != 1)
+            return "ERROR{BAD_FORMAT}";
+    }
+    else if (strncmp(buffer, "SUBSCRIBE", 9) == 0) {
+        // SUBSCRIBE {contato}
+        cmd->op = CMD_SUBSCRIBE;
+        if (sscanf(buffer, "SUBSCRIBE {%49[^}]}", cmd->nick) != 1)
+            return "ERROR{BAD_FORMAT}";
+    }
+    else if (strncmp(buffer, "UNSUBSCRIBE", 11) == 0) {
+        // UNSUBSCRIBE {contato}
+        cmd->op = CMD_UNSUBSCRIBE;
+        if (sscanf(buffer, "UNSUBSCRIBE {%49[^}]}", cmd->nick) != 1)
+            return "ERROR{BAD_FORMAT}";
+    }
+    else if (strncmp(buffer, "JOIN", 4) == 0) {
+        // JOIN {#grupo}
+        cmd->op = CMD_JOIN;
+        if (sscanf(buffer, "JOIN {%49[^}]}", cmd->nick) != 1 || !group_name_valid(cmd->nick))
+            return "ERROR{BAD_FORMAT}";
+    }
+    else if (strncmp(buffer, "LEAVE", 5) == 0) {
+        // LEAVE {#grupo}
+        cmd->op = CMD_LEAVE;
+        if (sscanf(buffer, "LEAVE {%49[^}]}", cmd->nick) != 1 || !group_name_valid(cmd->nick))
+            return "ERROR{BAD_FORMAT}";
+    }
+    else if (strncmp(buffer, "HISTORY", 7) == 0) {
+        // HISTORY {contato}: as últimas mensagens da conversa com o contato;
+        // HISTORY {contato, SEQ|TS, início, fim[, quantidade]}: faixa de sequências ou timestamps
+        cmd->op = CMD_HISTORY;
+        char range[4];
+        unsigned long long start = 0, end = 0;
+        int n = sscanf(buffer, "HISTORY {%49[^,}], %3[^,}], %llu, %llu, %u}", cmd->nick, range,
+                       &start, &end, &cmd->count);
+        if (n == 1)
+            cmd->range = HISTORY_LAST;
+        else if (n >= 4 && strcmp(range, "SEQ") == 0)
+            cmd->range = HISTORY_SEQ;
+        else if (n >= 4 && strcmp(range, "TS") == 0)
+            cmd->range = HISTORY_TS;
+        else
+            return "ERROR{BAD_FORMAT}";
+        cmd->seq = start;
+        cmd->end = end;
+    }
+    else if (strncmp(buffer, "SEARCH", 6) == 0) {
+        // SEARCH {termos}: mensagens das conversas do usuário com todos os termos
+        cmd->op = CMD_SEARCH;
+        if (sscanf(buffer, "SEARCH {%255[^}]}", text) != 1)
+            return "ERROR{BAD_FORMAT}";
+    }
+    else if (strncmp(buffer, "STATS", 5) == 0) {
+        cmd->op = CMD_STATS;
+    }
+    else if (strncmp(buffer, "LIST_SUBSCRIBE", 14) == 0) {
+        // LIST_SUBSCRIBE: lista completa e depois as mudanças (PRESENCE{...})
+        cmd->op = CMD_LIST_SUBSCRIBE;
+    }
+    else if (strncmp(buffer, "LIST_UNSUBSCRIBE", 16) == 0) {
+        cmd->op = CMD_LIST_UNSUBSCRIBE;
+    }
+    else if (strncmp(buffer, "LIST", 4) == 0) {
+        // LIST, LIST {prefixo} ou LIST {prefixo, início, quantidade}
+        cmd->op = CMD_LIST;
+        const char* open = strchr(buffer, '{');
+        if (open != NULL) {
+            size_t len = strcspn(open + 1, ",}");
+            if (len >= MAX_NICK_LEN || open[1 + len] == '\0')
+                return "ERROR{BAD_FORMAT}";
+            memcpy(cmd->nick, open + 1, len);
+            if (open[1 + len] == ',' &&
+                sscanf(open + 1 + len, ", %u, %u}", &cmd->offset, &cmd->count) != 2)
+                return "ERROR{BAD_FORMAT}";
+        }
+    }
+    else if (strncmp(buffer, "SEND_MSG_SEQ", 12) == 0) {
+        // SEND_MSG_SEQ {destinatário, sequência, texto}: reenvios com a mesma sequência
+        // não são entregues de novo
+        cmd->op = CMD_SEND_MSG;
+        unsigned long long seq;
+        if (sscanf(buffer, "SEND_MSG_SEQ {%49[^,], %llu, %255[^}]}", cmd->nick, &seq, text) != 3 ||
+            seq == 0 || cmd->nick[0] == '#')
+            return "ERROR{BAD_FORMAT}";
+        cmd->seq = seq;
+    }
+    else if (strncmp(buffer, "SEND_MSG", 8) == 0) {
+        // SEND_MSG {destinatário, texto} ou SEND_MSG {#grupo, texto}
+        cmd->op = CMD_SEND_MSG;
+        if (sscanf(buffer, "SEND_MSG {%49[^,], %255[^}]}", cmd->nick, text) != 2)
+            return "ERROR{BAD_FORMAT}";
+    }
+    else {
+        // Nenhum dos comandos anteriores
+        return "ERROR{UNKNOWN_COMMAND}";
+    }
+
+    cmd->text_len = strlen(text);
+    return NULL;
+}
+
+// Função que interpreta um frame binário. Os campos continuam no buffer de leitura
+// da conexão; só o apelido é copiado. Retorna NULL ou a resposta de erro.
+static const char* parse_binary(const ProtoFrame* frame, Command* cmd) {
+    memset(cmd, 0, sizeof(*cmd));
+
+    switch (frame->op) {
+    case OP_REGISTER: cmd->op = CMD_REGISTER; break;
+    case OP_DELETE:   cmd->op = CMD_DELETE;   break;
+    case OP_LOGIN:    cmd->op = CMD_LOGIN;    cmd->acks = frame->arg == 1; break;
+    case OP_LOGOUT:   cmd->op = CMD_LOGOUT;   break;
+    case OP_LIST_SUBSCRIBE:   cmd->op = CMD_LIST_SUBSCRIBE;   return NULL;
+    case OP_LIST_UNSUBSCRIBE: cmd->op = CMD_LIST_UNSUBSCRIBE; return NULL;
+    case OP_STATS:            cmd->op = CMD_STATS;            return NULL;
+    case OP_ACK:
+        cmd->op = CMD_ACK;
+        cmd->seq = frame->arg;
+        return NULL;
+    case OP_LIST:
+        // A = prefixo, arg = início << 32 | quantidade
+        cmd->op = CMD_LIST;
+        if (frame->a_len >= MAX_NICK_LEN || memchr(frame->a, '\0', frame->a_len))
+            return "ERROR{BAD_FORMAT}";
+        memcpy(cmd->nick, frame->a, frame->a_len);
+        cmd->offset = frame->arg >> 32;
+        cmd->count = (uint32_t)frame->arg;
+        return NULL;
+    case OP_SEARCH:
+        // B = termos
+        cmd->op = CMD_SEARCH;
+        if (frame->b_len == 0 || frame->b_len > MAX_TEXT_LEN)
+            return "ERROR{BAD_FORMAT}";
+        cmd->text = frame->b;
+        cmd->text_len = frame->b_len;
+        return NULL;
+    case OP_SEND_MSG: cmd->op = CMD_SEND_MSG; break;
+    case OP_SUBSCRIBE:   cmd->op = CMD_SUBSCRIBE;   break;
+    case OP_UNSUBSCRIBE: cmd->op = CMD_UNSUBSCRIBE; break;
+    case OP_JOIN:        cmd->op = CMD_JOIN;        break;
+    case OP_LEAVE:       cmd->op = CMD_LEAVE;       break;
+    case OP_HISTORY:     cmd->op = CMD_HISTORY;     break;
+    default:
+        return "ERROR{UNKNOWN_COMMAND}";
+    }
 
-    while (1){
-        // Limpando buffer
-        memset(buffer, 0, sizeof(buffer));
+    // Apelido: não vazio, cabe no campo e não contém '\0'
+    if (frame->a_len == 0 || frame->a_len >= MAX_NICK_LEN || memchr(frame->a, '\0', frame->a_len))
+        return "ERROR{BAD_FORMAT}";
+    memcpy(cmd->nick, frame->a, frame->a_len);
+
+    cmd->text = frame->b;
+    cmd->text_len = frame->b_len;
+    if (cmd->op == CMD_REGISTER && (cmd->text_len == 0 || cmd->text_len >= MAX_NAME_LEN ||
+                                    memchr(cmd->text, '\0', cmd->text_len) || cmd->nick[0] == '#'))
+        return "ERROR{BAD_FORMAT}";
+    if ((cmd->op == CMD_JOIN || cmd->op == CMD_LEAVE) && !group_name_valid(cmd->nick))
+        return "ERROR{BAD_FORMAT}";
+    if (cmd->op == CMD_SEND_MSG && (cmd->text_len == 0 || cmd->text_len > MAX_TEXT_LEN))
+        return "ERROR{BAD_FORMAT}";
+
+    // SEND_MSG: arg = sequência na conversa (só para usuários); LOGIN: B = última recebida
+    if (cmd->op == CMD_SEND_MSG) {
+        cmd->seq = frame->arg;
+        if (cmd->seq != 0 && cmd->nick[0] == '#')
+            return "ERROR{BAD_FORMAT}";
+    }
+    if (cmd->op == CMD_LOGIN && cmd->text_len == 8)
+        cmd->seq = get_u64(cmd->text);
+
+    // HISTORY: arg = início; B vazio = as últimas `arg` mensagens, ou fim (u64) e quantidade (u32)
+    if (cmd->op == CMD_HISTORY) {
+        cmd->seq = frame->arg;
+        if (cmd->text_len == 0) {
+            cmd->range = HISTORY_LAST;
+            cmd->count = frame->arg > HISTORY_PAGE_MAX ? HISTORY_PAGE_MAX : (uint32_t)frame->arg;
+        } else if (cmd->text_len == 12) {
+            cmd->range = frame->flags & PROTO_FLAG_TS ? HISTORY_TS : HISTORY_SEQ;
+            cmd->end = get_u64(cmd->text);
+            cmd->count = get_u32(cmd->text + 8);
+        } else {
+            return "ERROR{BAD_FORMAT}";
+        }
+        cmd->text_len = 0;
+    }
+
+    return NULL;
+}
 
-        // Recebendo dados do cliente
-        int bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
+// Função que codifica uma resposta ("OK", "OK{apelido}" ou "ERROR{codigo}") no protocolo
+// da conexão. Retorna o tamanho escrito em `out`.
+static size_t encode_response(int mode, const char* response, char* out) {
+    if (mode == MODE_TEXT)
+        return sprintf(out, "%s\n", response);
 
-        // Verificando se o cliente desconectou
-        if (bytes_received <= 0) {
-            for (int i = 0; i < user_count; i++) {
-                if (users[i].socket == client_socket) {
-                    users[i].online = 0;
-                    users[i].socket = -1;
-                    printf("Cliente desconectado: %s\n", users[i].nick);
+    // No modo binário o conteúdo entre chaves vai no campo A
+    const char* open = strchr(response, '{');
+    const char* arg = open ? open + 1 : "";
+    size_t arg_len = open ? strlen(arg) - 1 : 0;
+    uint8_t op = strncmp(response, "OK", 2) == 0 ? OP_OK : OP_ERROR;
+
+    return proto_encode(out, op, arg, arg_len, NULL, 0, 0);
+}
+
+// Função que aplica na conexão o resultado de um comando e escreve a resposta na ordem
+static void complete_request(Connection* conn, uint32_t seq, int session_op, const char* data, size_t len) {
+    // Atualizando a sessão da conexão
+    if (session_op == SESSION_LOGIN)
+        strcpy(conn->nick, conn->pending_nick);
+    else if (session_op == SESSION_LOGOUT && strcmp(conn->nick, conn->pending_nick) == 0)
+        conn->nick[0] = '\0';
+
+    // LOGIN/LOGOUT é sempre o último comando despachado enquanto a conexão espera
+    if (conn->blocked && seq == conn->next_seq - 1) {
+        conn->blocked = 0;
+        conn->pending_nick[0] = '\0';
+    }
+
+    conn_complete_reply(conn, seq, data, len);
+}
+
+// Função que leva a resposta já codificada à conexão de origem, aqui ou no shard dela
+static void reply_to(Shard* shard, Request* req, const char* data, size_t len, int session_op) {
+    if (conn_target(req->conn) == shard->id) {
+        Connection* conn = conn_lookup(shard, req->conn);
+        if (conn != NULL)
+            complete_request(conn, req->seq, session_op, data, len);
+        return;
+    }
+
+    ShardMsg* msg = shard_post(shard, conn_target(req->conn), MSG_REPLY, len);
+    msg->conn = req->conn;
+    msg->seq = req->seq;
+    msg->session_op = session_op;
+    memcpy(msg->data, data, len);
+}
+
+// Função que envia a resposta de um comando para a conexão de origem
+static void send_response(Shard* shard, Request* req, const char* response, int session_op) {
+    char line[MAX_MSG_LEN];
+    size_t len = encode_response(req->mode, response, line);
+    LOG(LOG_DEBUG, "Sent: %s", response);
+    stats_command(shard, req->op, req->start, response[0] == 'E');
+    reply_to(shard, req, line, len, session_op);
+}
+
+// Página do histórico em montagem
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} HistoryPage;
+
+// Função que acrescenta uma mensagem do histórico à página, com a vírgula que a separa
+// da anterior
+static void history_entry(void* ctx, uint64_t seq, int64_t ts, const char* from, const char* text, size_t len) {
+    HistoryPage* page = ctx;
+    size_t max = 96 + 2 * (MAX_NICK_LEN + len);
+    if (page->len + max > page->cap) {
+        while (page->len + max > page->cap)
+            page->cap *= 2;
+        page->data = realloc(page->data, page->cap);
+    }
+
+    // {"seq":...,"from":"...","text":"...","ts":...}
+    char* out = page->data + page->len;
+    size_t n = sprintf(out, ",{\"seq\":%llu,\"from\":\"", (unsigned long long)seq);
+    n += json_escape(out + n, from, strlen(from));
+    n += sprintf(out + n, "\",\"text\":\"");
+    n += json_escape(out + n, text, len);
+    n += sprintf(out + n, "\",\"ts\":%lld}", (long long)ts);
+    page->len += n;
+}
+
+// Função que responde o HISTORY com uma página da conversa entre o usuário logado e o
+// contato, no shard dono dela. No texto: HISTORY{messages:[...],next:N}; no binário,
+// OP_HISTORY_PAGE com o array JSON em B e a próxima sequência em arg (0 = fim da faixa).
+static void send_history(Shard* shard, Request* req, const Command* cmd) {
+    int binary = req->mode == MODE_BINARY;
+    HistoryPage page = { malloc(4096), 0, 4096 };
+    size_t start = binary ? PROTO_HEADER_LEN : 0;
+    page.len = start + sprintf(page.data + start, binary ? "[" : "HISTORY{messages:[");
+    size_t first = page.len;
+
+    uint64_t next = history_query(shard, req->from, cmd->nick, cmd->range, cmd->seq, cmd->end,
+                                  cmd->count, history_entry, &page);
+
+    // A primeira entrada não leva vírgula
+    if (page.len + 64 > page.cap) {
+        page.cap = page.len + 64;
+        page.data = realloc(page.data, page.cap);
+    }
+    if (page.len > first) {
+        memmove(page.data + first, page.data + first + 1, page.len - first - 1);
+        page.len--;
+    }
+    if (binary) {
+        page.data[page.len++] = ']';
+        char header[PROTO_HEADER_LEN];
+        proto_encode(header, OP_HISTORY_PAGE, NULL, 0, NULL, page.len - PROTO_HEADER_LEN, next);
+        memcpy(page.data, header, PROTO_HEADER_LEN);
+    } else {
+        page.len += sprintf(page.data + page.len, "],next:%llu}\n", (unsigned long long)next);
+    }
+    LOG(LOG_DEBUG, "Sent: HISTORY (%zu bytes)", page.len);
+
+    stats_command(shard, req->op, req->start, 0);
+    reply_to(shard, req, page.data, page.len, SESSION_NONE);
+    free(page.data);
+}
+
+// Função que leva o comando ao shard (ou nó) destino; o texto é copiado uma única
+// vez, para a mensagem entre shards
+static void post_command(Shard* shard, int target, const Request* req, const Command* cmd) {
+    ShardMsg* msg = shard_post(shard, target, MSG_COMMAND, sizeof(Request) + sizeof(Command) + cmd->text_len);
+    memcpy(msg->data, req, sizeof(Request));
+    memcpy(msg->data + sizeof(Request), cmd, sizeof(Command));
+    memcpy(msg->data + sizeof(Request) + sizeof(Command), cmd->text, cmd->text_len);
+}
+
+// Função que gasta uma ficha do limite de mensagens do remetente, no shard dono dele:
+// o balde fica no usuário, então reconectar ou logar de novo não o enche.
+// Retorna -1 se o remetente passou do limite.
+static int sender_take(Shard* shard, const char* from) {
+    User* sender = find_user(shard, from);
+    if (sender == NULL || bucket_take(&sender->bucket, &user_rate_limit, stats_now()) == 0)
+        return 0;
+
+    atomic_fetch_add_explicit(&shard->flow.rate_limited, 1, memory_order_relaxed);
+    return -1;
+}
+
+// Função que executa um comando no shard dono do usuário envolvido
+static void handle_command(Shard* shard, Request* req, Command* cmd) {
+    char response[512];
+    int session_op = SESSION_NONE;
+
+    if (cmd->op == CMD_HISTORY) {
+        send_history(shard, req, cmd);
+        return;
+    }
+
+    // SEND_MSG no shard dono do remetente: conferido o limite dele, segue para o dono
+    // do destinatário (ou do grupo)
+    if (cmd->op == CMD_SEND_MSG && !cmd->charged) {
+        if (sender_take(shard, req->from) < 0) {
+            send_response(shard, req, "ERROR{RATE_LIMITED}", SESSION_NONE);
+            return;
+        }
+        cmd->charged = 1;
+        int target = owner_target(cmd->nick);
+        if (target != shard->id) {
+            post_command(shard, target, req, cmd);
+            return;
+        }
+    }
+
+    if (cmd->op == CMD_REGISTER) {
+        int result = register_user(shard, cmd->nick, cmd->text, cmd->text_len);
+
+        if (result == 0)
+            snprintf(response, sizeof(response), "OK");
+        else if (result == -1)
+            snprintf(response, sizeof(response), "ERROR{NICK_TAKEN}");
+        else
+            snprintf(response, sizeof(response), "ERROR{LIMIT}");
+    }
+    else if (cmd->op == CMD_DELETE) {
+        int result = delete_user(shard, cmd->nick, req->conn);
+        if (result == 0)
+            snprintf(response, sizeof(response), "OK");
+        else if (result == -1)
+            snprintf(response, sizeof(response), "ERROR{NO_SUCH_USER}");
+        else if (result == -2)
+            snprintf(response, sizeof(response), "ERROR{UNAUTHORIZED}");
+        else
+            snprintf(response, sizeof(response), "ERROR{BAD_STATE}");
+    }
+    else if (cmd->op == CMD_LOGIN) {
+        int result = login_user(shard, cmd->nick, req->conn, cmd->acks, cmd->seq);
+        if (result == 0) {
+            snprintf(response, sizeof(response), "OK{%s}", cmd->nick);
+            session_op = SESSION_LOGIN;
+        }
+        else if (result == -1)
+            snprintf(response, sizeof(response), "ERROR{NO_SUCH_USER}");
+        else
+            snprintf(response, sizeof(response), "ERROR{ALREADY_ONLINE}");
+    }
+    else if (cmd->op == CMD_LOGOUT) {
+        int result = logout_user(shard, cmd->nick, req->conn);
+        if (result == 0) {
+            snprintf(response, sizeof(response), "OK");
+            session_op = SESSION_LOGOUT;
+        }
+        else if (result == -1)
+            snprintf(response, sizeof(response), "ERROR{NO_SUCH_USER}");
+        else
+            snprintf(response, sizeof(response), "ERROR{BAD_STATE}");
+    }
+    else if (cmd->op == CMD_ACK) {
+        int result = ack_messages(shard, cmd->nick, req->conn, cmd->seq);
+        if (result == 0)
+            snprintf(response, sizeof(response), "OK");
+        else
+            snprintf(response, sizeof(response), "ERROR{BAD_STATE}");
+    }
+    else if (cmd->op == CMD_SUBSCRIBE) {
+        // A resposta traz o estado atual; as mudanças seguintes chegam em PRESENCE{...}
+        presence_subscribe(shard, cmd->nick, req->conn);
+        User* user = find_user(shard, cmd->nick);
+        snprintf(response, sizeof(response), user && user->online ? "OK{online}" : "OK{offline}");
+    }
+    else if (cmd->op == CMD_UNSUBSCRIBE) {
+        presence_unsubscribe(shard, cmd->nick, req->conn);
+        snprintf(response, sizeof(response), "OK");
+    }
+    else if (cmd->op == CMD_JOIN) {
+        int result = group_join(shard, cmd->nick, req->from);
+        if (result == 0)
+            snprintf(response, sizeof(response), "OK");
+        else
+            snprintf(response, sizeof(response), "ERROR{LIMIT}");
+    }
+    else if (cmd->op == CMD_LEAVE) {
+        int result = group_leave(shard, cmd->nick, req->from);
+        if (result == 0)
+            snprintf(response, sizeof(response), "OK");
+        else
+            snprintf(response, sizeof(response), "ERROR{NOT_MEMBER}");
+    }
+    else if (cmd->nick[0] == '#') {
+        // SEND_MSG para um grupo: só membros podem enviar
+        int result = group_send(shard, req->from, cmd->nick, cmd->text, cmd->text_len);
+        if (result == 0)
+            snprintf(response, sizeof(response), "OK");
+        else if (result == -1)
+            snprintf(response, sizeof(response), "ERROR{NO_SUCH_GROUP}");
+        else if (result == -2)
+            snprintf(response, sizeof(response), "ERROR{UNAUTHORIZED}");
+        else
+            snprintf(response, sizeof(response), "ERROR{LIMIT}");
+    }
+    else {
+        int result = send_message(shard, req->from, cmd->nick, cmd->text, cmd->text_len, cmd->seq);
+        if (result == 0)
+            snprintf(response, sizeof(response), "OK");
+        else if (result == 1)
+            // Controle de fluxo: o destinatário não está dando conta das entregas
+            snprintf(response, sizeof(response), "OK{QUEUED}");
+        else if (result == 2)
+            // Reenvio: a mensagem já tinha sido aceita
+            snprintf(response, sizeof(response), "OK{DUP}");
+        else if (result == -1)
+            snprintf(response, sizeof(response), "ERROR{NO_SUCH_USER}");
+        else if (result == -2)
+            snprintf(response, sizeof(response), "ERROR{UNAUTHORIZED}");
+        else if (result == -4)
+            snprintf(response, sizeof(response), "ERROR{QUEUE_FULL}");
+        else
+            snprintf(response, sizeof(response), "ERROR{LIMIT}");
+    }
+
+    // Enviando resposta para o cliente
+    send_response(shard, req, response, session_op);
+
+    // As mensagens pendentes seguem o OK do LOGIN, sem atrasá-lo
+    if (session_op == SESSION_LOGIN)
+        queue_stream(shard, find_user(shard, cmd->nick));
+}
+
+// Função que recebe a parte da lista de um shard e responde quando todas chegarem
+static void list_part_received(Shard* shard, ListGather* gather, int part_shard, ListPart part) {
+    gather->parts[part_shard] = part;
+    if (--gather->parts_left > 0)
+        return;
+
+    Connection* conn = conn_lookup(shard, gather->conn);
+    if (conn != NULL) {
+        size_t len = PROTO_HEADER_LEN + strlen("USERS{users:[],total:4294967295}\n") + 1;
+        uint64_t total = 0;
+        for (int i = 0; i < shard_count; i++) {
+            len += gather->parts[i].len;
+            total += gather->parts[i].total;
+        }
+        if (gather->subscribe)
+            len += conn->sub_hold_len;
+
+        // No modo texto a lista vai em USERS{users:[...]}; no binário, só o array JSON
+        int binary = gather->mode == MODE_BINARY;
+        char* list = malloc(len);
+        size_t start = binary ? PROTO_HEADER_LEN : 0;
+        size_t off = start + sprintf(list + start, binary ? "[" : "USERS{users:[");
+        size_t first = off;
+
+        // Página: pula `offset` entradas na ordem dos shards e copia até `count`
+        // (quantidade 0 = até o fim)
+        uint32_t skip = gather->query.offset;
+        uint32_t take = gather->query.count ? gather->query.count : UINT32_MAX;
+        for (int i = 0; i < shard_count && take > 0; i++) {
+            const char* p = gather->parts[i].data;
+            const char* end = p + gather->parts[i].len;
+            if (skip == 0 && take == UINT32_MAX) {
+                memcpy(list + off, p, end - p);
+                off += end - p;
+                continue;
+            }
+            for (; p < end && take > 0; p = entry_end(p, end)) {
+                if (skip > 0) {
+                    skip--;
+                    continue;
                 }
+                const char* e = entry_end(p, end);
+                memcpy(list + off, p, e - p);
+                off += e - p;
+                take--;
             }
+        }
+
+        // A primeira entrada não leva vírgula
+        if (off > first) {
+            memmove(list + first, list + first + 1, off - first - 1);
+            off--;
+        }
+        if (binary)
+            off += sprintf(list + off, "]");
+        else if (gather->query.count > 0)
+            off += sprintf(list + off, "],total:%llu}\n", (unsigned long long)total);
+        else
+            off += sprintf(list + off, "]}\n");
+
+        if (binary) {
+            // Cabeçalho escrito por último, já sabendo o tamanho da lista
+            char header[PROTO_HEADER_LEN];
+            proto_encode(header, OP_USERS, NULL, 0, NULL, off - PROTO_HEADER_LEN, total);
+            memcpy(list, header, PROTO_HEADER_LEN);
+        }
+        LOG(LOG_DEBUG, "Sent: USERS (%zu bytes)", off);
+
+        // Inscrição: as mudanças recebidas enquanto a lista era montada vão logo depois dela
+        if (gather->subscribe && conn->list_sub == LIST_SUB_PENDING) {
+            memcpy(list + off, conn->sub_hold, conn->sub_hold_len);
+            off += conn->sub_hold_len;
+            free(conn->sub_hold);
+            conn->sub_hold = NULL;
+            conn->sub_hold_len = conn->sub_hold_cap = 0;
+            conn->list_sub = LIST_SUB_ACTIVE;
+        }
+
+        conn_complete_reply(conn, gather->seq, list, off);
+        free(list);
+        stats_command(shard, gather->op, gather->start, 0);
+    }
+
+    for (int i = 0; i < shard_count; i++)
+        free(gather->parts[i].data);
+    free(gather->parts);
+    free(gather);
+}
+
+// Função que pede a cada shard a sua parte da lista de usuários
+static void start_list(Shard* shard, Connection* conn, const Request* req, const Command* cmd) {
+    ListGather* gather = calloc(1, sizeof(ListGather));
+    gather->conn = conn_ref(shard, conn);
+    gather->seq = req->seq;
+    gather->op = req->op;
+    gather->start = req->start;
+    gather->mode = conn->mode;
+    gather->subscribe = cmd->op == CMD_LIST_SUBSCRIBE;
+    strcpy(gather->query.prefix, cmd->nick);
+    gather->query.offset = cmd->offset;
+    gather->query.count = cmd->count;
+    gather->parts_left = shard_count;
+    gather->parts = calloc(shard_count, sizeof(ListPart));
+
+    // Cada shard precisa de no máximo início + quantidade entradas
+    uint32_t limit = 0;
+    if (cmd->count > 0)
+        limit = cmd->offset + cmd->count < cmd->offset ? UINT32_MAX : cmd->offset + cmd->count;
+
+    for (int i = 0; i < shard_count; i++) {
+        if (i == shard->id)
+            continue;
+
+        ShardMsg* msg = shard_post(shard, i, MSG_LIST, sizeof(ListQuery));
+        msg->conn = gather->conn;
+        msg->cookie = gather;
+        msg->seq = limit;
+        memcpy(msg->data, &gather->query, sizeof(ListQuery));
+    }
+
+    // A parte local é a última; com um único shard a resposta sai imediatamente
+    list_part_received(shard, gather, shard->id, list_users(shard, &gather->query, limit));
+}
+
+// Função que acrescenta uma mensagem encontrada pelo SEARCH à parte do shard:
+// [i64 ts][u32 tamanho] e a entrada, com a vírgula que a separa da anterior
+static void search_entry(void* ctx, const char* with, uint64_t seq, int64_t ts, const char* from,
+                         const char* text, size_t len) {
+    HistoryPage* part = ctx;
+    size_t max = 128 + 2 * (2 * MAX_NICK_LEN + len);
+    if (part->len + max > part->cap) {
+        while (part->len + max > part->cap)
+            part->cap *= 2;
+        part->data = realloc(part->data, part->cap);
+    }
+
+    // {"with":"...","seq":...,"from":"...","text":"...","ts":...}
+    char* out = part->data + part->len + 12;
+    size_t n = sprintf(out, ",{\"with\":\"");
+    n += json_escape(out + n, with, strlen(with));
+    n += sprintf(out + n, "\",\"seq\":%llu,\"from\":\"", (unsigned long long)seq);
+    n += json_escape(out + n, from, strlen(from));
+    n += sprintf(out + n, "\",\"text\":\"");
+    n += json_escape(out + n, text, len);
+    n += sprintf(out + n, "\",\"ts\":%lld}", (long long)ts);
+
+    uint32_t entry_len = n;
+    memcpy(part->data + part->len, &ts, 8);
+    memcpy(part->data + part->len + 8, &entry_len, 4);
+    part->len += 12 + n;
+}
+
+// Função que procura as mensagens da busca nas partições do histórico do shard
+static HistoryPage search_local(Shard* shard, const SearchQuery* query) {
+    HistoryPage part = { malloc(4096), 0, 4096 };
+    history_search(shard, query->user, query->terms, query->count, search_entry, &part);
+    return part;
+}
+
+// Mensagem encontrada, na coleta
+typedef struct {
+    int64_t ts;
+    const char* entry;
+    uint32_t len;
+} SearchHit;
+
+// Função que compara duas mensagens encontradas: as mais novas primeiro (qsort)
+static int compare_hits(const void* a, const void* b) {
+    const SearchHit* x = a;
+    const SearchHit* y = b;
+    if (x->ts != y->ts)
+        return x->ts > y->ts ? -1 : 1;
+    return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+// Função que recebe as mensagens encontradas por um shard e responde quando todos
+// responderem: as SEARCH_PAGE_MAX mais novas. No texto: SEARCH{messages:[...]}; no
+// binário, OP_SEARCH_RESULT com o array JSON em B e a quantidade em arg.
+static void search_part_received(Shard* shard, SearchGather* gather, const char* data, size_t len) {
+    if (len > 0) {
+        gather->data = realloc(gather->data, gather->len + len);
+        memcpy(gather->data + gather->len, data, len);
+        gather->len += len;
+    }
+    if (--gather->parts_left > 0)
+        return;
+
+    Connection* conn = conn_lookup(shard, gather->conn);
+    if (conn != NULL) {
+        size_t count = 0;
+        for (size_t off = 0; off < gather->len; count++) {
+            uint32_t entry_len;
+            memcpy(&entry_len, gather->data + off + 8, 4);
+            off += 12 + entry_len;
+        }
+        SearchHit* hits = malloc((count + 1) * sizeof(SearchHit));
+        size_t off = 0;
+        for (size_t i = 0; i < count; i++) {
+            memcpy(&hits[i].ts, gather->data + off, 8);
+            memcpy(&hits[i].len, gather->data + off + 8, 4);
+            hits[i].entry = gather->data + off + 12;
+            off += 12 + hits[i].len;
+        }
+        qsort(hits, count, sizeof(SearchHit), compare_hits);
+        if (count > SEARCH_PAGE_MAX)
+            count = SEARCH_PAGE_MAX;
+
+        int binary = gather->mode == MODE_BINARY;
+        size_t size = PROTO_HEADER_LEN + strlen("SEARCH{messages:[]}\n") + 1;
+        for (size_t i = 0; i < count; i++)
+            size += hits[i].len;
+        char* out = malloc(size);
+        size_t start = binary ? PROTO_HEADER_LEN : 0;
+        size_t n = start + sprintf(out + start, binary ? "[" : "SEARCH{messages:[");
+        for (size_t i = 0; i < count; i++) {
+            // A primeira entrada não leva vírgula
+            size_t skip = i == 0 ? 1 : 0;
+            memcpy(out + n, hits[i].entry + skip, hits[i].len - skip);
+            n += hits[i].len - skip;
+        }
+        if (binary) {
+            out[n++] = ']';
+            char header[PROTO_HEADER_LEN];
+            proto_encode(header, OP_SEARCH_RESULT, NULL, 0, NULL, n - PROTO_HEADER_LEN, count);
+            memcpy(out, header, PROTO_HEADER_LEN);
+        } else {
+            n += sprintf(out + n, "]}\n");
+        }
+        LOG(LOG_DEBUG, "Sent: SEARCH (%zu bytes)", n);
+
+        conn_complete_reply(conn, gather->seq, out, n);
+        free(out);
+        free(hits);
+        stats_command(shard, CMD_SEARCH, gather->start, 0);
+    }
+
+    free(gather->data);
+    free(gather);
+}
+
+// Função que pede a cada shard as mensagens das partições do histórico dele que casam
+// com a busca (as conversas de um usuário ficam espalhadas por todos os shards)
+static void start_search(Shard* shard, Connection* conn, Request* req, const Command* cmd) {
+    uint64_t terms[SEARCH_TEXT_TERMS];
+    int count = search_terms(cmd->text, cmd->text_len, terms, SEARCH_TEXT_TERMS);
+    if (count == 0 || count > SEARCH_TERMS_MAX) {
+        send_response(shard, req, "ERROR{BAD_FORMAT}", SESSION_NONE);
+        return;
+    }
+
+    SearchQuery query = { .count = count };
+    strcpy(query.user, req->from);
+    memcpy(query.terms, terms, count * sizeof(uint64_t));
+
+    SearchGather* gather = calloc(1, sizeof(SearchGather));
+    gather->conn = conn_ref(shard, conn);
+    gather->seq = req->seq;
+    gather->mode = conn->mode;
+    gather->start = req->start;
+    gather->parts_left = shard_count;
+
+    for (int i = 0; i < shard_count; i++) {
+        if (i == shard->id)
+            continue;
+
+        ShardMsg* msg = shard_post(shard, i, MSG_SEARCH, sizeof(SearchQuery));
+        msg->conn = gather->conn;
+        msg->cookie = gather;
+        memcpy(msg->data, &query, sizeof(SearchQuery));
+    }
+
+    // A parte local é a última; com um único shard a resposta sai imediatamente
+    HistoryPage part = search_local(shard, &query);
+    search_part_received(shard, gather, part.data, part.len);
+    free(part.data);
+}
+
+// Função que inscreve a conexão nas mudanças da lista de usuários
+static void list_subscribe(Shard* shard, Connection* conn) {
+    if (conn->list_sub != LIST_SUB_NONE)
+        return;
+
+    if (shard->list_sub_count == shard->list_sub_cap) {
+        shard->list_sub_cap = shard->list_sub_cap ? shard->list_sub_cap * 2 : 16;
+        shard->list_subs = realloc(shard->list_subs, shard->list_sub_cap * sizeof(int));
+    }
+    shard->list_subs[shard->list_sub_count++] = conn->fd;
+    conn->list_sub = LIST_SUB_PENDING;
+    atomic_fetch_add_explicit(&list_subscribers, 1, memory_order_release);
+}
+
+// Função que cancela a inscrição da conexão
+static void list_unsubscribe(Shard* shard, Connection* conn) {
+    if (conn->list_sub == LIST_SUB_NONE)
+        return;
+
+    for (int i = 0; i < shard->list_sub_count; i++) {
+        if (shard->list_subs[i] == conn->fd) {
+            shard->list_subs[i] = shard->list_subs[--shard->list_sub_count];
             break;
         }
+    }
+    free(conn->sub_hold);
+    conn->sub_hold = NULL;
+    conn->sub_hold_len = conn->sub_hold_cap = 0;
+    conn->list_sub = LIST_SUB_NONE;
+    atomic_fetch_sub_explicit(&list_subscribers, 1, memory_order_release);
+}
 
-        printf("Recebido: %s\n", buffer);
-
-        // Processa o comando recebido
-
-        char response[512];
-
-        if (strncmp(buffer, "REGISTER", 8) == 0) {
-            char nick[MAX_MSG_LEN], name[MAX_NAME_LEN];
-
-            // REGISTER {apelido, nome}
-            if (sscanf(buffer, "REGISTER {%[^,], %[^}]}", nick, name) == 2) {
-                int result = register_user(nick, name);
-
-                if (result == 0)
-                    snprintf(response, sizeof(response), "OK");
-                else if (result == -1)
-                    snprintf(response, sizeof(response), "ERROR{NICK_TAKEN}");
-                else
-                    snprintf(response, sizeof(response), "ERROR{LIMIT}");
-            } else
-                snprintf(response, sizeof(response), "ERROR{BAD_FORMAT}");
-        }
-        else if (strncmp(buffer, "DELETE", 6) == 0) {
-            char nick[MAX_NICK_LEN];
-            
-            // DELETE {apelido}
-            if (sscanf(buffer, "DELETE {%[^}]}", nick) == 1) {
-                int result = delete_user(nick, client_socket);
-                if (result == 0)
-                    snprintf(response, sizeof(response), "OK");
-                else if (result == -1)
-                    snprintf(response, sizeof(response), "ERROR{NO_SUCH_USER}");
-                else if (result == -2)
-                    snprintf(response, sizeof(response), "ERROR{UNAUTHORIZED}");
-                else
-                    snprintf(response, sizeof(response), "ERROR{BAD_STATE}");
-            } else
-                snprintf(response, sizeof(response), "ERROR{BAD_FORMAT}");    
-        }
-        else if (strncmp(buffer, "LOGIN", 5) == 0) {
-            char nick[MAX_NICK_LEN];
-
-            // LOGIN {apelido}
-            if (sscanf(buffer, "LOGIN {%[^}]}", nick) == 1) {
-                int result = login_user(nick, client_socket);
-                if (result == 0)
-                    snprintf(response, sizeof(response), "OK{%s}", nick);
-                else if (result == -1)
-                    snprintf(response, sizeof(response), "ERROR{NO_SUCH_USER}");
-                else
-                    snprintf(response, sizeof(response), "ERROR{ALREADY_ONLINE}");
-            } else
-                snprintf(response, sizeof(response), "ERROR{BAD_FORMAT}");
-            
-        }
-        else if (strncmp(buffer, "LOGOUT", 6) == 0) {
-            char nick[MAX_NICK_LEN];
-
-            // LOGOUT {apelido}
-            if (sscanf(buffer, "LOGOUT {%[^}]}", nick) == 1) {
-                int result = logout_user(nick, client_socket);
-                if (result == 0)
-                    snprintf(response, sizeof(response), "OK");
-                else if (result == 1)
-                    snprintf(response, sizeof(response), "ERROR{NO_SUCH_USER}");
-                else
-                    snprintf(response, sizeof(response), "ERROR{BAD_STATE}");
-            } else
-                snprintf(response, sizeof(response), "ERROR{BAD_FORMAT}");
-        }
-        else if (strncmp(buffer, "LIST", 4) == 0) {
-            // LIST {usuarios}
-            char* list = list_users();
-            strcpy(response, list);
-        }
-        else if (strncmp(buffer, "SEND_MSG", 8) == 0) {
-            char to[MAX_NICK_LEN], text[256];
-            
-            // SEND_MSG {destinatário, texto}
-            if (sscanf(buffer, "SEND_MSG {%[^,], %[^}]}", to, text) == 2) {
-                char from_nick[MAX_NICK_LEN] = "";    
-                for (int i = 0; i < user_count; i++) {
-                    if (users[i].socket == client_socket && users[i].online) {
-                        strcpy(from_nick, users[i].nick);
-                        break;
-                    }
-                }
+// Função que responde o STATS com os contadores de controle de fluxo de todos os shards
+static void send_stats(Connection* conn, Request* req) {
+    unsigned long long congested = 0, events = 0, pauses = 0, spilled = 0, resumed = 0;
+    unsigned long long deferred = 0, throttled = 0, rate_limited = 0, over_quota = 0;
+    for (int i = 0; i < shard_count; i++) {
+        FlowStats* flow = &shards[i]->flow;
+        congested += atomic_load_explicit(&flow->congested, memory_order_relaxed);
+        events += atomic_load_explicit(&flow->congestion_events, memory_order_relaxed);
+        pauses += atomic_load_explicit(&flow->read_pauses, memory_order_relaxed);
+        spilled += atomic_load_explicit(&flow->spilled, memory_order_relaxed);
+        resumed += atomic_load_explicit(&flow->resumed, memory_order_relaxed);
+        deferred += atomic_load_explicit(&flow->deferred, memory_order_relaxed);
+        throttled += atomic_load_explicit(&flow->throttled, memory_order_relaxed);
+        rate_limited += atomic_load_explicit(&flow->rate_limited, memory_order_relaxed);
+        over_quota += atomic_load_explicit(&flow->over_quota, memory_order_relaxed);
+    }
 
-                if (strlen(from_nick) == 0)
-                    snprintf(response, sizeof(response), "ERROR{UNAUTHORIZED}");
-                else {
-                    int result = send_message(from_nick, to, text);
-                    if (result == 0)
-                        snprintf(response, sizeof(response), "OK");
-                    else if (result == 1)
-                        snprintf(response, sizeof(response), "ERROR{NO_SUCH_USER}");
-                    else
-                        snprintf(response, sizeof(response), "ERROR{UNAUTHORIZED}");
-                }
-            } else {
-                snprintf(response, sizeof(response), "ERROR{BAD_FORMAT}");
+    char body[512];
+    int len = snprintf(body, sizeof(body),
+                       "\"congested\":%llu,\"congestion_events\":%llu,\"read_pauses\":%llu,"
+                       "\"spilled\":%llu,\"resumed\":%llu,\"deferred\":%llu,\"throttled\":%llu,"
+                       "\"rate_limited\":%llu,\"over_quota\":%llu", congested, events, pauses, spilled, resumed,
+                       deferred, throttled, rate_limited, over_quota);
+
+    // Texto: STATS{...}; binário: OP_OK com os contadores (JSON) no campo B
+    char out[PROTO_HEADER_LEN + 600];
+    size_t n;
+    if (req->mode == MODE_BINARY)
+        n = proto_encode(out, OP_OK, NULL, 0, body, len, 0);
+    else
+        n = sprintf(out, "STATS{%s}\n", body);
+    complete_request(conn, req->seq, SESSION_NONE, out, n);
+    stats_command(conn->shard, CMD_STATS, req->start, 0);
+}
+
+// Função que executa o comando aqui ou o encaminha ao shard dono do usuário
+static void route_command(Shard* shard, Connection* conn, Request* req, Command* cmd) {
+    if (cmd->op == CMD_STATS) {
+        send_stats(conn, req);
+        return;
+    }
+    if (cmd->op == CMD_LIST) {
+        start_list(shard, conn, req, cmd);
+        return;
+    }
+    if (cmd->op == CMD_LIST_SUBSCRIBE) {
+        list_subscribe(shard, conn);
+        start_list(shard, conn, req, cmd);
+        return;
+    }
+    if (cmd->op == CMD_LIST_UNSUBSCRIBE) {
+        list_unsubscribe(shard, conn);
+        send_response(shard, req, "OK", SESSION_NONE);
+        return;
+    }
+
+    // O remetente (ou membro do grupo) é conhecido pela própria conexão
+    if ((cmd->op == CMD_SEND_MSG || cmd->op == CMD_JOIN || cmd->op == CMD_LEAVE || cmd->op == CMD_ACK ||
+         cmd->op == CMD_HISTORY || cmd->op == CMD_SEARCH) && req->from[0] == '\0') {
+        send_response(shard, req, "ERROR{UNAUTHORIZED}", SESSION_NONE);
+        return;
+    }
+    if (cmd->op == CMD_SEARCH) {
+        start_search(shard, conn, req, cmd);
+        return;
+    }
+
+    // As entregas de grupo não atravessam nós: no cluster os grupos ficam desligados
+    if (cluster_count > 0 && (cmd->op == CMD_JOIN || cmd->op == CMD_LEAVE ||
+                              (cmd->op == CMD_SEND_MSG && cmd->nick[0] == '#'))) {
+        send_response(shard, req, "ERROR{UNSUPPORTED}", SESSION_NONE);
+        return;
+    }
+
+    // O ACK vai ao shard dono do usuário logado
+    if (cmd->op == CMD_ACK)
+        strcpy(cmd->nick, req->from);
+
+    // Os contatos ficam também na conexão, para cancelar as inscrições quando ela fechar
+    if (cmd->op == CMD_SUBSCRIBE && presence_add_contact(conn, cmd->nick) < 0) {
+        send_response(shard, req, "ERROR{LIMIT}", SESSION_NONE);
+        return;
+    }
+    if (cmd->op == CMD_UNSUBSCRIBE)
+        presence_remove_contact(conn, cmd->nick);
+
+    // LOGIN e LOGOUT mudam o usuário da conexão: os comandos seguintes esperam a resposta
+    if (cmd->op == CMD_LOGIN || cmd->op == CMD_LOGOUT) {
+        conn->blocked = 1;
+        strcpy(conn->pending_nick, cmd->nick);
+    }
+
+    // O histórico fica no shard (e no nó) dono da conversa, não no do contato; com
+    // limite de mensagens, o SEND_MSG passa antes pelo shard dono do remetente
+    cmd->charged = cmd->op != CMD_SEND_MSG || user_rate_limit.rate <= 0;
+    int target = cmd->op == CMD_HISTORY ? history_target(req->from, cmd->nick)
+               : owner_target(cmd->charged ? cmd->nick : req->from);
+    if (target == shard->id) {
+        handle_command(shard, req, cmd);
+        return;
+    }
+    post_command(shard, target, req, cmd);
+}
+
+// Função que prepara a origem de um novo comando da conexão
+static void request_init(Shard* shard, Connection* conn, Request* req) {
+    req->conn = conn_ref(shard, conn);
+    req->seq = conn_reserve_reply(conn);
+    req->mode = conn->mode;
+    strcpy(req->from, conn->nick);
+    req->op = -1;
+    req->start = stats_now();
+}
+
+// Função que processa um comando de texto completo recebido do cliente no shard da conexão
+void dispatch_frame(Shard* shard, Connection* conn, const char* frame) {
+    LOG(LOG_DEBUG, "Recebido: %s", frame);
+
+    Request req;
+    request_init(shard, conn, &req);
+
+    // PROTO {BINARY} troca o protocolo da conexão para os frames seguintes; com
+    // DEFLATE (PROTO {TEXT, DEFLATE}) tudo o que vem depois do OK sai comprimido
+    if (strncmp(frame, "PROTO", 5) == 0) {
+        char mode[16], option[16] = "";
+        int fields = sscanf(frame, "PROTO {%15[^,}], %15[^}]}", mode, option);
+        int deflate = fields == 2 && strcmp(option, "DEFLATE") == 0;
+        if (fields < 1 || (fields == 2 && !deflate) ||
+            (strcmp(mode, "BINARY") != 0 && strcmp(mode, "TEXT") != 0)) {
+            send_response(shard, &req, "ERROR{BAD_FORMAT}", SESSION_NONE);
+        } else if (deflate && conn->flush_seq != req.seq) {
+            // Respostas anteriores ainda pendentes sairiam comprimidas
+            send_response(shard, &req, "ERROR{BAD_STATE}", SESSION_NONE);
+        } else {
+            send_response(shard, &req, "OK", SESSION_NONE);
+            if (strcmp(mode, "BINARY") == 0)
+                conn->mode = MODE_BINARY;
+            if (deflate && conn_compress(conn) < 0) {
+                LOG(LOG_ERROR, "Sem memória para comprimir a saída do socket %d", conn->fd);
+                conn->closing = 1;
             }
+        }
+        return;
+    }
+
+    Command cmd;
+    char text[256];
+    const char* error = parse_command(frame, &cmd, text);
+    if (error != NULL) {
+        send_response(shard, &req, error, SESSION_NONE);
+        return;
+    }
+
+    req.op = cmd.op;
+    route_command(shard, conn, &req, &cmd);
+}
+
+// Função que processa um frame binário completo recebido do cliente no shard da conexão
+void dispatch_binary(Shard* shard, Connection* conn, const ProtoFrame* frame) {
+    LOG(LOG_DEBUG, "Recebido: frame binário op=0x%02x (%zu bytes)", frame->op, frame->a_len + frame->b_len);
+
+    Request req;
+    request_init(shard, conn, &req);
+
+    Command cmd;
+    const char* error = parse_binary(frame, &cmd);
+    if (error != NULL) {
+        send_response(shard, &req, error, SESSION_NONE);
+        return;
+    }
+
+    req.op = cmd.op;
+    route_command(shard, conn, &req, &cmd);
+}
+
+// Função que marca como offline o usuário cuja conexão foi encerrada
+static void user_disconnected(Shard* shard, const char* nick, ConnRef session) {
+    User* user = find_user(shard, nick);
+    if (user == NULL || !user->online || !same_conn(user->session, session))
+        return;
 
-            
-            
+    ConnRef none = { 0, -1, 0, 0 };
+    set_online(shard, user, 0, none);
+    LOG(LOG_INFO, "Cliente desconectado: %s", nick);
+}
+
+// Função chamada quando uma conexão é encerrada: avisa o shard dono do usuário logado
+void handle_disconnect(Shard* shard, Connection* conn) {
+    // Um LOGIN ainda sem resposta também pode ter deixado o usuário online
+    const char* nicks[2] = { conn->nick, conn->pending_nick };
+    ConnRef ref = conn_ref(shard, conn);
+
+    list_unsubscribe(shard, conn);
+    presence_disconnect(shard, conn);
+
+    for (int i = 0; i < 2; i++) {
+        if (nicks[i][0] == '\0' || (i == 1 && strcmp(nicks[0], nicks[1]) == 0))
+            continue;
+
+        int target = owner_target(nicks[i]);
+        if (target == shard->id) {
+            user_disconnected(shard, nicks[i], ref);
+            continue;
         }
-        else {
-            // Nenhum dos comandos anteriores
-            snprintf(response, sizeof(response), "ERROR{UNKNOWN_COMMAND}");
+
+        size_t len = strlen(nicks[i]);
+        ShardMsg* msg = shard_post(shard, target, MSG_DISCONNECT, len);
+        msg->conn = ref;
+        memcpy(msg->data, nicks[i], len);
+    }
+}
+
+// Função que deixa offline os usuários do shard com sessões abertas pelo nó que saiu do
+// cluster e cancela as inscrições de presença das conexões dele
+static void node_down(Shard* shard, int node) {
+    ConnRef none = { 0, -1, 0, 0 };
+    int dropped = 0;
+    for (int32_t id = 0; id < user_table_count(&shard->users); id++) {
+        User* user = user_table_at(&shard->users, id);
+        if (user->online && user->session.node == node) {
+            set_online(shard, user, 0, none);
+            dropped++;
         }
-        
-        // Enviando resposta para o cliente
-        send(client_socket, response, strlen(response), 0);
-        printf("Sent: %s\n", response);
+    }
+    presence_drop_node(shard, node);
 
+    if (dropped > 0)
+        LOG(LOG_INFO, "Nó %d saiu do cluster: %d usuários desconectados", node, dropped);
+}
+
+// Função que trata uma mensagem vinda de outro shard
+void handle_shard_msg(Shard* shard, ShardMsg* msg) {
+    Connection* conn;
+
+    switch (msg->type) {
+    case MSG_COMMAND: {
+        Command* cmd = (Command*)(msg->data + sizeof(Request));
+        cmd->text = msg->data + sizeof(Request) + sizeof(Command);
+        handle_command(shard, (Request*)msg->data, cmd);
+        break;
+    }
+    case MSG_REPLY:
+        conn = conn_lookup(shard, msg->conn);
+        if (conn != NULL) {
+            complete_request(conn, msg->seq, msg->session_op, msg->data, msg->len);
+            // A resposta pode liberar comandos que estavam esperando
+            conn_process_frames(shard, conn);
+        }
+        break;
+    case MSG_DELIVER:
+        conn = conn_lookup(shard, msg->conn);
+        if (conn != NULL) {
+            uint64_t seq;
+            memcpy(&seq, msg->data, sizeof(seq));
+            write_delivery(conn, msg->data + sizeof(seq), msg->len - sizeof(seq), seq);
+        }
+        break;
+    case MSG_DISCONNECT:
+        user_disconnected(shard, msg->data, msg->conn);
+        break;
+    case MSG_LIST: {
+        // Dados da resposta: total (u32) e as entradas
+        ListPart part = list_users(shard, (ListQuery*)msg->data, msg->seq);
+        ShardMsg* reply = shard_post(shard, msg->conn.shard, MSG_LIST_PART, sizeof(uint32_t) + part.len);
+        reply->conn = msg->conn;
+        reply->cookie = msg->cookie;
+        reply->seq = shard->id;
+        memcpy(reply->data, &part.total, sizeof(uint32_t));
+        memcpy(reply->data + sizeof(uint32_t), part.data, part.len);
+        free(part.data);
+        break;
+    }
+    case MSG_LIST_PART: {
+        ListPart part;
+        memcpy(&part.total, msg->data, sizeof(uint32_t));
+        part.len = msg->len - sizeof(uint32_t);
+        part.data = malloc(part.len + 1);
+        memcpy(part.data, msg->data + sizeof(uint32_t), part.len);
+        list_part_received(shard, msg->cookie, msg->seq, part);
+        break;
+    }
+    case MSG_PRESENCE: {
+        const char* nick = msg->data;
+        list_change_received(shard, msg->session_op, nick, nick + strlen(nick) + 1);
+        break;
     }
+    case MSG_PRESENCE_FANOUT:
+        // Dados: seq inscritos (ConnRef) seguidos do apelido
+        presence_received(shard, msg->session_op, msg->data + msg->seq * sizeof(ConnRef),
+                          (const ConnRef*)msg->data, msg->seq);
+        break;
+    case MSG_PRESENCE_UNSUBSCRIBE:
+        presence_unsubscribe(shard, msg->data, msg->conn);
+        break;
+    case MSG_GROUP_DELIVER:
+        // Dados: seq apelidos terminados em '\0'
+        group_deliver(shard, msg->cookie, msg->data, msg->seq);
+        break;
+    case MSG_GROUP_WRITE:
+        // Dados: seq conexões (ConnRef)
+        group_write(shard, msg->cookie, (const ConnRef*)msg->data, msg->seq);
+        break;
+    case MSG_RESUME:
+        resume_deliveries(shard, msg->data, msg->conn);
+        break;
+    case MSG_SPILL_PENDING:
+        conn = conn_lookup(shard, msg->conn);
+        if (conn != NULL)
+            conn_spill_pending(conn);
+        break;
+    case MSG_HISTORY: {
+        size_t to_len = strlen(msg->data) + 1;
+        history_append(shard, msg->data, msg->data + to_len, msg->len - to_len);
+        break;
+    }
+    case MSG_SEARCH: {
+        HistoryPage part = search_local(shard, (SearchQuery*)msg->data);
+        ShardMsg* reply = shard_post(shard, msg->conn.shard, MSG_SEARCH_PART, part.len);
+        reply->conn = msg->conn;
+        reply->cookie = msg->cookie;
+        memcpy(reply->data, part.data, part.len);
+        free(part.data);
+        break;
+    }
+    case MSG_SEARCH_PART:
+        search_part_received(shard, msg->cookie, msg->data, msg->len);
+        break;
+    case MSG_NODE_DOWN:
+        node_down(shard, (int)msg->seq);
+        break;
+    }
+}
 
-    // Fechando o socket do cliente
-    close(client_socket);
+// Função que escolhe o shard deste nó que trata uma mensagem vinda de outro nó do
+// cluster. Retorna -1 se ela não tem destino aqui.
+int remote_msg_shard(ShardMsg* msg) {
+    ConnRef ref;
+
+    switch (msg->type) {
+    case MSG_COMMAND: {
+        if (msg->len < sizeof(Request) + sizeof(Command))
+            return -1;
+        Request* req = (Request*)msg->data;
+        Command* cmd = (Command*)(msg->data + sizeof(Request));
+        req->from[MAX_NICK_LEN - 1] = cmd->nick[MAX_NICK_LEN - 1] = '\0';
+        // O relógio do outro nó não serve para a latência: ela conta a partir da chegada
+        req->start = stats_now();
+        if (cmd->op == CMD_HISTORY)
+            return history_shard(req->from, cmd->nick);
+        return shard_of(cmd->op == CMD_SEND_MSG && !cmd->charged ? req->from : cmd->nick);
+    }
+    case MSG_REPLY:
+    case MSG_DELIVER:
+    case MSG_SPILL_PENDING:
+    case MSG_PRESENCE_FANOUT:
+        // Os avisos de presença para outro nó levam um único inscrito
+        if (msg->type == MSG_PRESENCE_FANOUT) {
+            if (msg->len < sizeof(ConnRef) || msg->seq != 1)
+                return -1;
+            memcpy(&ref, msg->data, sizeof(ConnRef));
+        } else {
+            ref = msg->conn;
+        }
+        return ref.node == cluster_self && ref.shard >= 0 && ref.shard < shard_count ? ref.shard : -1;
+    case MSG_DISCONNECT:
+    case MSG_RESUME:
+    case MSG_PRESENCE_UNSUBSCRIBE:
+        return shard_of(msg->data);
+    case MSG_HISTORY: {
+        // Dados: destinatário ('\0' no fim) e o registro, que começa pelo remetente
+        size_t to_len = strnlen(msg->data, msg->len) + 1;
+        if (to_len >= msg->len || to_len > MAX_NICK_LEN)
+            return -1;
+        char from[MAX_NICK_LEN];
+        size_t from_len = (uint8_t)msg->data[to_len];
+        if (from_len >= MAX_NICK_LEN || to_len + 1 + from_len > msg->len)
+            return -1;
+        memcpy(from, msg->data + to_len + 1, from_len);
+        from[from_len] = '\0';
+        return history_shard(from, msg->data);
+    }
+    default:
+        return -1;
+    }
 }
 
-int main() {
-    
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    
-    // Socket do servidor
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+// Função que responde ERROR{UNAVAILABLE} a um comando que não pôde ser levado ao nó
+// dono do usuário; a resposta entra no lote para o shard da conexão em `inbox`. As
+// demais mensagens para um nó fora do ar se perdem.
+void remote_msg_unavailable(const ShardMsg* msg, ShardBatch** inbox) {
+    if (msg->type != MSG_COMMAND)
+        return;
+
+    const Request* req = (const Request*)msg->data;
+    char line[64];
+    size_t len = encode_response(req->mode, "ERROR{UNAVAILABLE}", line);
+    ShardMsg* reply = batch_post(&inbox[req->conn.shard], MSG_REPLY, len);
+    reply->conn = req->conn;
+    reply->seq = req->seq;
+    reply->session_op = SESSION_NONE;
+    memcpy(reply->data, line, len);
+}
 
-    if (server_socket < 0) {
-        perror("Socket não criado\n");
-        exit(1);
+// Função que grava o estado completo do shard num snapshot e recomeça o log
+void shard_checkpoint(Shard* shard) {
+    char record[MAX_RECORD_LEN + 1];
+
+    names_compact(shard);
+    wal_checkpoint_begin(&shard->wal);
+    for (int i = 0; i < user_table_count(&shard->users); i++) {
+        User* user = user_table_at(&shard->users, i);
+        const char* nick = user_table_nick(&shard->users, i);
+        const char* name = ((UserProfile*)user_table_profile(&shard->users, i))->name;
+        wal_checkpoint_add(&shard->wal, WAL_REGISTER, nick, name, strlen(name));
+        if (user->acked_seq > 0) {
+            char seq[8];
+            put_u64(seq, user->acked_seq);
+            wal_checkpoint_add(&shard->wal, WAL_SEQ, nick, seq, sizeof(seq));
+        }
+        for (uint32_t j = 0; j < conv_size(&user->conversations); j++) {
+            ConvEntry* conv = conv_at(&shard->arena, &user->conversations, j);
+            if (conv == NULL)
+                continue;
+            const char* from = user_table_nick(&shard->names, conv->from - 1);
+            char data[8 + MAX_NICK_LEN];
+            put_u64(data, conv->seq);
+            memcpy(data + 8, from, strlen(from));
+            wal_checkpoint_add(&shard->wal, WAL_CONV, nick, data, 8 + strlen(from));
+        }
+        for (uint32_t j = 0; j < user->queue.count; j++) {
+            size_t len = record_peek(shard, &user->queue, j, record);
+            if (len == 0) {
+                LOG(LOG_WARN, "Registro inválido fora do snapshot (fila de %s)", nick);
+                continue;
+            }
+            wal_checkpoint_add(&shard->wal, WAL_ENQUEUE, nick, record, len);
+        }
     }
+    group_checkpoint(shard);
+    wal_checkpoint_end(&shard->wal);
+}
 
-    // Configurando opções do socket
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt");
-        exit(1);
+// Função que aplica um registro recuperado do disco ao shard dono do usuário
+// (que pode ser outro se o número de threads mudou desde a última execução)
+static void replay_record(void* ctx, int type, const char* nick, const char* data, size_t len) {
+    (void)ctx;
+    if (strlen(nick) >= MAX_NICK_LEN)
+        return;
+    if (type == WAL_GROUP_ENQUEUE) {
+        // Os membros podem pertencer a shards diferentes
+        group_replay_enqueue(data, len);
+        return;
+    }
+
+    Shard* shard = shards[shard_of(nick)];
+    User* user = find_user(shard, nick);
+    ConnRef none = { 0, -1, 0, 0 };
+
+    switch (type) {
+    case WAL_REGISTER:
+        if (len < MAX_NAME_LEN)
+            register_user(shard, nick, data, len);
+        break;
+    case WAL_DELETE:
+        delete_user(shard, nick, none);
+        break;
+    case WAL_ENQUEUE:
+        if (user != NULL && len <= MAX_RECORD_LEN && len >= 1 + (uint8_t)data[0] + sizeof(int64_t))
+            record_push(shard, &user->queue, data, len);
+        break;
+    case WAL_ACK:
+        if (user != NULL && len == 4) {
+            const uint8_t* p = (const uint8_t*)data;
+            uint32_t count = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+            while (count-- > 0 && queue_pop(&shard->slab, &user->queue, NULL) > 0)
+                user->acked_seq++;
+        }
+        break;
+    case WAL_SEQ:
+        if (user != NULL && len == 8)
+            user->acked_seq = get_u64(data);
+        break;
+    case WAL_CONV:
+        if (user != NULL && len > 8 && len - 8 < MAX_NICK_LEN && memchr(data + 8, '\0', len - 8) == NULL) {
+            int32_t from = name_intern(shard, data + 8, len - 8);
+            if (from >= 0)
+                conv_accept(&shard->arena, &user->conversations, from, get_u64(data));
+        }
+        break;
+    case WAL_GROUP_JOIN:
+    case WAL_GROUP_LEAVE:
+        if (len < MAX_NICK_LEN && memchr(data, '\0', len) == NULL) {
+            char member[MAX_NICK_LEN];
+            memcpy(member, data, len);
+            member[len] = '\0';
+            if (type == WAL_GROUP_JOIN)
+                group_join(shard, nick, member);
+            else
+                group_leave(shard, nick, member);
+        }
+        break;
+    }
+}
+
+// Função que abre a arena do shard e prepara as tabelas de usuários e de grupos e o
+// slab guardados nela. Com `create` a arena começa vazia. Retorna -1 se não foi possível.
+static int store_open(Shard* shard, uint64_t epoch, int create) {
+    char path[512];
+    wal_path(path, sizeof(path), epoch, shard->id, "store");
+    if (arena_open(&shard->arena, path, create) < 0)
+        return -1;
+
+    ArenaHeader* header = shard->arena.header;
+    if (header->root == 0) {
+        header->root = arena_alloc(&shard->arena, sizeof(ShardStore));
+        if (header->root == 0) {
+            arena_close(&shard->arena);
+            return -1;
+        }
+        memset(arena_ptr(&shard->arena, header->root), 0, sizeof(ShardStore));
+        header->epoch = epoch;
+    }
+
+    ShardStore* store = arena_ptr(&shard->arena, header->root);
+    slab_init(&shard->slab, &shard->arena, &store->slab);
+    if (user_table_init(&shard->users, &shard->arena, &store->users, sizeof(User), sizeof(UserProfile)) < 0 ||
+        user_table_init(&shard->groups, &shard->arena, &store->groups, sizeof(Group), 0) < 0 ||
+        user_table_init(&shard->names, &shard->arena, &store->names, 0, 0) < 0) {
+        arena_close(&shard->arena);
+        return -1;
+    }
+    return 0;
+}
+
+// Função que tenta retomar o estado deixado por um encerramento correto: basta mapear
+// as arenas e continuar os logs. Só vale se nada mudou depois do encerramento (mesmo
+// número de shards, arenas marcadas como fechadas e logs do tamanho registrado nelas).
+static int reopen_state(uint64_t epoch, int old_count) {
+    if (old_count != shard_count)
+        return -1;
+
+    int opened = 0, ok = 1;
+    while (ok && opened < shard_count) {
+        Shard* shard = shards[opened];
+        wal_init(&shard->wal, epoch, opened);
+        if (store_open(shard, epoch, 0) < 0)
+            break;
+        opened++;
+
+        ArenaHeader* header = shard->arena.header;
+        ok = header->clean && header->epoch == epoch && wal_reopen(&shard->wal) == 0 &&
+             header->generation == shard->wal.generation && header->wal_size == shard->wal.size;
+    }
+
+    if (ok && opened == shard_count) {
+        // A partir daqui uma queda invalida as arenas até o próximo encerramento correto
+        for (int i = 0; i < shard_count; i++) {
+            shards[i]->arena.header->clean = 0;
+            arena_sync_header(&shards[i]->arena);
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < opened; i++) {
+        arena_close(&shards[i]->arena);
+        wal_close(&shards[i]->wal);
     }
+    return -1;
+}
+
+// Função que recupera usuários e mensagens pendentes do diretório de dados. Depois de
+// um encerramento correto as arenas são apenas mapeadas de novo. Senão o estado é
+// refeito a partir dos snapshots e logs numa nova época: cada shard cria uma arena
+// vazia, recebe os registros dos seus usuários, grava um snapshot e só então CURRENT
+// aponta para os novos arquivos.
+static void recover_state() {
+    uint64_t epoch = 0;
+    int old_count = 0;
+    int found = wal_read_current(&epoch, &old_count) == 0;
+
+    if (found && reopen_state(epoch, old_count) == 0) {
+        int users = 0;
+        for (int i = 0; i < shard_count; i++)
+            users += user_table_count(&shards[i]->users);
+        LOG(LOG_INFO, "Estado reaberto de %s: %d usuários", wal_dir, users);
+        return;
+    }
+
+    for (int i = 0; i < shard_count; i++) {
+        wal_init(&shards[i]->wal, epoch + 1, i);
+        if (store_open(shards[i], epoch + 1, 1) < 0)
+            exit(1);
+    }
+
+    if (found)
+        for (int i = 0; i < old_count; i++)
+            wal_replay(epoch, i, replay_record, NULL);
+
+    int users = 0;
+    for (int i = 0; i < shard_count; i++) {
+        shard_checkpoint(shards[i]);
+        users += user_table_count(&shards[i]->users);
+    }
+    wal_write_current(epoch + 1, shard_count);
+    wal_remove_stale(epoch + 1);
 
-    // Configurando endereço de servidor
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;   // Aceita conexões de qualquer interface
-    server_addr.sin_port = htons(PORT);         // Porta do servidor
+    LOG(LOG_INFO, "Estado recuperado de %s: %d usuários", wal_dir, users);
+}
 
-    // Associando socket ao endereço
-    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind");
+// Função que encerra o shard deixando a arena pronta para ser reaberta: sessões não
+// sobrevivem ao reinício, o log é sincronizado e a arena marcada como fechada depois
+// que todas as páginas estão no disco
+void shard_shutdown(Shard* shard) {
+    for (int i = 0; i < user_table_count(&shard->users); i++) {
+        User* user = user_table_at(&shard->users, i);
+        if (user->online) {
+            user->online = 0;
+            user->session.fd = -1;
+            user->sent = 0;
+            user->acks = 0;
+        }
+    }
+
+    wal_close(&shard->wal);
+
+    ArenaHeader* header = shard->arena.header;
+    header->generation = shard->wal.generation;
+    header->wal_size = shard->wal.size;
+    arena_sync(&shard->arena);
+    header->clean = 1;
+    arena_close(&shard->arena);
+    record_codec_free(&shard->codec);
+    history_close(&shard->history);
+}
+
+// Função chamada em SIGINT/SIGTERM: pede o encerramento e acorda todos os shards
+static void handle_stop(int sig) {
+    (void)sig;
+    server_stopping = 1;
+
+    uint64_t one = 1;
+    for (int i = 0; i < shard_count; i++) {
+        ssize_t written = write(shards[i]->event_fd, &one, sizeof(one));
+        (void)written;
+    }
+    cluster_wake();
+}
+
+// Função que eleva o limite de descritores abertos para suportar milhares de conexões
+static void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char* argv[]) {
+
+    // Por padrão, um shard (thread de reactor) por núcleo
+    shard_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int admin_port = 0;
+    const char* log_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:s:m:l:L:e:r:u:q:p:c:n:")) != -1) {
+        switch (opt) {
+        case 't':
+            shard_count = atoi(optarg);
+            break;
+        case 'd':
+            snprintf(wal_dir, sizeof(wal_dir), "%s", optarg);
+            break;
+        case 's':
+            if (strcmp(optarg, "none") == 0)
+                wal_sync_mode = SYNC_NONE;
+            else if (strcmp(optarg, "batch") == 0)
+                wal_sync_mode = SYNC_BATCH;
+            else if (strcmp(optarg, "always") == 0)
+                wal_sync_mode = SYNC_ALWAYS;
+            else {
+                fprintf(stderr, "Durabilidade inválida: %s (none, batch ou always)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'm':
+            admin_port = atoi(optarg);
+            break;
+        case 'l':
+            log_level = log_level_parse(optarg);
+            if (log_level < 0) {
+                fprintf(stderr, "Nível de log inválido: %s (debug, info, warn ou error)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'L':
+            log_file = optarg;
+            break;
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0)
+                io_engine = IO_EPOLL;
+            else if (strcmp(optarg, "uring") == 0)
+                io_engine = IO_URING;
+            else {
+                fprintf(stderr, "Backend de E/S inválido: %s (epoll ou uring)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+        case 'u':
+            if (rate_limit_parse(optarg, opt == 'r' ? &conn_rate_limit : &user_rate_limit) < 0) {
+                fprintf(stderr, "Limite inválido: %s (taxa[:rajada], 0 = sem limite)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'q':
+            queue_quota = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            server_port = atoi(optarg);
+            break;
+        case 'c':
+            if (cluster_parse(optarg) < 0)
+                exit(1);
+            break;
+        case 'n':
+            cluster_self = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Uso: %s [-t threads] [-d diretório] [-s none|batch|always] [-m porta]"
+                            " [-l nível] [-L arquivo] [-e epoll|uring] [-r taxa[:rajada]]"
+                            " [-u taxa[:rajada]] [-q mensagens] [-p porta] [-c host:porta,...]"
+                            " [-n nó]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (shard_count < 1)
+        shard_count = 1;
+    if (server_port <= 0 || server_port > 65535) {
+        fprintf(stderr, "Porta inválida: %d\n", server_port);
+        exit(1);
+    }
+    if (cluster_self < 0 || cluster_self >= (cluster_count > 0 ? cluster_count : 1)) {
+        fprintf(stderr, "Nó inválido: %d (a lista -c tem %d nós)\n", cluster_self, cluster_count);
         exit(1);
     }
 
-    // Socket no modo de ESCUTA
-    if (listen(server_socket, BACKLOG) < 0) {
-        perror("listen");
+    if (log_init(log_file) < 0)
         exit(1);
+    raise_fd_limit();
+
+    // Criando os shards; todos os sockets de escuta ficam prontos antes das threads
+    shards = calloc(shard_count, sizeof(Shard*));
+    for (int i = 0; i < shard_count; i++) {
+        shards[i] = calloc(1, sizeof(Shard));
+        if (shard_init(shards[i], i) < 0)
+            exit(1);
     }
 
-    printf("Servidor está escutando na porta %d\n", PORT);
+    recover_state();
 
-    while (1) {
-        // Nova conexão aceita
-        client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        if (client_socket < 0) {
-            perror("accept");
-            continue;
-        }
+    LOG(LOG_INFO, "Servidor está escutando na porta %d (%d threads, %s)", server_port, shard_count,
+        io_engine == IO_URING ? "io_uring" : "epoll");
 
-        printf("Novo cliente conectado - %s:%d\n",
-                inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    // Links com os outros nós do cluster
+    if (cluster_count > 0 && cluster_start() < 0)
+        exit(1);
 
-        handle_client(client_socket);
+    // Métricas no formato do Prometheus, só para conexões locais
+    if (admin_port > 0) {
+        if (stats_admin_start(admin_port) < 0)
+            exit(1);
+        LOG(LOG_INFO, "Métricas em http://127.0.0.1:%d/metrics", admin_port);
     }
 
-    
+    for (int i = 1; i < shard_count; i++) {
+        if (pthread_create(&shards[i]->thread, NULL, shard_run, shards[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // A thread principal executa o shard 0
+    shard_run(shards[0]);
+
+    for (int i = 1; i < shard_count; i++)
+        pthread_join(shards[i]->thread, NULL);
+    cluster_join();
+    LOG(LOG_INFO, "Servidor encerrado");
+    log_shutdown();
 
-    close(server_socket);
     return 0;
 }
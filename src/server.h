@@ -0,0 +1,373 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <zlib.h>
+
+#include "mailbox.h"
+#include "msg_queue.h"
+#include "protocol.h"
+#include "ratelimit.h"
+#include "wal.h"
+#include "uring.h"
+
+#define MAX_MSG_LEN 1024
+#define MAX_NAME_LEN 100
+#define MAX_NICK_LEN 50
+#define PORT 8080
+// Tamanho da fila de conexões pendentes
+#define BACKLOG SOMAXCONN
+// Número máximo de eventos tratados por chamada ao epoll_wait
+#define MAX_EVENTS 256
+// Tamanho do bloco lido por chamada a recv
+#define READ_CHUNK 4096
+// Número máximo de respostas aguardando outros shards por conexão
+#define MAX_PENDING 64
+// Fila de saída a partir da qual a conexão fica congestionada: os comandos dela deixam
+// de ser lidos e as entregas para o usuário dela esperam na fila de mensagens
+#define CONN_HIGH_WATER (1u << 20)
+// Fila de saída abaixo da qual a conexão volta ao normal e as entregas retidas são retomadas
+#define CONN_LOW_WATER (256u << 10)
+// Bytes recebidos e ainda não processados a partir dos quais a leitura do socket é suspensa
+#define READ_LIMIT (256u << 10)
+// Bytes de comandos que uma conexão processa por vez na fila de conexões prontas
+// (deficit round robin); cabe o maior frame, então cada vez processa pelo menos um
+#define DRR_QUANTUM 8192
+// Limite padrão de comandos por segundo de cada conexão (opção -r)
+#define DEFAULT_CONN_RATE 2000
+// Limite padrão de mensagens por segundo de cada usuário logado (opção -u)
+#define DEFAULT_USER_RATE 100
+// Mensagens guardadas por destinatário a partir das quais novas são recusadas (opção -q)
+#define DEFAULT_QUEUE_QUOTA 10000
+// Tamanho máximo do registro de uma entrega (remetente, que nas mensagens de grupo é
+// "#grupo/remetente", timestamp e texto)
+#define MAX_RECORD_LEN (1 + 2 * MAX_NICK_LEN + 8 + MAX_TEXT_LEN)
+
+// Backend de E/S dos sockets (opção -e)
+enum {
+    IO_EPOLL,                   // epoll edge-triggered com recv/sendmsg
+    IO_URING                    // io_uring: accept e recv multishot, envios em lote
+};
+
+// Protocolo usado pela conexão
+enum {
+    MODE_TEXT,                  // Comandos de texto (REGISTER {a, b}, ...)
+    MODE_BINARY                 // Frames binários com tamanho (ver protocol.h)
+};
+
+// Referência a uma conexão que pode estar em qualquer shard
+typedef struct {
+    int shard;                  // Shard que aceitou a conexão
+    int fd;                     // Socket da conexão
+    uint32_t id;                // Identificador da conexão no shard (protege contra reuso do fd)
+    int node;                   // Nó do cluster onde a conexão está
+} ConnRef;
+
+#include "presence.h"
+#include "conversation.h"
+
+// Campos quentes do usuário, percorridos nas entregas e nos logins. O apelido fica no
+// array de apelidos da tabela e o nome no perfil (dados frios), pelo mesmo id.
+typedef struct User {
+    int online;                 // Flag que indica se está online <1> ou offline <2>
+    ConnRef session;            // Conexão associada ao usuário (fd -1 se nenhuma)
+    MessageQueue queue;         // Fila de mensagens pendentes
+    uint64_t acked_seq;         // Sequência da última mensagem retirada da fila (a i-ésima da fila é acked_seq + 1 + i)
+    uint32_t sent;              // Mensagens do início da fila já enviadas à sessão, aguardando ACK
+    int acks;                   // A sessão confirma as entregas (LOGIN com ACK)
+    ConvTable conversations;    // Última sequência aceita de cada remetente (SEND_MSG numerado)
+    uint32_t list_offset;       // Posição do dígito "online" do usuário na lista serializada do shard
+    TokenBucket bucket;         // Mensagens por segundo enviadas pelo usuário (não depende da sessão)
+} User;
+
+// Dados frios do usuário, só lidos no LIST e nos snapshots
+typedef struct {
+    char name[MAX_NAME_LEN];    // Nome do usuário
+} UserProfile;
+
+#include "user_table.h"
+#include "record.h"
+#include "history.h"
+#include "group.h"
+#include "stats.h"
+#include "log.h"
+
+// Raiz da arena de um shard: tudo o que sobrevive a um reinício
+typedef struct {
+    UserTableData users;        // Tabela de usuários
+    SlabData slab;              // Slab das mensagens pendentes
+    UserTableData groups;       // Tabela de grupos (array de Group)
+    UserTableData names;        // Nomes internados das filas (array de InternedName)
+} ShardStore;
+
+// Entrega de grupo montada uma única vez e compartilhada pelas filas de saída de
+// todas as conexões que a recebem, em qualquer shard
+struct SharedMsg {
+    atomic_int refs;            // Referências (shards e blocos de saída que a usam)
+    uint32_t record_len;        // Registro de entrega (formato das filas e do log)
+    uint32_t text_len;          // DELIVER_MSG{...} do protocolo de texto
+    uint32_t binary_len;        // Frame OP_DELIVER do protocolo binário
+    char data[];                // Registro, texto e frame, nessa ordem
+};
+
+// Bloco da fila de saída de uma conexão; os blocos são enviados juntos com sendmsg
+typedef struct OutBlock {
+    struct OutBlock* next;      // Próximo bloco da fila
+    size_t off;                 // Bytes já enviados
+    size_t len;                 // Bytes escritos no bloco
+    size_t cap;                 // Capacidade de data
+    SharedMsg* shared;          // Entrega de grupo referenciada (bytes em ref, não em data)
+    const char* ref;
+    char data[];                // Bytes a enviar
+} OutBlock;
+
+struct Shard;
+
+// Resposta pronta que aguarda as anteriores para manter a ordem dos comandos
+typedef struct {
+    int done;                   // Resposta já recebida
+    char* data;                 // Bytes da resposta
+    size_t len;                 // Tamanho da resposta
+} PendingReply;
+
+typedef struct Connection {
+    int fd;                     // Socket do cliente
+    uint32_t id;                // Identificador da conexão no shard
+    struct Shard* shard;        // Shard dono da conexão
+    char* rbuf;                 // Buffer de leitura (bytes recebidos ainda não processados)
+    size_t rlen;                // Bytes válidos no buffer de leitura
+    size_t rcap;                // Capacidade do buffer de leitura
+    OutBlock* out_head;         // Fila de saída (bytes ainda não enviados)
+    OutBlock* out_tail;
+    size_t out_bytes;           // Total de bytes na fila de saída
+    int dirty;                  // Tem bytes novos para enviar no fim da iteração
+    int closing;                // Conexão deve ser fechada após enviar o que está pendente
+    int mode;                   // Protocolo da conexão (MODE_*)
+    int blocked;                // Aguardando resposta de um comando que altera a sessão
+    char nick[MAX_NICK_LEN];    // Usuário logado nesta conexão ("" se nenhum)
+    char pending_nick[MAX_NICK_LEN]; // Usuário de um LOGIN/LOGOUT ainda sem resposta
+    uint32_t next_seq;          // Sequência da próxima resposta reservada
+    uint32_t flush_seq;         // Sequência da próxima resposta a ser escrita
+    PendingReply* pending;      // Respostas fora de ordem (alocado sob demanda)
+    int list_sub;               // Inscrição nas mudanças da lista de usuários (LIST_SUB_*)
+    char* sub_hold;             // Mudanças recebidas antes da lista inicial ser enviada
+    size_t sub_hold_len;
+    size_t sub_hold_cap;
+    char (*contacts)[MAX_NICK_LEN]; // Usuários cuja presença a conexão acompanha
+    int contact_count;
+    int contact_cap;
+    PresenceNote* held;         // Avisos de presença retidos pela fila de saída cheia
+    int held_count;
+    int held_cap;
+    int congested;              // Fila de saída passou de CONN_HIGH_WATER e ainda não caiu abaixo de CONN_LOW_WATER
+    int read_paused;            // Leitura suspensa (fila de saída cheia ou comandos acumulados)
+    int spill_pending;          // Entregas podem estar retidas na fila do usuário: pedir a retomada
+    int ready;                  // Na fila de conexões prontas, esperando a vez de processar comandos
+    size_t deficit;             // Bytes de comandos que ainda pode processar na vez atual
+    TokenBucket bucket;         // Comandos por segundo da conexão
+    z_stream* zout;             // Compressor da saída (NULL sem compressão)
+    int zpending;               // O compressor guarda bytes ainda não escritos na fila de saída
+    uint64_t sync_wait;         // Gravação do log que precisa chegar ao disco antes da saída (SYNC_ALWAYS)
+    int sync_held;              // Na lista de conexões esperando o fsync do log
+    int io_refs;                // Operações do io_uring em andamento que usam a conexão
+    int close_fd;               // Socket fechado só na última conclusão do io_uring (-1 se nenhum)
+    int recv_armed;             // recv multishot ativo no io_uring
+    int send_inflight;          // Envios submetidos ao io_uring e ainda não concluídos
+    int send_final;             // Último envio antes do fechamento já submetido
+    struct IoSend* io_send;     // Mensagens dos envios em andamento (io_uring, alocado sob demanda)
+} Connection;
+
+// Estado da inscrição de uma conexão na lista de usuários
+enum {
+    LIST_SUB_NONE,
+    LIST_SUB_PENDING,           // Aguardando a lista inicial; as mudanças ficam em sub_hold
+    LIST_SUB_ACTIVE             // Mudanças enviadas assim que chegam
+};
+
+// Contadores de controle de fluxo do shard: escritos só pela thread do shard e lidos
+// pelo STATS em qualquer shard
+typedef struct {
+    atomic_ullong congested;         // Conexões congestionadas agora
+    atomic_ullong congestion_events; // Vezes que uma conexão passou de CONN_HIGH_WATER
+    atomic_ullong read_pauses;       // Vezes que a leitura de uma conexão foi suspensa
+    atomic_ullong spilled;           // Entregas desviadas para a fila do usuário (destino congestionado)
+    atomic_ullong resumed;           // Entregas da fila enviadas a usuários online (login e retomadas)
+    atomic_ullong deferred;          // Vezes que uma conexão esgotou a vez e voltou à fila de prontas
+    atomic_ullong throttled;         // Vezes que uma conexão esperou fichas do limite de comandos
+    atomic_ullong rate_limited;      // Mensagens recusadas pelo limite do usuário (ERROR{RATE_LIMITED})
+    atomic_ullong over_quota;        // Mensagens recusadas ou descartadas pela cota da fila do destinatário
+} FlowStats;
+
+// Lista de usuários do shard já serializada para o LIST, atualizada a cada alteração
+// em vez de refeita a cada consulta
+typedef struct {
+    char* data;                 // Entradas ",{...}" na ordem da tabela de usuários
+    size_t len;
+    size_t cap;
+    int valid;                  // 0: refeita por inteiro na próxima consulta
+} ListCache;
+
+// Tipos de mensagem trocados entre shards
+enum {
+    MSG_COMMAND,                // Comando a executar no shard dono do usuário
+    MSG_REPLY,                  // Resposta de um comando para a conexão de origem
+    MSG_DELIVER,                // Entrega para uma conexão: u64 sequência (0 = sem ACK) e o registro
+    MSG_DISCONNECT,             // Conexão de um usuário foi encerrada
+    MSG_LIST,                   // Pedido da parte da lista de usuários de um shard
+    MSG_LIST_PART,              // Parte da lista de usuários de um shard
+    MSG_PRESENCE,               // Mudança na lista de usuários para os inscritos do shard
+    MSG_PRESENCE_FANOUT,        // Mudança de estado de um usuário para conexões inscritas nele
+    MSG_PRESENCE_UNSUBSCRIBE,   // Conexão inscrita no usuário foi encerrada
+    MSG_GROUP_DELIVER,          // Entrega de grupo (cookie) para os membros do shard em data
+    MSG_GROUP_WRITE,            // Entrega de grupo (cookie) para as conexões do shard em data
+    MSG_RESUME,                 // Conexão do usuário saiu do congestionamento: enviar as entregas retidas
+    MSG_SPILL_PENDING,          // Ainda há entregas retidas para a conexão: pedir de novo ao esvaziar
+    MSG_HISTORY,                // Mensagem entregue para o histórico: destinatário ('\0') e o registro
+    MSG_SEARCH,                 // Pedido das mensagens de um shard que casam com o SEARCH
+    MSG_SEARCH_PART,            // Mensagens de um shard que casam com o SEARCH
+    MSG_NODE_DOWN               // O nó seq saiu do cluster: as sessões abertas por ele caem
+};
+
+// Operações de sessão aplicadas à conexão quando a resposta chega
+enum {
+    SESSION_NONE,
+    SESSION_LOGIN,
+    SESSION_LOGOUT
+};
+
+// Mensagem entre shards. Várias mensagens para o mesmo shard são agrupadas num
+// único ShardBatch, enviado pela mailbox no fim da iteração do shard de origem.
+typedef struct ShardMsg {
+    int type;                   // Tipo da mensagem (MSG_*)
+    ConnRef conn;               // Conexão de origem (pedidos) ou de destino (respostas)
+    uint32_t seq;               // Posição da resposta na ordem da conexão
+    int session_op;             // Operação de sessão (SESSION_*) das respostas
+    void* cookie;               // Contexto opaco devolvido na resposta
+    size_t len;                 // Tamanho de data
+    char data[];                // Conteúdo da mensagem
+} ShardMsg;
+
+// Lote de mensagens para um shard (ou para outro nó, que as repassa aos shards dele)
+typedef struct {
+    MailboxNode node;           // Encadeamento na mailbox (deve ser o primeiro campo)
+    int peer;                   // Nó destino dos lotes entregues ao cluster
+    size_t len;                 // Bytes ocupados em data
+    size_t cap;                 // Capacidade de data
+    char data[];                // ShardMsg consecutivas, alinhadas a 8 bytes
+} ShardBatch;
+
+// Função que retorna quanto uma mensagem com `len` bytes de dados ocupa no lote
+static inline size_t shard_msg_size(size_t len) {
+    return (sizeof(ShardMsg) + len + 1 + 7) & ~(size_t)7;
+}
+
+#include "cluster.h"
+
+// Lote para outro shard ou nó retido até o fsync do log (SYNC_ALWAYS)
+typedef struct {
+    ShardBatch* batch;
+    int target;                 // Destino, como em shard_post
+    uint64_t ticket;            // Gravação do log que precisa chegar ao disco antes
+} HeldBatch;
+
+typedef struct Shard {
+    int id;                     // Índice do shard
+    pthread_t thread;           // Thread do reactor
+    int epoll_fd;               // Instância do epoll do shard
+    Uring ring;                 // Anel do io_uring (fd -1 com o backend epoll)
+    int listen_fd;              // Socket de escuta próprio (SO_REUSEPORT)
+    int event_fd;               // Acorda o shard quando chegam mensagens na mailbox
+    Mailbox mailbox;            // Mensagens vindas de outros shards
+    ShardBatch** outbox;        // Lote em montagem para cada shard destino e, depois
+                                // deles, para cada nó do cluster
+    int* dirty;                 // Sockets com bytes novos para enviar nesta iteração
+    int dirty_count;
+    int dirty_cap;
+    ConnRef* sync_conns;        // Conexões com saída esperando o fsync do log
+    int sync_conn_count;
+    int sync_conn_cap;
+    HeldBatch* sync_batches;    // Lotes esperando o fsync do log, na ordem em que saíram
+    int sync_batch_count;
+    int sync_batch_cap;
+    ConnRef* ready;             // Conexões com comandos esperando a vez, na ordem de chegada
+    int ready_count;
+    int ready_cap;
+    Connection** connections;   // Conexões do shard indexadas pelo socket
+    int connections_cap;        // Tamanho da tabela de conexões
+    int connection_count;       // Conexões abertas
+    uint64_t out_bytes;         // Bytes nas filas de saída de todas as conexões
+    atomic_uint* congested;     // Por socket: id da conexão congestionada (0 = nenhuma), lido
+    int congested_cap;          // pelos shards donos dos usuários antes de entregar
+    uint32_t next_conn_id;      // Próximo identificador de conexão
+    Arena arena;                // Arquivo mapeado com os usuários e as filas do shard
+    UserTable users;            // Usuários pertencentes a este shard
+    UserTable groups;           // Grupos pertencentes a este shard
+    Slab slab;                  // Armazenamento das mensagens pendentes dos usuários do shard
+    UserTable names;            // Remetentes e grupos das mensagens guardadas, por id
+    RecordCodec codec;          // Compressores dos textos guardados
+    Wal wal;                    // Log durável das alterações nos usuários do shard
+    HistoryStore history;       // Histórico das conversas pertencentes ao shard
+    ListCache list;             // Parte do shard na lista de usuários, já serializada
+    int* list_subs;             // Sockets inscritos nas mudanças da lista
+    int list_sub_count;
+    int list_sub_cap;
+    PresenceTable presence;     // Conexões inscritas na presença dos usuários do shard
+    GroupScratch group_scratch; // Áreas de trabalho das entregas de grupo
+    FlowStats flow;             // Contadores de controle de fluxo
+    ShardStats stats;           // Latências dos comandos e medidas do shard
+} Shard;
+
+extern Shard** shards;          // Todos os shards do servidor
+extern int shard_count;         // Número de shards (threads de reactor)
+extern volatile sig_atomic_t server_stopping; // Encerramento pedido (SIGINT/SIGTERM)
+extern int io_engine;           // Backend de E/S pedido (IO_*)
+extern int server_port;         // Porta dos clientes (opção -p)
+extern RateLimit conn_rate_limit;   // Comandos por segundo de cada conexão
+extern RateLimit user_rate_limit;   // Mensagens por segundo enviadas por cada usuário
+extern uint32_t queue_quota;        // Mensagens guardadas por destinatário (0 = sem cota)
+
+// reactor.c
+int shard_init(Shard* shard, int id);
+void* shard_run(void* arg);
+Connection* conn_lookup(Shard* shard, ConnRef ref);
+ConnRef conn_ref(Shard* shard, Connection* conn);
+int conn_congested(ConnRef ref);
+void conn_spill_pending(Connection* conn);
+void conn_send(Connection* conn, const char* data, size_t len);
+void conn_send_shared(Connection* conn, SharedMsg* msg);
+int conn_compress(Connection* conn);
+uint32_t conn_reserve_reply(Connection* conn);
+void conn_complete_reply(Connection* conn, uint32_t seq, const char* data, size_t len);
+void conn_process_frames(Shard* shard, Connection* conn);
+ShardMsg* shard_post(Shard* from, int target, int type, size_t len);
+ShardMsg* batch_post(ShardBatch** slot, int type, size_t len);
+void batch_deliver(Shard* target, ShardBatch* batch);
+
+// server.c
+uint32_t hash_nick(const char* nick);
+int shard_of(const char* nick);
+int owner_target(const char* nick);
+int conn_target(ConnRef ref);
+User* find_user(Shard* shard, const char* nick);
+const char* user_nick(Shard* shard, const User* user);
+int delivery_held(const User* user);
+void queue_stream(Shard* shard, User* user);
+size_t delivery_encode(char* out, const char* from, const char* text, size_t text_len, int64_t ts);
+SharedMsg* shared_msg_new(const char* record, size_t len);
+void shared_msg_release(SharedMsg* msg);
+void dispatch_frame(Shard* shard, Connection* conn, const char* frame);
+void dispatch_binary(Shard* shard, Connection* conn, const ProtoFrame* frame);
+void handle_shard_msg(Shard* shard, ShardMsg* msg);
+int remote_msg_shard(ShardMsg* msg);
+void remote_msg_unavailable(const ShardMsg* msg, ShardBatch** inbox);
+void handle_disconnect(Shard* shard, Connection* conn);
+void request_resume(Shard* shard, Connection* conn);
+size_t presence_encode(int mode, char* out, int event, const char* nick, const char* name);
+void shard_checkpoint(Shard* shard);
+void shard_shutdown(Shard* shard);
+
+#endif
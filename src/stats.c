@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "server.h"
+
+#define LOAD(field) atomic_load_explicit(&(field), memory_order_relaxed)
+#define STORE(field, value) atomic_store_explicit(&(field), (value), memory_order_relaxed)
+
+// Nomes dos comandos nas métricas, na ordem de CMD_*
+static const char* command_names[STATS_COMMANDS] = {
+    "register", "delete", "login", "logout", "list", "send_msg", "list_subscribe",
+    "list_unsubscribe", "subscribe", "unsubscribe", "join", "leave", "stats", "ack", "history",
+    "search"
+};
+
+// Percentis publicados para cada histograma
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static int admin_fd = -1;       // Socket de escuta da administração
+
+// Função que retorna o relógio monotônico em nanossegundos
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Função que registra a resposta de um comando despachado em `start`, na
+// instrumentação do shard que está respondendo
+void stats_command(Shard* shard, int op, uint64_t start, int error) {
+    if (op < 0 || op >= STATS_COMMANDS)
+        return;
+
+    CommandStats* cmd = &shard->stats.commands[op];
+    hist_record(&cmd->latency, stats_now() - start);
+    if (error)
+        atomic_fetch_add_explicit(&cmd->errors, 1, memory_order_relaxed);
+}
+
+// Função que publica as medidas do shard (chamada no fim de cada iteração)
+void stats_publish(Shard* shard) {
+    ShardStats* stats = &shard->stats;
+    STORE(stats->connections, shard->connection_count);
+    STORE(stats->out_bytes, shard->out_bytes);
+    STORE(stats->users, user_table_count(&shard->users));
+    STORE(stats->groups, user_table_count(&shard->groups));
+    STORE(stats->queued_messages, shard->slab.data->messages_queued);
+    STORE(stats->slab_chunks, shard->slab.data->chunks_in_use);
+    STORE(stats->arena_bytes, shard->arena.size);
+}
+
+// Função que escreve um histograma (em ns) como summary em segundos
+static void render_summary(FILE* out, const char* name, const char* labels, const Histogram* hist) {
+    const char* sep = labels[0] ? "," : "";
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+        fprintf(out, "%s{%s%squantile=\"%g\"} %.9f\n", name, labels, sep, quantiles[i],
+                hist_percentile(hist, quantiles[i] * 100.0) / 1e9);
+
+    // Sem rótulos, _sum e _count vão sem chaves
+    const char* open = labels[0] ? "{" : "";
+    const char* close = labels[0] ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, open, labels, close, LOAD(hist->sum) / 1e9);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, open, labels, close, LOAD(hist->total));
+}
+
+// Função que escreve o cabeçalho de uma métrica
+static void render_header(FILE* out, const char* name, const char* type, const char* help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Função que escreve uma medida com um valor por shard. `offset` é a posição do campo
+// (atomic_ullong) dentro de Shard.
+static void render_per_shard(FILE* out, const char* name, const char* type, const char* help, size_t offset) {
+    render_header(out, name, type, help);
+    for (int i = 0; i < shard_count; i++) {
+        atomic_ullong* field = (atomic_ullong*)((char*)shards[i] + offset);
+        fprintf(out, "%s{shard=\"%d\"} %llu\n", name, i, LOAD(*field));
+    }
+}
+
+// Função que monta o texto das métricas de todos os shards. Retorna o texto alocado
+// com malloc (tamanho em `len`).
+static char* stats_render(size_t* len) {
+    char* text = NULL;
+    FILE* out = open_memstream(&text, len);
+    if (out == NULL)
+        return NULL;
+
+    // Comandos: histogramas somados entre os shards (lidos enquanto são escritos)
+    Histogram* merged = calloc(STATS_COMMANDS + 2, sizeof(Histogram));
+    unsigned long long errors[STATS_COMMANDS] = { 0 };
+    for (int i = 0; i < shard_count; i++) {
+        ShardStats* stats = &shards[i]->stats;
+        for (int c = 0; c < STATS_COMMANDS; c++) {
+            hist_merge(&merged[c], &stats->commands[c].latency);
+            errors[c] += LOAD(stats->commands[c].errors);
+        }
+        hist_merge(&merged[STATS_COMMANDS], &stats->loop);
+        hist_merge(&merged[STATS_COMMANDS + 1], &stats->wal_commit);
+    }
+
+    render_header(out, "chat_commands_total", "counter", "Comandos respondidos.");
+    for (int c = 0; c < STATS_COMMANDS; c++)
+        fprintf(out, "chat_commands_total{command=\"%s\"} %llu\n", command_names[c], LOAD(merged[c].total));
+
+    render_header(out, "chat_command_errors_total", "counter", "Comandos respondidos com ERROR.");
+    for (int c = 0; c < STATS_COMMANDS; c++)
+        fprintf(out, "chat_command_errors_total{command=\"%s\"} %llu\n", command_names[c], errors[c]);
+
+    render_header(out, "chat_command_duration_seconds", "summary",
+                  "Tempo entre o despacho do comando e a sua resposta.");
+    for (int c = 0; c < STATS_COMMANDS; c++) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "command=\"%s\"", command_names[c]);
+        render_summary(out, "chat_command_duration_seconds", labels, &merged[c]);
+    }
+
+    render_header(out, "chat_loop_iteration_seconds", "summary",
+                  "Trabalho de cada iteração do reactor depois do epoll_wait.");
+    render_summary(out, "chat_loop_iteration_seconds", "", &merged[STATS_COMMANDS]);
+    render_header(out, "chat_wal_commit_seconds", "summary",
+                  "Gravação do log por iteração (o fsync é feito pela thread de fsync do shard).");
+    render_summary(out, "chat_wal_commit_seconds", "", &merged[STATS_COMMANDS + 1]);
+    free(merged);
+
+#define SHARD_FIELD(field) offsetof(Shard, field)
+    render_per_shard(out, "chat_mailbox_messages_total", "counter",
+                     "Mensagens recebidas de outros shards.", SHARD_FIELD(stats.mailbox_messages));
+    render_per_shard(out, "chat_connections", "gauge", "Conexões abertas.", SHARD_FIELD(stats.connections));
+    render_per_shard(out, "chat_output_queue_bytes", "gauge",
+                     "Bytes nas filas de saída das conexões.", SHARD_FIELD(stats.out_bytes));
+    render_per_shard(out, "chat_users", "gauge", "Usuários registrados.", SHARD_FIELD(stats.users));
+    render_per_shard(out, "chat_groups", "gauge", "Grupos.", SHARD_FIELD(stats.groups));
+    render_per_shard(out, "chat_queued_messages", "gauge",
+                     "Mensagens nas filas dos usuários.", SHARD_FIELD(stats.queued_messages));
+    render_per_shard(out, "chat_slab_chunks", "gauge", "Chunks do slab em uso.", SHARD_FIELD(stats.slab_chunks));
+    render_per_shard(out, "chat_arena_bytes", "gauge", "Tamanho do arquivo da arena.", SHARD_FIELD(stats.arena_bytes));
+    render_per_shard(out, "chat_congested_connections", "gauge",
+                     "Conexões acima do limite da fila de saída.", SHARD_FIELD(flow.congested));
+    render_per_shard(out, "chat_congestion_events_total", "counter",
+                     "Vezes que uma conexão passou do limite da fila de saída.", SHARD_FIELD(flow.congestion_events));
+    render_per_shard(out, "chat_read_pauses_total", "counter",
+                     "Vezes que a leitura de uma conexão foi suspensa.", SHARD_FIELD(flow.read_pauses));
+    render_per_shard(out, "chat_spilled_total", "counter",
+                     "Entregas desviadas para a fila do usuário.", SHARD_FIELD(flow.spilled));
+    render_per_shard(out, "chat_resumed_total", "counter",
+                     "Entregas da fila enviadas a usuários online (pendentes do login e retidas).", SHARD_FIELD(flow.resumed));
+    render_per_shard(out, "chat_deferred_total", "counter",
+                     "Vezes que uma conexão esgotou a vez e voltou à fila de prontas.", SHARD_FIELD(flow.deferred));
+    render_per_shard(out, "chat_throttled_total", "counter",
+                     "Vezes que uma conexão esperou o limite de comandos.", SHARD_FIELD(flow.throttled));
+    render_per_shard(out, "chat_rate_limited_total", "counter",
+                     "Mensagens recusadas pelo limite do usuário.", SHARD_FIELD(flow.rate_limited));
+    render_per_shard(out, "chat_over_quota_total", "counter",
+                     "Mensagens recusadas ou descartadas pela cota da fila do destinatário.", SHARD_FIELD(flow.over_quota));
+#undef SHARD_FIELD
+
+    fclose(out);
+    return text;
+}
+
+// Função que atende o socket de administração: cada conexão recebe as métricas numa
+// resposta HTTP/1.0 (o pedido é ignorado), o que serve tanto ao Prometheus quanto a
+// um curl. Roda numa thread própria, fora do caminho dos shards.
+static void* admin_run(void* arg) {
+    (void)arg;
+
+    while (!server_stopping) {
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        // Lendo (e descartando) o pedido, com limite de espera
+        struct timeval timeout = { .tv_sec = 1 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[4096];
+        if (recv(fd, request, sizeof(request), 0) < 0) {
+            close(fd);
+            continue;
+        }
+
+        size_t len = 0;
+        char* body = stats_render(&len);
+        if (body != NULL) {
+            char header[128];
+            int n = snprintf(header, sizeof(header),
+                             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\n\r\n", len);
+            if (send(fd, header, n, MSG_NOSIGNAL) == n)
+                send(fd, body, len, MSG_NOSIGNAL);
+            free(body);
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
+
+// Função que abre o socket de administração em 127.0.0.1:`port` e inicia sua thread
+int stats_admin_start(int port) {
+    admin_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (admin_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    // Só aceita conexões locais
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(admin_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(admin_fd, 16) < 0) {
+        perror("bind");
+        close(admin_fd);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, admin_run, NULL) != 0) {
+        close(admin_fd);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+// Instrumentação do servidor. Cada shard escreve só nos próprios contadores e
+// histogramas (sem trava e sem disputa de linhas de cache entre threads); o socket de
+// administração (opção -m) soma os shards no momento da leitura e responde no formato
+// de texto do Prometheus.
+
+// Comandos acompanhados, na ordem de CMD_* (server.c)
+#define STATS_COMMANDS 16
+
+typedef struct Shard Shard;
+
+// Contadores de um comando
+typedef struct {
+    atomic_ullong errors;       // Respostas ERROR{...}
+    Histogram latency;          // Do despacho até a resposta (ns); total = comandos
+} CommandStats;
+
+// Instrumentação de um shard
+typedef struct {
+    CommandStats commands[STATS_COMMANDS];
+    Histogram loop;             // Trabalho de cada iteração do reactor, após o epoll_wait (ns)
+    Histogram wal_commit;       // Gravação do log nas iterações com registros, sem o fsync (ns)
+    atomic_ullong mailbox_messages; // Mensagens recebidas de outros shards
+
+    // Medidas publicadas no fim de cada iteração
+    atomic_ullong connections;      // Conexões abertas
+    atomic_ullong out_bytes;        // Bytes nas filas de saída das conexões
+    atomic_ullong users;            // Usuários registrados
+    atomic_ullong groups;           // Grupos
+    atomic_ullong queued_messages;  // Mensagens nas filas dos usuários
+    atomic_ullong slab_chunks;      // Chunks do slab em uso
+    atomic_ullong arena_bytes;      // Tamanho do arquivo da arena
+} ShardStats;
+
+uint64_t stats_now();
+void stats_command(Shard* shard, int op, uint64_t start, int error);
+void stats_publish(Shard* shard);
+int stats_admin_start(int port);
+
+#endif
@@ -0,0 +1,224 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+// Função que chama io_uring_setup
+static int sys_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+// Função que chama io_uring_enter
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void* arg, size_t size) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+// Função que chama io_uring_register
+static int sys_register(int fd, unsigned op, void* arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+// Função que registra o anel de buffers fornecidos (grupo 0) e entrega todos os
+// buffers ao kernel. Retorna -1 se falhar.
+static int buf_ring_init(Uring* ring) {
+    size_t ring_bytes = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ring->bufs = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED) {
+        ring->bufs = NULL;
+        return -1;
+    }
+    ring->buf_data = mmap(NULL, (size_t)URING_BUF_COUNT * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_data == MAP_FAILED) {
+        ring->buf_data = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufs;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = 0;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    ring->buf_mask = URING_BUF_COUNT - 1;
+    for (unsigned i = 0; i < URING_BUF_COUNT; i++)
+        uring_buf_recycle(ring, i);
+    return 0;
+}
+
+// Função que cria o anel com `entries` submissões (e quatro vezes mais conclusões).
+// Retorna -1 se o kernel não suportar o necessário (errno indica o motivo).
+int uring_init(Uring* ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = entries * 4;
+    ring->fd = sys_setup(entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    // Um único mapeamento para as duas filas; espera com timeout; sem perda de conclusões
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+    if ((params.features & needed) != needed) {
+        uring_close(ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_map = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_map == MAP_FAILED) {
+        ring->ring_map = NULL;
+        uring_close(ring);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_close(ring);
+        return -1;
+    }
+
+    char* base = ring->ring_map;
+    ring->sq_head = (unsigned*)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(base + params.sq_off.tail);
+    ring->sq_array = (unsigned*)(base + params.sq_off.array);
+    ring->sq_mask = *(unsigned*)(base + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned*)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    for (unsigned i = 0; i < ring->sq_entries; i++)
+        ring->sq_array[i] = i;
+
+    if (buf_ring_init(ring) < 0) {
+        uring_close(ring);
+        return -1;
+    }
+    return 0;
+}
+
+// Função que fecha o anel e libera os mapeamentos
+void uring_close(Uring* ring) {
+    if (ring->buf_data != NULL)
+        munmap(ring->buf_data, (size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (ring->bufs != NULL)
+        munmap(ring->bufs, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring_map != NULL)
+        munmap(ring->ring_map, ring->ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Função que entrega ao kernel as submissões pendentes, esperando por conclusões se
+// `wait` for diferente de zero. Retorna -1 se falhar.
+static int uring_enter(Uring* ring, unsigned wait, struct __kernel_timespec* ts) {
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)ts;
+    unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+
+    int submitted = sys_enter(ring->fd, ring->sq_pending, wait, flags, &arg, sizeof(arg));
+    if (submitted < 0) {
+        // Timeout da espera: as submissões já foram entregues
+        if (errno == ETIME) {
+            ring->sq_pending = 0;
+            return 0;
+        }
+        return -1;
+    }
+    ring->sq_pending -= (unsigned)submitted < ring->sq_pending ? (unsigned)submitted : ring->sq_pending;
+    return 0;
+}
+
+// Função que garante `count` posições livres na fila de submissão, entregando as
+// pendentes ao kernel se preciso (envios encadeados precisam sair juntos). Retorna -1
+// se não houver espaço.
+int uring_reserve(Uring* ring, unsigned count) {
+    unsigned used = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_entries - used >= count)
+        return 0;
+    if (uring_enter(ring, 0, NULL) < 0)
+        return -1;
+    used = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return ring->sq_entries - used >= count ? 0 : -1;
+}
+
+// Função que retorna uma submissão zerada no fim da fila, entregando as pendentes ao
+// kernel se a fila estiver cheia. Retorna NULL se não houver espaço.
+struct io_uring_sqe* uring_sqe(Uring* ring) {
+    if (uring_reserve(ring, 1) < 0)
+        return NULL;
+
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+// Função que entrega ao kernel as submissões pendentes, sem esperar. Retorna -1 se falhar.
+int uring_submit(Uring* ring) {
+    return ring->sq_pending > 0 ? uring_enter(ring, 0, NULL) : 0;
+}
+
+// Função que entrega as submissões pendentes e espera até `timeout_ms` por uma
+// conclusão (-1 para sempre, 0 para não esperar). Retorna -1 se falhar (EINTR incluído).
+int uring_wait(Uring* ring, int timeout_ms) {
+    if (timeout_ms == 0 || uring_cqe(ring) != NULL)
+        return ring->sq_pending > 0 ? uring_enter(ring, 0, NULL) : 0;
+
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+    };
+    return uring_enter(ring, 1, timeout_ms > 0 ? &ts : NULL);
+}
+
+// Função que retorna a próxima conclusão (NULL se não houver)
+struct io_uring_cqe* uring_cqe(Uring* ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+// Função que libera a conclusão retornada por uring_cqe
+void uring_cqe_seen(Uring* ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Função que retorna o início do buffer fornecido `id`
+char* uring_buf(Uring* ring, unsigned id) {
+    return ring->buf_data + (size_t)id * URING_BUF_SIZE;
+}
+
+// Função que devolve o buffer `id` ao kernel depois de consumido
+void uring_buf_recycle(Uring* ring, unsigned id) {
+    unsigned short tail = ring->bufs->tail;
+    struct io_uring_buf* buf = &ring->bufs->bufs[tail & ring->buf_mask];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(ring, id);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = (unsigned short)id;
+    __atomic_store_n(&ring->bufs->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,53 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// Anel io_uring de um shard, usado direto pelas chamadas de sistema (sem liburing).
+// As submissões se acumulam durante a iteração e saem juntas na próxima espera; as
+// leituras usam um anel de buffers fornecidos ao kernel (recv multishot escolhe um
+// buffer livre a cada pacote).
+
+// Buffers fornecidos para as leituras
+#define URING_BUF_COUNT 256
+#define URING_BUF_SIZE 16384
+
+typedef struct {
+    int fd;                     // Descritor do anel (-1 se não iniciado)
+    // Fila de submissão
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending;        // Submissões ainda não entregues ao kernel
+    struct io_uring_sqe* sqes;
+    // Fila de conclusão
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    // Mapeamentos
+    void* ring_map;
+    size_t ring_size;
+    size_t sqes_size;
+    // Buffers fornecidos (grupo 0)
+    struct io_uring_buf_ring* bufs;
+    char* buf_data;
+    unsigned buf_mask;
+} Uring;
+
+int uring_init(Uring* ring, unsigned entries);
+void uring_close(Uring* ring);
+int uring_reserve(Uring* ring, unsigned count);
+struct io_uring_sqe* uring_sqe(Uring* ring);
+int uring_submit(Uring* ring);
+int uring_wait(Uring* ring, int timeout_ms);
+struct io_uring_cqe* uring_cqe(Uring* ring);
+void uring_cqe_seen(Uring* ring);
+char* uring_buf(Uring* ring, unsigned id);
+void uring_buf_recycle(Uring* ring, unsigned id);
+
+#endif
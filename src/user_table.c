@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+
+// Tamanho inicial do índice (em bits)
+#define INITIAL_INDEX_BITS 6
+
+// Função que calcula a posição inicial de um hash no índice (hash de Fibonacci).
+// Os bits baixos do hash já escolheram o shard, então são misturados antes.
+static uint32_t home_of(uint32_t hash, uint32_t bits) {
+    return (uint32_t)(hash * 2654435769u) >> (32 - bits);
+}
+
+// Função que retorna o i-ésimo item do array
+static char* item_at(UserTable* table, int32_t i) {
+    return (char*)arena_ptr(table->arena, table->data->items) + (size_t)i * table->data->item_size;
+}
+
+// Função que retorna o apelido do i-ésimo item
+static char* nick_at(UserTable* table, int32_t i) {
+    return (char*)arena_ptr(table->arena, table->data->nicks) + (size_t)i * MAX_NICK_LEN;
+}
+
+// Função que retorna os dados frios do i-ésimo item
+static char* profile_at(UserTable* table, int32_t i) {
+    return (char*)arena_ptr(table->arena, table->data->profiles) + (size_t)i * table->data->profile_size;
+}
+
+// Função que retorna o índice
+static UserIndexEntry* index_of(UserTable* table) {
+    return arena_ptr(table->arena, table->data->index);
+}
+
+// Função que aloca na arena um índice vazio com 2^bits entradas (0 sem espaço)
+static ArenaOff index_alloc(Arena* arena, uint32_t bits) {
+    size_t size = (size_t)1 << bits;
+    ArenaOff off = arena_alloc(arena, size * sizeof(UserIndexEntry));
+    if (off == 0)
+        return 0;
+
+    UserIndexEntry* index = arena_ptr(arena, off);
+    for (size_t i = 0; i < size; i++)
+        index[i].slot = -1;
+    return off;
+}
+
+// Função que insere uma entrada no índice (sem verificar duplicatas)
+static void index_insert(UserIndexEntry* index, uint32_t bits, uint32_t hash, int32_t slot) {
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t pos = home_of(hash, bits);
+
+    while (index[pos].slot >= 0)
+        pos = (pos + 1) & mask;
+
+    index[pos].hash = hash;
+    index[pos].slot = slot;
+}
+
+// Função que busca a entrada do índice que aponta para `slot`
+static uint32_t index_position(UserTable* table, uint32_t hash, int32_t slot) {
+    UserIndexEntry* index = index_of(table);
+    uint32_t bits = table->data->index_bits;
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t pos = home_of(hash, bits);
+
+    while (index[pos].slot != slot)
+        pos = (pos + 1) & mask;
+
+    return pos;
+}
+
+// Função que dobra o índice quando a ocupação passa de 50%. Retorna -1 sem espaço.
+static int index_grow(UserTable* table) {
+    UserTableData* data = table->data;
+    uint32_t bits = data->index_bits + 1;
+    ArenaOff off = index_alloc(table->arena, bits);
+    if (off == 0)
+        return -1;
+
+    UserIndexEntry* index = arena_ptr(table->arena, off);
+    for (int i = 0; i < data->count; i++)
+        index_insert(index, bits, hash_nick(nick_at(table, i)), i);
+
+    arena_free(table->arena, data->index, ((size_t)1 << data->index_bits) * sizeof(UserIndexEntry));
+    data->index = off;
+    data->index_bits = bits;
+    return 0;
+}
+
+// Função que aloca uma cópia maior de um dos arrays (`capacity` elementos de `size`
+// bytes, com os `count` primeiros copiados). Retorna -1 sem espaço.
+static int array_copy(Arena* arena, ArenaOff array, size_t size, int32_t count, int32_t capacity, ArenaOff* out) {
+    *out = 0;
+    if (size == 0)
+        return 0;
+    if ((*out = arena_alloc(arena, (size_t)capacity * size)) == 0)
+        return -1;
+    if (count > 0)
+        memcpy(arena_ptr(arena, *out), arena_ptr(arena, array), (size_t)count * size);
+    return 0;
+}
+
+// Função que prepara o acesso à tabela guardada na arena, criando-a vazia (com itens
+// de `item_size` bytes e dados frios de `profile_size`) se ainda não existe. Retorna
+// -1 sem espaço.
+int user_table_init(UserTable* table, Arena* arena, UserTableData* data, size_t item_size, size_t profile_size) {
+    table->arena = arena;
+    table->data = data;
+    if (data->index != 0)
+        return 0;
+
+    memset(data, 0, sizeof(*data));
+    data->item_size = item_size;
+    data->profile_size = profile_size;
+    data->index_bits = INITIAL_INDEX_BITS;
+    data->index = index_alloc(arena, data->index_bits);
+    return data->index != 0 ? 0 : -1;
+}
+
+// Função que retorna o número de usuários da tabela
+int user_table_count(const UserTable* table) {
+    return table->data->count;
+}
+
+// Função que busca um item pelo apelido em O(1). Retorna o id ou -1.
+int32_t user_table_lookup(UserTable* table, const char* nick) {
+    UserIndexEntry* index = index_of(table);
+    uint32_t bits = table->data->index_bits;
+    uint32_t hash = hash_nick(nick);
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t pos = home_of(hash, bits);
+
+    while (index[pos].slot >= 0) {
+        UserIndexEntry* entry = &index[pos];
+        if (entry->hash == hash && strcmp(nick_at(table, entry->slot), nick) == 0)
+            return entry->slot;
+        pos = (pos + 1) & mask;
+    }
+    return -1;
+}
+
+// Função que adiciona um item (o apelido não pode existir na tabela), zerado e com o
+// perfil zerado. Retorna o id do novo item ou -1 sem espaço.
+int32_t user_table_insert(UserTable* table, const char* nick) {
+    UserTableData* data = table->data;
+
+    if (data->count == data->capacity) {
+        int32_t capacity = data->capacity ? data->capacity * 2 : 64;
+        ArenaOff items = 0, nicks = 0, profiles = 0;
+        int failed = array_copy(table->arena, data->items, data->item_size, data->count, capacity, &items) < 0;
+        failed = failed || array_copy(table->arena, data->nicks, MAX_NICK_LEN, data->count, capacity, &nicks) < 0;
+        failed = failed || array_copy(table->arena, data->profiles, data->profile_size, data->count, capacity, &profiles) < 0;
+        if (failed) {
+            // Os arrays velhos continuam valendo; as cópias já feitas são devolvidas
+            arena_free(table->arena, items, (size_t)capacity * data->item_size);
+            arena_free(table->arena, nicks, (size_t)capacity * MAX_NICK_LEN);
+            return -1;
+        }
+        arena_free(table->arena, data->items, (size_t)data->capacity * data->item_size);
+        arena_free(table->arena, data->nicks, (size_t)data->capacity * MAX_NICK_LEN);
+        arena_free(table->arena, data->profiles, (size_t)data->capacity * data->profile_size);
+        data->items = items;
+        data->nicks = nicks;
+        data->profiles = profiles;
+        data->capacity = capacity;
+    }
+
+    if ((uint32_t)(data->count + 1) * 2 > (1u << data->index_bits) && index_grow(table) < 0)
+        return -1;
+
+    // Tabelas sem itens ou sem perfil não têm esses arrays
+    int32_t id = data->count;
+    if (data->item_size > 0)
+        memset(item_at(table, id), 0, data->item_size);
+    if (data->profile_size > 0)
+        memset(profile_at(table, id), 0, data->profile_size);
+    strcpy(nick_at(table, id), nick);
+
+    index_insert(index_of(table), data->index_bits, hash_nick(nick), id);
+    data->count++;
+    return id;
+}
+
+// Função que remove um item em O(1): o último item ocupa o lugar dele nos arrays
+// e a entrada do índice é apagada deslocando as seguintes (sem marcadores de remoção)
+void user_table_delete(UserTable* table, int32_t slot) {
+    UserTableData* data = table->data;
+    UserIndexEntry* index = index_of(table);
+    int32_t last = data->count - 1;
+    uint32_t mask = (1u << data->index_bits) - 1;
+
+    // Apagando a entrada do índice
+    uint32_t i = index_position(table, hash_nick(nick_at(table, slot)), slot);
+    uint32_t j = i;
+    while (1) {
+        index[i].slot = -1;
+        while (1) {
+            j = (j + 1) & mask;
+            if (index[j].slot < 0)
+                goto removed;
+
+            // Entradas cuja posição inicial está em (i, j] continuam onde estão
+            uint32_t k = home_of(index[j].hash, data->index_bits);
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            break;
+        }
+        index[i] = index[j];
+        i = j;
+    }
+
+removed:
+    // Movendo o último item para a posição liberada
+    if (slot != last) {
+        uint32_t pos = index_position(table, hash_nick(nick_at(table, last)), last);
+        index[pos].slot = slot;
+        if (data->item_size > 0)
+            memcpy(item_at(table, slot), item_at(table, last), data->item_size);
+        memcpy(nick_at(table, slot), nick_at(table, last), MAX_NICK_LEN);
+        if (data->profile_size > 0)
+            memcpy(profile_at(table, slot), profile_at(table, last), data->profile_size);
+    }
+    data->count--;
+}
+
+// Função que retorna os campos quentes do item
+void* user_table_at(UserTable* table, int32_t id) {
+    return item_at(table, id);
+}
+
+// Função que retorna o apelido do item
+const char* user_table_nick(UserTable* table, int32_t id) {
+    return nick_at(table, id);
+}
+
+// Função que retorna os dados frios do item
+void* user_table_profile(UserTable* table, int32_t id) {
+    return profile_at(table, id);
+}
+
+// Função que retorna o id de um item a partir dos seus campos quentes
+int32_t user_table_id(UserTable* table, const void* item) {
+    return ((const char*)item - item_at(table, 0)) / table->data->item_size;
+}
+
+// Função que busca um item pelo apelido em O(1)
+void* user_table_find(UserTable* table, const char* nick) {
+    int32_t id = user_table_lookup(table, nick);
+    return id >= 0 ? item_at(table, id) : NULL;
+}
+
+// Função que adiciona um item (o apelido não pode existir na tabela).
+// Retorna o novo item zerado, ou NULL sem espaço.
+void* user_table_add(UserTable* table, const char* nick) {
+    int32_t id = user_table_insert(table, nick);
+    return id >= 0 ? item_at(table, id) : NULL;
+}
+
+// Função que remove um item
+void user_table_remove(UserTable* table, void* item) {
+    user_table_delete(table, user_table_id(table, item));
+}
+
+// Função que devolve à arena todos os arrays da tabela; ela precisa de um novo
+// user_table_init para voltar a ser usada
+void user_table_free(UserTable* table) {
+    UserTableData* data = table->data;
+    arena_free(table->arena, data->items, (size_t)data->capacity * data->item_size);
+    arena_free(table->arena, data->nicks, (size_t)data->capacity * MAX_NICK_LEN);
+    arena_free(table->arena, data->profiles, (size_t)data->capacity * data->profile_size);
+    arena_free(table->arena, data->index, ((size_t)1 << data->index_bits) * sizeof(UserIndexEntry));
+    memset(data, 0, sizeof(*data));
+}
@@ -0,0 +1,52 @@
+#ifndef USER_TABLE_H
+#define USER_TABLE_H
+
+#include <stdint.h>
+
+#include "arena.h"
+
+// Entrada do índice hash: hash do apelido e posição do usuário no array
+typedef struct {
+    uint32_t hash;              // Hash completo do apelido (evita strcmp em colisões)
+    int32_t slot;               // Posição em items (-1 se a entrada está vazia)
+} UserIndexEntry;
+
+// Tabela de usuários (ou de grupos, ou de nomes) de um shard, guardada na arena, em
+// arrays paralelos e densos (sem buracos) indexados pelo id do item: os campos
+// quentes (item), os apelidos (char[MAX_NICK_LEN]) e os dados frios (perfil), mais
+// um índice hash com endereçamento aberto e sondagem linear. A busca pelo apelido só
+// lê o índice e o array de apelidos; quem percorre os itens não passa pelos textos.
+// O id de um item vale até a próxima remoção (o último item ocupa o lugar do removido).
+typedef struct {
+    ArenaOff items;             // Campos quentes (array de User ou Group; 0 se item_size é 0)
+    ArenaOff nicks;             // Apelidos, na mesma ordem
+    ArenaOff profiles;          // Dados frios, na mesma ordem (0 se profile_size é 0)
+    int32_t count;              // Número de itens
+    int32_t capacity;           // Capacidade dos arrays
+    uint32_t item_size;         // Tamanho de cada item
+    uint32_t profile_size;      // Tamanho dos dados frios de cada item
+    ArenaOff index;             // Índice por apelido (array de UserIndexEntry)
+    uint32_t index_bits;        // log2 do tamanho do índice
+} UserTableData;
+
+// Acesso à tabela de usuários de um shard
+typedef struct {
+    Arena* arena;               // Arena onde a tabela é guardada
+    UserTableData* data;        // Estado da tabela (dentro da arena)
+} UserTable;
+
+int user_table_init(UserTable* table, Arena* arena, UserTableData* data, size_t item_size, size_t profile_size);
+int user_table_count(const UserTable* table);
+int32_t user_table_lookup(UserTable* table, const char* nick);
+int32_t user_table_insert(UserTable* table, const char* nick);
+void user_table_delete(UserTable* table, int32_t id);
+void* user_table_at(UserTable* table, int32_t id);
+const char* user_table_nick(UserTable* table, int32_t id);
+void* user_table_profile(UserTable* table, int32_t id);
+int32_t user_table_id(UserTable* table, const void* item);
+void* user_table_find(UserTable* table, const char* nick);
+void* user_table_add(UserTable* table, const char* nick);
+void user_table_remove(UserTable* table, void* item);
+void user_table_free(UserTable* table);
+
+#endif
@@ -0,0 +1,524 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+
+// Cabeçalho dos arquivos: identificador (8 bytes) e geração (u64)
+#define FILE_HEADER_LEN 16
+#define WAL_MAGIC "CHATWAL1"
+#define SNAP_MAGIC "CHATSNP1"
+// Cabeçalho de um registro: tamanho e crc32
+#define RECORD_HEADER_LEN 8
+// Tamanho do buffer de escrita do snapshot
+#define SNAP_BUFFER 65536
+
+char wal_dir[256] = "data";
+int wal_sync_mode = SYNC_BATCH;
+
+static uint32_t crc_table[256];
+
+// Função que monta a tabela do crc32 (polinômio refletido 0xEDB88320)
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+// Função que calcula o crc32 de um bloco
+static uint32_t crc32(const char* data, size_t len) {
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+        c = crc_table[(c ^ (uint8_t)data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static void put_u32(char* p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t get_u32(const char* p) {
+    const uint8_t* u = (const uint8_t*)p;
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
+
+static void put_u64(char* p, uint64_t v) {
+    put_u32(p, v >> 32);
+    put_u32(p + 4, (uint32_t)v);
+}
+
+static uint64_t get_u64(const char* p) {
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+// Função que retorna o tempo monotônico em milissegundos
+static int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Função que monta o caminho de um arquivo do shard
+void wal_path(char* out, size_t size, uint64_t epoch, int id, const char* ext) {
+    snprintf(out, size, "%s/shard-%llu-%d.%s", wal_dir, (unsigned long long)epoch, id, ext);
+}
+
+// Função que interrompe o servidor quando não é possível gravar: continuar
+// respondendo OK sem o log no disco quebraria a garantia de durabilidade
+static void wal_fatal(const char* what) {
+    perror(what);
+    exit(1);
+}
+
+// Função que grava todo o buffer no arquivo
+static void write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0)
+            wal_fatal("write");
+        data += n;
+        len -= n;
+    }
+}
+
+// Função que garante que as entradas do diretório (renomeações) estão no disco
+static void sync_dir() {
+    int fd = open(wal_dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Função que codifica um registro em `out`. Retorna o tamanho do registro.
+static size_t record_encode(char* out, int type, const char* nick, const char* data, size_t len) {
+    size_t nick_len = strlen(nick);
+    size_t body = 2 + nick_len + len;
+
+    out[RECORD_HEADER_LEN] = type;
+    out[RECORD_HEADER_LEN + 1] = nick_len;
+    memcpy(out + RECORD_HEADER_LEN + 2, nick, nick_len);
+    if (len > 0)
+        memcpy(out + RECORD_HEADER_LEN + 2 + nick_len, data, len);
+
+    put_u32(out, body);
+    put_u32(out + 4, crc32(out + RECORD_HEADER_LEN, body));
+
+    return RECORD_HEADER_LEN + body;
+}
+
+// Função que lê CURRENT. Retorna 0 se existe, -1 se o diretório ainda não tem estado.
+int wal_read_current(uint64_t* epoch, int* shard_count) {
+    crc_init();
+    mkdir(wal_dir, 0755);
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/CURRENT", wal_dir);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    unsigned long long e;
+    int count;
+    int ok = fscanf(file, "%llu %d", &e, &count) == 2;
+    fclose(file);
+    if (!ok)
+        return -1;
+
+    *epoch = e;
+    *shard_count = count;
+    return 0;
+}
+
+// Função que torna válido o conjunto de arquivos da época (troca atômica de CURRENT)
+int wal_write_current(uint64_t epoch, int shard_count) {
+    char path[512], tmp[512], line[64];
+    snprintf(path, sizeof(path), "%s/CURRENT", wal_dir);
+    snprintf(tmp, sizeof(tmp), "%s/CURRENT.tmp", wal_dir);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        wal_fatal(tmp);
+    int len = snprintf(line, sizeof(line), "%llu %d\n", (unsigned long long)epoch, shard_count);
+    write_all(fd, line, len);
+    if (fsync(fd) < 0)
+        wal_fatal("fsync");
+    close(fd);
+
+    if (rename(tmp, path) < 0)
+        wal_fatal("rename");
+    sync_dir();
+    return 0;
+}
+
+// Função que remove os arquivos de shards de outras épocas
+void wal_remove_stale(uint64_t epoch) {
+    DIR* dir = opendir(wal_dir);
+    if (dir == NULL)
+        return;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long long e;
+        if (sscanf(entry->d_name, "shard-%llu-", &e) != 1 || e == epoch)
+            continue;
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", wal_dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+// Função que lê os registros de um arquivo, chamando `apply` para cada um.
+// Com `check` o arquivo só é lido se tiver a geração `*generation`; sem ele,
+// `*generation` recebe a geração do arquivo. Um registro incompleto ou corrompido (escrita
+// interrompida por uma queda) encerra a leitura.
+static void replay_file(const char* path, const char* magic, uint64_t* generation, int check,
+                        WalApply apply, void* ctx) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < FILE_HEADER_LEN) {
+        close(fd);
+        return;
+    }
+
+    size_t size = st.st_size;
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    if (memcmp(map, magic, 8) != 0 || (check && get_u64(map + 8) != *generation)) {
+        munmap(map, size);
+        return;
+    }
+    *generation = get_u64(map + 8);
+
+    size_t offset = FILE_HEADER_LEN;
+    while (offset + RECORD_HEADER_LEN <= size) {
+        uint32_t body = get_u32(map + offset);
+        const char* p = map + offset + RECORD_HEADER_LEN;
+        if (body < 2 || body > size - offset - RECORD_HEADER_LEN ||
+            crc32(p, body) != get_u32(map + offset + 4))
+            break;
+
+        uint8_t nick_len = p[1];
+        if ((size_t)nick_len + 2 > body || nick_len == 0 || nick_len >= 64)
+            break;
+
+        char nick[64];
+        memcpy(nick, p + 2, nick_len);
+        nick[nick_len] = '\0';
+        apply(ctx, (uint8_t)p[0], nick, p + 2 + nick_len, body - 2 - nick_len);
+
+        offset += RECORD_HEADER_LEN + body;
+    }
+
+    munmap(map, size);
+}
+
+// Função que recupera o estado de um shard da época: snapshot e, se for da mesma
+// geração, o log gravado depois dele
+void wal_replay(uint64_t epoch, int id, WalApply apply, void* ctx) {
+    char path[512];
+    uint64_t generation = 0;
+
+    wal_path(path, sizeof(path), epoch, id, "snap");
+    replay_file(path, SNAP_MAGIC, &generation, 0, apply, ctx);
+
+    wal_path(path, sizeof(path), epoch, id, "wal");
+    replay_file(path, WAL_MAGIC, &generation, 1, apply, ctx);
+}
+
+// Função que inicializa o log de um shard; o arquivo é criado pelo primeiro checkpoint
+void wal_init(Wal* wal, uint64_t epoch, int id) {
+    memset(wal, 0, sizeof(*wal));
+    wal->fd = -1;
+    wal->snap_fd = -1;
+    wal->epoch = epoch;
+    wal->id = id;
+    crc_init();
+}
+
+// Função que reabre o log da época para continuar gravando nele (reinício após um
+// encerramento correto). Retorna -1 se o log não existe ou está inválido.
+int wal_reopen(Wal* wal) {
+    char path[512];
+    wal_path(path, sizeof(path), wal->epoch, wal->id, "wal");
+
+    int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    char header[FILE_HEADER_LEN];
+    struct stat st;
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, WAL_MAGIC, 8) != 0 ||
+        fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    wal->fd = fd;
+    wal->generation = get_u64(header + 8);
+    wal->size = st.st_size - FILE_HEADER_LEN;
+    wal->last_sync_ms = now_ms();
+    return 0;
+}
+
+// Função executada pela thread de fsync do log: sincroniza até a última gravação
+// pedida e acorda o shard, que libera a saída que esperava por ela
+static void* sync_run(void* arg) {
+    Wal* wal = arg;
+
+    pthread_mutex_lock(&wal->sync_lock);
+    while (1) {
+        uint64_t target = wal->requested;
+        if (target == atomic_load(&wal->synced)) {
+            if (wal->sync_stop)
+                break;
+            pthread_cond_wait(&wal->sync_cond, &wal->sync_lock);
+            continue;
+        }
+
+        // O arquivo só é trocado (checkpoint) com todos os pedidos concluídos
+        int fd = wal->fd;
+        pthread_mutex_unlock(&wal->sync_lock);
+        if (fdatasync(fd) < 0)
+            wal_fatal("fdatasync");
+        pthread_mutex_lock(&wal->sync_lock);
+
+        atomic_store(&wal->synced, target);
+        pthread_cond_broadcast(&wal->sync_done);
+        uint64_t one = 1;
+        if (write(wal->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("eventfd");
+    }
+    pthread_mutex_unlock(&wal->sync_lock);
+    return NULL;
+}
+
+// Função que inicia a thread de fsync do log; a partir daqui o wal_commit só grava e
+// pede o fsync, e `wake_fd` é acordado quando ele termina
+void wal_start(Wal* wal, int wake_fd) {
+    if (wal_sync_mode == SYNC_NONE || wal->fd < 0)
+        return;
+
+    wal->wake_fd = wake_fd;
+    pthread_mutex_init(&wal->sync_lock, NULL);
+    pthread_cond_init(&wal->sync_cond, NULL);
+    pthread_cond_init(&wal->sync_done, NULL);
+    errno = pthread_create(&wal->sync_thread, NULL, sync_run, wal);
+    if (errno != 0)
+        wal_fatal("pthread_create");
+    wal->sync_started = 1;
+}
+
+// Função que pede o fsync das gravações feitas até agora: à thread de fsync, ou no
+// próprio chamador antes de ela existir (recuperação)
+static void sync_request(Wal* wal) {
+    wal->last_sync_ms = now_ms();
+    if (!wal->sync_started) {
+        if (fdatasync(wal->fd) < 0)
+            wal_fatal("fdatasync");
+        wal->requested = wal->written;
+        atomic_store(&wal->synced, wal->written);
+        return;
+    }
+
+    pthread_mutex_lock(&wal->sync_lock);
+    wal->requested = wal->written;
+    pthread_cond_signal(&wal->sync_cond);
+    pthread_mutex_unlock(&wal->sync_lock);
+}
+
+// Função que espera a thread de fsync concluir os pedidos feitos, antes de o arquivo
+// do log ser trocado ou fechado
+static void sync_wait(Wal* wal) {
+    if (!wal->sync_started)
+        return;
+
+    pthread_mutex_lock(&wal->sync_lock);
+    while (atomic_load(&wal->synced) != wal->requested)
+        pthread_cond_wait(&wal->sync_done, &wal->sync_lock);
+    pthread_mutex_unlock(&wal->sync_lock);
+}
+
+// Função que grava o que falta do log, sincroniza e fecha o arquivo
+void wal_close(Wal* wal) {
+    if (wal->fd < 0)
+        return;
+
+    wal_commit(wal);
+    if (wal->sync_started) {
+        pthread_mutex_lock(&wal->sync_lock);
+        wal->sync_stop = 1;
+        pthread_cond_signal(&wal->sync_cond);
+        pthread_mutex_unlock(&wal->sync_lock);
+        pthread_join(wal->sync_thread, NULL);
+        pthread_mutex_destroy(&wal->sync_lock);
+        pthread_cond_destroy(&wal->sync_cond);
+        pthread_cond_destroy(&wal->sync_done);
+        wal->sync_started = 0;
+        wal->sync_stop = 0;
+    }
+    if (wal->written != atomic_load(&wal->synced) && fdatasync(wal->fd) < 0)
+        wal_fatal("fdatasync");
+    close(wal->fd);
+    free(wal->buf);
+    wal->buf = NULL;
+    wal->len = wal->cap = 0;
+    wal->fd = -1;
+    wal->requested = wal->written;
+    atomic_store(&wal->synced, wal->written);
+}
+
+// Função que acrescenta um registro ao log. Ele só vai para o disco no wal_commit,
+// junto com os demais registros da iteração. Sem log aberto (recuperação) não faz nada.
+void wal_append(Wal* wal, int type, const char* nick, const char* data, size_t len) {
+    if (wal->fd < 0)
+        return;
+
+    size_t needed = RECORD_HEADER_LEN + 2 + strlen(nick) + len;
+    if (wal->len + needed > wal->cap) {
+        while (wal->len + needed > wal->cap)
+            wal->cap = wal->cap ? wal->cap * 2 : 65536;
+        wal->buf = realloc(wal->buf, wal->cap);
+    }
+    wal->len += record_encode(wal->buf + wal->len, type, nick, data, len);
+}
+
+// Função que grava os registros da iteração (group commit) e pede o fsync conforme a
+// durabilidade escolhida, sem esperar por ele. Retorna 1 quando o log cresceu o
+// bastante para um checkpoint.
+int wal_commit(Wal* wal) {
+    if (wal->len > 0) {
+        write_all(wal->fd, wal->buf, wal->len);
+        wal->size += wal->len;
+        wal->len = 0;
+        wal->written++;
+    }
+
+    if (wal->written != wal->requested && wal_sync_mode != SYNC_NONE) {
+        if (wal_sync_mode == SYNC_ALWAYS || now_ms() - wal->last_sync_ms >= WAL_SYNC_INTERVAL_MS)
+            sync_request(wal);
+    }
+
+    return wal->size >= WAL_CHECKPOINT_SIZE;
+}
+
+// Função que retorna quanto o laço de eventos pode esperar antes do próximo fsync
+// (-1 se não há nada pendente)
+int wal_timeout(const Wal* wal) {
+    if (wal->written == wal->requested || wal_sync_mode != SYNC_BATCH)
+        return -1;
+
+    int64_t left = wal->last_sync_ms + WAL_SYNC_INTERVAL_MS - now_ms();
+    return left > 0 ? (int)left : 0;
+}
+
+// Função que retorna a gravação que precisa chegar ao disco antes de liberar a saída
+// produzida agora: com SYNC_ALWAYS, a última se ainda estiver sem fsync; senão 0
+uint64_t wal_barrier(Wal* wal) {
+    if (wal_sync_mode != SYNC_ALWAYS || wal->written == atomic_load(&wal->synced))
+        return 0;
+    return wal->written;
+}
+
+// Função que retorna a última gravação que já está no disco
+uint64_t wal_synced(Wal* wal) {
+    return atomic_load(&wal->synced);
+}
+
+// Função que começa um snapshot da próxima geração; o estado é escrito com
+// wal_checkpoint_add e o snapshot só passa a valer no wal_checkpoint_end
+void wal_checkpoint_begin(Wal* wal) {
+    char path[512];
+    wal_path(path, sizeof(path), wal->epoch, wal->id, "snap.tmp");
+
+    wal->snap_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (wal->snap_fd < 0)
+        wal_fatal(path);
+
+    wal->snap_buf = malloc(SNAP_BUFFER);
+    memcpy(wal->snap_buf, SNAP_MAGIC, 8);
+    put_u64(wal->snap_buf + 8, wal->generation + 1);
+    wal->snap_len = FILE_HEADER_LEN;
+}
+
+// Função que escreve um registro no snapshot em construção
+void wal_checkpoint_add(Wal* wal, int type, const char* nick, const char* data, size_t len) {
+    size_t needed = RECORD_HEADER_LEN + 2 + strlen(nick) + len;
+    if (wal->snap_len + needed > SNAP_BUFFER) {
+        write_all(wal->snap_fd, wal->snap_buf, wal->snap_len);
+        wal->snap_len = 0;
+    }
+    wal->snap_len += record_encode(wal->snap_buf + wal->snap_len, type, nick, data, len);
+}
+
+// Função que conclui o checkpoint: o snapshot substitui o anterior e o log recomeça
+// vazio na nova geração. Uma queda entre as duas trocas é segura, pois o log antigo
+// tem a geração anterior e é ignorado na recuperação.
+void wal_checkpoint_end(Wal* wal) {
+    char tmp[512], path[512];
+
+    write_all(wal->snap_fd, wal->snap_buf, wal->snap_len);
+    if (fsync(wal->snap_fd) < 0)
+        wal_fatal("fsync");
+    close(wal->snap_fd);
+    free(wal->snap_buf);
+    wal->snap_fd = -1;
+    wal->snap_buf = NULL;
+
+    wal_path(tmp, sizeof(tmp), wal->epoch, wal->id, "snap.tmp");
+    wal_path(path, sizeof(path), wal->epoch, wal->id, "snap");
+    if (rename(tmp, path) < 0)
+        wal_fatal("rename");
+    wal->generation++;
+
+    // Novo log com a geração do snapshot
+    wal_path(tmp, sizeof(tmp), wal->epoch, wal->id, "wal.tmp");
+    wal_path(path, sizeof(path), wal->epoch, wal->id, "wal");
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        wal_fatal(tmp);
+
+    char header[FILE_HEADER_LEN];
+    memcpy(header, WAL_MAGIC, 8);
+    put_u64(header + 8, wal->generation);
+    write_all(fd, header, sizeof(header));
+    if (fsync(fd) < 0)
+        wal_fatal("fsync");
+    if (rename(tmp, path) < 0)
+        wal_fatal("rename");
+    sync_dir();
+
+    // O snapshot tem todo o estado: as gravações do log antigo já não precisam de fsync
+    sync_wait(wal);
+    if (wal->fd >= 0)
+        close(wal->fd);
+    if (wal->sync_started)
+        pthread_mutex_lock(&wal->sync_lock);
+    wal->fd = fd;
+    wal->requested = wal->written;
+    atomic_store(&wal->synced, wal->written);
+    if (wal->sync_started)
+        pthread_mutex_unlock(&wal->sync_lock);
+    wal->size = 0;
+    wal->last_sync_ms = now_ms();
+}
@@ -0,0 +1,101 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Log de escrita antecipada (write-ahead log) de um shard. Cada alteração de estado
+// (registro, remoção, mensagem guardada, mensagens entregues, membros de grupo) vira um registro no log;
+// os registros de uma iteração do reactor são gravados juntos (group commit) e o
+// fsync é feito por uma thread de sincronização do shard, sem parar o laço de eventos:
+// com SYNC_ALWAYS o reactor retém só a saída que depende das gravações ainda sem fsync
+// (wal_barrier/wal_synced). Um snapshot periódico (checkpoint) mantém o log curto.
+//
+// Arquivos no diretório de dados:
+//   CURRENT                   época e número de shards do conjunto de arquivos válido
+//   shard-<época>-<id>.snap   snapshot do shard (estado completo numa geração)
+//   shard-<época>-<id>.wal    registros posteriores ao snapshot da mesma geração
+//   shard-<época>-<id>.store  arena mapeada com o estado vivo do shard (ver arena.h)
+//
+// Formato de um registro: [u32 tamanho][u32 crc32][u8 tipo][u8 tam. apelido][apelido][dados]
+
+// Tamanho do log que dispara um checkpoint
+#define WAL_CHECKPOINT_SIZE (64u << 20)
+// Intervalo máximo entre fsyncs no modo SYNC_BATCH
+#define WAL_SYNC_INTERVAL_MS 100
+
+// Tipos de registro
+enum {
+    WAL_REGISTER = 1,           // dados: nome do usuário
+    WAL_DELETE,                 // sem dados
+    WAL_ENQUEUE,                // dados: registro de entrega guardado na fila
+    WAL_ACK,                    // dados: u32 com o número de mensagens retiradas da fila (entregues ou confirmadas)
+    WAL_GROUP_JOIN,             // apelido: grupo; dados: membro
+    WAL_GROUP_LEAVE,            // apelido: grupo; dados: membro
+    WAL_GROUP_ENQUEUE,          // apelido: grupo; dados: u32 tamanho do registro, registro
+                                // de entrega e os membros offline que o guardaram ('\0' após cada)
+    WAL_SEQ,                    // dados: u64 com a sequência da última mensagem retirada da fila
+    WAL_CONV                    // dados: u64 com a última sequência aceita do remetente e o remetente
+};
+
+// Durabilidade das escritas (opção -s)
+enum {
+    SYNC_NONE,                  // Grava a cada iteração, o sistema decide quando ir ao disco
+    SYNC_BATCH,                 // fsync no máximo a cada WAL_SYNC_INTERVAL_MS
+    SYNC_ALWAYS                 // fsync antes de liberar as respostas que dependem das gravações
+};
+
+typedef struct {
+    int fd;                     // Arquivo do log (-1 enquanto não aberto)
+    char* buf;                  // Registros da iteração atual, ainda não gravados
+    size_t len;
+    size_t cap;
+    uint64_t size;              // Bytes gravados no arquivo do log
+    uint64_t epoch;             // Época do conjunto de arquivos
+    uint64_t generation;        // Geração do snapshot atual
+    int id;                     // Shard dono do log
+    uint64_t written;           // Gravações no arquivo (uma por wal_commit com registros)
+    uint64_t requested;         // Última gravação com fsync pedido
+    _Atomic uint64_t synced;    // Última gravação já no disco (escrito pela thread de fsync)
+    int64_t last_sync_ms;       // Momento do último pedido de fsync
+    int sync_started;           // Thread de fsync em execução (senão o fsync é feito no wal_commit)
+    int sync_stop;              // Encerramento pedido à thread de fsync
+    int wake_fd;                // eventfd acordado a cada fsync concluído
+    pthread_t sync_thread;
+    pthread_mutex_t sync_lock;  // Protege requested e sync_stop
+    pthread_cond_t sync_cond;   // Acorda a thread com um novo pedido
+    pthread_cond_t sync_done;   // Avisa cada fsync concluído
+    int snap_fd;                // Snapshot em construção (checkpoint)
+    char* snap_buf;
+    size_t snap_len;
+} Wal;
+
+// Função chamada para cada registro lido na recuperação
+typedef void (*WalApply)(void* ctx, int type, const char* nick, const char* data, size_t len);
+
+extern char wal_dir[256];       // Diretório de dados (opção -d)
+extern int wal_sync_mode;       // Durabilidade (SYNC_*)
+
+int wal_read_current(uint64_t* epoch, int* shard_count);
+int wal_write_current(uint64_t epoch, int shard_count);
+void wal_remove_stale(uint64_t epoch);
+void wal_replay(uint64_t epoch, int id, WalApply apply, void* ctx);
+
+void wal_path(char* out, size_t size, uint64_t epoch, int id, const char* ext);
+void wal_init(Wal* wal, uint64_t epoch, int id);
+int wal_reopen(Wal* wal);
+void wal_start(Wal* wal, int wake_fd);
+void wal_close(Wal* wal);
+void wal_append(Wal* wal, int type, const char* nick, const char* data, size_t len);
+int wal_commit(Wal* wal);
+int wal_timeout(const Wal* wal);
+uint64_t wal_barrier(Wal* wal);
+uint64_t wal_synced(Wal* wal);
+
+void wal_checkpoint_begin(Wal* wal);
+void wal_checkpoint_add(Wal* wal, int type, const char* nick, const char* data, size_t len);
+void wal_checkpoint_end(Wal* wal);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Apoio dos testes (make test). Cada teste é um programa que termina com 0 se tudo
+// passou; a primeira verificação que falha mostra a condição e encerra com 1.
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "%s:%d: falhou: %s\n", __FILE__, __LINE__, #cond);  \
+            exit(1);                                                            \
+        }                                                                       \
+    } while (0)
+
+// Função que cria um diretório temporário para o teste em `out`
+static inline void test_tmpdir(char* out, size_t size) {
+    snprintf(out, size, "/tmp/chat-test-XXXXXX");
+    CHECK(mkdtemp(out) != NULL);
+}
+
+// Função que apaga o diretório temporário do teste
+static inline void test_rmdir(const char* dir) {
+    char command[512];
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    CHECK(system(command) == 0);
+}
+
+#endif
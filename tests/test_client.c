@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "../src/chat_client.h"
+#include "test.h"
+
+// Ida e volta com a biblioteca de cliente contra um servidor de verdade (bin/server
+// numa porta e num diretório de dados só do teste): registro, login, entrega direta,
+// entrega guardada para um usuário offline, protocolo binário e recuperação do
+// estado depois de reiniciar o servidor, com os dois backends de E/S; e o limite de
+// mensagens de cada remetente, que não recomeça a cada sessão.
+
+// Tempo máximo de espera por uma resposta ou entrega
+#define TIMEOUT_MS 5000
+
+// Eventos recebidos por uma conexão
+typedef struct {
+    int responses;              // Respostas recebidas
+    char response[128];         // Última resposta: "OK", "OK{detalhe}" ou "ERROR{código}"
+    int messages;               // Entregas recebidas
+    char from[64];              // Última entrega
+    char text[256];
+} Events;
+
+static int port;
+static char dir[64];
+
+// Função que guarda cada evento recebido
+static void on_event(ChatClient* client, const ChatEvent* event, void* ctx) {
+    (void)client;
+    Events* events = ctx;
+    if (event->type == CHAT_EVENT_MESSAGE) {
+        snprintf(events->from, sizeof(events->from), "%.*s", (int)event->from_len, event->from);
+        snprintf(events->text, sizeof(events->text), "%.*s", (int)event->text_len, event->text);
+        events->messages++;
+    } else if (event->type == CHAT_EVENT_OK || event->type == CHAT_EVENT_ERROR) {
+        const char* kind = event->type == CHAT_EVENT_OK ? "OK" : "ERROR";
+        if (event->text_len > 0)
+            snprintf(events->response, sizeof(events->response), "%s{%.*s}", kind, (int)event->text_len, event->text);
+        else
+            snprintf(events->response, sizeof(events->response), "%s", kind);
+        events->responses++;
+    }
+}
+
+// Função que inicia o servidor com as opções extras (lista terminada em NULL)
+static pid_t server_start(const char* const* extra) {
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    const char* argv[32] = { "bin/server", "-t", "2", "-d", dir, "-p", port_arg, "-s", "always", "-l", "error" };
+    int argc = 11;
+    while (extra != NULL && *extra != NULL)
+        argv[argc++] = *extra++;
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        execv(argv[0], (char* const*)argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Função que encerra o servidor (SIGTERM) e espera a saída limpa
+static void server_stop(pid_t pid) {
+    int status;
+    CHECK(kill(pid, SIGTERM) == 0);
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Função que conecta ao servidor, esperando ele começar a aceitar conexões
+static ChatClient* connect_to(int options, Events* events) {
+    memset(events, 0, sizeof(*events));
+    for (int tries = 0; tries < TIMEOUT_MS / 10; tries++) {
+        ChatClient* client = chat_connect("127.0.0.1", port, options, on_event, events);
+        if (client != NULL)
+            return client;
+        CHECK(errno == ECONNREFUSED);
+        usleep(10000);
+    }
+    CHECK(!"servidor não aceitou a conexão");
+    return NULL;
+}
+
+// Função que espera a resposta do último comando. Retorna o texto dela.
+static const char* reply(ChatClient* client, Events* events) {
+    int before = events->responses;
+    CHECK(chat_wait(client, TIMEOUT_MS) == 0);
+    CHECK(events->responses > before);
+    return events->response;
+}
+
+// Função que espera até a conexão ter recebido `count` entregas
+static void wait_messages(ChatClient* client, Events* events, int count) {
+    for (int waited = 0; events->messages < count; waited += 10) {
+        CHECK(waited < TIMEOUT_MS);
+        struct pollfd pfd = { .fd = chat_fd(client), .events = POLLIN };
+        if (poll(&pfd, 1, 10) > 0)
+            CHECK(chat_read(client) >= 0);
+    }
+}
+
+// Função que envia uma mensagem e retorna a resposta
+static const char* send_text(ChatClient* client, Events* events, const char* to, const char* text) {
+    CHECK(chat_send(client, to, text, strlen(text)) == 0);
+    return reply(client, events);
+}
+
+// Função que verifica a última entrega recebida
+static void check_message(const Events* events, const char* from, const char* text) {
+    CHECK(strcmp(events->from, from) == 0);
+    CHECK(strcmp(events->text, text) == 0);
+}
+
+// Função que faz a ida e volta completa com o backend `engine`
+static void round_trip(const char* engine) {
+    const char* options[] = { "-e", engine, NULL };
+    test_tmpdir(dir, sizeof(dir));
+
+    pid_t server = server_start(options);
+    Events a_events, b_events, c_events;
+    ChatClient* a = connect_to(0, &a_events);
+
+    // Registro (apelidos repetidos são recusados)
+    const char* nicks[] = { "alice", "bob", "carol" };
+    for (int i = 0; i < 3; i++) {
+        CHECK(chat_register(a, nicks[i], nicks[i]) == 0);
+        CHECK(strcmp(reply(a, &a_events), "OK") == 0);
+    }
+    CHECK(chat_register(a, "bob", "Outro Bob") == 0);
+    CHECK(strncmp(reply(a, &a_events), "ERROR", 5) == 0);
+
+    // Entrega direta entre duas sessões
+    ChatClient* b = connect_to(0, &b_events);
+    CHECK(chat_login(a, "alice") == 0);
+    CHECK(strncmp(reply(a, &a_events), "OK", 2) == 0);
+    CHECK(chat_login(b, "bob") == 0);
+    CHECK(strncmp(reply(b, &b_events), "OK", 2) == 0);
+    CHECK(strcmp(send_text(a, &a_events, "bob", "oi, bob"), "OK") == 0);
+    wait_messages(b, &b_events, 1);
+    check_message(&b_events, "alice", "oi, bob");
+    CHECK(strcmp(send_text(a, &a_events, "ninguem", "oi?"), "ERROR{NO_SUCH_USER}") == 0);
+
+    // Entrega guardada para carol, offline, que loga pelo protocolo binário
+    CHECK(strcmp(send_text(a, &a_events, "carol", "guardada"), "OK") == 0);
+    ChatClient* c = connect_to(CHAT_BINARY, &c_events);
+    CHECK(chat_login(c, "carol") == 0);
+    CHECK(strncmp(reply(c, &c_events), "OK", 2) == 0);
+    wait_messages(c, &c_events, 1);
+    check_message(&c_events, "alice", "guardada");
+    CHECK(strcmp(send_text(c, &c_events, "alice", "recebi"), "OK") == 0);
+    wait_messages(a, &a_events, 1);
+    check_message(&a_events, "carol", "recebi");
+
+    // Mensagem guardada para bob, offline, sobrevive ao reinício do servidor
+    CHECK(chat_logout(b, "bob") == 0);
+    CHECK(strcmp(reply(b, &b_events), "OK") == 0);
+    chat_close(b);
+    CHECK(strcmp(send_text(a, &a_events, "bob", "depois do reinício"), "OK") == 0);
+    chat_close(a);
+    chat_close(c);
+    server_stop(server);
+
+    server = server_start(options);
+    b = connect_to(0, &b_events);
+    CHECK(chat_register(b, "alice", "alice") == 0);
+    CHECK(strncmp(reply(b, &b_events), "ERROR", 5) == 0);
+    CHECK(chat_login(b, "bob") == 0);
+    CHECK(strncmp(reply(b, &b_events), "OK", 2) == 0);
+    wait_messages(b, &b_events, 1);
+    check_message(&b_events, "alice", "depois do reinício");
+    chat_close(b);
+    server_stop(server);
+    test_rmdir(dir);
+}
+
+// Função que verifica que o limite de mensagens é de cada remetente: quem passou dele
+// não impede os outros de escrever para o mesmo destinatário ou grupo, e o balde fica
+// no usuário, então não recomeça quando a sessão muda
+static void rate_limit() {
+    const char* options[] = { "-u", "0.1:3", NULL };
+    test_tmpdir(dir, sizeof(dir));
+
+    pid_t server = server_start(options);
+    Events a_events, b_events, c_events;
+    ChatClient* a = connect_to(0, &a_events);
+    const char* nicks[] = { "alice", "bob", "carol" };
+    for (int i = 0; i < 3; i++) {
+        CHECK(chat_register(a, nicks[i], nicks[i]) == 0);
+        CHECK(strcmp(reply(a, &a_events), "OK") == 0);
+    }
+    CHECK(chat_login(a, "alice") == 0);
+    CHECK(strncmp(reply(a, &a_events), "OK", 2) == 0);
+    CHECK(chat_join(a, "#sala") == 0);
+    CHECK(strcmp(reply(a, &a_events), "OK") == 0);
+
+    // A rajada de alice passa; a mensagem seguinte é recusada, também para o grupo
+    for (int i = 0; i < 3; i++)
+        CHECK(strcmp(send_text(a, &a_events, "bob", "oi"), "OK") == 0);
+    CHECK(strcmp(send_text(a, &a_events, "bob", "oi"), "ERROR{RATE_LIMITED}") == 0);
+    CHECK(strcmp(send_text(a, &a_events, "#sala", "oi"), "ERROR{RATE_LIMITED}") == 0);
+
+    // Outro remetente continua escrevendo para bob e para o grupo
+    ChatClient* c = connect_to(0, &c_events);
+    CHECK(chat_login(c, "carol") == 0);
+    CHECK(strncmp(reply(c, &c_events), "OK", 2) == 0);
+    CHECK(chat_join(c, "#sala") == 0);
+    CHECK(strcmp(reply(c, &c_events), "OK") == 0);
+    CHECK(strcmp(send_text(c, &c_events, "bob", "oi, bob"), "OK") == 0);
+    CHECK(strcmp(send_text(c, &c_events, "#sala", "oi, sala"), "OK") == 0);
+
+    // Reconectando e logando de novo, o limite de alice continua esgotado
+    CHECK(chat_logout(a, "alice") == 0);
+    CHECK(strcmp(reply(a, &a_events), "OK") == 0);
+    chat_close(a);
+    a = connect_to(0, &a_events);
+    CHECK(chat_login(a, "alice") == 0);
+    CHECK(strncmp(reply(a, &a_events), "OK", 2) == 0);
+    CHECK(strcmp(send_text(a, &a_events, "bob", "oi"), "ERROR{RATE_LIMITED}") == 0);
+
+    // bob recebe as de alice aceitas antes do limite e a de carol
+    ChatClient* b = connect_to(0, &b_events);
+    CHECK(chat_login(b, "bob") == 0);
+    CHECK(strncmp(reply(b, &b_events), "OK", 2) == 0);
+    wait_messages(b, &b_events, 4);
+    check_message(&b_events, "carol", "oi, bob");
+    CHECK(strcmp(send_text(c, &c_events, "bob", "de novo"), "OK") == 0);
+    wait_messages(b, &b_events, 5);
+    check_message(&b_events, "carol", "de novo");
+
+    chat_close(a);
+    chat_close(b);
+    chat_close(c);
+    server_stop(server);
+    test_rmdir(dir);
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    port = 20000 + getpid() % 20000;
+
+    round_trip("epoll");
+    round_trip("uring");
+    rate_limit();
+
+    printf("test_client: ok\n");
+    return 0;
+}
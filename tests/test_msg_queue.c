@@ -0,0 +1,107 @@
+#include "../src/msg_queue.h"
+#include "test.h"
+
+// Filas de mensagens no slab: mensagens de um ou vários chunks voltam intactas e na
+// ordem, o buffer circular cresce e dá a volta, mensagens compartilhadas só liberam
+// os chunks na última referência e uma fila esvaziada devolve tudo ao slab.
+
+#define MESSAGES 1000
+
+// Função que monta a i-ésima mensagem de teste em `out`. Retorna o tamanho.
+static size_t message(int i, char* out) {
+    size_t len = 1 + (size_t)(i * 37) % 700;
+    for (size_t k = 0; k < len; k++)
+        out[k] = (char)('a' + (i + k) % 26);
+    return len;
+}
+
+// Função que confere uma mensagem lida da fila
+static void check_message(int i, const char* data, size_t len) {
+    char expected[1024];
+    size_t expected_len = message(i, expected);
+    CHECK(len == expected_len);
+    CHECK(memcmp(data, expected, len) == 0);
+}
+
+int main() {
+    char dir[64], path[128];
+    test_tmpdir(dir, sizeof(dir));
+    snprintf(path, sizeof(path), "%s/queue.store", dir);
+
+    Arena arena;
+    CHECK(arena_open(&arena, path, 1) == 0);
+    ArenaOff root = arena_alloc(&arena, sizeof(SlabData));
+    CHECK(root != 0);
+    SlabData* data = arena_ptr(&arena, root);
+    memset(data, 0, sizeof(*data));
+
+    Slab slab;
+    slab_init(&slab, &arena, data);
+    MessageQueue queue;
+    memset(&queue, 0, sizeof(queue));
+
+    // Enchendo a fila (o buffer circular dobra várias vezes)
+    char buffer[1024];
+    for (int i = 0; i < MESSAGES; i++) {
+        size_t len = message(i, buffer);
+        CHECK(queue_push(&slab, &queue, buffer, len) == 0);
+    }
+    CHECK(queue.count == MESSAGES);
+    CHECK(data->messages_queued == MESSAGES);
+    for (int i = 0; i < MESSAGES; i += 97)
+        check_message(i, buffer, queue_peek(&slab, &queue, i, buffer));
+
+    // Retirando e acrescentando alternadamente: a cabeça dá a volta no buffer
+    int head = 0, tail = MESSAGES;
+    for (int round = 0; round < 5 * MESSAGES; round++) {
+        size_t len = queue_pop(&slab, &queue, buffer);
+        check_message(head++, buffer, len);
+        CHECK(buffer[len] == '\0');
+        len = message(tail++, buffer);
+        CHECK(queue_push(&slab, &queue, buffer, len) == 0);
+    }
+    CHECK(queue.count == MESSAGES);
+
+    // Esvaziando: os chunks e o buffer voltam ao slab
+    while (queue.count > 0)
+        check_message(head++, buffer, queue_pop(&slab, &queue, buffer));
+    CHECK(head == tail);
+    CHECK(queue_pop(&slab, &queue, buffer) == 0);
+    CHECK(queue.ring == 0);
+    CHECK(data->chunks_in_use == 0 && data->messages_queued == 0);
+
+    // Mensagem compartilhada por duas filas (entrega de grupo)
+    MessageQueue other;
+    memset(&other, 0, sizeof(other));
+    size_t len = message(42, buffer);
+    uint32_t chain = slab_share(&slab, buffer, len);
+    CHECK(chain != NO_CHUNK);
+    CHECK(queue_push_shared(&slab, &queue, chain, len) == 0);
+    CHECK(queue_push_shared(&slab, &other, chain, len) == 0);
+    slab_release(&slab, chain);
+    uint64_t shared_chunks = data->chunks_in_use;
+    CHECK(shared_chunks > 0);
+
+    check_message(42, buffer, queue_pop(&slab, &queue, buffer));
+    CHECK(data->chunks_in_use == shared_chunks);
+    check_message(42, buffer, queue_peek(&slab, &other, 0, buffer));
+    check_message(42, buffer, queue_pop(&slab, &other, buffer));
+    CHECK(data->chunks_in_use == 0);
+
+    // queue_clear descarta as mensagens restantes, compartilhadas ou não
+    chain = slab_share(&slab, buffer, len);
+    CHECK(queue_push_shared(&slab, &queue, chain, len) == 0);
+    slab_release(&slab, chain);
+    for (int i = 0; i < 100; i++) {
+        len = message(i, buffer);
+        CHECK(queue_push(&slab, &queue, buffer, len) == 0);
+    }
+    queue_clear(&slab, &queue);
+    CHECK(queue.count == 0 && queue.ring == 0);
+    CHECK(data->chunks_in_use == 0 && data->messages_queued == 0);
+
+    arena_close(&arena);
+    test_rmdir(dir);
+    printf("test_msg_queue: ok\n");
+    return 0;
+}
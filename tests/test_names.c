@@ -0,0 +1,185 @@
+#include "../src/server.h"
+#include "test.h"
+
+// Compactação da tabela de nomes no checkpoint (names_compact): com mais de
+// NAMES_COMPACT_MIN nomes e mais da metade sem uso, a tabela é refeita só com os
+// nomes das filas e das conversas, e os ids guardados são reescritos no lugar. As
+// mensagens diretas e as compartilhadas de grupo voltam com os remetentes e grupos
+// originais, a cadeia compartilhada é reescrita uma única vez e as conversas
+// continuam achando a última sequência de cada remetente.
+
+#define NAMES (NAMES_COMPACT_MIN + 200)
+#define KEPT(i) ((i) % 5 == 1)  // Remetentes com mensagens guardadas
+#define CONV_NAME 3             // Remetente só lembrado pela conversa
+#define CONV_SEQ 7
+#define LONG_TEXT "uma mensagem longa o bastante para ser comprimida com o dicionário do shard"
+
+static Shard shard;
+
+// Função de hash da tabela (no servidor, a de server.c)
+uint32_t hash_nick(const char* nick) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)nick; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Função que monta um registro de entrega no formato de delivery_encode. Retorna o tamanho.
+static size_t make_record(char* out, const char* from, const char* text, int64_t ts) {
+    size_t from_len = strlen(from), text_len = strlen(text);
+    out[0] = (char)from_len;
+    memcpy(out + 1, from, from_len);
+    memcpy(out + 1 + from_len, &ts, sizeof(ts));
+    memcpy(out + 1 + from_len + sizeof(ts), text, text_len);
+    return 1 + from_len + sizeof(ts) + text_len;
+}
+
+// Função que cria um usuário vazio na tabela do shard
+static User* add_user(const char* nick) {
+    User* user = user_table_add(&shard.users, nick);
+    CHECK(user != NULL);
+    memset(user, 0, sizeof(*user));
+    return user;
+}
+
+// Função que lê um varint do registro compactado. Retorna os bytes lidos.
+static size_t read_varint(const char* in, uint64_t* value) {
+    size_t n = 0;
+    *value = 0;
+    do {
+        *value |= (uint64_t)((uint8_t)in[n] & 0x7f) << (7 * n);
+    } while ((uint8_t)in[n++] & 0x80);
+    return n;
+}
+
+int main() {
+    char dir[64], path[128];
+    test_tmpdir(dir, sizeof(dir));
+    snprintf(path, sizeof(path), "%s/names.store", dir);
+    log_level = LOG_ERROR;
+
+    CHECK(arena_open(&shard.arena, path, 1) == 0);
+    ArenaOff users_off = arena_alloc(&shard.arena, sizeof(UserTableData));
+    ArenaOff names_off = arena_alloc(&shard.arena, sizeof(UserTableData));
+    ArenaOff slab_off = arena_alloc(&shard.arena, sizeof(SlabData));
+    CHECK(users_off != 0 && names_off != 0 && slab_off != 0);
+    memset(arena_ptr(&shard.arena, users_off), 0, sizeof(UserTableData));
+    memset(arena_ptr(&shard.arena, names_off), 0, sizeof(UserTableData));
+    memset(arena_ptr(&shard.arena, slab_off), 0, sizeof(SlabData));
+    CHECK(user_table_init(&shard.users, &shard.arena, arena_ptr(&shard.arena, users_off),
+                          sizeof(User), sizeof(UserProfile)) == 0);
+    CHECK(user_table_init(&shard.names, &shard.arena, arena_ptr(&shard.arena, names_off), 0, 0) == 0);
+    slab_init(&shard.slab, &shard.arena, arena_ptr(&shard.arena, slab_off));
+
+    // Nomes n0 ... n(NAMES-1), com ids na mesma ordem; abaixo de NAMES_COMPACT_MIN a
+    // tabela não é refeita, mesmo sem nenhum nome em uso
+    char nick[MAX_NICK_LEN];
+    for (int i = 0; i < NAMES; i++) {
+        snprintf(nick, sizeof(nick), "n%d", i);
+        CHECK(name_intern(&shard, nick, strlen(nick)) == i);
+        if (i == NAMES_COMPACT_MIN / 2) {
+            names_compact(&shard);
+            CHECK(user_table_count(&shard.names) == i + 1);
+        }
+    }
+
+    // Mensagens diretas para bob dos remetentes mantidos (uma com texto comprimido)
+    User* bob = add_user("bob");
+    User* eva = add_user("eva");
+    char record[MAX_RECORD_LEN + 1];
+    int direct = 0;
+    for (int i = 0; i < NAMES; i++) {
+        if (!KEPT(i))
+            continue;
+        snprintf(nick, sizeof(nick), "n%d", i);
+        size_t len = make_record(record, nick, i == 6 ? LONG_TEXT : nick, 1000 + i);
+        CHECK(record_push(&shard, &bob->queue, record, len) == 0);
+        direct++;
+    }
+
+    // Mensagem de grupo guardada uma única vez para bob e eva
+    size_t len = make_record(record, "#sala/n11", "para o grupo", 5000);
+    size_t packed_len;
+    uint32_t chain = record_share(&shard, record, len, &packed_len);
+    CHECK(chain != NO_CHUNK);
+    CHECK(queue_push_shared(&shard.slab, &bob->queue, chain, packed_len) == 0);
+    CHECK(queue_push_shared(&shard.slab, &eva->queue, chain, packed_len) == 0);
+    slab_release(&shard.slab, chain);
+    int32_t group_id = user_table_lookup(&shard.names, "#sala");
+    CHECK(group_id == NAMES);
+
+    // Conversa de bob com um remetente que não tem mensagens guardadas
+    snprintf(nick, sizeof(nick), "n%d", CONV_NAME);
+    CHECK(conv_accept(&shard.arena, &bob->conversations, user_table_lookup(&shard.names, nick), CONV_SEQ) == 0);
+
+    // Registros completos antes da compactação
+    uint32_t count = bob->queue.count;
+    CHECK(count == (uint32_t)direct + 1);
+    char (*before)[MAX_RECORD_LEN + 1] = malloc((count + 1) * sizeof(*before));
+    size_t* before_len = malloc((count + 1) * sizeof(size_t));
+    for (uint32_t j = 0; j < count; j++)
+        CHECK((before_len[j] = record_peek(&shard, &bob->queue, j, before[j])) > 0);
+    CHECK((before_len[count] = record_peek(&shard, &eva->queue, 0, before[count])) > 0);
+    uint64_t chunks = shard.slab.data->chunks_in_use;
+
+    // Só os remetentes mantidos, o grupo e o remetente da conversa continuam em uso
+    int live = direct + 2;
+    CHECK(NAMES + 1 - live > (NAMES + 1) / 2);
+    names_compact(&shard);
+    CHECK(user_table_count(&shard.names) == live);
+    CHECK(user_table_lookup(&shard.names, "n0") < 0);
+    CHECK(user_table_lookup(&shard.names, "n2") < 0);
+
+    // Os novos ids seguem a ordem dos antigos
+    CHECK(user_table_lookup(&shard.names, "n1") == 0);
+    CHECK(user_table_lookup(&shard.names, "n3") == 1);
+    CHECK(user_table_lookup(&shard.names, "#sala") == live - 1);
+
+    // Os registros voltam iguais, sem chunks novos
+    char after[MAX_RECORD_LEN + 1];
+    for (uint32_t j = 0; j < count; j++) {
+        CHECK(record_peek(&shard, &bob->queue, j, after) == before_len[j]);
+        CHECK(memcmp(after, before[j], before_len[j]) == 0);
+    }
+    CHECK(record_peek(&shard, &eva->queue, 0, after) == before_len[count]);
+    CHECK(memcmp(after, before[count], before_len[count]) == 0);
+    CHECK(shard.slab.data->chunks_in_use == chunks);
+
+    // A cadeia continua compartilhada e foi reescrita uma única vez: os ids nela são
+    // os novos (reescrita duas vezes, teriam sido traduzidos de novo)
+    CHECK(queue_shared_chain(&shard.slab, &bob->queue, count - 1) == chain);
+    CHECK(queue_shared_chain(&shard.slab, &eva->queue, 0) == chain);
+    char packed[MAX_PACKED_LEN + 1];
+    CHECK(queue_peek(&shard.slab, &eva->queue, 0, packed) == packed_len);
+    CHECK(packed[0] & RECORD_GROUP);
+    uint64_t sender, group;
+    size_t n = 1 + read_varint(packed + 1, &sender);
+    read_varint(packed + n, &group);
+    CHECK(sender == (uint64_t)user_table_lookup(&shard.names, "n11"));
+    CHECK(group == (uint64_t)user_table_lookup(&shard.names, "#sala"));
+    CHECK(sender != 11 && group != (uint64_t)group_id);
+
+    // A conversa acha o remetente pelo id novo
+    int32_t conv_id = user_table_lookup(&shard.names, nick);
+    CHECK(conv_id == 1);
+    CHECK(conv_last(&shard.arena, &bob->conversations, conv_id) == CONV_SEQ);
+    CHECK(conv_size(&bob->conversations) > 0);
+
+    // Nomes novos recebem os ids seguintes e os registros antigos continuam válidos
+    CHECK(name_intern(&shard, "novo", 4) == live);
+    CHECK(record_pop(&shard, &bob->queue, after) == before_len[0]);
+    CHECK(memcmp(after, before[0], before_len[0]) == 0);
+
+    free(before);
+    free(before_len);
+    queue_clear(&shard.slab, &bob->queue);
+    queue_clear(&shard.slab, &eva->queue);
+    CHECK(shard.slab.data->chunks_in_use == 0);
+    record_codec_free(&shard.codec);
+    arena_close(&shard.arena);
+    test_rmdir(dir);
+    printf("test_names: ok\n");
+    return 0;
+}
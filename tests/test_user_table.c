@@ -0,0 +1,107 @@
+#include "../src/server.h"
+#include "test.h"
+
+// Remoção na tabela de usuários: a entrada apagada do índice é preenchida deslocando
+// as seguintes (sem marcadores), e o último item ocupa o lugar do removido. O hash
+// de teste tem só HASH_CLASSES valores, então as sondagens formam sequências longas
+// que dão a volta no fim do índice.
+
+#define HASH_CLASSES 5
+#define ITEMS 300
+
+// Função de hash da tabela (no servidor, a de server.c): só o último caractere conta
+uint32_t hash_nick(const char* nick) {
+    return (uint32_t)(nick[strlen(nick) - 1] % HASH_CLASSES) * 0x33333333u;
+}
+
+// Função que confere que os itens vivos são encontrados pelo apelido, com o próprio
+// valor, e que os removidos não são
+static void check_table(UserTable* table, const int* alive) {
+    int count = 0;
+    for (int i = 0; i < ITEMS; i++) {
+        char nick[MAX_NICK_LEN];
+        snprintf(nick, sizeof(nick), "user%d", i);
+        int32_t id = user_table_lookup(table, nick);
+        if (!alive[i]) {
+            CHECK(id < 0);
+            continue;
+        }
+        CHECK(id >= 0 && id < user_table_count(table));
+        CHECK(strcmp(user_table_nick(table, id), nick) == 0);
+        CHECK(*(int*)user_table_at(table, id) == i);
+        CHECK(*(int*)user_table_profile(table, id) == -i);
+        count++;
+    }
+    CHECK(user_table_count(table) == count);
+}
+
+int main() {
+    char dir[64], path[128];
+    test_tmpdir(dir, sizeof(dir));
+    snprintf(path, sizeof(path), "%s/table.store", dir);
+
+    Arena arena;
+    CHECK(arena_open(&arena, path, 1) == 0);
+    ArenaOff root = arena_alloc(&arena, sizeof(UserTableData));
+    CHECK(root != 0);
+    UserTableData* data = arena_ptr(&arena, root);
+    memset(data, 0, sizeof(*data));
+
+    UserTable table;
+    CHECK(user_table_init(&table, &arena, data, sizeof(int), sizeof(int)) == 0);
+
+    int alive[ITEMS] = { 0 };
+    for (int i = 0; i < ITEMS; i++) {
+        char nick[MAX_NICK_LEN];
+        snprintf(nick, sizeof(nick), "user%d", i);
+        int* item = user_table_add(&table, nick);
+        CHECK(item != NULL);
+        *item = i;
+        *(int*)user_table_profile(&table, user_table_id(&table, item)) = -i;
+        alive[i] = 1;
+    }
+    check_table(&table, alive);
+
+    // Removendo em ordem embaralhada, conferindo a tabela inteira depois de cada uma
+    for (int n = 0; n < ITEMS; n++) {
+        int i = (n * 7 + 3) % ITEMS;
+        if (n % 3 == 2)
+            continue;
+        char nick[MAX_NICK_LEN];
+        snprintf(nick, sizeof(nick), "user%d", i);
+        user_table_remove(&table, user_table_find(&table, nick));
+        alive[i] = 0;
+        check_table(&table, alive);
+    }
+
+    // Os apelidos removidos podem voltar e as sondagens continuam corretas
+    for (int i = 0; i < ITEMS; i += 2) {
+        if (alive[i])
+            continue;
+        char nick[MAX_NICK_LEN];
+        snprintf(nick, sizeof(nick), "user%d", i);
+        int* item = user_table_add(&table, nick);
+        CHECK(item != NULL);
+        *item = i;
+        *(int*)user_table_profile(&table, user_table_id(&table, item)) = -i;
+        alive[i] = 1;
+    }
+    check_table(&table, alive);
+
+    // Esvaziando a tabela
+    for (int i = 0; i < ITEMS; i++) {
+        if (!alive[i])
+            continue;
+        char nick[MAX_NICK_LEN];
+        snprintf(nick, sizeof(nick), "user%d", i);
+        user_table_delete(&table, user_table_lookup(&table, nick));
+        alive[i] = 0;
+    }
+    check_table(&table, alive);
+    CHECK(user_table_count(&table) == 0);
+
+    arena_close(&arena);
+    test_rmdir(dir);
+    printf("test_user_table: ok\n");
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../src/wal.h"
+#include "test.h"
+
+// Recuperação do log: registros íntegros voltam na ordem, e um final cortado ou um
+// registro com crc errado encerram a leitura sem aplicar nada dali em diante.
+
+#define MAX_SEEN 16
+
+// Registros entregues pela recuperação
+typedef struct {
+    int count;
+    int types[MAX_SEEN];
+    char nicks[MAX_SEEN][64];
+    char data[MAX_SEEN][64];
+} Seen;
+
+// Função que guarda cada registro recuperado
+static void collect(void* ctx, int type, const char* nick, const char* data, size_t len) {
+    Seen* seen = ctx;
+    CHECK(seen->count < MAX_SEEN && len < 64);
+    seen->types[seen->count] = type;
+    snprintf(seen->nicks[seen->count], 64, "%s", nick);
+    memcpy(seen->data[seen->count], data, len);
+    seen->data[seen->count][len] = '\0';
+    seen->count++;
+}
+
+// Função que recupera o shard 0 da época 1
+static Seen replay(void) {
+    Seen seen;
+    memset(&seen, 0, sizeof(seen));
+    wal_replay(1, 0, collect, &seen);
+    return seen;
+}
+
+// Função que lê um arquivo inteiro. Retorna o tamanho.
+static size_t read_file(const char* path, char* out, size_t cap) {
+    int fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+    ssize_t n = read(fd, out, cap);
+    close(fd);
+    CHECK(n >= 0);
+    return (size_t)n;
+}
+
+// Função que substitui o conteúdo de um arquivo
+static void write_file(const char* path, const char* data, size_t len) {
+    int fd = open(path, O_WRONLY | O_TRUNC);
+    CHECK(fd >= 0);
+    CHECK(write(fd, data, len) == (ssize_t)len);
+    close(fd);
+}
+
+int main() {
+    char dir[64];
+    test_tmpdir(dir, sizeof(dir));
+    snprintf(wal_dir, sizeof(wal_dir), "%s", dir);
+    wal_sync_mode = SYNC_ALWAYS;
+
+    // Snapshot com o registro do usuário e log com três mensagens guardadas
+    Wal wal;
+    wal_init(&wal, 1, 0);
+    wal_checkpoint_begin(&wal);
+    wal_checkpoint_add(&wal, WAL_REGISTER, "alice", "Alice", 5);
+    wal_checkpoint_end(&wal);
+    wal_append(&wal, WAL_ENQUEUE, "alice", "m1", 2);
+    wal_append(&wal, WAL_ENQUEUE, "alice", "m2", 2);
+    wal_append(&wal, WAL_ENQUEUE, "alice", "m3", 2);
+    wal_commit(&wal);
+    wal_close(&wal);
+
+    Seen seen = replay();
+    CHECK(seen.count == 4);
+    CHECK(seen.types[0] == WAL_REGISTER && strcmp(seen.data[0], "Alice") == 0);
+    for (int i = 1; i < 4; i++) {
+        CHECK(seen.types[i] == WAL_ENQUEUE && strcmp(seen.nicks[i], "alice") == 0);
+        CHECK(seen.data[i][0] == 'm' && seen.data[i][1] == '0' + i);
+    }
+
+    char path[512], original[4096], copy[4096];
+    wal_path(path, sizeof(path), 1, 0, "wal");
+    size_t size = read_file(path, original, sizeof(original));
+    size_t record = (size - 16) / 3;
+    CHECK((size - 16) % 3 == 0);
+
+    // Final cortado no meio do último registro (queda durante a escrita)
+    write_file(path, original, size - 3);
+    seen = replay();
+    CHECK(seen.count == 3);
+    CHECK(strcmp(seen.data[2], "m2") == 0);
+
+    // Só o tamanho do último registro chegou ao disco
+    write_file(path, original, size - record + 4);
+    seen = replay();
+    CHECK(seen.count == 3);
+
+    // Um byte trocado no segundo registro: ele e os seguintes são ignorados
+    memcpy(copy, original, size);
+    copy[16 + record + record - 1] ^= 0x40;
+    write_file(path, copy, size);
+    seen = replay();
+    CHECK(seen.count == 2);
+    CHECK(strcmp(seen.data[1], "m1") == 0);
+
+    // Tamanho corrompido apontando além do fim do arquivo
+    memcpy(copy, original, size);
+    copy[16] = 0x7f;
+    write_file(path, copy, size);
+    seen = replay();
+    CHECK(seen.count == 1);
+
+    // Log de outra geração (anterior ao snapshot) não é aplicado
+    memcpy(copy, original, size);
+    copy[15] ^= 1;
+    write_file(path, copy, size);
+    seen = replay();
+    CHECK(seen.count == 1 && seen.types[0] == WAL_REGISTER);
+
+    // O log íntegro volta a ser lido por inteiro
+    write_file(path, original, size);
+    seen = replay();
+    CHECK(seen.count == 4);
+
+    test_rmdir(dir);
+    printf("test_wal: ok\n");
+    return 0;
+}